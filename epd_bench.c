@@ -0,0 +1,1030 @@
+//
+// epd_bench - benchmark driver for epd_image (make bench)
+//
+// Generates a deterministic synthetic corpus (gradients, photo-like noise
+// and mostly white UI screens) at common e-paper resolutions as 1/4/8/24/32-bpp
+// BMP and 4:4:4/4:2:0 JPEG files, runs every output format with and without
+// dithering through epd_image --STATSJSON and reports the megapixels/sec of
+// each pipeline stage and of the whole conversion
+//
+// Written by Larry Bank
+//
+// Copyright 2023 BitBank Software, Inc. All Rights Reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//===========================================================================
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#define NULL_DEVICE "NUL"
+#define MakeDir(d) _mkdir(d)
+#else
+#define NULL_DEVICE "/dev/null"
+#define MakeDir(d) mkdir(d, 0755)
+#endif
+
+// must match the stage names of epd_image --STATS
+enum
+{
+  STAGE_READ = 0,
+  STAGE_DECODE,
+  STAGE_SCALE,
+  STAGE_ORIENT,
+  STAGE_INVERT,
+  STAGE_DITHER,
+  STAGE_PACK,
+  STAGE_EMIT,
+  STAGE_COUNT
+};
+const char *szStages[] = {"read", "decode", "scale", "orient", "invert", "dither", "pack", "emit"};
+
+// Source file types of the corpus
+enum
+{
+  SOURCE_BMP1 = 0,
+  SOURCE_BMP4,
+  SOURCE_BMP8,
+  SOURCE_BMP24,
+  SOURCE_BMP32,
+  SOURCE_JPEG444,
+  SOURCE_JPEG420,
+  SOURCE_COUNT
+};
+const char *szSources[] = {"bmp1", "bmp4", "bmp8", "bmp24", "bmp32", "jpg444", "jpg420"};
+const char *szContents[] = {"gradient", "photo", "ui"};
+#define CONTENT_COUNT 3
+const char *szFormats[] = {"BW", "BWR", "BWY", "BWYR", "4GRAY"};
+#define FORMAT_COUNT 5
+const int iSizes[][2] = {{250, 122}, {296, 128}, {400, 300}, {800, 480}, {1304, 984}, {1872, 1404}};
+#define SIZE_COUNT 6
+
+// Totals of a group of runs
+typedef struct tag_bench_total
+{
+    int iRuns;
+    double dPixels; // source pixels converted
+    int64_t llWall; // whole conversions (microseconds)
+    int64_t llStage[STAGE_COUNT];
+    int iStageRuns[STAGE_COUNT];
+    double dStagePixels[STAGE_COUNT]; // pixels of the runs which used each stage
+} BENCH_TOTAL;
+
+//
+// Deterministic pseudo random numbers (the same corpus on every machine)
+//
+uint32_t u32Seed;
+uint32_t BenchRand(void)
+{
+    u32Seed = u32Seed * 1664525 + 1013904223;
+    return u32Seed >> 8;
+} /* BenchRand() */
+//
+// Hash of a lattice point for the value noise
+//
+int LatticeValue(int x, int y, int iSeed)
+{
+    uint32_t u32 = (uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u ^ (uint32_t)iSeed * 83492791u;
+    u32 ^= u32 >> 13;
+    u32 *= 0x5bd1e995;
+    u32 ^= u32 >> 15;
+    return (int)(u32 & 0xff);
+} /* LatticeValue() */
+//
+// Smooth noise with features about iScale pixels apart (0-255)
+//
+int ValueNoise(int x, int y, int iScale, int iSeed)
+{
+    int ix = x / iScale, iy = y / iScale, fx = x % iScale, fy = y % iScale;
+    int a, b, c, d, t, u;
+
+    a = LatticeValue(ix, iy, iSeed);
+    b = LatticeValue(ix+1, iy, iSeed);
+    c = LatticeValue(ix, iy+1, iSeed);
+    d = LatticeValue(ix+1, iy+1, iSeed);
+    t = a + ((b - a) * fx) / iScale;
+    u = c + ((d - c) * fx) / iScale;
+    return t + ((u - t) * fy) / iScale;
+} /* ValueNoise() */
+//
+// Fill a rectangle of a 24-bpp (R,G,B) image
+//
+void FillRect(uint8_t *pRGB, int iWidth, int iHeight, int x, int y, int cx, int cy, int r, int g, int b)
+{
+    int i, j;
+    uint8_t *d;
+
+    for (j=y; j<y+cy && j<iHeight; j++) {
+        for (i=x; i<x+cx && i<iWidth; i++) {
+            d = &pRGB[(j * iWidth + i) * 3];
+            d[0] = (uint8_t)r; d[1] = (uint8_t)g; d[2] = (uint8_t)b;
+        }
+    }
+} /* FillRect() */
+//
+// Generate the R,G,B pixels of one kind of synthetic image
+// 0 = gradients, 1 = photo-like noise, 2 = mostly white UI
+//
+void MakeContent(uint8_t *pRGB, int iWidth, int iHeight, int iContent)
+{
+    int x, y, i, c, v, iBar, iLine, iRow;
+    uint8_t *d = pRGB;
+
+    u32Seed = (uint32_t)(iWidth * 31 + iHeight * 17 + iContent);
+    if (iContent == 0) { // smooth color gradients
+        for (y=0; y<iHeight; y++) {
+            for (x=0; x<iWidth; x++) {
+                d[0] = (uint8_t)((x * 255) / (iWidth - 1));
+                d[1] = (uint8_t)((y * 255) / (iHeight - 1));
+                d[2] = (uint8_t)(255 - (d[0] + d[1]) / 2);
+                d += 3;
+            }
+        }
+        return;
+    }
+    if (iContent == 1) { // several octaves of noise + grain
+        for (y=0; y<iHeight; y++) {
+            for (x=0; x<iWidth; x++) {
+                for (c=0; c<3; c++) {
+                    v = (ValueNoise(x, y, 97, c) * 4 + ValueNoise(x, y, 23, c + 3) * 2 + ValueNoise(x, y, 5, c + 6)) / 7;
+                    v = (v - 128) * 2 + 128 + (int)(BenchRand() & 15) - 8; // stretch the contrast
+                    d[c] = (uint8_t)((v < 0) ? 0 : ((v > 255) ? 255 : v));
+                }
+                d += 3;
+            }
+        }
+        return;
+    }
+    // white screen with a title bar, lines of "text", boxes and a red button
+    memset(pRGB, 0xff, iWidth * iHeight * 3);
+    iBar = iHeight / 10;
+    FillRect(pRGB, iWidth, iHeight, 0, 0, iWidth, iBar, 0, 0, 0);
+    iLine = (iHeight / 30 > 4) ? iHeight / 30 : 4;
+    for (iRow = iBar + iLine; iRow + iLine < (iHeight * 3) / 4; iRow += iLine * 2) {
+        x = iWidth / 20;
+        while (x < iWidth - iWidth / 20) { // words of random widths
+            i = iLine + (int)(BenchRand() % (iLine * 4));
+            if (x + i > iWidth - iWidth / 20) break;
+            FillRect(pRGB, iWidth, iHeight, x, iRow, i, iLine, 0, 0, 0);
+            x += i + iLine;
+        }
+    }
+    for (i=0; i<3; i++) { // outlined boxes
+        x = iWidth / 20 + (i * iWidth) / 3;
+        y = (iHeight * 3) / 4 + iLine;
+        FillRect(pRGB, iWidth, iHeight, x, y, iWidth / 4, 2, 0, 0, 0);
+        FillRect(pRGB, iWidth, iHeight, x, y + iHeight / 8, iWidth / 4, 2, 0, 0, 0);
+        FillRect(pRGB, iWidth, iHeight, x, y, 2, iHeight / 8, 0, 0, 0);
+        FillRect(pRGB, iWidth, iHeight, x + iWidth / 4 - 2, y, 2, iHeight / 8 + 2, 0, 0, 0);
+    }
+    FillRect(pRGB, iWidth, iHeight, iWidth - iWidth / 5, iBar / 4, iWidth / 6, iBar / 2, 255, 0, 0);
+} /* MakeContent() */
+//
+// Store a little-endian value
+//
+void Put16(uint8_t *p, int i)
+{
+    p[0] = (uint8_t)i; p[1] = (uint8_t)(i >> 8);
+} /* Put16() */
+void Put32(uint8_t *p, int i)
+{
+    p[0] = (uint8_t)i; p[1] = (uint8_t)(i >> 8); p[2] = (uint8_t)(i >> 16); p[3] = (uint8_t)(i >> 24);
+} /* Put32() */
+//
+// Write the R,G,B image as a bottom-up Windows BMP file of 1/4/8/24/32 bpp
+// 1-bpp is thresholded, 4-bpp has 16 grays and 8-bpp a 3-3-2 color palette
+// returns 1 for success, 0 for failure
+//
+int WriteBMP(char *szName, uint8_t *pRGB, int iWidth, int iHeight, int iBpp)
+{
+    FILE *f;
+    uint8_t ucHeader[54], ucPal[1024], *pLine, *s;
+    int x, y, i, iPitch, iColors, iGray;
+
+    iColors = (iBpp <= 8) ? (1 << iBpp) : 0;
+    iPitch = (((iWidth * iBpp) + 7)/8 + 3) & ~3;
+    memset(ucHeader, 0, sizeof(ucHeader));
+    ucHeader[0] = 'B'; ucHeader[1] = 'M';
+    Put32(&ucHeader[2], 54 + iColors*4 + iPitch * iHeight);
+    Put32(&ucHeader[10], 54 + iColors*4);
+    Put32(&ucHeader[14], 40);
+    Put32(&ucHeader[18], iWidth);
+    Put32(&ucHeader[22], iHeight); // positive = bottom-up
+    Put16(&ucHeader[26], 1);
+    Put16(&ucHeader[28], iBpp);
+    Put32(&ucHeader[34], iPitch * iHeight);
+    Put32(&ucHeader[46], iColors);
+    for (i=0; i<iColors; i++) {
+        if (iBpp == 8) { // 3-3-2 RGB
+            ucPal[i*4+2] = (uint8_t)(((i >> 5) * 255) / 7);
+            ucPal[i*4+1] = (uint8_t)((((i >> 2) & 7) * 255) / 7);
+            ucPal[i*4+0] = (uint8_t)(((i & 3) * 255) / 3);
+        } else {
+            ucPal[i*4] = ucPal[i*4+1] = ucPal[i*4+2] = (uint8_t)((i * 255) / (iColors - 1));
+        }
+        ucPal[i*4+3] = 0;
+    }
+    f = fopen(szName, "wb");
+    if (f == NULL) {
+        printf("Unable to create %s\n", szName);
+        return 0;
+    }
+    fwrite(ucHeader, 1, 54, f);
+    fwrite(ucPal, 4, iColors, f);
+    pLine = (uint8_t *)malloc(iPitch);
+    for (y=iHeight-1; y>=0; y--) {
+        memset(pLine, 0, iPitch);
+        s = &pRGB[y * iWidth * 3];
+        for (x=0; x<iWidth; x++, s+=3) {
+            iGray = (s[0] * 77 + s[1] * 150 + s[2] * 29) >> 8;
+            switch (iBpp) {
+                case 1:
+                    if (iGray >= 128) pLine[x >> 3] |= (uint8_t)(0x80 >> (x & 7));
+                    break;
+                case 4:
+                    pLine[x >> 1] |= (uint8_t)((iGray >> 4) << ((x & 1) ? 0 : 4));
+                    break;
+                case 8:
+                    pLine[x] = (uint8_t)((s[0] & 0xe0) | ((s[1] >> 3) & 0x1c) | (s[2] >> 6));
+                    break;
+                default: // B,G,R(,A)
+                    i = x * (iBpp / 8);
+                    pLine[i] = s[2]; pLine[i+1] = s[1]; pLine[i+2] = s[0];
+                    if (iBpp == 32) pLine[i+3] = 0xff;
+                    break;
+            }
+        }
+        fwrite(pLine, 1, iPitch, f);
+    }
+    free(pLine);
+    fclose(f);
+    return 1;
+} /* WriteBMP() */
+//
+// Minimal baseline JPEG encoder for the corpus
+// 4:4:4 or 4:2:0, quality 90 tables, optimal Huffman tables per image
+// (the coefficients are quantized in a first pass to count the symbols)
+//
+const int iZigzag[64] = {0,1,8,16,9,2,3,10,17,24,32,25,18,11,4,5,12,19,26,33,40,48,41,34,27,20,13,6,7,14,21,28,
+                         35,42,49,56,57,50,43,36,29,22,15,23,30,37,44,51,58,59,52,45,38,31,39,46,53,60,61,54,47,55,62,63};
+const int iLumaQ[64] = {16,11,10,16,24,40,51,61, 12,12,14,19,26,58,60,55, 14,13,16,24,40,57,69,56, 14,17,22,29,51,87,80,62,
+                        18,22,37,56,68,109,103,77, 24,35,55,64,81,104,113,92, 49,64,78,87,103,121,120,101, 72,92,95,98,112,100,103,99};
+const int iChromaQ[64] = {17,18,24,47,99,99,99,99, 18,21,26,66,99,99,99,99, 24,26,56,99,99,99,99,99, 47,66,99,99,99,99,99,99,
+                          99,99,99,99,99,99,99,99, 99,99,99,99,99,99,99,99, 99,99,99,99,99,99,99,99, 99,99,99,99,99,99,99,99};
+typedef struct tag_huff_table
+{
+    uint8_t ucBits[17]; // number of codes of each length
+    uint8_t ucVals[256];
+    int iCount;
+    uint16_t usCode[256];
+    uint8_t ucSize[256];
+} HUFF_TABLE;
+
+typedef struct tag_jpeg_writer
+{
+    FILE *f;
+    uint32_t u32Bits;
+    int iBitCount;
+} JPEG_WRITER;
+
+//
+// Build a JPEG Huffman table (code lengths limited to 16 bits)
+// from symbol counts, as in section K.2 of the JPEG standard
+//
+void MakeHuffTable(long *pFreq, HUFF_TABLE *pTable)
+{
+    long freq[257];
+    int codesize[257], others[257], bits[33];
+    int i, j, c1, c2, iCode, k;
+    long v;
+
+    memcpy(freq, pFreq, 256 * sizeof(long));
+    freq[256] = 1; // reserves one code so that no code is all 1's
+    memset(codesize, 0, sizeof(codesize));
+    memset(bits, 0, sizeof(bits));
+    for (i=0; i<257; i++) others[i] = -1;
+    while (1) {
+        c1 = -1; v = 1000000000L;
+        for (i=0; i<=256; i++) { // the least frequent
+            if (freq[i] && freq[i] <= v) { v = freq[i]; c1 = i; }
+        }
+        c2 = -1; v = 1000000000L;
+        for (i=0; i<=256; i++) { // the next least frequent
+            if (freq[i] && freq[i] <= v && i != c1) { v = freq[i]; c2 = i; }
+        }
+        if (c2 < 0) break;
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+        codesize[c1]++;
+        while (others[c1] >= 0) { c1 = others[c1]; codesize[c1]++; }
+        others[c1] = c2;
+        codesize[c2]++;
+        while (others[c2] >= 0) { c2 = others[c2]; codesize[c2]++; }
+    }
+    for (i=0; i<=256; i++) {
+        if (codesize[i]) bits[codesize[i]]++;
+    }
+    for (i=32; i>16; i--) { // limit the lengths to 16 bits
+        while (bits[i] > 0) {
+            j = i - 2;
+            while (bits[j] == 0) j--;
+            bits[i] -= 2;
+            bits[i-1]++;
+            bits[j+1] += 2;
+            bits[j]--;
+        }
+    }
+    while (bits[i] == 0) i--;
+    bits[i]--; // remove the reserved code
+    memset(pTable, 0, sizeof(HUFF_TABLE));
+    for (i=1; i<=16; i++) pTable->ucBits[i] = (uint8_t)bits[i];
+    for (i=1; i<=32; i++) { // symbols in order of code length
+        for (j=0; j<256; j++) {
+            if (codesize[j] == i) pTable->ucVals[pTable->iCount++] = (uint8_t)j;
+        }
+    }
+    iCode = 0; k = 0; // canonical codes
+    for (i=1; i<=16; i++) {
+        for (j=0; j<bits[i]; j++) {
+            pTable->usCode[pTable->ucVals[k]] = (uint16_t)iCode++;
+            pTable->ucSize[pTable->ucVals[k++]] = (uint8_t)i;
+        }
+        iCode <<= 1;
+    }
+} /* MakeHuffTable() */
+void PutBits(JPEG_WRITER *pJW, uint32_t u32Code, int iSize)
+{
+    uint8_t uc;
+
+    pJW->u32Bits = (pJW->u32Bits << iSize) | (u32Code & ((1u << iSize) - 1));
+    pJW->iBitCount += iSize;
+    while (pJW->iBitCount >= 8) {
+        uc = (uint8_t)(pJW->u32Bits >> (pJW->iBitCount - 8));
+        fputc(uc, pJW->f);
+        if (uc == 0xff) fputc(0, pJW->f); // byte stuffing
+        pJW->iBitCount -= 8;
+    }
+} /* PutBits() */
+//
+// Number of bits needed for a coefficient value
+//
+int BitSize(int i)
+{
+    int n = 0;
+    if (i < 0) i = -i;
+    while (i) { n++; i >>= 1; }
+    return n;
+} /* BitSize() */
+//
+// Forward DCT and quantization of an 8x8 block (level shifted samples)
+// in fixed point, so the corpus is the same on every machine
+// The coefficients are stored in zigzag order
+//
+const int iDCTCos[8][8] = { // cos((2x+1)u*pi/16) * (u ? 1/2 : 1/sqrt(8)) * 8192
+    {2896, 2896, 2896, 2896, 2896, 2896, 2896, 2896},
+    {4017, 3406, 2276, 799, -799, -2276, -3406, -4017},
+    {3784, 1567, -1567, -3784, -3784, -1567, 1567, 3784},
+    {3406, -799, -4017, -2276, 2276, 4017, 799, -3406},
+    {2896, -2896, -2896, 2896, 2896, -2896, -2896, 2896},
+    {2276, -4017, 799, 3406, -3406, -799, 4017, -2276},
+    {1567, -3784, 3784, -1567, -1567, 3784, -3784, 1567},
+    {799, -2276, 3406, -4017, 4017, -3406, 2276, -799}};
+void FDCTBlock(int *pBlock, const uint8_t *pQ, int16_t *pOut)
+{
+    int iTemp[64], u, v, x;
+    int64_t ll, llQ;
+
+    for (v=0; v<8; v++) { // rows (scaled by 2^13)
+        for (u=0; u<8; u++) {
+            iTemp[v*8 + u] = 0;
+            for (x=0; x<8; x++) iTemp[v*8 + u] += pBlock[v*8 + x] * iDCTCos[u][x];
+        }
+    }
+    for (x=0; x<64; x++) { // columns (scaled by 2^26) and quantize
+        u = iZigzag[x] & 7; v = iZigzag[x] >> 3;
+        ll = 0;
+        for (int y=0; y<8; y++) ll += (int64_t)iTemp[y*8 + u] * iDCTCos[v][y];
+        llQ = (int64_t)pQ[x] << 26;
+        pOut[x] = (int16_t)((ll < 0) ? -((-ll + llQ/2) / llQ) : ((ll + llQ/2) / llQ));
+    }
+} /* FDCTBlock() */
+//
+// Count (pass 1) or write (pass 2) the Huffman symbols of a block
+//
+void CodeBlock(int16_t *pCoef, int *pDC, long *pDCFreq, long *pACFreq, HUFF_TABLE *pDC_T, HUFF_TABLE *pAC_T, JPEG_WRITER *pJW)
+{
+    int i, iRun = 0, iDiff, iSize, iSym;
+
+    iDiff = pCoef[0] - *pDC;
+    *pDC = pCoef[0];
+    iSize = BitSize(iDiff);
+    if (pJW) {
+        PutBits(pJW, pDC_T->usCode[iSize], pDC_T->ucSize[iSize]);
+        if (iSize) PutBits(pJW, (iDiff < 0) ? iDiff - 1 : iDiff, iSize);
+    } else {
+        pDCFreq[iSize]++;
+    }
+    for (i=1; i<64; i++) {
+        if (pCoef[i] == 0) {
+            iRun++;
+            continue;
+        }
+        while (iRun > 15) { // ZRL
+            if (pJW) PutBits(pJW, pAC_T->usCode[0xf0], pAC_T->ucSize[0xf0]);
+            else pACFreq[0xf0]++;
+            iRun -= 16;
+        }
+        iSize = BitSize(pCoef[i]);
+        iSym = (iRun << 4) | iSize;
+        if (pJW) {
+            PutBits(pJW, pAC_T->usCode[iSym], pAC_T->ucSize[iSym]);
+            PutBits(pJW, (pCoef[i] < 0) ? pCoef[i] - 1 : pCoef[i], iSize);
+        } else {
+            pACFreq[iSym]++;
+        }
+        iRun = 0;
+    }
+    if (iRun) { // EOB
+        if (pJW) PutBits(pJW, pAC_T->usCode[0], pAC_T->ucSize[0]);
+        else pACFreq[0]++;
+    }
+} /* CodeBlock() */
+void WriteMarker(FILE *f, int iMarker, int iLen)
+{
+    fputc(0xff, f); fputc(iMarker, f);
+    fputc(iLen >> 8, f); fputc(iLen & 0xff, f);
+} /* WriteMarker() */
+void WriteHuffTable(FILE *f, int iClassID, HUFF_TABLE *pTable)
+{
+    WriteMarker(f, 0xc4, 2 + 1 + 16 + pTable->iCount);
+    fputc(iClassID, f);
+    fwrite(&pTable->ucBits[1], 1, 16, f);
+    fwrite(pTable->ucVals, 1, pTable->iCount, f);
+} /* WriteHuffTable() */
+//
+// Write the R,G,B image as a baseline JPEG file
+// returns 1 for success, 0 for failure
+//
+int WriteJPEG(char *szName, uint8_t *pRGB, int iWidth, int iHeight, int bSubsample)
+{
+    FILE *f;
+    JPEG_WRITER jw;
+    HUFF_TABLE dc[2], ac[2];
+    long dcfreq[2][256], acfreq[2][256];
+    uint8_t ucQ[2][64];
+    int iBlock[64];
+    int16_t *pCoef, *c;
+    int i, q, bx, by, iComp, iPass, iMCU, iBlocks, iDC[3], cx, cy, sx, sy, n;
+    const uint8_t *s;
+
+    for (i=0; i<64; i++) { // quality 90 = 20% of the standard tables (zigzag order)
+        q = (iLumaQ[iZigzag[i]] * 20 + 50) / 100;
+        ucQ[0][i] = (uint8_t)((q) ? q : 1);
+        q = (iChromaQ[iZigzag[i]] * 20 + 50) / 100;
+        ucQ[1][i] = (uint8_t)((q) ? q : 1);
+    }
+    iMCU = (bSubsample) ? 16 : 8;
+    cx = (iWidth + iMCU - 1) / iMCU;
+    cy = (iHeight + iMCU - 1) / iMCU;
+    iBlocks = (bSubsample) ? 6 : 3; // per MCU
+    pCoef = (int16_t *)malloc(cx * cy * iBlocks * 64 * sizeof(int16_t));
+    if (pCoef == NULL) return 0;
+    c = pCoef;
+    for (by=0; by<cy; by++) { // quantized coefficients of every block in MCU order
+        for (bx=0; bx<cx; bx++) {
+            for (n=0; n<iBlocks; n++) {
+                iComp = (bSubsample) ? ((n < 4) ? 0 : n - 3) : n;
+                for (i=0; i<64; i++) {
+                    int r = 0, g = 0, b = 0, k, iSamples = (bSubsample && iComp) ? 4 : 1;
+                    for (k=0; k<iSamples; k++) { // average 2x2 for subsampled chroma
+                        if (bSubsample && iComp) {
+                            sx = bx*16 + (i & 7)*2 + (k & 1);
+                            sy = by*16 + (i >> 3)*2 + (k >> 1);
+                        } else if (bSubsample) {
+                            sx = bx*16 + (n & 1)*8 + (i & 7);
+                            sy = by*16 + (n >> 1)*8 + (i >> 3);
+                        } else {
+                            sx = bx*8 + (i & 7);
+                            sy = by*8 + (i >> 3);
+                        }
+                        if (sx >= iWidth) sx = iWidth - 1; // repeat the edge pixels
+                        if (sy >= iHeight) sy = iHeight - 1;
+                        s = &pRGB[(sy * iWidth + sx) * 3];
+                        r += s[0]; g += s[1]; b += s[2];
+                    }
+                    r /= iSamples; g /= iSamples; b /= iSamples;
+                    if (iComp == 0) iBlock[i] = ((19595*r + 38470*g + 7471*b + 32768) >> 16) - 128;
+                    else if (iComp == 1) iBlock[i] = (-11059*r - 21709*g + 32768*b + 32768) >> 16;
+                    else iBlock[i] = (32768*r - 27439*g - 5329*b + 32768) >> 16;
+                }
+                FDCTBlock(iBlock, ucQ[iComp != 0], c);
+                c += 64;
+            }
+        }
+    }
+    memset(dcfreq, 0, sizeof(dcfreq));
+    memset(acfreq, 0, sizeof(acfreq));
+    f = fopen(szName, "wb");
+    if (f == NULL) {
+        printf("Unable to create %s\n", szName);
+        free(pCoef);
+        return 0;
+    }
+    memset(&jw, 0, sizeof(jw));
+    jw.f = f;
+    for (iPass=0; iPass<2; iPass++) { // count the symbols, then write them
+        if (iPass == 1) {
+            for (i=0; i<2; i++) {
+                MakeHuffTable(dcfreq[i], &dc[i]);
+                MakeHuffTable(acfreq[i], &ac[i]);
+            }
+            fputc(0xff, f); fputc(0xd8, f); // SOI
+            for (i=0; i<2; i++) {
+                WriteMarker(f, 0xdb, 67); // DQT
+                fputc(i, f);
+                fwrite(ucQ[i], 1, 64, f);
+            }
+            WriteMarker(f, 0xc0, 17); // SOF0
+            fputc(8, f);
+            fputc(iHeight >> 8, f); fputc(iHeight & 0xff, f);
+            fputc(iWidth >> 8, f); fputc(iWidth & 0xff, f);
+            fputc(3, f);
+            for (i=0; i<3; i++) {
+                fputc(i + 1, f);
+                fputc((bSubsample && i == 0) ? 0x22 : 0x11, f);
+                fputc(i != 0, f);
+            }
+            for (i=0; i<2; i++) {
+                WriteHuffTable(f, i, &dc[i]);
+                WriteHuffTable(f, 0x10 | i, &ac[i]);
+            }
+            WriteMarker(f, 0xda, 12); // SOS
+            fputc(3, f);
+            for (i=0; i<3; i++) {
+                fputc(i + 1, f);
+                fputc((i) ? 0x11 : 0x00, f);
+            }
+            fputc(0, f); fputc(63, f); fputc(0, f);
+        }
+        iDC[0] = iDC[1] = iDC[2] = 0;
+        c = pCoef;
+        for (i=0; i<cx * cy * iBlocks; i++, c+=64) {
+            n = i % iBlocks;
+            iComp = (bSubsample) ? ((n < 4) ? 0 : n - 3) : n;
+            CodeBlock(c, &iDC[iComp], dcfreq[iComp != 0], acfreq[iComp != 0], &dc[iComp != 0], &ac[iComp != 0], (iPass) ? &jw : NULL);
+        }
+    }
+    if (jw.iBitCount) PutBits(&jw, 0x7f, 8 - jw.iBitCount); // pad with 1's
+    fputc(0xff, f); fputc(0xd9, f); // EOI
+    fclose(f);
+    free(pCoef);
+    return 1;
+} /* WriteJPEG() */
+//
+// Make the corpus file of one size, content and source type
+// (if it doesn't exist yet)
+// returns 1 for success, 0 for failure
+//
+int MakeCorpusFile(char *szName, uint8_t *pRGB, int iWidth, int iHeight, int iSource)
+{
+    static const int iBpps[5] = {1, 4, 8, 24, 32};
+    struct stat st;
+
+    if (stat(szName, &st) == 0) return 1; // already made
+    if (iSource >= SOURCE_JPEG444)
+        return WriteJPEG(szName, pRGB, iWidth, iHeight, iSource == SOURCE_JPEG420);
+    return WriteBMP(szName, pRGB, iWidth, iHeight, iBpps[iSource]);
+} /* MakeCorpusFile() */
+//
+// Read the total wall and (main thread) CPU time and the stage times
+// from the JSON written by epd_image --STATSJSON
+// returns 1 for success, 0 for failure
+//
+int ReadStats(char *szName, int64_t *pWall, int64_t *pCPU, int64_t *pStages, int *pCalls)
+{
+    FILE *f;
+    char szLine[512], *s;
+    long long ll;
+    int i, iCalls;
+
+    f = fopen(szName, "r");
+    if (f == NULL) return 0;
+    *pWall = -1;
+    while (fgets(szLine, sizeof(szLine), f)) {
+        if ((s = strstr(szLine, "\"stage\": \"")) != NULL) {
+            for (i=0; i<STAGE_COUNT; i++) {
+                if (strncmp(s + 10, szStages[i], strlen(szStages[i])) == 0 && s[10 + strlen(szStages[i])] == '"') break;
+            }
+            if (i < STAGE_COUNT && (s = strstr(szLine, "\"calls\": ")) != NULL && sscanf(s, "\"calls\": %d, \"wall_us\": %lld", &iCalls, &ll) == 2) {
+                pStages[i] = ll;
+                pCalls[i] = iCalls;
+            }
+        } else if ((s = strstr(szLine, "\"wall_us\": ")) != NULL && sscanf(s, "\"wall_us\": %lld", &ll) == 1) {
+            *pWall = ll;
+        } else if ((s = strstr(szLine, "\"main_thread_cpu_us\": ")) != NULL && sscanf(s, "\"main_thread_cpu_us\": %lld", &ll) == 1) {
+            *pCPU = ll;
+        }
+    }
+    fclose(f);
+    return (*pWall >= 0);
+} /* ReadStats() */
+//
+// Add a run to a total
+//
+void AddRun(BENCH_TOTAL *pTotal, double dPixels, int64_t llWall, int64_t *pStages, int *pCalls)
+{
+    int i;
+
+    pTotal->iRuns++;
+    pTotal->dPixels += dPixels;
+    pTotal->llWall += llWall;
+    for (i=0; i<STAGE_COUNT; i++) {
+        if (pCalls[i] == 0) continue;
+        pTotal->llStage[i] += pStages[i];
+        pTotal->iStageRuns[i]++;
+        pTotal->dStagePixels[i] += dPixels;
+    }
+} /* AddRun() */
+//
+// Megapixels per second of a total (pixels per microsecond)
+//
+double MPS(double dPixels, int64_t llTime)
+{
+    return (llTime > 0) ? dPixels / (double)llTime : 0.0;
+} /* MPS() */
+//
+// Make the corpus files of the first iSizeCount sizes (the ones not made yet)
+// returns 1 for success, 0 for failure
+//
+int MakeCorpus(char *szDir, int iSizeCount)
+{
+    char szName[512];
+    int iSize, iContent, iSource;
+    uint8_t *pRGB;
+
+    MakeDir(szDir);
+    printf("Making the corpus in %s/\n", szDir);
+    for (iSize=0; iSize<iSizeCount; iSize++) {
+        pRGB = (uint8_t *)malloc(iSizes[iSize][0] * iSizes[iSize][1] * 3);
+        for (iContent=0; iContent<CONTENT_COUNT; iContent++) {
+            MakeContent(pRGB, iSizes[iSize][0], iSizes[iSize][1], iContent);
+            for (iSource=0; iSource<SOURCE_COUNT; iSource++) {
+                sprintf(szName, "%s/%s_%dx%d_%s.%s", szDir, szContents[iContent], iSizes[iSize][0], iSizes[iSize][1], szSources[iSource], (iSource >= SOURCE_JPEG444) ? "jpg" : "bmp");
+                if (!MakeCorpusFile(szName, pRGB, iSizes[iSize][0], iSizes[iSize][1], iSource)) {
+                    free(pRGB);
+                    return 0;
+                }
+            }
+        }
+        free(pRGB);
+    }
+    return 1;
+} /* MakeCorpus() */
+//
+// 64-bit FNV-1a hash of a file
+// returns 0 if the file can't be read
+//
+uint64_t HashFile(char *szName)
+{
+    FILE *f;
+    uint64_t u64 = 0xcbf29ce484222325ULL;
+    uint8_t ucBuf[4096];
+    int i, iLen;
+
+    f = fopen(szName, "rb");
+    if (f == NULL) return 0;
+    while ((iLen = (int)fread(ucBuf, 1, sizeof(ucBuf), f)) > 0) {
+        for (i=0; i<iLen; i++) {
+            u64 ^= ucBuf[i];
+            u64 *= 0x100000001b3ULL;
+        }
+    }
+    fclose(f);
+    return u64;
+} /* HashFile() */
+//
+// Regression gate corpus: every source type of the photo-like image plus
+// the UI screen as 24-bpp BMP and 4:2:0 JPEG (the smallest size, which
+// isn't a multiple of 8 in either direction)
+//
+const int iGateFiles[][2] = {{1, SOURCE_BMP1}, {1, SOURCE_BMP4}, {1, SOURCE_BMP8}, {1, SOURCE_BMP24}, {1, SOURCE_BMP32},
+                             {1, SOURCE_JPEG444}, {1, SOURCE_JPEG420}, {2, SOURCE_BMP24}, {2, SOURCE_JPEG420}};
+#define GATE_FILES 9
+#define GATE_TIMING_SIZE 3 // 800x480
+#define GATE_TIMING_RUNS 5
+// option flags of each case
+#define GATE_DITHER 1
+#define GATE_MIRROR 2
+#define GATE_FLIPV 4
+#define GATE_INVERT 8
+#define GATE_LSBFIRST 16
+#define GATE_FLAGS 32
+const char szGateFlags[] = "DMFIL"; // flag letters in the golden file
+
+typedef struct tag_gate_case
+{
+    char szKey[96]; // <input> <format> <rotation> <flags>
+    char szHash[20]; // hex hash of the output or "failed"
+} GATE_CASE;
+//
+// Run every option combination of the gate corpus and compare the output
+// hashes with the goldens (or write them with bWriteGolden) and the
+// throughput of each format with and without dither with the timing
+// baseline (or write it with bWriteBaseline)
+// returns 1 if nothing regressed, 0 if it did
+//
+int RunGate(char *szExe, char *szDir, char *szGolden, char *szTiming, int bWriteGolden, int bWriteBaseline, int iTolerance)
+{
+    char szName[512], szLeaf[64], szCmd[2048], szJSON[512], szOut[512], szFlags[8], szSpec[64], szLine[256];
+    int i, j, iFile, iFormat, iRotation, iFlags, iCases = 0, iGoldens = 0, iNext = 0, iMismatch = 0, iMissing = 0, iSlow = 0, rc;
+    int iCalls[STAGE_COUNT], iBestCalls[STAGE_COUNT];
+    int64_t llWall, llCPU, llBest, llStages[STAGE_COUNT], llBestStages[STAGE_COUNT];
+    double dBase[FORMAT_COUNT][2], dMPS;
+    BENCH_TOTAL totals[FORMAT_COUNT][2];
+    GATE_CASE *pGoldens = NULL, gc;
+    FILE *f, *fOut = NULL;
+
+    if (!MakeCorpus(szDir, GATE_TIMING_SIZE + 1))
+        return 0;
+    if (!bWriteGolden) {
+        f = fopen(szGolden, "r");
+        if (f == NULL) {
+            printf("Unable to open the goldens %s (make them with --golden)\n", szGolden);
+            return 0;
+        }
+        pGoldens = (GATE_CASE *)malloc(GATE_FILES * FORMAT_COUNT * 4 * GATE_FLAGS * sizeof(GATE_CASE));
+        while (fgets(szLine, sizeof(szLine), f) && iGoldens < GATE_FILES * FORMAT_COUNT * 4 * GATE_FLAGS) {
+            char *s = strrchr(szLine, ' ');
+            if (szLine[0] == '#' || s == NULL || s - szLine >= (int)sizeof(gc.szKey)) continue;
+            memcpy(pGoldens[iGoldens].szKey, szLine, s - szLine);
+            pGoldens[iGoldens].szKey[s - szLine] = 0;
+            sscanf(s + 1, "%19s", pGoldens[iGoldens].szHash);
+            iGoldens++;
+        }
+        fclose(f);
+    } else {
+        fOut = fopen(szGolden, "w");
+        if (fOut == NULL) {
+            printf("Unable to create %s\n", szGolden);
+            return 0;
+        }
+        fprintf(fOut, "# epd_bench --gate goldens: <input> <format> <rotation> <flags> <FNV-1a hash of the output>\n");
+        fprintf(fOut, "# flags: D = DITHER, M = MIRROR, F = FLIPV, I = INVERT, L = LSBFIRST\n");
+    }
+    for (i=0; i<FORMAT_COUNT; i++) dBase[i][0] = dBase[i][1] = 0.0;
+    f = (bWriteBaseline) ? NULL : fopen(szTiming, "r");
+    if (f) {
+        while (fgets(szLine, sizeof(szLine), f)) {
+            if (sscanf(szLine, "%31s %d %lf", szSpec, &j, &dMPS) != 3 || j < 0 || j > 1) continue;
+            for (i=0; i<FORMAT_COUNT; i++) {
+                if (strcmp(szSpec, szFormats[i]) == 0) dBase[i][j] = dMPS;
+            }
+        }
+        fclose(f);
+    }
+    memset(totals, 0, sizeof(totals));
+    sprintf(szJSON, "%s/gate.json", szDir);
+    sprintf(szOut, "%s/gate.h", szDir);
+    for (iFile=0; iFile<GATE_FILES; iFile++) {
+        iFormat = iGateFiles[iFile][1]; // source type
+        sprintf(szLeaf, "%s_%dx%d_%s.%s", szContents[iGateFiles[iFile][0]], iSizes[0][0], iSizes[0][1], szSources[iFormat], (iFormat >= SOURCE_JPEG444) ? "jpg" : "bmp");
+        sprintf(szName, "%s/%s", szDir, szLeaf);
+        printf("Checking %s\n", szLeaf);
+        fflush(stdout);
+        for (iFormat=0; iFormat<FORMAT_COUNT; iFormat++) {
+            for (iRotation=0; iRotation<360; iRotation+=90) {
+                for (iFlags=0; iFlags<GATE_FLAGS; iFlags++) {
+                    for (i=0; i<5; i++) {
+                        szFlags[i] = (iFlags & (1 << i)) ? szGateFlags[i] : '-';
+                    }
+                    szFlags[5] = 0;
+                    sprintf(szCmd, "%s%s%s%s%s%s", szExe, (iFlags & GATE_LSBFIRST) ? " --LSBFIRST" : "", (iFlags & GATE_DITHER) ? " --DITHER" : "",
+                            (iFlags & GATE_MIRROR) ? " --MIRROR" : "", (iFlags & GATE_FLIPV) ? " --FLIPV" : "", (iFlags & GATE_INVERT) ? " --INVERT" : "");
+                    if (iRotation)
+                        sprintf(&szCmd[strlen(szCmd)], " --ROTATE %d", iRotation);
+                    sprintf(&szCmd[strlen(szCmd)], " --%s %s %s > %s", szFormats[iFormat], szName, szOut, NULL_DEVICE);
+                    remove(szOut);
+                    sprintf(gc.szKey, "%s %s %d %s", szLeaf, szFormats[iFormat], iRotation, szFlags);
+                    rc = system(szCmd);
+                    if (rc == 0 && HashFile(szOut) != 0) {
+                        sprintf(gc.szHash, "%016llx", (unsigned long long)HashFile(szOut));
+                    } else {
+                        strcpy(gc.szHash, "failed"); // (e.g. color dithering of a palette image)
+                    }
+                    iCases++;
+                    if (fOut) {
+                        fprintf(fOut, "%s %s\n", gc.szKey, gc.szHash);
+                        continue;
+                    }
+                    // the goldens are normally in the same order
+                    if (iNext >= iGoldens || strcmp(pGoldens[iNext].szKey, gc.szKey) != 0) {
+                        for (iNext=0; iNext<iGoldens; iNext++) {
+                            if (strcmp(pGoldens[iNext].szKey, gc.szKey) == 0) break;
+                        }
+                    }
+                    if (iNext >= iGoldens) {
+                        printf("No golden for %s\n", gc.szKey);
+                        iMissing++;
+                    } else if (strcmp(pGoldens[iNext].szHash, gc.szHash) != 0) {
+                        printf("MISMATCH %s: %s, golden %s\n", gc.szKey, gc.szHash, pGoldens[iNext].szHash);
+                        iMismatch++;
+                    }
+                    iNext++;
+                }
+            }
+        }
+    }
+    // throughput of each format with and without dither on the larger
+    // photo (BMP and JPEG) in CPU time, the best of a few runs to filter out noise
+    for (iFormat=0; iFormat<FORMAT_COUNT; iFormat++) {
+        printf("Timing %s\n", szFormats[iFormat]);
+        fflush(stdout);
+        for (j=0; j<2; j++) {
+            for (iFile=0; iFile<2; iFile++) {
+                sprintf(szName, "%s/%s_%dx%d_%s.%s", szDir, szContents[1], iSizes[GATE_TIMING_SIZE][0], iSizes[GATE_TIMING_SIZE][1], szSources[(iFile) ? SOURCE_JPEG420 : SOURCE_BMP24], (iFile) ? "jpg" : "bmp");
+                sprintf(szCmd, "%s --STATSJSON %s%s --%s %s %s > %s", szExe, szJSON, (j) ? " --DITHER" : "", szFormats[iFormat], szName, szOut, NULL_DEVICE);
+                llBest = -1;
+                for (i=0; i<GATE_TIMING_RUNS; i++) {
+                    remove(szJSON);
+                    memset(iCalls, 0, sizeof(iCalls));
+                    if (system(szCmd) == 0 && ReadStats(szJSON, &llWall, &llCPU, llStages, iCalls) && (llBest < 0 || llCPU < llBest)) {
+                        llBest = llCPU; // (less affected by other processes than the wall time)
+                        memcpy(llBestStages, llStages, sizeof(llStages));
+                        memcpy(iBestCalls, iCalls, sizeof(iCalls));
+                    }
+                }
+                if (llBest >= 0)
+                    AddRun(&totals[iFormat][j], (double)iSizes[GATE_TIMING_SIZE][0] * iSizes[GATE_TIMING_SIZE][1], llBest, llBestStages, iBestCalls);
+            }
+        }
+    }
+    remove(szJSON);
+    remove(szOut);
+    free(pGoldens);
+    if (fOut) {
+        fclose(fOut);
+        printf("Wrote %d golden hashes to %s\n", iCases, szGolden);
+    } else {
+        printf("%d cases: %d match, %d mismatched, %d without a golden\n", iCases, iCases - iMismatch - iMissing, iMismatch, iMissing);
+    }
+    fOut = (bWriteBaseline) ? fopen(szTiming, "w") : NULL;
+    if (fOut) fprintf(fOut, "# epd_bench --gate timing baseline: <format> <dither> <Mpixels/CPU second>\n");
+    printf("\nThroughput on %dx%d (Mpixels/CPU second, tolerance %d%%)\n", iSizes[GATE_TIMING_SIZE][0], iSizes[GATE_TIMING_SIZE][1], iTolerance);
+    printf("format dither  baseline   current  change\n");
+    for (iFormat=0; iFormat<FORMAT_COUNT; iFormat++) {
+        for (j=0; j<2; j++) {
+            dMPS = MPS(totals[iFormat][j].dPixels, totals[iFormat][j].llWall);
+            if (fOut) fprintf(fOut, "%s %d %.3f\n", szFormats[iFormat], j, dMPS);
+            if (dBase[iFormat][j] > 0.0) {
+                i = (dMPS < dBase[iFormat][j] * (100 - iTolerance) / 100.0);
+                printf("%-6s %6s %9.2f %9.2f  %+5.1f%%%s\n", szFormats[iFormat], (j) ? "yes" : "no", dBase[iFormat][j], dMPS, (dMPS / dBase[iFormat][j] - 1.0) * 100.0, (i) ? "  SLOWER" : "");
+                iSlow += i;
+            } else {
+                printf("%-6s %6s %9s %9.2f\n", szFormats[iFormat], (j) ? "yes" : "no", "-", dMPS);
+            }
+        }
+    }
+    if (fOut) {
+        fclose(fOut);
+        printf("Wrote the timing baseline to %s\n", szTiming);
+    } else if (!bWriteBaseline && dBase[0][0] == 0.0) {
+        printf("No timing baseline in %s (make one with --baseline)\n", szTiming);
+    }
+    rc = (iMismatch == 0 && iMissing == 0 && iSlow == 0);
+    printf("\nRegression gate %s\n", (rc) ? "passed" : "FAILED");
+    return rc;
+} /* RunGate() */
+
+int main(int argc, char *argv[])
+{
+    char *szExe = "./epd_image", *szDir = "bench_corpus", *szCSV = "bench_results.csv";
+    char *szGolden = "regress_golden.txt", *szTiming = "regress_timing.txt";
+    char szName[512], szCmd[2048], szJSON[512], szOut[512];
+    int i, iSize, iContent, iSource, iFormat, bDither, iSizeCount = SIZE_COUNT, bQuick = 0, iSkipped = 0, iFailed = 0;
+    int bGate = 0, bWriteGolden = 0, bWriteBaseline = 0, iTolerance = 15;
+    int iCalls[STAGE_COUNT];
+    int64_t llWall, llCPU, llStages[STAGE_COUNT];
+    double dPixels;
+    FILE *fCSV;
+    BENCH_TOTAL all, bySize[SIZE_COUNT], bySource[SOURCE_COUNT][FORMAT_COUNT][2];
+
+    for (i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) bQuick = 1;
+        else if (strcmp(argv[i], "--exe") == 0 && i+1 < argc) szExe = argv[++i];
+        else if (strcmp(argv[i], "--dir") == 0 && i+1 < argc) szDir = argv[++i];
+        else if (strcmp(argv[i], "--csv") == 0 && i+1 < argc) szCSV = argv[++i];
+        else if (strcmp(argv[i], "--gate") == 0) bGate = 1;
+        else if (strcmp(argv[i], "--golden") == 0) bGate = bWriteGolden = 1;
+        else if (strcmp(argv[i], "--baseline") == 0) bGate = bWriteBaseline = 1;
+        else if (strcmp(argv[i], "--tolerance") == 0 && i+1 < argc) iTolerance = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--goldfile") == 0 && i+1 < argc) szGolden = argv[++i];
+        else if (strcmp(argv[i], "--timefile") == 0 && i+1 < argc) szTiming = argv[++i];
+        else {
+            printf("Usage: epd_bench [--quick] [--exe <epd_image>] [--dir <corpus dir>] [--csv <results file>]\n");
+            printf("       epd_bench --gate [--tolerance <percent>] [--goldfile <file>] [--timefile <file>]\n");
+            printf("--quick = only the 3 smallest sizes and the bmp24/jpg420 sources\n");
+            printf("--gate = regression gate: check every option combination against the golden output hashes\n");
+            printf("         and the throughput against the timing baseline (default tolerance 15%%)\n");
+            printf("--golden = (re)write the golden hashes from this build instead of checking them\n");
+            printf("--baseline = (re)write the timing baseline from this build (checks the goldens too)\n");
+            return -1;
+        }
+    }
+    if (bQuick) iSizeCount = 3;
+    if (bGate)
+        return RunGate(szExe, szDir, szGolden, szTiming, bWriteGolden, bWriteBaseline, iTolerance) ? 0 : -1;
+    if (!MakeCorpus(szDir, iSizeCount))
+        return -1;
+    fCSV = fopen(szCSV, "w");
+    if (fCSV == NULL) {
+        printf("Unable to create %s\n", szCSV);
+        return -1;
+    }
+    fprintf(fCSV, "width,height,content,source,format,dither,wall_us");
+    for (i=0; i<STAGE_COUNT; i++) fprintf(fCSV, ",%s_us", szStages[i]);
+    fprintf(fCSV, "\n");
+    memset(&all, 0, sizeof(all));
+    memset(bySize, 0, sizeof(bySize));
+    memset(bySource, 0, sizeof(bySource));
+    sprintf(szJSON, "%s/stats.json", szDir);
+    sprintf(szOut, "%s/out.h", szDir);
+    for (iSize=0; iSize<iSizeCount; iSize++) {
+        dPixels = (double)iSizes[iSize][0] * iSizes[iSize][1];
+        printf("Converting %dx%d...\n", iSizes[iSize][0], iSizes[iSize][1]);
+        fflush(stdout);
+        for (iContent=0; iContent<CONTENT_COUNT; iContent++) {
+            for (iSource=0; iSource<SOURCE_COUNT; iSource++) {
+                if (bQuick && iSource != SOURCE_BMP24 && iSource != SOURCE_JPEG420) continue;
+                sprintf(szName, "%s/%s_%dx%d_%s.%s", szDir, szContents[iContent], iSizes[iSize][0], iSizes[iSize][1], szSources[iSource], (iSource >= SOURCE_JPEG444) ? "jpg" : "bmp");
+                for (iFormat=0; iFormat<FORMAT_COUNT; iFormat++) {
+                    for (bDither=0; bDither<2; bDither++) {
+                        // color dithering needs a full color source
+                        if (bDither && iFormat >= 1 && iFormat <= 3 && iSource < SOURCE_BMP24) {
+                            iSkipped++;
+                            continue;
+                        }
+                        sprintf(szCmd, "%s --STATSJSON %s %s--%s %s %s > %s", szExe, szJSON, (bDither) ? "--DITHER " : "", szFormats[iFormat], szName, szOut, NULL_DEVICE);
+                        remove(szJSON);
+                        memset(iCalls, 0, sizeof(iCalls));
+                        memset(llStages, 0, sizeof(llStages));
+                        if (system(szCmd) != 0 || !ReadStats(szJSON, &llWall, &llCPU, llStages, iCalls)) {
+                            printf("Failed: %s\n", szCmd);
+                            iFailed++;
+                            continue;
+                        }
+                        AddRun(&all, dPixels, llWall, llStages, iCalls);
+                        AddRun(&bySize[iSize], dPixels, llWall, llStages, iCalls);
+                        AddRun(&bySource[iSource][iFormat][bDither], dPixels, llWall, llStages, iCalls);
+                        fprintf(fCSV, "%d,%d,%s,%s,%s,%d,%lld", iSizes[iSize][0], iSizes[iSize][1], szContents[iContent], szSources[iSource], szFormats[iFormat], bDither, (long long)llWall);
+                        for (i=0; i<STAGE_COUNT; i++) fprintf(fCSV, ",%lld", (long long)llStages[i]);
+                        fprintf(fCSV, "\n");
+                    }
+                }
+            }
+        }
+    }
+    fclose(fCSV);
+    remove(szJSON);
+    remove(szOut);
+    printf("\n%d conversions (%d skipped: color dithering needs a 24/32-bpp source, %d failed)\n", all.iRuns, iSkipped, iFailed);
+    printf("\nMegapixels/sec of each stage (over the runs which used it)\n");
+    printf("stage      runs   total ms   Mpixels/s\n");
+    for (i=0; i<STAGE_COUNT; i++) {
+        if (all.dStagePixels[i] == 0.0) continue;
+        printf("%-7s %7d %10.1f %11.2f\n", szStages[i], all.iStageRuns[i], all.llStage[i] / 1000.0, MPS(all.dStagePixels[i], all.llStage[i]));
+    }
+    printf("overall %7d %10.1f %11.2f\n", all.iRuns, all.llWall / 1000.0, MPS(all.dPixels, all.llWall));
+    printf("\nOverall Mpixels/s by size\n");
+    for (iSize=0; iSize<iSizeCount; iSize++) {
+        printf("%4dx%-4d %8.2f\n", iSizes[iSize][0], iSizes[iSize][1], MPS(bySize[iSize].dPixels, bySize[iSize].llWall));
+    }
+    printf("\nOverall Mpixels/s by source and format (plain / dithered)\n");
+    printf("source ");
+    for (iFormat=0; iFormat<FORMAT_COUNT; iFormat++) printf("  %13s", szFormats[iFormat]);
+    printf("\n");
+    for (iSource=0; iSource<SOURCE_COUNT; iSource++) {
+        if (bySource[iSource][0][0].iRuns == 0) continue;
+        printf("%-6s ", szSources[iSource]);
+        for (iFormat=0; iFormat<FORMAT_COUNT; iFormat++) {
+            BENCH_TOTAL *p = bySource[iSource][iFormat];
+            if (p[1].iRuns)
+                printf("  %6.2f/%6.2f", MPS(p[0].dPixels, p[0].llWall), MPS(p[1].dPixels, p[1].llWall));
+            else
+                printf("  %6.2f/  -   ", MPS(p[0].dPixels, p[0].llWall));
+        }
+        printf("\n");
+    }
+    printf("\nEvery run is in %s\n", szCSV);
+    return (iFailed) ? -1 : 0;
+} /* main() */
@@ -0,0 +1,151 @@
+//
+// epd_bundle - device side reader for image bundles created by epd_image --BUNDLE
+//
+// A bundle packs many converted images into one binary file (e.g. for a
+// SPI flash partition). The bundle is used in place - the lookup functions
+// return pointers into the memory mapped bundle data without copying it
+//
+// Written by Larry Bank
+//
+// Copyright 2023 BitBank Software, Inc. All Rights Reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//===========================================================================
+//
+// File layout (all values little-endian):
+// header (16 bytes)
+//   0  'E','P','D','B'
+//   4  uint16_t version
+//   6  uint16_t image count
+//   8  uint32_t alignment of each image's data
+//  12  uint32_t total bundle size
+// index (32 bytes per image, sorted by name hash)
+//   0  uint32_t FNV-1a hash of the image name
+//   4  uint8_t  format (0=BW, 1=BWR, 2=BWY, 3=BWYR, 4=4GRAY)
+//   5  uint8_t  plane count
+//   6  uint8_t  flags (EPD_BUNDLE_RLE)
+//   7  uint8_t  reserved
+//   8  uint16_t width
+//  10  uint16_t height
+//  12  uint16_t bytes per line of each plane
+//  14  uint16_t reserved
+//  16  uint32_t offset of plane 0, plane 1
+//  24  uint32_t size of plane 0, plane 1
+// image data
+//
+#ifndef __EPD_BUNDLE__
+#define __EPD_BUNDLE__
+
+#include <stdint.h>
+#include <string.h>
+
+#define EPD_BUNDLE_VERSION 1
+#define EPD_BUNDLE_HEADER_SIZE 16
+#define EPD_BUNDLE_ENTRY_SIZE 32
+// entry flags
+#define EPD_BUNDLE_RLE 1 // planes are compressed (see EPD_RLEDecode() in epd_decode.h)
+
+typedef struct epd_bundle_tag
+{
+    const uint8_t *pData; // start of the (memory mapped) bundle
+    uint32_t u32Size;
+    int iCount; // number of images
+} EPD_BUNDLE;
+
+typedef struct epd_bundle_image_tag
+{
+    int iFormat, iPlanes, iFlags;
+    int iWidth, iHeight, iPitch;
+    const uint8_t *pPlane[2]; // point into the bundle data
+    uint32_t u32PlaneSize[2];
+} EPD_BUNDLE_IMAGE;
+
+static inline uint32_t EPD_Get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+static inline uint16_t EPD_Get16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+//
+// 32-bit FNV-1a hash of an image name
+// (the name is the C array name epd_image would have used)
+//
+static inline uint32_t EPD_BundleHash(const char *szName)
+{
+    uint32_t u32 = 0x811c9dc5;
+    while (*szName) {
+        u32 ^= (uint8_t)*szName++;
+        u32 *= 0x01000193;
+    }
+    return u32;
+} /* EPD_BundleHash() */
+//
+// Check the bundle header
+// returns 1 for success, 0 for failure
+//
+static inline int EPD_BundleOpen(EPD_BUNDLE *pBundle, const uint8_t *pData, uint32_t u32Size)
+{
+    memset(pBundle, 0, sizeof(EPD_BUNDLE));
+    if (u32Size < EPD_BUNDLE_HEADER_SIZE || memcmp(pData, "EPDB", 4) != 0)
+        return 0;
+    if (EPD_Get16(&pData[4]) != EPD_BUNDLE_VERSION || EPD_Get32(&pData[12]) > u32Size)
+        return 0;
+    pBundle->iCount = EPD_Get16(&pData[6]);
+    if (EPD_BUNDLE_HEADER_SIZE + (uint32_t)pBundle->iCount * EPD_BUNDLE_ENTRY_SIZE > u32Size)
+        return 0;
+    pBundle->pData = pData;
+    pBundle->u32Size = u32Size;
+    return 1;
+} /* EPD_BundleOpen() */
+//
+// Fill in the image info for index entry i
+//
+static inline void EPD_BundleGetImage(EPD_BUNDLE *pBundle, int i, EPD_BUNDLE_IMAGE *pImage)
+{
+    const uint8_t *p = &pBundle->pData[EPD_BUNDLE_HEADER_SIZE + (i * EPD_BUNDLE_ENTRY_SIZE)];
+    int j;
+
+    pImage->iFormat = p[4];
+    pImage->iPlanes = p[5];
+    pImage->iFlags = p[6];
+    pImage->iWidth = EPD_Get16(&p[8]);
+    pImage->iHeight = EPD_Get16(&p[10]);
+    pImage->iPitch = EPD_Get16(&p[12]);
+    for (j=0; j<2; j++) {
+        pImage->u32PlaneSize[j] = (j < pImage->iPlanes) ? EPD_Get32(&p[24 + j*4]) : 0;
+        pImage->pPlane[j] = (j < pImage->iPlanes) ? &pBundle->pData[EPD_Get32(&p[16 + j*4])] : NULL;
+    }
+} /* EPD_BundleGetImage() */
+//
+// Find an image by name with a binary search of the index
+// returns 1 if found (and fills in pImage), 0 if not
+//
+static inline int EPD_BundleFind(EPD_BUNDLE *pBundle, const char *szName, EPD_BUNDLE_IMAGE *pImage)
+{
+    uint32_t u32Hash, u32;
+    int iLow = 0, iHigh = pBundle->iCount - 1, iMid;
+
+    u32Hash = EPD_BundleHash(szName);
+    while (iLow <= iHigh) {
+        iMid = (iLow + iHigh) >> 1;
+        u32 = EPD_Get32(&pBundle->pData[EPD_BUNDLE_HEADER_SIZE + (iMid * EPD_BUNDLE_ENTRY_SIZE)]);
+        if (u32 == u32Hash) {
+            EPD_BundleGetImage(pBundle, iMid, pImage);
+            return 1;
+        }
+        if (u32 < u32Hash) iLow = iMid + 1;
+        else iHigh = iMid - 1;
+    }
+    return 0;
+} /* EPD_BundleFind() */
+
+#endif // __EPD_BUNDLE__
@@ -0,0 +1,569 @@
+//
+// epd_decode - device side helpers for data created by epd_image
+//
+// Portable C (no memory allocation) intended to be compiled into
+// MCU firmware along with the generated image headers
+//
+// Written by Larry Bank
+//
+// Copyright 2023 BitBank Software, Inc. All Rights Reserved.
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//===========================================================================
+//
+#ifndef __EPD_DECODE__
+#define __EPD_DECODE__
+
+#include <stdint.h>
+#include <string.h>
+
+// How the generated arrays are read; AVR keeps them in program memory
+#ifndef EPD_READ_BYTE
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#define EPD_READ_BYTE(p) pgm_read_byte(p)
+#else
+#define EPD_READ_BYTE(p) (*(p))
+#endif
+#endif
+
+// Size of the stack buffer used by the streaming decoder
+// each callback receives at most this many bytes
+#ifndef EPD_STREAM_BUF_SIZE
+#define EPD_STREAM_BUF_SIZE 64
+#endif
+
+//
+// RLE codec (--RLE)
+// Each code starts with a control byte:
+// 0LLLLLLL           = L+1 literal bytes follow (1-128)
+// 10LLLLLL B         = repeat byte B, L+2 times (2-65)
+// 110LLLLL LLLLLLLL  = run of L+1 0x00 bytes (1-8192)
+// 111LLLLL LLLLLLLL  = run of L+1 0xFF bytes (1-8192)
+//
+#define EPD_RLE_REPEAT 0x80
+#define EPD_RLE_ZERO 0xc0
+#define EPD_RLE_ONES 0x20
+#define EPD_RLE_MAX_LITERAL 128
+#define EPD_RLE_MAX_SHORT 65
+#define EPD_RLE_MAX_LONG 8192
+
+// Called by the streaming decoder with each block of decompressed bytes
+// (e.g. to write them to the display controller over SPI)
+typedef void (EPD_WRITE_CALLBACK)(const uint8_t *pData, int iLen, void *pUser);
+
+//
+// Decompress RLE data into a RAM buffer
+// returns the number of bytes written (stops at iDestLen)
+//
+static inline int EPD_RLEDecode(const uint8_t *pSrc, int iSrcLen, uint8_t *pDest, int iDestLen)
+{
+    const uint8_t *pEnd = pSrc + iSrcLen;
+    uint8_t *d = pDest, *pDestEnd = pDest + iDestLen;
+    uint8_t c, uc;
+    int iLen;
+
+    while (pSrc < pEnd && d < pDestEnd) {
+        c = EPD_READ_BYTE(pSrc++);
+        if (c < EPD_RLE_REPEAT) { // literal bytes
+            iLen = c + 1;
+            if (iLen > pDestEnd - d) iLen = (int)(pDestEnd - d);
+            while (iLen--)
+                *d++ = EPD_READ_BYTE(pSrc++);
+        } else {
+            if (c < EPD_RLE_ZERO) { // short run of any byte
+                iLen = (c & 0x3f) + 2;
+                uc = EPD_READ_BYTE(pSrc++);
+            } else { // long run of 0x00 or 0xFF
+                iLen = (((c & 0x1f) << 8) | EPD_READ_BYTE(pSrc++)) + 1;
+                uc = (c & EPD_RLE_ONES) ? 0xff : 0x00;
+            }
+            if (iLen > pDestEnd - d) iLen = (int)(pDestEnd - d);
+            memset(d, uc, iLen);
+            d += iLen;
+        }
+    } // while
+    return (int)(d - pDest);
+} /* EPD_RLEDecode() */
+//
+// Decompress RLE data through a small stack buffer
+// and pass it to the callback in blocks of up to EPD_STREAM_BUF_SIZE bytes
+// This allows writing a full screen image directly to the display
+// without a framebuffer
+// returns the total number of bytes decompressed
+//
+static inline int EPD_RLEStream(const uint8_t *pSrc, int iSrcLen, EPD_WRITE_CALLBACK *pfnWrite, void *pUser)
+{
+    const uint8_t *pEnd = pSrc + iSrcLen;
+    uint8_t ucBuf[EPD_STREAM_BUF_SIZE];
+    uint8_t c, uc;
+    int iLen, iCount, iTotal = 0, iOff = 0;
+
+    while (pSrc < pEnd) {
+        c = EPD_READ_BYTE(pSrc++);
+        if (c < EPD_RLE_REPEAT) { // literal bytes
+            iLen = c + 1;
+            while (iLen) {
+                if (iOff == EPD_STREAM_BUF_SIZE) {
+                    (*pfnWrite)(ucBuf, iOff, pUser);
+                    iOff = 0;
+                }
+                ucBuf[iOff++] = EPD_READ_BYTE(pSrc++);
+                iLen--;
+                iTotal++;
+            }
+        } else {
+            if (c < EPD_RLE_ZERO) { // short run of any byte
+                iLen = (c & 0x3f) + 2;
+                uc = EPD_READ_BYTE(pSrc++);
+            } else { // long run of 0x00 or 0xFF
+                iLen = (((c & 0x1f) << 8) | EPD_READ_BYTE(pSrc++)) + 1;
+                uc = (c & EPD_RLE_ONES) ? 0xff : 0x00;
+            }
+            iTotal += iLen;
+            while (iLen) {
+                if (iOff == EPD_STREAM_BUF_SIZE) {
+                    (*pfnWrite)(ucBuf, iOff, pUser);
+                    iOff = 0;
+                }
+                iCount = EPD_STREAM_BUF_SIZE - iOff;
+                if (iCount > iLen) iCount = iLen;
+                memset(&ucBuf[iOff], uc, iCount);
+                iOff += iCount;
+                iLen -= iCount;
+            }
+        }
+    } // while
+    if (iOff) {
+        (*pfnWrite)(ucBuf, iOff, pUser);
+    }
+    return iTotal;
+} /* EPD_RLEStream() */
+//
+// Row window state for EPD_RLEDecodeWindow()
+//
+typedef struct epd_window_tag
+{
+    int iPos; // current byte offset within the band
+    int iPitch; // bytes per row of the plane
+    int iStart, iEnd; // byte offsets of the first and last+1 rows wanted
+    int x, cx; // byte column and width of the window
+    int iOff; // bytes in ucBuf
+    EPD_WRITE_CALLBACK *pfnWrite;
+    void *pUser;
+    uint8_t ucBuf[EPD_STREAM_BUF_SIZE];
+} EPD_WINDOW;
+//
+// Pass the part of a literal (pSrc != NULL) or fill run
+// which lands inside the window to the output buffer
+//
+static inline void EPD_WindowPut(EPD_WINDOW *pW, const uint8_t *pSrc, uint8_t ucFill, int iLen)
+{
+    int iCol, iCount, iLeft, iRight;
+
+    while (iLen > 0 && pW->iPos < pW->iEnd) {
+        iCol = pW->iPos % pW->iPitch;
+        iCount = pW->iPitch - iCol; // rest of this row
+        if (iCount > iLen) iCount = iLen;
+        if (pW->iPos >= pW->iStart) {
+            iLeft = (iCol > pW->x) ? iCol : pW->x;
+            iRight = (iCol + iCount < pW->x + pW->cx) ? iCol + iCount : pW->x + pW->cx;
+            while (iLeft < iRight) {
+                int i, n = iRight - iLeft;
+                if (pW->iOff == EPD_STREAM_BUF_SIZE) {
+                    (*pW->pfnWrite)(pW->ucBuf, pW->iOff, pW->pUser);
+                    pW->iOff = 0;
+                }
+                if (n > EPD_STREAM_BUF_SIZE - pW->iOff) n = EPD_STREAM_BUF_SIZE - pW->iOff;
+                if (pSrc) {
+                    for (i=0; i<n; i++)
+                        pW->ucBuf[pW->iOff + i] = EPD_READ_BYTE(&pSrc[iLeft - iCol + i]);
+                } else {
+                    memset(&pW->ucBuf[pW->iOff], ucFill, n);
+                }
+                pW->iOff += n;
+                iLeft += n;
+            }
+        }
+        pW->iPos += iCount;
+        iLen -= iCount;
+        if (pSrc) pSrc += iCount;
+    } // while
+} /* EPD_WindowPut() */
+//
+// Decompress a rectangle of a row-banded RLE plane (--RLEROWS)
+// Only the bands which overlap the window are decoded
+// pIndex is the <name>_index array (uint16_t or uint32_t entries)
+// x and cx are in bytes, y and cy are in rows
+// The window is passed to the callback row by row, top to bottom
+// (a single callback may contain the end of one row and the start of the next)
+// returns the number of bytes delivered
+//
+static inline int EPD_RLEDecodeWindow(const uint8_t *pData, const void *pIndex, int bIndex32, int iPitch, int iBandRows, int x, int y, int cx, int cy, EPD_WRITE_CALLBACK *pfnWrite, void *pUser)
+{
+    EPD_WINDOW win;
+    const uint8_t *s, *pEnd;
+    uint32_t u32Start, u32End;
+    uint8_t c, uc;
+    int iBand, iLen, iBandY;
+
+    if (cx <= 0 || cy <= 0) return 0;
+    win.iPitch = iPitch;
+    win.x = x; win.cx = cx;
+    win.iOff = 0;
+    win.pfnWrite = pfnWrite;
+    win.pUser = pUser;
+    for (iBand = y / iBandRows; iBand <= (y + cy - 1) / iBandRows; iBand++) {
+        if (bIndex32) {
+            const uint32_t *p32 = (const uint32_t *)pIndex;
+#ifdef __AVR__
+            u32Start = pgm_read_dword(&p32[iBand]);
+            u32End = pgm_read_dword(&p32[iBand+1]);
+#else
+            u32Start = p32[iBand];
+            u32End = p32[iBand+1];
+#endif
+        } else {
+            const uint16_t *p16 = (const uint16_t *)pIndex;
+#ifdef __AVR__
+            u32Start = pgm_read_word(&p16[iBand]);
+            u32End = pgm_read_word(&p16[iBand+1]);
+#else
+            u32Start = p16[iBand];
+            u32End = p16[iBand+1];
+#endif
+        }
+        iBandY = iBand * iBandRows;
+        win.iPos = 0;
+        win.iStart = ((y > iBandY) ? y - iBandY : 0) * iPitch;
+        win.iEnd = ((y + cy < iBandY + iBandRows) ? y + cy - iBandY : iBandRows) * iPitch;
+        s = &pData[u32Start];
+        pEnd = &pData[u32End];
+        while (s < pEnd && win.iPos < win.iEnd) {
+            c = EPD_READ_BYTE(s++);
+            if (c < EPD_RLE_REPEAT) { // literal bytes
+                iLen = c + 1;
+                EPD_WindowPut(&win, s, 0, iLen);
+                s += iLen;
+            } else {
+                if (c < EPD_RLE_ZERO) { // short run of any byte
+                    iLen = (c & 0x3f) + 2;
+                    uc = EPD_READ_BYTE(s++);
+                } else { // long run of 0x00 or 0xFF
+                    iLen = (((c & 0x1f) << 8) | EPD_READ_BYTE(s++)) + 1;
+                    uc = (c & EPD_RLE_ONES) ? 0xff : 0x00;
+                }
+                EPD_WindowPut(&win, NULL, uc, iLen);
+            }
+        } // while
+    } // for each band
+    if (win.iOff) {
+        (*pfnWrite)(win.ucBuf, win.iOff, pUser);
+    }
+    return cx * cy;
+} /* EPD_RLEDecodeWindow() */
+//
+// Expand a tile mapped plane (--TILES) and pass it to the callback
+// row by row in blocks of up to EPD_STREAM_BUF_SIZE bytes
+// pTiles = the shared tile array, iTileBytes = bytes per tile row,
+// iTileHeight = rows per tile, pMap = the plane's tile map (uint8_t or
+// uint16_t entries, bMap16 selects which), iMapWidth = tiles per row
+// iPitch and iHeight are the plane's bytes per row and row count
+// returns the number of bytes delivered
+//
+static inline int EPD_TileBlit(const uint8_t *pTiles, int iTileBytes, int iTileHeight, const void *pMap, int bMap16, int iMapWidth, int iPitch, int iHeight, EPD_WRITE_CALLBACK *pfnWrite, void *pUser)
+{
+    uint8_t ucBuf[EPD_STREAM_BUF_SIZE];
+    const uint8_t *s;
+    int x, y, i, iTile, iCount, iOff = 0, iTileSize = iTileBytes * iTileHeight;
+
+    for (y=0; y<iHeight; y++) {
+        for (x=0; x<iMapWidth; x++) {
+            i = ((y / iTileHeight) * iMapWidth) + x;
+            if (bMap16) {
+#ifdef __AVR__
+                iTile = pgm_read_word(&((const uint16_t *)pMap)[i]);
+#else
+                iTile = ((const uint16_t *)pMap)[i];
+#endif
+            } else {
+                iTile = EPD_READ_BYTE(&((const uint8_t *)pMap)[i]);
+            }
+            s = &pTiles[(iTile * iTileSize) + ((y % iTileHeight) * iTileBytes)];
+            iCount = iPitch - (x * iTileBytes); // the last tile may be clipped
+            if (iCount > iTileBytes) iCount = iTileBytes;
+            for (i=0; i<iCount; i++) {
+                if (iOff == EPD_STREAM_BUF_SIZE) {
+                    (*pfnWrite)(ucBuf, iOff, pUser);
+                    iOff = 0;
+                }
+                ucBuf[iOff++] = EPD_READ_BYTE(s++);
+            }
+        } // for x
+    } // for y
+    if (iOff) {
+        (*pfnWrite)(ucBuf, iOff, pUser);
+    }
+    return iPitch * iHeight;
+} /* EPD_TileBlit() */
+//
+// Sparse plane format (--SPARSE)
+// A list of spans of non-empty bytes; everything else is background
+// each span = row (uint16_t little-endian), byte column, byte count, data
+//
+#define EPD_SPAN_HEADER 4
+// Called with each span, e.g. to set a controller RAM window and write it
+typedef void (EPD_SPAN_CALLBACK)(int x, int y, const uint8_t *pData, int iLen, void *pUser);
+//
+// Write the spans of a sparse plane into a RAM buffer
+// (the buffer must already be filled with the background value)
+// returns the number of spans applied
+//
+static inline int EPD_SparseApply(const uint8_t *pSrc, int iSrcLen, uint8_t *pDest, int iPitch)
+{
+    const uint8_t *pEnd = pSrc + iSrcLen;
+    uint8_t *d;
+    int y, iLen, iSpans = 0;
+
+    while (pSrc + EPD_SPAN_HEADER <= pEnd) {
+        y = EPD_READ_BYTE(pSrc) | (EPD_READ_BYTE(&pSrc[1]) << 8);
+        d = &pDest[(y * iPitch) + EPD_READ_BYTE(&pSrc[2])];
+        iLen = EPD_READ_BYTE(&pSrc[3]);
+        pSrc += EPD_SPAN_HEADER;
+        while (iLen--)
+            *d++ = EPD_READ_BYTE(pSrc++);
+        iSpans++;
+    }
+    return iSpans;
+} /* EPD_SparseApply() */
+//
+// Pass each span of a sparse plane to the callback
+// so that only the changed areas of the panel RAM need to be written
+// (pData points into the sparse array; on AVR it's in PROGMEM)
+// returns the number of spans
+//
+static inline int EPD_SparseSpans(const uint8_t *pSrc, int iSrcLen, EPD_SPAN_CALLBACK *pfnSpan, void *pUser)
+{
+    const uint8_t *pEnd = pSrc + iSrcLen;
+    int y, x, iLen, iSpans = 0;
+
+    while (pSrc + EPD_SPAN_HEADER <= pEnd) {
+        y = EPD_READ_BYTE(pSrc) | (EPD_READ_BYTE(&pSrc[1]) << 8);
+        x = EPD_READ_BYTE(&pSrc[2]);
+        iLen = EPD_READ_BYTE(&pSrc[3]);
+        (*pfnSpan)(x, y, &pSrc[EPD_SPAN_HEADER], iLen, pUser);
+        pSrc += EPD_SPAN_HEADER + iLen;
+        iSpans++;
+    }
+    return iSpans;
+} /* EPD_SparseSpans() */
+//
+// Expand a sparse plane to the full plane and pass it to the callback
+// in blocks of up to EPD_STREAM_BUF_SIZE bytes (for controllers which
+// need the whole plane written in order)
+// returns the number of bytes delivered
+//
+static inline int EPD_SparseStream(const uint8_t *pSrc, int iSrcLen, int iPitch, int iHeight, uint8_t ucBackground, EPD_WRITE_CALLBACK *pfnWrite, void *pUser)
+{
+    const uint8_t *pEnd = pSrc + iSrcLen;
+    uint8_t ucBuf[EPD_STREAM_BUF_SIZE];
+    int iPos = 0, iNext, iLen, iCount, iOff = 0, iTotal = iPitch * iHeight;
+
+    while (iPos < iTotal) {
+        if (pSrc + EPD_SPAN_HEADER <= pEnd) {
+            iNext = ((EPD_READ_BYTE(pSrc) | (EPD_READ_BYTE(&pSrc[1]) << 8)) * iPitch) + EPD_READ_BYTE(&pSrc[2]);
+            iLen = EPD_READ_BYTE(&pSrc[3]);
+            pSrc += EPD_SPAN_HEADER;
+        } else { // background to the end
+            iNext = iTotal;
+            iLen = 0;
+        }
+        while (iPos < iNext) { // background up to the next span
+            if (iOff == EPD_STREAM_BUF_SIZE) {
+                (*pfnWrite)(ucBuf, iOff, pUser);
+                iOff = 0;
+            }
+            iCount = EPD_STREAM_BUF_SIZE - iOff;
+            if (iCount > iNext - iPos) iCount = iNext - iPos;
+            memset(&ucBuf[iOff], ucBackground, iCount);
+            iOff += iCount;
+            iPos += iCount;
+        }
+        iPos += iLen;
+        while (iLen--) {
+            if (iOff == EPD_STREAM_BUF_SIZE) {
+                (*pfnWrite)(ucBuf, iOff, pUser);
+                iOff = 0;
+            }
+            ucBuf[iOff++] = EPD_READ_BYTE(pSrc++);
+        }
+    } // while
+    if (iOff) {
+        (*pfnWrite)(ucBuf, iOff, pUser);
+    }
+    return iTotal;
+} /* EPD_SparseStream() */
+//
+// Draw a 1-bit sprite at any x position into a 1-bpp frame buffer
+// without shifting at run time, using the pre-shifted copy made by
+// epd_image --SHIFTS for (x & 7). pMasks is the <name>_masks array
+// (first byte mask, last byte mask and byte count of each shift).
+// The sprite must fit entirely within the frame buffer (no clipping)
+//
+static inline void EPD_SpriteBlit(uint8_t *pFB, int iFBPitch, int x, int y, const uint8_t *pSprite, int iPitch, int iHeight, const uint8_t *pMasks)
+{
+    uint8_t ucFirst, ucLast, *d;
+    int i, iCount;
+
+    pMasks += (x & 7) * 3;
+    ucFirst = EPD_READ_BYTE(pMasks);
+    ucLast = EPD_READ_BYTE(&pMasks[1]);
+    iCount = EPD_READ_BYTE(&pMasks[2]);
+    if (iCount == 1) ucFirst &= ucLast;
+    pFB += (y * iFBPitch) + (x >> 3);
+    while (iHeight--) {
+        d = pFB;
+        d[0] = (d[0] & ~ucFirst) | (EPD_READ_BYTE(pSprite) & ucFirst);
+        for (i=1; i<iCount-1; i++) {
+            d[i] = EPD_READ_BYTE(&pSprite[i]);
+        }
+        if (iCount > 1) {
+            d[i] = (d[i] & ~ucLast) | (EPD_READ_BYTE(&pSprite[i]) & ucLast);
+        }
+        pSprite += iPitch;
+        pFB += iFBPitch;
+    }
+} /* EPD_SpriteBlit() */
+//
+// Partial update rectangles (--DELTA)
+// <name>_rects holds x, y, width, height of each rectangle (x and width
+// in bytes of the packed plane, y and height in lines) and each plane's
+// data array holds the new bytes of every rectangle, one after another
+//
+// Called with each changed rectangle, e.g. to set the controller RAM
+// window and do a partial refresh of that area
+typedef void (EPD_RECT_CALLBACK)(int x, int y, int cx, int cy, const uint8_t *pData, void *pUser);
+//
+// Pass each rectangle of one plane to the callback
+// (pData points into the plane array; on AVR it's in PROGMEM)
+// returns the number of bytes of plane data used
+//
+static inline int EPD_DeltaRects(const uint16_t *pRects, int iCount, const uint8_t *pData, EPD_RECT_CALLBACK *pfnRect, void *pUser)
+{
+    int i, x, y, cx, cy, iOff = 0;
+
+    for (i=0; i<iCount; i++) {
+#ifdef __AVR__
+        x = pgm_read_word(&pRects[i*4]); y = pgm_read_word(&pRects[i*4+1]);
+        cx = pgm_read_word(&pRects[i*4+2]); cy = pgm_read_word(&pRects[i*4+3]);
+#else
+        x = pRects[i*4]; y = pRects[i*4+1];
+        cx = pRects[i*4+2]; cy = pRects[i*4+3];
+#endif
+        (*pfnRect)(x, y, cx, cy, &pData[iOff], pUser);
+        iOff += cx * cy;
+    }
+    return iOff;
+} /* EPD_DeltaRects() */
+//
+// Copy the rectangles of one plane into a RAM buffer holding the
+// previous image to turn it into the new one
+// returns the number of bytes of plane data used
+//
+static inline int EPD_DeltaApply(const uint16_t *pRects, int iCount, const uint8_t *pData, uint8_t *pDest, int iPitch)
+{
+    int i, x, y, cx, cy, iOff = 0;
+    uint8_t *d;
+
+    for (i=0; i<iCount; i++) {
+#ifdef __AVR__
+        x = pgm_read_word(&pRects[i*4]); y = pgm_read_word(&pRects[i*4+1]);
+        cx = pgm_read_word(&pRects[i*4+2]); cy = pgm_read_word(&pRects[i*4+3]);
+#else
+        x = pRects[i*4]; y = pRects[i*4+1];
+        cx = pRects[i*4+2]; cy = pRects[i*4+3];
+#endif
+        while (cy--) {
+            d = &pDest[(y++ * iPitch) + x];
+            for (int j=0; j<cx; j++)
+                d[j] = EPD_READ_BYTE(&pData[iOff + j]);
+            iOff += cx;
+        }
+    }
+    return iOff;
+} /* EPD_DeltaApply() */
+//
+// Frame sequences (--SEQUENCE)
+// <name>_frames holds the offset of each frame in <name>_seq followed by
+// the total size. Each frame starts with its type:
+// EPD_SEQ_KEYFRAME = the full planes follow (plane 0, then plane 1)
+// EPD_SEQ_DELTA    = uint16_t rectangle count, then for each rectangle
+//                    x, y, width, height (uint16_t little-endian, x and
+//                    width in bytes) and its data for plane 0, then plane 1
+// Unchanged frames are a delta with no rectangles
+//
+#define EPD_SEQ_KEYFRAME 0
+#define EPD_SEQ_DELTA 1
+
+// Called with each area of a plane to write, e.g. to set the controller
+// RAM window for that plane and send the data
+typedef void (EPD_PLANE_RECT_CALLBACK)(int iPlane, int x, int y, int cx, int cy, const uint8_t *pData, void *pUser);
+//
+// Play one frame of a sequence: pass each area that it changes to the
+// callback (a keyframe is the whole of each plane)
+// returns the frame type
+//
+static inline int EPD_SeqPlayFrame(const uint8_t *pFrame, int iPlanes, int iPitch, int iHeight, EPD_PLANE_RECT_CALLBACK *pfnRect, void *pUser)
+{
+    const uint8_t *s;
+    int i, iPlane, iCount, x, y, cx, cy;
+
+    if (EPD_READ_BYTE(pFrame) == EPD_SEQ_KEYFRAME) {
+        for (iPlane=0; iPlane<iPlanes; iPlane++) {
+            (*pfnRect)(iPlane, 0, 0, iPitch, iHeight, &pFrame[1 + (iPlane * iPitch * iHeight)], pUser);
+        }
+        return EPD_SEQ_KEYFRAME;
+    }
+    iCount = EPD_READ_BYTE(&pFrame[1]) | (EPD_READ_BYTE(&pFrame[2]) << 8);
+    s = &pFrame[3];
+    for (i=0; i<iCount; i++) {
+        x = EPD_READ_BYTE(s) | (EPD_READ_BYTE(&s[1]) << 8);
+        y = EPD_READ_BYTE(&s[2]) | (EPD_READ_BYTE(&s[3]) << 8);
+        cx = EPD_READ_BYTE(&s[4]) | (EPD_READ_BYTE(&s[5]) << 8);
+        cy = EPD_READ_BYTE(&s[6]) | (EPD_READ_BYTE(&s[7]) << 8);
+        s += 8;
+        for (iPlane=0; iPlane<iPlanes; iPlane++) {
+            (*pfnRect)(iPlane, x, y, cx, cy, s, pUser);
+            s += cx * cy;
+        }
+    }
+    return EPD_SEQ_DELTA;
+} /* EPD_SeqPlayFrame() */
+//
+// Find the keyframe to start from to show frame iFrame
+// (play it and every frame after it up to iFrame)
+//
+static inline int EPD_SeqFindKeyframe(const uint8_t *pSeq, const uint32_t *pFrames, int iFrame)
+{
+    uint32_t u32;
+
+    for (; iFrame > 0; iFrame--) {
+#ifdef __AVR__
+        u32 = pgm_read_dword(&pFrames[iFrame]);
+#else
+        u32 = pFrames[iFrame];
+#endif
+        if (EPD_READ_BYTE(&pSeq[u32]) == EPD_SEQ_KEYFRAME)
+            break;
+    }
+    return iFrame;
+} /* EPD_SeqFindKeyframe() */
+
+#endif // __EPD_DECODE__
@@ -26,6 +26,13 @@
 #define HAS_SIMD
 #endif
 
+// optional hooks called at the start and end of each row of MCUs
+// (e.g. for profiling); they compile to nothing unless defined by the includer
+#ifndef JPEG_ROW_BEGIN
+#define JPEG_ROW_BEGIN(y)
+#define JPEG_ROW_END(y)
+#endif
+
 // forward references
 static int JPEGInit(JPEGIMAGE *pJPEG);
 static int JPEGParseInfo(JPEGIMAGE *pPage, int bExtractThumb);
@@ -3315,6 +3322,7 @@ static int DecodeJPEG(JPEGIMAGE *pJPEG)
     jd.y = pJPEG->iYOffset;
     for (y = 0; y < cy && bContinue; y++, jd.y += mcuCY)
     {
+        JPEG_ROW_BEGIN(y);
         jd.x = pJPEG->iXOffset;
         xoff = 0; // start of new LCD output group
         iPitch = iMCUCount * mcuCX; // pixels per line of LCD buffer
@@ -3476,6 +3484,7 @@ static int DecodeJPEG(JPEGIMAGE *pJPEG)
             if (pJPEG->iVLCOff >= FILE_HIGHWATER)
                 JPEGGetMoreData(pJPEG); // need more 'filtered' VLC data
         } // for x
+        JPEG_ROW_END(y);
     } // for y
     if (iErr != 0)
         pJPEG->iError = JPEG_DECODE_ERROR;
@@ -25,15 +25,26 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
 #ifdef _WIN32
 #include <direct.h>
+#include <windows.h>
 #else
 #include <unistd.h>
+#include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
 #endif
 
 #define __LINUX__
 #include "JPEGDEC.h"
+// --TRACE records a span for each row of MCUs decoded
+void TraceJPEGRow(int iRow, int bEnd);
+#define JPEG_ROW_BEGIN(y) TraceJPEGRow(y, 0)
+#define JPEG_ROW_END(y) TraceJPEGRow(y, 1)
 #include "jpeg.inl"
+#include "epd_decode.h"
+#include "epd_bundle.h"
 
 enum
 {
@@ -49,18 +60,187 @@ enum
 
 // Output format options (black & white, black/white/red, black/white/yellow, 2-bit grayscale)
 const char *szOptions[] = {"BW", "BWR", "BWY", "BWYR", "4GRAY", NULL};
-uint8_t ucBlue[256], ucGreen[256], ucRed[256]; // palette colors
+// Each worker thread has its own copy of the palette (see ProcessImage())
+#ifdef _MSC_VER
+#define EPD_THREAD_LOCAL __declspec(thread)
+#else
+#define EPD_THREAD_LOCAL __thread
+#endif
+EPD_THREAD_LOCAL uint8_t ucBlue[256], ucGreen[256], ucRed[256]; // palette colors
 #ifdef _WIN32
 #define SLASH_CHAR '\\'
 #else
 #define SLASH_CHAR '/'
 #endif
+// Packed memory planes ready to be written in one of the output formats
+typedef struct tag_epd_planes
+{
+    int iWidth, iHeight; // image size in pixels
+    int iPitch; // bytes per line of each plane
+    int iPlaneSize; // bytes per plane
+    int iPlaneCount; // 1 or 2
+    int bVertical; // bytes hold vertical pixels, iPitch bytes per page
+    int bLSBFirst; // BW bytes hold the left pixel in the LSB
+    uint8_t *pPlane[2]; // plane data, indexed by the array name suffix (_0, _1)
+} EPD_PLANES;
+
+// Where the generated arrays go
+enum
+{
+  OUTPUT_C = 0, // C initializers in the output header
+  OUTPUT_ASM, // binary blob + .S file using .incbin + header with extern declarations
+  OUTPUT_SPLIT, // header with extern declarations + .c file with the data
+  OUTPUT_COUNT
+};
+typedef struct tag_epd_output
+{
+    int iMode; // OUTPUT_C/ASM/SPLIT
+    FILE *ohandle; // output header (comments, declarations and C data)
+    FILE *dhandle; // assembler source (OUTPUT_ASM) or C data (OUTPUT_SPLIT)
+    FILE *bhandle; // binary blob (OUTPUT_ASM)
+    int iBinOffset; // current size of the binary blob
+    int bGuard; // the header has an include guard to close
+    char szBinLeaf[256]; // blob name as seen by .incbin
+    int iWordSize; // plane data written as 1, 2 or 4 byte elements
+    int bBigEndian; // first byte in the MSB of each word
+    int iArrayAlign; // alignment attribute of the arrays (0 = none)
+} EPD_OUTPUT;
+
+// Conversion settings from the command line
+typedef struct tag_epd_options
+{
+    int iOption; // output format (OPTION_xxx)
+    int iRotation; // 0/90/180/270
+    int bMirror, bFlipv, bInvert, bDither;
+    int iRowAlign; // bytes per line rounded up to a multiple of this
+    int bVertical; // pack vertical bytes (pages) instead of horizontal
+    struct tag_epd_stable *pStable; // dithering state kept between frames
+    struct tag_epd_plan *pPlan; // panel native plane layout (--PANEL), NULL = the defaults
+} EPD_OPTIONS;
+
+// Dithered output of the previous frame of a sequence (--STABLE)
+// Pixels whose source hasn't changed by more than iThreshold since they
+// were last dithered keep their old output so that the frames only
+// differ where the image really changed
+typedef struct tag_epd_stable
+{
+    int iThreshold; // largest change of a source pixel (0-255) to ignore
+    int iWidth, iHeight, iFormat; // the state is reset if these change
+    uint8_t *pSrc; // source pixel (gray or B,G,R) when last dithered
+    uint8_t *pOut; // dithered output (gray level or B,G,R)
+} EPD_STABLE;
+
+// A decoded source image, shared (read only) by all of the conversions
+typedef struct tag_epd_image
+{
+    uint8_t *pData; // pixels start at pData + iOffBits (top-down)
+    int iOffBits, iSize; // iSize = bytes of pixel data
+    int iWidth, iHeight, iBpp;
+    uint8_t ucRed[256], ucGreen[256], ucBlue[256]; // palette (<= 8 bpp)
+} EPD_IMAGE;
+
+// One output of a multi-target (--TARGET) run
+typedef struct tag_epd_target
+{
+    EPD_OPTIONS opts; // format/orientation of this output
+    char *szSpec; // from the command line (see ParseTarget())
+    char *szOutName;
+    EPD_IMAGE *pImage;
+    EPD_PLANES planes;
+    int rc;
+} EPD_TARGET;
+
+// One output of a multi-resolution (--SIZES) run
+typedef struct tag_epd_size
+{
+    EPD_OPTIONS opts; // format/orientation of this size
+    int iWidth, iHeight; // size of the output (after any rotation)
+    int bStretch; // ignore the aspect ratio instead of padding with white
+    EPD_IMAGE *pLevels; // shared resampling pyramid (24-bpp)
+    int iLevels;
+    EPD_PLANES planes;
+    int rc;
+} EPD_SIZE;
+
+// One panel of a video wall (--WALL)
+typedef struct tag_epd_panel
+{
+    EPD_OPTIONS opts; // format and rotation (how the panel is mounted)
+    char *szSpec; // <col>,<row>:<spec> from the command line
+    int iCol, iRow;
+    int x, y, cx, cy; // area of the panel on the wall canvas
+    EPD_IMAGE *pCanvas; // the dithered canvas of this panel's format
+    EPD_PLANES planes;
+    int rc;
+} EPD_PANEL;
+
+// The whole wall image prepared (dithered) for one output format
+typedef struct tag_epd_canvas
+{
+    EPD_OPTIONS opts;
+    EPD_IMAGE *pSource;
+    EPD_IMAGE image;
+    int rc;
+} EPD_CANVAS;
+
+// One frame of a sprite sheet (--SPRITES)
+typedef struct tag_epd_frame
+{
+    char szName[64];
+    int x, y, cx, cy; // area of the frame on the sheet
+    EPD_OPTIONS opts;
+    EPD_IMAGE *pSheet; // the decoded sheet (shared)
+    EPD_PLANES planes;
+    int rc;
+} EPD_FRAME;
+
+// Native memory layout of a display panel (--PANEL)
+// The plane order and polarity are relative to the default output
+typedef struct tag_epd_profile
+{
+    char szName[32];
+    int iWidth, iHeight; // native size of the panel's RAM (after the rotation)
+    int iOption; // output format
+    int iRotation; // rotates the image into the RAM scan order
+    int bLSBFirst; // first pixel (left or top) in the LSB of each byte
+    int bSwapPlanes; // the 2 planes are in the opposite order
+    int iInvert; // planes to invert (bit 0 = plane 0, bit 1 = plane 1)
+    int bVertical; // vertical bytes (pages) instead of horizontal
+    int iRowAlign;
+} EPD_PROFILE;
+
+// A panel profile compiled into what the packers do with each finished byte
+typedef struct tag_epd_plan
+{
+    int iSwap; // packed plane n is stored as plane n ^ iSwap
+    uint8_t ucXform[2][256]; // new value of each byte of packed plane 0 and 1
+} EPD_PLAN;
+
+// Work done by RunJobs() - called once for each job index
+typedef void (EPD_JOB_FUNC)(void *pUser, int iJob);
+#define MAX_TARGETS 16
+#define MAX_SIZES 16
+#define MAX_LEVELS 16
+#define MAX_PANELS 64
+#define MAX_FRAMES 4096
+#define MAX_PROFILES 64
+int iThreads = 0; // worker threads for parallel jobs (0 = one per CPU)
+
+// A changed area of a packed plane (x and cx in bytes, y and cy in lines)
+typedef struct tag_epd_rect
+{
+    int x, y, cx, cy;
+} EPD_RECT;
+
 int iWidth, iHeight, iBpp;
 int bMSBFirst = 1;
 FILE * ihandle;
 void GetLeafName(char *fname, char *leaf);
 void FixName(char *name);
+void FreePlanes(EPD_PLANES *pPlanes);
+void CloseOutput(EPD_OUTPUT *pOut);
 unsigned char GetGrayPixel(int x, int y, uint8_t *pData, int iPitch, int iBpp);
+uint8_t PlaneBackground(int iOption, int iPlane);
 /* Table to flip the bit direction of a byte */
 const uint8_t ucMirror[256]=
      {0, 128, 64, 192, 32, 160, 96, 224, 16, 144, 80, 208, 48, 176, 112, 240,
@@ -80,6 +260,418 @@ const uint8_t ucMirror[256]=
       7, 135, 71, 199, 39, 167, 103, 231, 23, 151, 87, 215, 55, 183, 119, 247,
       15, 143, 79, 207, 47, 175, 111, 239, 31, 159, 95, 223, 63, 191, 127, 255};
 
+//
+// Return the current time in microseconds
+//
+int64_t GetMicros(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER li, freq;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&li);
+    return (int64_t)((li.QuadPart * 1000000) / freq.QuadPart);
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((int64_t)tv.tv_sec * 1000000) + tv.tv_usec;
+#endif
+} /* GetMicros() */
+//
+// Return the CPU time used by the calling thread in microseconds
+//
+int64_t GetCPUMicros(void)
+{
+#ifdef _WIN32
+    FILETIME ftCreate, ftExit, ftKernel, ftUser;
+    GetThreadTimes(GetCurrentThread(), &ftCreate, &ftExit, &ftKernel, &ftUser);
+    return (int64_t)(((((uint64_t)ftKernel.dwHighDateTime << 32) | ftKernel.dwLowDateTime) +
+                      (((uint64_t)ftUser.dwHighDateTime << 32) | ftUser.dwLowDateTime)) / 10);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ((int64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+#endif
+} /* GetCPUMicros() */
+//
+// Pipeline stage statistics (--STATS)
+// Each stage adds up its wall time, CPU time, bytes processed and the
+// most heap memory in use while it ran. The times of stages run on
+// several threads at once are added together. When --STATS isn't used
+// the only cost is a test of iStats in StatsBegin()/StatsEnd()
+//
+enum
+{
+  STAGE_READ = 0, // read the input file
+  STAGE_DECODE, // BMP/JPEG to top-down pixels
+  STAGE_SCALE, // resample (SIZES, WALL, PANEL)
+  STAGE_ORIENT, // mirror, flip, rotate, crop
+  STAGE_INVERT,
+  STAGE_DITHER,
+  STAGE_PACK, // classify the pixels and pack them into memory planes
+  STAGE_EMIT, // write the arrays
+  STAGE_COUNT
+};
+const char *szStages[] = {"read", "decode", "scale", "orient", "invert", "dither", "pack", "emit"};
+typedef struct tag_epd_stage_stats
+{
+    int iCalls;
+    int64_t llWall, llCPU; // microseconds
+    int64_t llBytes; // bytes processed
+    int64_t llPeak; // most heap memory in use while the stage ran
+} EPD_STAGE_STATS;
+
+// One run of a stage
+typedef struct tag_epd_timer
+{
+    int iStage, iPrevStage;
+    int64_t llWall, llCPU;
+    int64_t llTrace; // start time of the trace span (nanoseconds)
+} EPD_TIMER;
+
+int iStats = 0; // collect the stage statistics
+char *szStatsJSON = NULL; // write them as JSON to this file ("-" = stdout) instead of a table
+int64_t llStatsStart, llStatsCPU;
+EPD_STAGE_STATS stageStats[STAGE_COUNT];
+int64_t llHeapInUse, llHeapPeak; // bytes allocated by this file
+EPD_THREAD_LOCAL int iCurStage = -1; // stage running on this thread
+#ifdef _WIN32
+CRITICAL_SECTION csStats;
+#define StatsLock() EnterCriticalSection(&csStats)
+#define StatsUnlock() LeaveCriticalSection(&csStats)
+#else
+pthread_mutex_t mutexStats = PTHREAD_MUTEX_INITIALIZER;
+#define StatsLock() pthread_mutex_lock(&mutexStats)
+#define StatsUnlock() pthread_mutex_unlock(&mutexStats)
+#endif
+int iTrace = 0; // record the trace events (--TRACE)
+void TraceEvent(const char *szName, const char *szCat, int64_t llStart, const char *szArg, int iArg);
+int64_t GetTraceTime(void);
+// Each block gets a header with its size and whether it was counted
+// (allocated after --STATS was seen) so that free() can subtract it
+#define STATS_HEADER 16
+//
+// Track a change of the heap in use (called with the lock held)
+//
+void StatsHeap(int64_t llChange)
+{
+    llHeapInUse += llChange;
+    if (llHeapInUse > llHeapPeak) llHeapPeak = llHeapInUse;
+    if (iCurStage >= 0 && llHeapInUse > stageStats[iCurStage].llPeak)
+        stageStats[iCurStage].llPeak = llHeapInUse;
+} /* StatsHeap() */
+//
+// Allocation functions which keep track of the heap in use
+// All of the allocations below go through these (see the #defines)
+//
+void *StatsMalloc(size_t iSize)
+{
+    uint8_t *p = (uint8_t *)malloc(iSize + STATS_HEADER);
+    if (p == NULL) return NULL;
+    ((size_t *)p)[0] = iSize;
+    ((size_t *)p)[1] = (size_t)iStats;
+    if (iStats) {
+        StatsLock();
+        StatsHeap((int64_t)iSize);
+        StatsUnlock();
+    }
+    return p + STATS_HEADER;
+} /* StatsMalloc() */
+void StatsFree(void *pMem)
+{
+    uint8_t *p;
+    if (pMem == NULL) return;
+    p = (uint8_t *)pMem - STATS_HEADER;
+    if (((size_t *)p)[1]) {
+        StatsLock();
+        StatsHeap(-(int64_t)((size_t *)p)[0]);
+        StatsUnlock();
+    }
+    free(p);
+} /* StatsFree() */
+void *StatsCalloc(size_t iCount, size_t iSize)
+{
+    void *p = StatsMalloc(iCount * iSize);
+    if (p) memset(p, 0, iCount * iSize);
+    return p;
+} /* StatsCalloc() */
+void *StatsRealloc(void *pMem, size_t iSize)
+{
+    uint8_t *p, *pOld;
+    int64_t llOldSize;
+    if (pMem == NULL) return StatsMalloc(iSize);
+    pOld = (uint8_t *)pMem - STATS_HEADER;
+    llOldSize = (((size_t *)pOld)[1]) ? (int64_t)((size_t *)pOld)[0] : 0;
+    p = (uint8_t *)realloc(pOld, iSize + STATS_HEADER);
+    if (p == NULL) return NULL;
+    ((size_t *)p)[0] = iSize;
+    ((size_t *)p)[1] = (size_t)iStats;
+    if (iStats) {
+        StatsLock();
+        StatsHeap((int64_t)iSize - llOldSize);
+        StatsUnlock();
+    }
+    return p + STATS_HEADER;
+} /* StatsRealloc() */
+#define malloc(n) StatsMalloc(n)
+#define calloc(n, s) StatsCalloc(n, s)
+#define realloc(p, n) StatsRealloc(p, n)
+#define free(p) StatsFree(p)
+//
+// Start timing a stage on this thread
+//
+void StatsBegin(EPD_TIMER *pTimer, int iStage)
+{
+    pTimer->iStage = -1;
+    if ((!iStats && !iTrace) || iCurStage == iStage) return; // a stage inside itself is only counted once
+    pTimer->iStage = iStage;
+    pTimer->iPrevStage = iCurStage;
+    iCurStage = iStage;
+    if (iTrace) pTimer->llTrace = GetTraceTime();
+    if (!iStats) return;
+    StatsLock();
+    StatsHeap(0); // the memory in use as it starts
+    StatsUnlock();
+    pTimer->llCPU = GetCPUMicros();
+    pTimer->llWall = GetMicros();
+} /* StatsBegin() */
+//
+// Finish timing a stage which processed llBytes bytes
+//
+void StatsEnd(EPD_TIMER *pTimer, int64_t llBytes)
+{
+    EPD_STAGE_STATS *pStats;
+    int64_t llWall, llCPU;
+
+    if (pTimer->iStage < 0) return;
+    if (iTrace) TraceEvent(szStages[pTimer->iStage], "stage", pTimer->llTrace, NULL, 0);
+    if (!iStats) {
+        iCurStage = pTimer->iPrevStage;
+        return;
+    }
+    llWall = GetMicros() - pTimer->llWall;
+    llCPU = GetCPUMicros() - pTimer->llCPU;
+    pStats = &stageStats[pTimer->iStage];
+    StatsLock();
+    pStats->iCalls++;
+    pStats->llWall += llWall;
+    pStats->llCPU += llCPU;
+    pStats->llBytes += llBytes;
+    StatsHeap(0);
+    StatsUnlock();
+    iCurStage = pTimer->iPrevStage;
+} /* StatsEnd() */
+//
+// Print the stage statistics when the program exits (atexit() callback)
+//
+void PrintStats(void)
+{
+    EPD_STAGE_STATS *p;
+    FILE *f = stdout;
+    int64_t llWall = GetMicros() - llStatsStart, llCPU = GetCPUMicros() - llStatsCPU;
+    int i;
+
+    if (szStatsJSON) {
+        if (strcmp(szStatsJSON, "-") != 0 && (f = fopen(szStatsJSON, "w")) == NULL) {
+            printf("Unable to create stats file: %s\n", szStatsJSON);
+            return;
+        }
+        fprintf(f, "{\n  \"wall_us\": %lld,\n  \"main_thread_cpu_us\": %lld,\n  \"peak_heap_bytes\": %lld,\n  \"stages\": [\n",
+                (long long)llWall, (long long)llCPU, (long long)llHeapPeak);
+        for (i=0; i<STAGE_COUNT; i++) {
+            p = &stageStats[i];
+            fprintf(f, "    {\"stage\": \"%s\", \"calls\": %d, \"wall_us\": %lld, \"cpu_us\": %lld, \"bytes\": %lld, \"peak_heap_bytes\": %lld}%s\n",
+                    szStages[i], p->iCalls, (long long)p->llWall, (long long)p->llCPU, (long long)p->llBytes, (long long)p->llPeak, (i < STAGE_COUNT-1) ? "," : "");
+        }
+        fprintf(f, "  ]\n}\n");
+        if (f != stdout) fclose(f);
+        return;
+    }
+    printf("stage    calls   wall ms    cpu ms      MBytes   MB/s  peak heap KB\n");
+    for (i=0; i<STAGE_COUNT; i++) {
+        p = &stageStats[i];
+        if (p->iCalls == 0) continue;
+        printf("%-7s %6d %9.2f %9.2f %11.3f %6.0f %13lld\n", szStages[i], p->iCalls, p->llWall / 1000.0, p->llCPU / 1000.0,
+               p->llBytes / 1000000.0, (p->llWall) ? (double)p->llBytes / p->llWall : 0.0, (long long)(p->llPeak + 1023) / 1024);
+    }
+    printf("total           %9.2f %9.2f (main thread)              %13lld\n", llWall / 1000.0, llCPU / 1000.0, (long long)(llHeapPeak + 1023) / 1024);
+} /* PrintStats() */
+//
+// Start collecting the stage statistics and print them at exit
+//
+void StartStats(void)
+{
+    if (iStats) return;
+#ifdef _WIN32
+    if (!iTrace) InitializeCriticalSection(&csStats);
+#endif
+    iStats = 1;
+    llStatsStart = GetMicros();
+    llStatsCPU = GetCPUMicros();
+    atexit(PrintStats);
+} /* StartStats() */
+//
+// Pipeline trace (--TRACE)
+// Each thread records complete spans (name, start, duration) into its own
+// ring buffer without any locking; when the ring is full the oldest spans
+// are overwritten. At exit all of the rings are written in the Chrome
+// Trace Event Format (JSON), which chrome://tracing and Perfetto can show
+// as a timeline of every thread
+//
+#define TRACE_RING 16384 // spans kept per thread
+typedef struct tag_epd_trace_event
+{
+    const char *szName, *szCat;
+    const char *szArg; // name of iArg (NULL for none)
+    int64_t llStart, llDur; // nanoseconds
+    int iArg;
+} EPD_TRACE_EVENT;
+
+typedef struct tag_epd_trace_ring
+{
+    int iTid; // 1 = main thread
+    int iNext; // next slot to write
+    int64_t llCount; // spans recorded (including the overwritten ones)
+    struct tag_epd_trace_ring *pNext; // list of all of the rings
+    EPD_TRACE_EVENT events[TRACE_RING];
+} EPD_TRACE_RING;
+
+char *szTraceFile = NULL;
+int64_t llTraceStart;
+EPD_TRACE_RING *pTraceRings = NULL;
+int iTraceThreads = 0;
+EPD_THREAD_LOCAL EPD_TRACE_RING *pTraceRing = NULL; // this thread's ring
+EPD_THREAD_LOCAL int64_t llJPEGRowStart;
+//
+// Return a monotonic time in nanoseconds for the trace
+//
+int64_t GetTraceTime(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER li, freq;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&li);
+    return (int64_t)((li.QuadPart / freq.QuadPart) * 1000000000 + ((li.QuadPart % freq.QuadPart) * 1000000000) / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+#endif
+} /* GetTraceTime() */
+//
+// Return the trace ring of this thread, allocating it the first time
+// (the rings aren't counted as heap used by the image stages)
+//
+EPD_TRACE_RING *GetTraceRing(void)
+{
+    EPD_TRACE_RING *pRing = pTraceRing;
+
+    if (pRing == NULL) {
+        pRing = (EPD_TRACE_RING *)(calloc)(1, sizeof(EPD_TRACE_RING));
+        if (pRing == NULL) return NULL;
+        StatsLock();
+        pRing->iTid = ++iTraceThreads;
+        pRing->pNext = pTraceRings;
+        pTraceRings = pRing;
+        StatsUnlock();
+        pTraceRing = pRing;
+    }
+    return pRing;
+} /* GetTraceRing() */
+//
+// Record a span from llStart until now on this thread
+//
+void TraceEvent(const char *szName, const char *szCat, int64_t llStart, const char *szArg, int iArg)
+{
+    EPD_TRACE_EVENT *pEvent;
+    EPD_TRACE_RING *pRing = GetTraceRing();
+
+    if (pRing == NULL) return;
+    pEvent = &pRing->events[pRing->iNext];
+    pEvent->szName = szName;
+    pEvent->szCat = szCat;
+    pEvent->szArg = szArg;
+    pEvent->llStart = llStart;
+    pEvent->llDur = GetTraceTime() - llStart;
+    pEvent->iArg = iArg;
+    if (++pRing->iNext == TRACE_RING) pRing->iNext = 0;
+    pRing->llCount++;
+} /* TraceEvent() */
+//
+// Called by DecodeJPEG() at the start and end of each row of MCUs
+//
+void TraceJPEGRow(int iRow, int bEnd)
+{
+    if (!iTrace) return;
+    if (bEnd)
+        TraceEvent("MCU row", "jpeg", llJPEGRowStart, "row", iRow);
+    else
+        llJPEGRowStart = GetTraceTime();
+} /* TraceJPEGRow() */
+//
+// Write the spans of every thread as a Chrome trace when the program exits
+// (atexit() callback, all of the worker threads have finished)
+//
+void WriteTrace(void)
+{
+    EPD_TRACE_RING *pRing, *pNextRing;
+    EPD_TRACE_EVENT *pEvent;
+    FILE *f;
+    int64_t i, llFirst, llDropped = 0, llStart;
+    int bComma = 0;
+
+    f = fopen(szTraceFile, "w");
+    if (f == NULL) {
+        printf("Unable to create trace file: %s\n", szTraceFile);
+        return;
+    }
+    fprintf(f, "{\"traceEvents\": [\n");
+    for (pRing = pTraceRings; pRing != NULL; pRing = pRing->pNext) {
+        if (pRing->iTid == 1)
+            fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"main\"}}", bComma ? ",\n" : "");
+        else
+            fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"worker %d\"}}", bComma ? ",\n" : "", pRing->iTid, pRing->iTid - 1);
+        bComma = 1;
+        // oldest span first
+        llFirst = 0;
+        if (pRing->llCount > TRACE_RING) {
+            llDropped += pRing->llCount - TRACE_RING;
+            llFirst = pRing->iNext;
+        }
+        for (i=0; i<pRing->llCount && i<TRACE_RING; i++) {
+            pEvent = &pRing->events[(llFirst + i) % TRACE_RING];
+            llStart = pEvent->llStart - llTraceStart;
+            if (llStart < 0) llStart = 0;
+            fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %lld.%03d, \"dur\": %lld.%03d, \"pid\": 1, \"tid\": %d",
+                    pEvent->szName, pEvent->szCat,
+                    (long long)(llStart / 1000), (int)(llStart % 1000), (long long)(pEvent->llDur / 1000), (int)(pEvent->llDur % 1000), pRing->iTid);
+            if (pEvent->szArg)
+                fprintf(f, ", \"args\": {\"%s\": %d}", pEvent->szArg, pEvent->iArg);
+            fprintf(f, "}");
+        }
+    }
+    fprintf(f, "\n], \"displayTimeUnit\": \"ms\", \"otherData\": {\"dropped_events\": %lld}}\n", (long long)llDropped);
+    fclose(f);
+    for (pRing = pTraceRings; pRing != NULL; pRing = pNextRing) {
+        pNextRing = pRing->pNext;
+        (free)(pRing);
+    }
+    pTraceRings = NULL;
+} /* WriteTrace() */
+//
+// Start recording the trace and write it to szFile at exit
+//
+void StartTrace(char *szFile)
+{
+    szTraceFile = szFile;
+    if (iTrace) return;
+#ifdef _WIN32
+    if (!iStats) InitializeCriticalSection(&csStats);
+#endif
+    iTrace = 1;
+    llTraceStart = GetTraceTime();
+    GetTraceRing(); // the main thread gets tid 1
+    atexit(WriteTrace);
+} /* StartTrace() */
 //
 // Parse the BMP header and read the pixel data into memory
 // returns 1 for success, 0 for failure
@@ -121,90 +713,15 @@ int ReadBMP(uint8_t *pBMP, int *offbits, int *width, int *height, int *bpp)
     return 1;
 } /* ReadBMP() */
 //
-// Create 1 memory plane hex output
-//
-void MakeC_BW(uint8_t *pSrc, int iOffBits, int iWidth, int iHeight, int iBpp, int iSize, FILE *ohandle, char *szLeaf)
-{
-	int x, y, iSrcPitch, iPitch;
-    int iIn, iTotal, i, iLine;
-	uint8_t uc, ucPixel, *s = &pSrc[iOffBits];
-
-    iPitch = (iWidth + 7)/8; // output bytes per line
-	iSrcPitch = ((iWidth * iBpp) + 7)/8;
-	iSrcPitch = (iSrcPitch + 3) & 0xfffc; // Windows BMP lines are dword aligned
-	iTotal = iPitch * iHeight; // how many bytes we're creating
-	// show pitch
-	fprintf(ohandle, "// Image size: width %d, height %d\n", iWidth, iHeight);
-	fprintf(ohandle, "// %d bytes per line\n", iPitch);
-	fprintf(ohandle, "// %d bytes per plane\n", iTotal);
-        if (bMSBFirst)
-           fprintf(ohandle, "// MSB on the left\n");
-        else
-           fprintf(ohandle, "// LSB on the left\n");
-    fprintf(ohandle, "const uint8_t %s_0[] PROGMEM = {\n", szLeaf); // start of data array (plane 0)
-    iLine = i = iIn = 0;
-    for (y=0; y<iHeight; y++) {
-        uc = 0;
-        for (x=0; x<iWidth; x++) {
-            ucPixel = GetGrayPixel(x, y, s, iSrcPitch, iBpp); // slower, but easier on the eyes
-            uc <<= 1;
-            uc |= (ucPixel >> 1); // only need MSB of 2-bit pair
-            if ((x & 7) == 7 || x == iWidth-1) {
-                if ((x & 7) != 7) { // adjust last odd byte
-                    uc <<= (7-(x&7));
-                }
-                i++;
-                iLine++;
-                if (bMSBFirst == 0) uc = ucMirror[uc]; // reverse bit direction
-                fprintf(ohandle, "0x%02x", uc);
-                if (i != iTotal) {
-                    fprintf(ohandle, ",");
-                }
-                if (iLine == BYTES_PER_LINE) {
-                    fprintf(ohandle, "\n");
-                    iLine = 0;
-                }
-                uc = 0;
-            } // if a whole byte was formed
-        } // for x
-    } // for y
-    fprintf(ihandle, "};\n"); // final closing brace
-} /* MakeC_BW() */
-//
-// Match the given pixel to black (00), white (01), or yellow (1x)
+// Color classification of a single pixel (shared by the Get...Pixel()
+// functions and the specialized packers)
+// Match the color to black (00), white (01), or yellow (10)
 //
-unsigned char GetYellowPixel(int x, int y, uint8_t *pData, int iPitch, int iBpp)
+static inline uint8_t ClassifyYellow(int r, int g, int b)
 {
-    uint8_t uc=0, *s;
-    int gr, r=0, g=0, b=0;
-    
-    switch (iBpp) {
-        case 4:
-            s = &pData[(y * iPitch) + (x >> 1)];
-            uc = s[0];
-            if ((x & 1) == 0) uc >>= 4;
-            uc &= 0xf;
-            b = ucBlue[uc];
-            g = ucGreen[uc];
-            r = ucRed[uc];
-            break;
-        case 8:
-            s = &pData[(y * iPitch) + x];
-            uc = s[0];
-            b = ucBlue[uc];
-            g = ucGreen[uc];
-            r = ucRed[uc];
-            break;
-        case 24:
-        case 32:
-            s = &pData[(y * iPitch) + ((x * iBpp)>>3)];
-            b = s[0];
-            g = s[1];
-            r = s[2];
-            break;
-    } // switch on bpp
-    gr = (b + r + g*2)>>2; // gray
-    // match the color to closest of black/white/yellow
+    uint8_t uc = 0;
+    int gr = (b + r + g*2)>>2; // gray
+
     if (r > b && g > b) { // yellow is dominant?
         if (gr < 100 && r < 80) {
             // black
@@ -225,42 +742,15 @@ unsigned char GetYellowPixel(int x, int y, uint8_t *pData, int iPitch, int iBpp)
         }
     }
     return uc;
-} /* GetYellowPixel() */
+} /* ClassifyYellow() */
 //
-// Match the given pixel to black (00), white (01), or red (1x)
+// Match the color to black (00), white (01), or red (10)
 //
-unsigned char GetRedPixel(int x, int y, uint8_t *pData, int iPitch, int iBpp)
+static inline uint8_t ClassifyRed(int r, int g, int b)
 {
-    uint8_t ucOut=0, uc, *s;
-    int gr=0, r=0, g=0, b=0;
-    
-    switch (iBpp) {
-        case 4:
-            s = &pData[(y * iPitch) + (x >> 1)];
-            uc = s[0];
-            if ((x & 1) == 0) uc >>= 4;
-            uc &= 0xf;
-            b = ucBlue[uc];
-            g = ucGreen[uc];
-            r = ucRed[uc];
-            break;
-        case 8:
-            s = &pData[(y * iPitch) + x];
-            uc = s[0];
-            b = ucBlue[uc];
-            g = ucGreen[uc];
-            r = ucRed[uc];
-            break;
-        case 24:
-        case 32:
-            s = &pData[(y * iPitch) + ((x * iBpp)>>3)];
-            b = s[0];
-            g = s[1];
-            r = s[2];
-            break;
-    } // switch on bpp
-    gr = (b + r + g*2)>>2; // gray
-    // match the color to closest of black/white/red
+    uint8_t ucOut = 0;
+    int gr = (b + r + g*2)>>2; // gray
+
     if (r > g && r > b) { // red is dominant
         if (gr < 100 && r < 80) {
             // black
@@ -281,43 +771,15 @@ unsigned char GetRedPixel(int x, int y, uint8_t *pData, int iPitch, int iBpp)
         }
     }
     return ucOut;
-} /* GetRedPixel() */
+} /* ClassifyRed() */
 //
-// Match the given pixel to black (00), white (01), yellow (10), or red (11)
-// returns 2 bit value of closest matching color
+// Match the color to black (00), white (01), yellow (10), or red (11)
 //
-unsigned char GetBWYRPixel(int x, int y, uint8_t *pData, int iPitch, int iBpp)
+static inline uint8_t ClassifyBWYR(int r, int g, int b)
 {
-    uint8_t ucOut=0, uc=0, *s;
-    int gr=0, r=0, g=0, b=0;
-    
-    switch (iBpp) {
-        case 4:
-            s = &pData[(y * iPitch) + (x >> 1)];
-            uc = s[0];
-            if ((x & 1) == 0) uc >>= 4;
-            uc &= 0xf;
-            b = ucBlue[uc];
-            g = ucGreen[uc];
-            r = ucRed[uc];
-            break;
-        case 8:
-            s = &pData[(y * iPitch) + x];
-            uc = s[0];
-            b = ucBlue[uc];
-            g = ucGreen[uc];
-            r = ucRed[uc];
-            break;
-        case 24:
-        case 32:
-            s = &pData[(y * iPitch) + ((x * iBpp)>>3)];
-            r = s[2];
-            g = s[1];
-            b = s[0];
-            break;
-    } // switch on bpp
-    gr = (b + r + g*2)>>2; // gray
-    // match the color to closest of black/white/yellow/red
+    uint8_t ucOut = 0;
+    int gr = (b + r + g*2)>>2; // gray
+
     if (r > b || g > b) { // red or yellow is dominant
         if (gr < 90 || (r < 80 && g < 80)) {
             // black
@@ -340,23 +802,23 @@ unsigned char GetBWYRPixel(int x, int y, uint8_t *pData, int iPitch, int iBpp)
         }
     }
     return ucOut;
-} /* GetBWYRPixel() */
+} /* ClassifyBWYR() */
 //
-// Return the given pixel as a 2-bit grayscale value
+// The 2-bit gray level of a color
 //
-unsigned char GetGrayPixel(int x, int y, uint8_t *pData, int iPitch, int iBpp)
+static inline uint8_t ClassifyGray(int r, int g, int b)
+{
+    return (uint8_t)(((b + g + r*2) >> 2) >> 6); // simple grayscale, top 2 bits
+} /* ClassifyGray() */
+//
+// Match the given pixel to black (00), white (01), or yellow (1x)
+//
+unsigned char GetYellowPixel(int x, int y, uint8_t *pData, int iPitch, int iBpp)
 {
     uint8_t uc=0, *s;
     int r=0, g=0, b=0;
     
     switch (iBpp) {
-        case 1:
-            s = &pData[(y * iPitch) + (x >> 3)];
-            uc = s[0];
-            uc >>= (x & 7);
-            uc &= 1;
-            uc |= (uc << 1); // only black/white (00/11)
-            break;
         case 4:
             s = &pData[(y * iPitch) + (x >> 1)];
             uc = s[0];
@@ -365,8 +827,6 @@ unsigned char GetGrayPixel(int x, int y, uint8_t *pData, int iPitch, int iBpp)
             b = ucBlue[uc];
             g = ucGreen[uc];
             r = ucRed[uc];
-            b = ((b + g + r*2) >> 2); // simple grayscale
-            uc = (uint8_t)(b >> 6); // top 2 bits are the gray level
             break;
         case 8:
             s = &pData[(y * iPitch) + x];
@@ -374,8 +834,6 @@ unsigned char GetGrayPixel(int x, int y, uint8_t *pData, int iPitch, int iBpp)
             b = ucBlue[uc];
             g = ucGreen[uc];
             r = ucRed[uc];
-            b = ((b + g + r*2) >> 2); // simple grayscale
-            uc = (uint8_t)(b >> 6); // top 2 bits are the gray level
             break;
         case 24:
         case 32:
@@ -383,8 +841,122 @@ unsigned char GetGrayPixel(int x, int y, uint8_t *pData, int iPitch, int iBpp)
             b = s[0];
             g = s[1];
             r = s[2];
-            b = ((b + g + r*2) >> 2); // simple grayscale
-            uc = (uint8_t)(b >> 6); // top 2 bits are the gray level
+            break;
+    } // switch on bpp
+    return uc | ClassifyYellow(r, g, b); // (uc is the palette index for 4/8-bpp)
+} /* GetYellowPixel() */
+//
+// Match the given pixel to black (00), white (01), or red (1x)
+//
+unsigned char GetRedPixel(int x, int y, uint8_t *pData, int iPitch, int iBpp)
+{
+    uint8_t uc, *s;
+    int r=0, g=0, b=0;
+    
+    switch (iBpp) {
+        case 4:
+            s = &pData[(y * iPitch) + (x >> 1)];
+            uc = s[0];
+            if ((x & 1) == 0) uc >>= 4;
+            uc &= 0xf;
+            b = ucBlue[uc];
+            g = ucGreen[uc];
+            r = ucRed[uc];
+            break;
+        case 8:
+            s = &pData[(y * iPitch) + x];
+            uc = s[0];
+            b = ucBlue[uc];
+            g = ucGreen[uc];
+            r = ucRed[uc];
+            break;
+        case 24:
+        case 32:
+            s = &pData[(y * iPitch) + ((x * iBpp)>>3)];
+            b = s[0];
+            g = s[1];
+            r = s[2];
+            break;
+    } // switch on bpp
+    return ClassifyRed(r, g, b);
+} /* GetRedPixel() */
+//
+// Match the given pixel to black (00), white (01), yellow (10), or red (11)
+// returns 2 bit value of closest matching color
+//
+unsigned char GetBWYRPixel(int x, int y, uint8_t *pData, int iPitch, int iBpp)
+{
+    uint8_t uc=0, *s;
+    int r=0, g=0, b=0;
+    
+    switch (iBpp) {
+        case 4:
+            s = &pData[(y * iPitch) + (x >> 1)];
+            uc = s[0];
+            if ((x & 1) == 0) uc >>= 4;
+            uc &= 0xf;
+            b = ucBlue[uc];
+            g = ucGreen[uc];
+            r = ucRed[uc];
+            break;
+        case 8:
+            s = &pData[(y * iPitch) + x];
+            uc = s[0];
+            b = ucBlue[uc];
+            g = ucGreen[uc];
+            r = ucRed[uc];
+            break;
+        case 24:
+        case 32:
+            s = &pData[(y * iPitch) + ((x * iBpp)>>3)];
+            r = s[2];
+            g = s[1];
+            b = s[0];
+            break;
+    } // switch on bpp
+    return ClassifyBWYR(r, g, b);
+} /* GetBWYRPixel() */
+//
+// Return the given pixel as a 2-bit grayscale value
+//
+unsigned char GetGrayPixel(int x, int y, uint8_t *pData, int iPitch, int iBpp)
+{
+    uint8_t uc=0, *s;
+    int r=0, g=0, b=0;
+    
+    switch (iBpp) {
+        case 1:
+            s = &pData[(y * iPitch) + (x >> 3)];
+            uc = s[0];
+            uc >>= (x & 7);
+            uc &= 1;
+            uc |= (uc << 1); // only black/white (00/11)
+            break;
+        case 4:
+            s = &pData[(y * iPitch) + (x >> 1)];
+            uc = s[0];
+            if ((x & 1) == 0) uc >>= 4;
+            uc &= 0xf;
+            b = ucBlue[uc];
+            g = ucGreen[uc];
+            r = ucRed[uc];
+            uc = ClassifyGray(r, g, b);
+            break;
+        case 8:
+            s = &pData[(y * iPitch) + x];
+            uc = s[0];
+            b = ucBlue[uc];
+            g = ucGreen[uc];
+            r = ucRed[uc];
+            uc = ClassifyGray(r, g, b);
+            break;
+        case 24:
+        case 32:
+            s = &pData[(y * iPitch) + ((x * iBpp)>>3)];
+            b = s[0];
+            g = s[1];
+            r = s[2];
+            uc = ClassifyGray(r, g, b);
             break;
     } // switch on bpp
     return uc;
@@ -435,682 +1007,4690 @@ unsigned char GetGrayPixel8(int x, int y, uint8_t *pData, int iPitch, int iBpp)
     return uc;
 } /* GetGrayPixel8() */
 //
-// Convert 2-bit grayscale (4GRAY) into hex 2-plane output
+// Allocate the memory planes of the output format
+// returns 1 for success, 0 for failure
 //
-void MakeC_4GRAY(uint8_t *pSrc, int iOffBits, int iWidth, int iHeight, int iBpp, int iSize, FILE *ohandle, char *szLeaf)
+int AllocPlanes(int iWidth, int iHeight, int iOption, int iRowAlign, EPD_PLANES *pPlanes)
 {
-    int iSrcPitch, iPitch;
-    int i, iPlane, x, y, iIn, iTotal, iLine;
-    uint8_t ucPixel, uc, *s = &pSrc[iOffBits];
+    int iPlane, iPitch;
 
-    iSrcPitch = ((iBpp * iWidth) + 7)/8;
-    iSrcPitch = (iSrcPitch + 3) & 0xfffc; // Windows BMP lines are dword aligned
-    iPitch = (iWidth + 7)/8; // bytes per line of each 1-bpp plane
-    iTotal = iPitch * iHeight; // how many bytes we're creating
-    // show pitch
-    fprintf(ohandle, "// Image size: width %d, height %d\n", iWidth, iHeight);
-    fprintf(ohandle, "// %d bytes per line\n", iPitch);
-    fprintf(ohandle, "// %d bytes per plane\n", iTotal);
-    for (iPlane=0; iPlane<2; iPlane++) {
-        fprintf(ohandle, "// Plane %d data\n", iPlane);
-        fprintf(ohandle, "const uint8_t %s_%d[] PROGMEM = {\n", szLeaf, 1-iPlane); // MSB is plane 0 in the UC8151, so reverse the plane number
-        iLine = i = iIn = 0;
-        for (y=0; y<iHeight; y++) {
+    memset(pPlanes, 0, sizeof(EPD_PLANES));
+    pPlanes->iWidth = iWidth;
+    pPlanes->iHeight = iHeight;
+    pPlanes->bLSBFirst = !bMSBFirst;
+    if (iOption == OPTION_BWYR) {
+        iPitch = (iWidth + 3)/4; // bytes per line of the 2-bpp plane
+        pPlanes->iPlaneCount = 1;
+    } else {
+        iPitch = (iWidth + 7)/8; // bytes per line of each 1-bpp plane
+        pPlanes->iPlaneCount = (iOption == OPTION_BW) ? 1 : 2;
+    }
+    pPlanes->iPitch = iPitch;
+    if (iRowAlign > 1) { // e.g. for DMA which needs word aligned lines
+        pPlanes->iPitch = ((iPitch + iRowAlign - 1) / iRowAlign) * iRowAlign;
+    }
+    pPlanes->iPlaneSize = pPlanes->iPitch * iHeight;
+    for (iPlane=0; iPlane<pPlanes->iPlaneCount; iPlane++) {
+        pPlanes->pPlane[iPlane] = (uint8_t *)malloc(pPlanes->iPlaneSize);
+        if (pPlanes->pPlane[iPlane] == NULL) {
+            FreePlanes(pPlanes);
+            return 0;
+        }
+        if (pPlanes->iPitch != iPitch) // the padding is white
+            memset(pPlanes->pPlane[iPlane], PlaneBackground(iOption, iPlane), pPlanes->iPlaneSize);
+    }
+    return 1;
+} /* AllocPlanes() */
+//
+// Generic (reference) packer for any source bpp and output format
+// Reads each pixel with the Get...Pixel() functions
+//
+void PackGeneric(uint8_t *s, int iSrcPitch, int iBpp, int iOption, EPD_PLANES *pPlanes)
+{
+    int iPlane, x, y, iWidth = pPlanes->iWidth;
+    uint8_t ucPixel, uc, *d;
+
+    if (iOption == OPTION_BWYR) { // 2 bits per pixel, 1 plane
+        for (y=0; y<pPlanes->iHeight; y++) {
+            d = &pPlanes->pPlane[0][y * pPlanes->iPitch];
+            uc = 0;
+            for (x=0; x<iWidth; x++) {
+                ucPixel = GetBWYRPixel(x, y, s, iSrcPitch, iBpp); // slower, but easier on the eyes
+                uc <<= 2;
+                uc |= ucPixel; // pack 2 bits at a time into each byte
+                if ((x & 3) == 3 || x == iWidth-1) { // store new bytes every 4 pixels
+                    if ((x & 3) != 3) { // adjust last odd byte
+                        uc <<= ((3-(x&3))*2);
+                    }
+                    *d++ = uc;
+                    uc = 0;
+                } // if a whole byte was formed
+            } // for x
+        } // for y
+        return;
+    }
+    for (iPlane=0; iPlane<pPlanes->iPlaneCount; iPlane++) {
+        for (y=0; y<pPlanes->iHeight; y++) {
+            // MSB is plane 0 in the UC8151, so reverse the plane number for 4GRAY
+            d = &pPlanes->pPlane[(iOption == OPTION_4GRAY) ? 1-iPlane : iPlane][y * pPlanes->iPitch];
             uc = 0;
             for (x=0; x<iWidth; x++) {
-                ucPixel = GetGrayPixel(x, y, s, iSrcPitch, iBpp); // slower, but easier on the eyes
+                if (iOption == OPTION_BWR)
+                    ucPixel = GetRedPixel(x, y, s, iSrcPitch, iBpp); // slower, but easier on the eyes
+                else if (iOption == OPTION_BWY)
+                    ucPixel = GetYellowPixel(x, y, s, iSrcPitch, iBpp);
+                else
+                    ucPixel = GetGrayPixel(x, y, s, iSrcPitch, iBpp);
                 uc <<= 1;
-                uc |= ((ucPixel >> iPlane) & 1); // add correct plane's bit
+                if (iOption == OPTION_BW)
+                    uc |= (ucPixel >> 1); // only need MSB of 2-bit pair
+                else
+                    uc |= ((ucPixel >> iPlane) & 1); // add correct plane's bit
                 if ((x & 7) == 7 || x == iWidth-1) {
                     if ((x & 7) != 7) { // adjust last odd byte
                         uc <<= (7-(x&7));
                     }
-                    i++;
-                    iLine++;
-                    fprintf(ohandle, "0x%02x", uc);
-                    if (i != iTotal) {
-                        fprintf(ohandle, ",");
-                    }
-                    if (iLine == BYTES_PER_LINE) {
-                        fprintf(ohandle, "\n");
-                        iLine = 0;
-                    }
+                    if (iOption == OPTION_BW && bMSBFirst == 0) uc = ucMirror[uc]; // reverse bit direction
+                    *d++ = uc;
                     uc = 0;
                 } // if a whole byte was formed
             } // for x
         } // for y
-        fprintf(ihandle, "};\n"); // final closing brace
     } // for each plane
-} /* MakeC_4GRAY() */
+} /* PackGeneric() */
 //
-// Convert to Black/White/Yellow/Red packed 1-plane output
+// Specialized packers
+// Each (source bpp, output format, bit order) combination gets its own
+// copy of the packing loop, generated by the macros below, so that the
+// inner loop has no branches on the format, bpp, bit order or the last
+// partial byte. PackPlanes() picks one per image with GetPacker().
+// Every pixel is reduced to the 2-bit value the Get...Pixel() functions
+// return; palettized sources look it up in a table made from the palette.
+// The _PLAN packers also put each finished byte through the tables of a
+// panel profile (see MakePlan()) so the planes come out in the panel's
+// own bit order and polarity without another pass over them.
+//
+typedef void (EPD_PACKER)(uint8_t *pSrc, int iSrcPitch, int iWidth, int iHeight, const uint8_t *pLUT, const uint8_t *pXform, uint8_t **pDest, int iPitch);
+
+// Fetch the 2-bit value of pixel x of source line s
+#define FETCH_LUT1(s, x) pLUT[(s[(x) >> 3] >> ((x) & 7)) & 1]
+#define FETCH_LUT4(s, x) pLUT[(s[(x) >> 1] >> (((x) & 1) ? 0 : 4)) & 0xf]
+#define FETCH_LUT8(s, x) pLUT[s[(x)]]
+#define FETCH_GRAY24(s, x) ClassifyGray(s[(x)*3+2], s[(x)*3+1], s[(x)*3])
+#define FETCH_GRAY32(s, x) ClassifyGray(s[(x)*4+2], s[(x)*4+1], s[(x)*4])
+#define FETCH_RED24(s, x) ClassifyRed(s[(x)*3+2], s[(x)*3+1], s[(x)*3])
+#define FETCH_RED32(s, x) ClassifyRed(s[(x)*4+2], s[(x)*4+1], s[(x)*4])
+#define FETCH_YELLOW24(s, x) ClassifyYellow(s[(x)*3+2], s[(x)*3+1], s[(x)*3])
+#define FETCH_YELLOW32(s, x) ClassifyYellow(s[(x)*4+2], s[(x)*4+1], s[(x)*4])
+#define FETCH_BWYR24(s, x) ClassifyBWYR(s[(x)*3+2], s[(x)*3+1], s[(x)*3])
+#define FETCH_BWYR32(s, x) ClassifyBWYR(s[(x)*4+2], s[(x)*4+1], s[(x)*4])
+// Bit order of the finished BW bytes
+#define ORDER_MSB(uc) (uc)
+#define ORDER_LSB(uc) ucMirror[uc]
+// Finished bytes of packed plane 0 or 1 in a panel's layout (EPD_PLAN)
+#define ORDER_PLAN0(uc) pXform[uc]
+#define ORDER_PLAN1(uc) pXform[256 + (uc)]
+
+// 1 plane of 1-bpp (BW), the MSB of the gray level
+#define DEFINE_PACK_1P(NAME, FETCH, ORDER) \
+void NAME(uint8_t *pSrc, int iSrcPitch, int iWidth, int iHeight, const uint8_t *pLUT, const uint8_t *pXform, uint8_t **pDest, int iPitch) \
+{ \
+    int x, y, k, iTail = iWidth & 7; \
+    uint8_t uc, *s, *d; \
+    (void)pLUT; (void)pXform; \
+    for (y=0; y<iHeight; y++) { \
+        s = &pSrc[y * iSrcPitch]; \
+        d = &pDest[0][y * iPitch]; \
+        for (x=0; x<(iWidth & ~7); x+=8) { \
+            uc = 0; \
+            for (k=0; k<8; k++) \
+                uc = (uint8_t)((uc << 1) | (FETCH(s, x+k) >> 1)); \
+            *d++ = ORDER(uc); \
+        } \
+        if (iTail) { \
+            uc = 0; \
+            for (k=0; k<iTail; k++) \
+                uc = (uint8_t)((uc << 1) | (FETCH(s, x+k) >> 1)); \
+            uc <<= (8 - iTail); \
+            *d = ORDER(uc); \
+        } \
+    } \
+}
+// 2 planes of 1-bpp; plane 0 gets bit SHIFT0 of each pixel, plane 1 bit SHIFT1
+#define DEFINE_PACK_2P(NAME, FETCH, SHIFT0, SHIFT1, ORDER0, ORDER1) \
+void NAME(uint8_t *pSrc, int iSrcPitch, int iWidth, int iHeight, const uint8_t *pLUT, const uint8_t *pXform, uint8_t **pDest, int iPitch) \
+{ \
+    int x, y, k, iTail = iWidth & 7; \
+    uint8_t uc, uc0, uc1, *s, *d0, *d1; \
+    (void)pLUT; (void)pXform; \
+    for (y=0; y<iHeight; y++) { \
+        s = &pSrc[y * iSrcPitch]; \
+        d0 = &pDest[0][y * iPitch]; \
+        d1 = &pDest[1][y * iPitch]; \
+        for (x=0; x<(iWidth & ~7); x+=8) { \
+            uc0 = uc1 = 0; \
+            for (k=0; k<8; k++) { \
+                uc = FETCH(s, x+k); \
+                uc0 = (uint8_t)((uc0 << 1) | ((uc >> SHIFT0) & 1)); \
+                uc1 = (uint8_t)((uc1 << 1) | ((uc >> SHIFT1) & 1)); \
+            } \
+            *d0++ = ORDER0(uc0); \
+            *d1++ = ORDER1(uc1); \
+        } \
+        if (iTail) { \
+            uc0 = uc1 = 0; \
+            for (k=0; k<iTail; k++) { \
+                uc = FETCH(s, x+k); \
+                uc0 = (uint8_t)((uc0 << 1) | ((uc >> SHIFT0) & 1)); \
+                uc1 = (uint8_t)((uc1 << 1) | ((uc >> SHIFT1) & 1)); \
+            } \
+            *d0 = ORDER0((uint8_t)(uc0 << (8 - iTail))); \
+            *d1 = ORDER1((uint8_t)(uc1 << (8 - iTail))); \
+        } \
+    } \
+}
+// 1 plane of 2-bpp (BWYR)
+#define DEFINE_PACK_2BPP(NAME, FETCH, ORDER) \
+void NAME(uint8_t *pSrc, int iSrcPitch, int iWidth, int iHeight, const uint8_t *pLUT, const uint8_t *pXform, uint8_t **pDest, int iPitch) \
+{ \
+    int x, y, k, iTail = iWidth & 3; \
+    uint8_t uc, *s, *d; \
+    (void)pLUT; (void)pXform; \
+    for (y=0; y<iHeight; y++) { \
+        s = &pSrc[y * iSrcPitch]; \
+        d = &pDest[0][y * iPitch]; \
+        for (x=0; x<(iWidth & ~3); x+=4) { \
+            uc = 0; \
+            for (k=0; k<4; k++) \
+                uc = (uint8_t)((uc << 2) | FETCH(s, x+k)); \
+            *d++ = ORDER(uc); \
+        } \
+        if (iTail) { \
+            uc = 0; \
+            for (k=0; k<iTail; k++) \
+                uc = (uint8_t)((uc << 2) | FETCH(s, x+k)); \
+            *d = ORDER((uint8_t)(uc << ((4 - iTail) * 2))); \
+        } \
+    } \
+}
+// BW
+DEFINE_PACK_1P(PackBW_LUT1_MSB, FETCH_LUT1, ORDER_MSB)
+DEFINE_PACK_1P(PackBW_LUT4_MSB, FETCH_LUT4, ORDER_MSB)
+DEFINE_PACK_1P(PackBW_LUT8_MSB, FETCH_LUT8, ORDER_MSB)
+DEFINE_PACK_1P(PackBW_24_MSB, FETCH_GRAY24, ORDER_MSB)
+DEFINE_PACK_1P(PackBW_32_MSB, FETCH_GRAY32, ORDER_MSB)
+DEFINE_PACK_1P(PackBW_LUT1_LSB, FETCH_LUT1, ORDER_LSB)
+DEFINE_PACK_1P(PackBW_LUT4_LSB, FETCH_LUT4, ORDER_LSB)
+DEFINE_PACK_1P(PackBW_LUT8_LSB, FETCH_LUT8, ORDER_LSB)
+DEFINE_PACK_1P(PackBW_24_LSB, FETCH_GRAY24, ORDER_LSB)
+DEFINE_PACK_1P(PackBW_32_LSB, FETCH_GRAY32, ORDER_LSB)
+// BWR/BWY (plane 0 = black/white, plane 1 = the color)
+DEFINE_PACK_2P(PackColor_LUT1, FETCH_LUT1, 0, 1, ORDER_MSB, ORDER_MSB)
+DEFINE_PACK_2P(PackColor_LUT4, FETCH_LUT4, 0, 1, ORDER_MSB, ORDER_MSB)
+DEFINE_PACK_2P(PackColor_LUT8, FETCH_LUT8, 0, 1, ORDER_MSB, ORDER_MSB)
+DEFINE_PACK_2P(PackBWR_24, FETCH_RED24, 0, 1, ORDER_MSB, ORDER_MSB)
+DEFINE_PACK_2P(PackBWR_32, FETCH_RED32, 0, 1, ORDER_MSB, ORDER_MSB)
+DEFINE_PACK_2P(PackBWY_24, FETCH_YELLOW24, 0, 1, ORDER_MSB, ORDER_MSB)
+DEFINE_PACK_2P(PackBWY_32, FETCH_YELLOW32, 0, 1, ORDER_MSB, ORDER_MSB)
+// 4GRAY (MSB is plane 0 in the UC8151)
+DEFINE_PACK_2P(PackGray_LUT1, FETCH_LUT1, 1, 0, ORDER_MSB, ORDER_MSB)
+DEFINE_PACK_2P(PackGray_LUT4, FETCH_LUT4, 1, 0, ORDER_MSB, ORDER_MSB)
+DEFINE_PACK_2P(PackGray_LUT8, FETCH_LUT8, 1, 0, ORDER_MSB, ORDER_MSB)
+DEFINE_PACK_2P(PackGray_24, FETCH_GRAY24, 1, 0, ORDER_MSB, ORDER_MSB)
+DEFINE_PACK_2P(PackGray_32, FETCH_GRAY32, 1, 0, ORDER_MSB, ORDER_MSB)
+// BWYR
+DEFINE_PACK_2BPP(PackBWYR_LUT1, FETCH_LUT1, ORDER_MSB)
+DEFINE_PACK_2BPP(PackBWYR_LUT4, FETCH_LUT4, ORDER_MSB)
+DEFINE_PACK_2BPP(PackBWYR_LUT8, FETCH_LUT8, ORDER_MSB)
+DEFINE_PACK_2BPP(PackBWYR_24, FETCH_BWYR24, ORDER_MSB)
+DEFINE_PACK_2BPP(PackBWYR_32, FETCH_BWYR32, ORDER_MSB)
+// The same for a panel profile
+DEFINE_PACK_1P(PackBW_LUT1_PLAN, FETCH_LUT1, ORDER_PLAN0)
+DEFINE_PACK_1P(PackBW_LUT4_PLAN, FETCH_LUT4, ORDER_PLAN0)
+DEFINE_PACK_1P(PackBW_LUT8_PLAN, FETCH_LUT8, ORDER_PLAN0)
+DEFINE_PACK_1P(PackBW_24_PLAN, FETCH_GRAY24, ORDER_PLAN0)
+DEFINE_PACK_1P(PackBW_32_PLAN, FETCH_GRAY32, ORDER_PLAN0)
+DEFINE_PACK_2P(PackColor_LUT1_PLAN, FETCH_LUT1, 0, 1, ORDER_PLAN0, ORDER_PLAN1)
+DEFINE_PACK_2P(PackColor_LUT4_PLAN, FETCH_LUT4, 0, 1, ORDER_PLAN0, ORDER_PLAN1)
+DEFINE_PACK_2P(PackColor_LUT8_PLAN, FETCH_LUT8, 0, 1, ORDER_PLAN0, ORDER_PLAN1)
+DEFINE_PACK_2P(PackBWR_24_PLAN, FETCH_RED24, 0, 1, ORDER_PLAN0, ORDER_PLAN1)
+DEFINE_PACK_2P(PackBWR_32_PLAN, FETCH_RED32, 0, 1, ORDER_PLAN0, ORDER_PLAN1)
+DEFINE_PACK_2P(PackBWY_24_PLAN, FETCH_YELLOW24, 0, 1, ORDER_PLAN0, ORDER_PLAN1)
+DEFINE_PACK_2P(PackBWY_32_PLAN, FETCH_YELLOW32, 0, 1, ORDER_PLAN0, ORDER_PLAN1)
+DEFINE_PACK_2P(PackGray_LUT1_PLAN, FETCH_LUT1, 1, 0, ORDER_PLAN0, ORDER_PLAN1)
+DEFINE_PACK_2P(PackGray_LUT4_PLAN, FETCH_LUT4, 1, 0, ORDER_PLAN0, ORDER_PLAN1)
+DEFINE_PACK_2P(PackGray_LUT8_PLAN, FETCH_LUT8, 1, 0, ORDER_PLAN0, ORDER_PLAN1)
+DEFINE_PACK_2P(PackGray_24_PLAN, FETCH_GRAY24, 1, 0, ORDER_PLAN0, ORDER_PLAN1)
+DEFINE_PACK_2P(PackGray_32_PLAN, FETCH_GRAY32, 1, 0, ORDER_PLAN0, ORDER_PLAN1)
+DEFINE_PACK_2BPP(PackBWYR_LUT1_PLAN, FETCH_LUT1, ORDER_PLAN0)
+DEFINE_PACK_2BPP(PackBWYR_LUT4_PLAN, FETCH_LUT4, ORDER_PLAN0)
+DEFINE_PACK_2BPP(PackBWYR_LUT8_PLAN, FETCH_LUT8, ORDER_PLAN0)
+DEFINE_PACK_2BPP(PackBWYR_24_PLAN, FETCH_BWYR24, ORDER_PLAN0)
+DEFINE_PACK_2BPP(PackBWYR_32_PLAN, FETCH_BWYR32, ORDER_PLAN0)
 //
-void MakeC_4CLR(uint8_t *pSrc, int iOffBits, int iWidth, int iHeight, int iBpp, int iSize, FILE *ohandle, char *szLeaf)
+// Pick the specialized packer for a source bpp, output format and bit order
+// (or panel plan)
+// returns NULL if there isn't one (the generic packer handles it)
+//
+EPD_PACKER *GetPacker(int iBpp, int iOption, int bMSB, int bPlan)
 {
-    int iSrcPitch, iPitch;
-    int i, x, y, iIn, iTotal, iLine;
-    uint8_t ucPixel, uc, *s = &pSrc[iOffBits];
+    static EPD_PACKER * const pBW[2][5] = {
+        {PackBW_LUT1_LSB, PackBW_LUT4_LSB, PackBW_LUT8_LSB, PackBW_24_LSB, PackBW_32_LSB},
+        {PackBW_LUT1_MSB, PackBW_LUT4_MSB, PackBW_LUT8_MSB, PackBW_24_MSB, PackBW_32_MSB}};
+    static EPD_PACKER * const pBWR[5] = {PackColor_LUT1, PackColor_LUT4, PackColor_LUT8, PackBWR_24, PackBWR_32};
+    static EPD_PACKER * const pBWY[5] = {PackColor_LUT1, PackColor_LUT4, PackColor_LUT8, PackBWY_24, PackBWY_32};
+    static EPD_PACKER * const pGray[5] = {PackGray_LUT1, PackGray_LUT4, PackGray_LUT8, PackGray_24, PackGray_32};
+    static EPD_PACKER * const pBWYR[5] = {PackBWYR_LUT1, PackBWYR_LUT4, PackBWYR_LUT8, PackBWYR_24, PackBWYR_32};
+    static EPD_PACKER * const pPlan[OPTION_COUNT][5] = { // in OPTION_xxx order
+        {PackBW_LUT1_PLAN, PackBW_LUT4_PLAN, PackBW_LUT8_PLAN, PackBW_24_PLAN, PackBW_32_PLAN},
+        {PackColor_LUT1_PLAN, PackColor_LUT4_PLAN, PackColor_LUT8_PLAN, PackBWR_24_PLAN, PackBWR_32_PLAN},
+        {PackColor_LUT1_PLAN, PackColor_LUT4_PLAN, PackColor_LUT8_PLAN, PackBWY_24_PLAN, PackBWY_32_PLAN},
+        {PackBWYR_LUT1_PLAN, PackBWYR_LUT4_PLAN, PackBWYR_LUT8_PLAN, PackBWYR_24_PLAN, PackBWYR_32_PLAN},
+        {PackGray_LUT1_PLAN, PackGray_LUT4_PLAN, PackGray_LUT8_PLAN, PackGray_24_PLAN, PackGray_32_PLAN}};
+    int i;
 
-    iSrcPitch = ((iBpp * iWidth) + 7)/8;
-    iSrcPitch = (iSrcPitch + 3) & 0xfffc; // Windows BMP lines are dword aligned
-    iPitch = (iWidth + 3)/4; // bytes per line of the 2-bpp plane
-    iTotal = iPitch * iHeight; // how many bytes we're creating
-    // show pitch
-    fprintf(ohandle, "// Image size: width %d, height %d\n", iWidth, iHeight);
-    fprintf(ohandle, "// %d bytes per line\n", iPitch);
-    fprintf(ohandle, "// %d bytes total\n", iTotal);
-    fprintf(ohandle, "const uint8_t %s[] PROGMEM = {\n", szLeaf);
-    iLine = i = iIn = 0;
-    for (y=0; y<iHeight; y++) {
-        uc = 0;
-        for (x=0; x<iWidth; x++) {
-            ucPixel = GetBWYRPixel(x, y, s, iSrcPitch, iBpp); // slower, but easier on the eyes
-            uc <<= 2;
-            uc |= ucPixel; // pack 2 bits at a time into each byte
-            if ((x & 3) == 3 || x == iWidth-1) { // store new bytes every 4 pixels
-                if ((x & 3) != 3) { // adjust last odd byte
-                    uc <<= ((3-(x&3))*2);
-                }
-                i++;
-                iLine++;
-                fprintf(ohandle, "0x%02x", uc);
-                if (i != iTotal) {
-                    fprintf(ohandle, ",");
-                }
-                if (iLine == BYTES_PER_LINE) {
-                    fprintf(ohandle, "\n");
-                    iLine = 0;
+    switch (iBpp) {
+        case 1: i = 0; break;
+        case 4: i = 1; break;
+        case 8: i = 2; break;
+        case 24: i = 3; break;
+        case 32: i = 4; break;
+        default: return NULL;
+    }
+    if (bPlan)
+        return (iOption >= 0 && iOption < OPTION_COUNT) ? pPlan[iOption][i] : NULL;
+    switch (iOption) {
+        case OPTION_BW: return pBW[bMSB != 0][i];
+        case OPTION_BWR: return pBWR[i];
+        case OPTION_BWY: return pBWY[i];
+        case OPTION_4GRAY: return pGray[i];
+        case OPTION_BWYR: return pBWYR[i];
+    }
+    return NULL;
+} /* GetPacker() */
+//
+// Make the table of 2-bit pixel values for a palettized (1/4/8-bpp) source
+// by running each color index through the same Get...Pixel() function
+// as the generic packer
+//
+void MakePackLUT(int iBpp, int iOption, uint8_t *pLUT)
+{
+    uint8_t uc[4] = {0};
+    int i;
+
+    for (i=0; i<(1 << iBpp); i++) {
+        uc[0] = (uint8_t)((iBpp == 4) ? (i << 4) : i); // the color index of pixel 0
+        switch (iOption) {
+            case OPTION_BWR: pLUT[i] = GetRedPixel(0, 0, uc, 4, iBpp); break;
+            case OPTION_BWY: pLUT[i] = GetYellowPixel(0, 0, uc, 4, iBpp); break;
+            case OPTION_BWYR: pLUT[i] = GetBWYRPixel(0, 0, uc, 4, iBpp); break;
+            default: pLUT[i] = GetGrayPixel(0, 0, uc, 4, iBpp); break;
+        }
+    }
+} /* MakePackLUT() */
+//
+// Compile a panel profile into the byte tables of a packing plan
+// The tables turn a finished byte of the default layout (first pixel in
+// the MSB, left for horizontal bytes or top for vertical ones) into the
+// panel's bit order and polarity
+//
+void MakePlan(EPD_PROFILE *pProfile, EPD_PLAN *pPlan)
+{
+    int i, j, k, bMirror, iPlanes;
+    uint8_t uc;
+
+    iPlanes = (pProfile->iOption == OPTION_BW || pProfile->iOption == OPTION_BWYR) ? 1 : 2;
+    pPlan->iSwap = (iPlanes == 2 && pProfile->bSwapPlanes);
+    // vertical bytes already have the top pixel in the LSB
+    bMirror = (pProfile->bLSBFirst != pProfile->bVertical);
+    for (j=0; j<2; j++) {
+        for (i=0; i<256; i++) {
+            uc = (uint8_t)i;
+            if (bMirror) {
+                if (pProfile->iOption == OPTION_BWYR) { // reverse the order of the 2-bit pixels
+                    uc = 0;
+                    for (k=0; k<4; k++)
+                        uc |= ((i >> (k*2)) & 3) << ((3-k)*2);
+                } else {
+                    uc = ucMirror[uc];
                 }
-                uc = 0;
-            } // if a whole byte was formed
-        } // for x
-    } // for y
-    fprintf(ihandle, "};\n"); // final closing brace
-} /* MakeC_4CLR() */
+            }
+            if (pProfile->iInvert & (1 << (j ^ pPlan->iSwap)))
+                uc = ~uc;
+            pPlan->ucXform[j][i] = uc;
+        }
+    }
+} /* MakePlan() */
 //
-// Convert BWR/BWY into 2-plane output
+// Put already packed planes through a packing plan
+// (for the layouts which the packers can't do in the same pass)
+//
+void ApplyPlan(EPD_PLANES *pPlanes, EPD_PLAN *pPlan)
+{
+    int i, iPlane;
+    uint8_t *p;
+
+    for (iPlane=0; iPlane<pPlanes->iPlaneCount; iPlane++) {
+        p = pPlanes->pPlane[iPlane];
+        for (i=0; i<pPlanes->iPlaneSize; i++)
+            p[i] = pPlan->ucXform[iPlane][p[i]];
+    }
+    if (pPlan->iSwap) {
+        p = pPlanes->pPlane[0];
+        pPlanes->pPlane[0] = pPlanes->pPlane[1];
+        pPlanes->pPlane[1] = p;
+    }
+} /* ApplyPlan() */
 //
-void MakeC_3CLR(uint8_t *pSrc, int iOffBits, int iWidth, int iHeight, int iBpp, int iSize, FILE *ohandle, char *szLeaf, int iType)
+// Pack the source image into 1 or 2 memory planes
+// in the output format's native layout (or a panel's if pPlan isn't NULL)
+// returns 1 for success, 0 for failure
+//
+int PackPlanes(uint8_t *pSrc, int iOffBits, int iWidth, int iHeight, int iBpp, int iOption, int iRowAlign, EPD_PLAN *pPlan, EPD_PLANES *pPlanes)
 {
-    int iSrcPitch, iPitch;
-    int i, iPlane, x, y, iIn, iTotal, iLine;
-    uint8_t ucPixel, uc, *s = &pSrc[iOffBits];
+    int iSrcPitch, iPlane;
+    uint8_t ucLUT[256], *pDest[2];
+    EPD_PACKER *pfnPack;
 
+    if (!AllocPlanes(iWidth, iHeight, iOption, iRowAlign, pPlanes))
+        return 0;
     iSrcPitch = ((iBpp * iWidth) + 7)/8;
     iSrcPitch = (iSrcPitch + 3) & 0xfffc; // Windows BMP lines are dword aligned
-    iPitch = (iWidth + 7)/8; // bytes per line of each 1-bpp plane
-    iTotal = iPitch * iHeight; // how many bytes we're creating
-    // show pitch
-    fprintf(ohandle, "// Image size: width %d, height %d\n", iWidth, iHeight);
-    fprintf(ohandle, "// %d bytes per line\n", iPitch);
-    fprintf(ohandle, "// %d bytes per plane\n", iTotal);
-    for (iPlane=0; iPlane<2; iPlane++) {
-        fprintf(ohandle, "// Plane %d data\n", iPlane);
-        fprintf(ohandle, "const uint8_t %s_%d[] PROGMEM = {\n", szLeaf, iPlane);
-        iLine = i = iIn = 0;
-        for (y=0; y<iHeight; y++) {
-            uc = 0;
-            for (x=0; x<iWidth; x++) {
-                if (iType == OPTION_BWR)
-                    ucPixel = GetRedPixel(x, y, s, iSrcPitch, iBpp); // slower, but easier on the eyes
+    pfnPack = GetPacker(iBpp, iOption, bMSBFirst, pPlan != NULL);
+    if (pfnPack) {
+        if (iBpp <= 8)
+            MakePackLUT(iBpp, iOption, ucLUT);
+        pDest[0] = pPlanes->pPlane[0];
+        pDest[1] = pPlanes->pPlane[1];
+        if (pPlan) {
+            for (iPlane=0; iPlane<pPlanes->iPlaneCount; iPlane++) {
+                pDest[iPlane] = pPlanes->pPlane[iPlane ^ pPlan->iSwap];
+                if (iRowAlign > 1) // the padding in the panel's polarity
+                    memset(pDest[iPlane], pPlan->ucXform[iPlane][PlaneBackground(iOption, iPlane)], pPlanes->iPlaneSize);
+            }
+        }
+        (*pfnPack)(&pSrc[iOffBits], iSrcPitch, iWidth, iHeight, ucLUT, (pPlan) ? &pPlan->ucXform[0][0] : NULL, pDest, pPlanes->iPitch);
+    } else {
+        PackGeneric(&pSrc[iOffBits], iSrcPitch, iBpp, iOption, pPlanes);
+        if (pPlan)
+            ApplyPlan(pPlanes, pPlan);
+    }
+    return 1;
+} /* PackPlanes() */
+//
+// Free the memory planes allocated by PackPlanes()
+//
+void FreePlanes(EPD_PLANES *pPlanes)
+{
+    for (int i=0; i<2; i++) {
+        free(pPlanes->pPlane[i]);
+        pPlanes->pPlane[i] = NULL;
+    }
+} /* FreePlanes() */
+//
+// Transpose an 8x8 block of bits
+// 8 rows of horizontal bytes (MSB on the left) become 8 columns of
+// vertical bytes (LSB on top)
+//
+void Transpose8x8(uint8_t **pRows, int iCol, uint8_t *pDest)
+{
+    uint64_t x, t;
+    int i;
+
+    x = 0;
+    for (i=7; i>=0; i--) { // bottom row in the top byte
+        x = (x << 8) | pRows[i][iCol];
+    }
+    t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+    x = x ^ t ^ (t << 28);
+    for (i=0; i<8; i++) { // left column in the top byte
+        pDest[i] = (uint8_t)(x >> (56 - i*8));
+    }
+} /* Transpose8x8() */
+//
+// Repack the horizontal planes as pages of vertical bytes for
+// column addressed controllers (SSD1306 style, LSB on top)
+// 1-bpp planes hold 8 rows per page, the 2-bpp BWYR plane holds 4
+// The 1-bpp planes are converted one 8x8 block at a time so that only
+// 8 source lines are touched for each page
+// returns 1 for success, 0 for failure
+//
+int VerticalPlanes(EPD_PLANES *pPlanes, int iOption)
+{
+    int iPlane, iPages, iPage, x, y, iRows, iCol;
+    uint8_t *pNew, *d, *pRows[8], *pBG, ucTemp[8], uc;
+
+    iRows = (iOption == OPTION_BWYR) ? 4 : 8;
+    iPages = (pPlanes->iHeight + iRows - 1) / iRows;
+    pBG = (uint8_t *)malloc(pPlanes->iPitch); // a white line for the rows past the bottom
+    if (pBG == NULL) return 0;
+    for (iPlane=0; iPlane<pPlanes->iPlaneCount; iPlane++) {
+        pNew = (uint8_t *)malloc(pPlanes->iWidth * iPages);
+        if (pNew == NULL) {
+            free(pBG);
+            return 0;
+        }
+        memset(pBG, PlaneBackground(iOption, iPlane), pPlanes->iPitch);
+        for (iPage=0; iPage<iPages; iPage++) {
+            d = &pNew[iPage * pPlanes->iWidth];
+            for (y=0; y<iRows; y++) { // rows past the bottom are white
+                if (iPage*iRows + y < pPlanes->iHeight)
+                    pRows[y] = &pPlanes->pPlane[iPlane][(iPage*iRows + y) * pPlanes->iPitch];
                 else
-                    ucPixel = GetYellowPixel(x, y, s, iSrcPitch, iBpp);
-                uc <<= 1;
-                uc |= ((ucPixel >> iPlane) & 1); // add correct plane's bit
-                if ((x & 7) == 7 || x == iWidth-1) {
-                    if ((x & 7) != 7) { // adjust last odd byte
-                        uc <<= (7-(x&7));
-                    }
-                    i++;
-                    iLine++;
-                    fprintf(ohandle, "0x%02x", uc);
-                    if (i != iTotal) {
-                        fprintf(ohandle, ",");
+                    pRows[y] = pBG;
+            }
+            if (iOption == OPTION_BWYR) { // 4 pixels of 2 bits each
+                for (x=0; x<pPlanes->iWidth; x++) {
+                    uc = 0;
+                    for (y=0; y<4; y++) {
+                        uc |= ((pRows[y][x >> 2] >> (6 - (x & 3)*2)) & 3) << (y*2);
                     }
-                    if (iLine == BYTES_PER_LINE) {
-                        fprintf(ohandle, "\n");
-                        iLine = 0;
+                    d[x] = uc;
+                }
+                continue;
+            }
+            for (iCol=0; iCol*8 < pPlanes->iWidth; iCol++) {
+                if (iOption == OPTION_BW && !bMSBFirst) { // put the left pixel back in the MSB
+                    uint8_t ucRow[8], *pRow[8];
+                    for (y=0; y<8; y++) {
+                        ucRow[y] = ucMirror[pRows[y][iCol]];
+                        pRow[y] = &ucRow[y];
                     }
-                    uc = 0;
-                } // if a whole byte was formed
-            } // for x
-        } // for y
-        fprintf(ihandle, "};\n"); // final closing brace
+                    Transpose8x8(pRow, 0, ucTemp);
+                } else {
+                    Transpose8x8(pRows, iCol, ucTemp);
+                }
+                for (x=0; x<8 && iCol*8 + x < pPlanes->iWidth; x++) {
+                    d[iCol*8 + x] = ucTemp[x];
+                }
+            } // for iCol
+        } // for each page
+        free(pPlanes->pPlane[iPlane]);
+        pPlanes->pPlane[iPlane] = pNew;
     } // for each plane
-} /* MakeC_3CLR() */
+    free(pBG);
+    pPlanes->iPitch = pPlanes->iWidth;
+    pPlanes->iPlaneSize = pPlanes->iWidth * iPages;
+    pPlanes->bVertical = 1;
+    return 1;
+} /* VerticalPlanes() */
 //
-// mirror image horizontally
+// Write a block of bytes as comma separated hex values
+// BYTES_PER_LINE to a line (the caller writes the array declaration)
 //
-void MirrorBMP(uint8_t *pPixels, int iWidth, int iHeight, int iBpp)
+void WriteHexData(FILE *ohandle, uint8_t *pData, int iLen)
 {
-    int y;
-    uint8_t c1,c2,c3, *s, *d;
-    uint32_t lTemp, *ld, *ls;
-    int x, iPitch;
+    int i, iLine = 0;
 
-       iPitch = ((iWidth * iBpp) + 7)/8;
-       iPitch = (iPitch + 3) & 0xfffc;
-       switch (iBpp)
-          {
-          case 1:
-                  if ((iWidth & 7) == 0) { // multiple of 8 wide
-                      for (y=0; y<iHeight; y++)
-                      {
-                          s = &pPixels[y * iPitch];
-                          d = s + (iWidth>>3) - 1;
-                          x = iWidth >> 4;
-                          while (x)
-                          {
-                              c1 = ucMirror[*s];
-                              c2 = ucMirror[*d];
-                              *s++ = c2;
-                              *d-- = c1;
-                              x--;
-                          }
-                      }
-                  } else {
-                      // DEBUG
-                  }
-             break;
-          case 4:
-             for (y=0; y<iHeight; y++)
-                {
-                s = &pPixels[y * iPitch];
-                d = s + (iWidth>>1) - 1;
-                x = iWidth >> 2;
-                while (x)
-                   {
-                   c1 = *s;
-                   c2 = *d;
-                   c1 = (c1 << 4) | (c1 >> 4);
-                   c2 = (c2 << 4) | (c2 >> 4);
-                   *s++ = c2;
-                   *d-- = c1;
-                   x--;
-                   }
-                }
-             break;
-          case 8:
-             for (y=0; y<iHeight; y++)
-                {
-                s = &pPixels[y * iPitch];
-                d = s + iWidth - 1;
-                    x = iWidth >> 1;
-                    while (x)
-                       {
-                       c1 = *s;
-                       *s++ = *d;
-                       *d-- = c1;
-                       x--;
-                       }
-                    }
-                 break;
-              case 24:
-                  for (y=0; y<iHeight; y++)
-                    {
-                    s = &pPixels[y * iPitch];
-                    d = s + (iWidth - 1)*3;
-                    x = iWidth >> 1;
-                    while (x)
-                       {
-                       c1 = s[0];
-                       c2 = s[1];
-                       c3 = s[2];
-                           s[0] = d[0];
-                           s[1] = d[1];
-                           s[2] = d[2];
-                           s += 3;
-                           d[0] = c1;
-                           d[1] = c2;
-                           d[2] = c3;
-                           d -= 3;
-                           x--;
-                           }
-                        }
-                     break;
-                  case 32:
-                  for (y=0; y<iHeight; y++)
-                    {
-                        ls = (uint32_t *)&pPixels[y * iPitch];
-                        ld = ls + iWidth - 1;
-                        x = iWidth >> 1;
-                        while (x)
-                           {
-                           lTemp = *ls;
-                           *ls++ = *ld;
-                           *ld-- = lTemp;
-                           x--;
-                           }
-                        }
-                     break;
-                  }
-} /* MirrorBMP() */
+    for (i=0; i<iLen; i++) {
+        fprintf(ohandle, "0x%02x", pData[i]);
+        if (i != iLen-1) {
+            fprintf(ohandle, ",");
+        }
+        if (++iLine == BYTES_PER_LINE) {
+            fprintf(ohandle, "\n");
+            iLine = 0;
+        }
+    }
+    fprintf(ohandle, "};\n"); // final closing brace
+} /* WriteHexData() */
 //
-// flip image vertically
+// Write a named constant array in the current output mode
+// iElemSize is 1, 2 or 4 (uint8_t/uint16_t/uint32_t)
+// Wider elements are stored little-endian in the binary blob
+// and written in hex when the plane data is word packed
 //
-void FlipBMP(uint8_t *p, int iWidth, int iHeight, int iBpp)
+void WriteArrayData(EPD_OUTPUT *pOut, const char *szName, void *pData, int iElemSize, int iCount)
 {
-int iPitch;
-uint8_t c, *s, *d;
+    const char *szType = (iElemSize == 1) ? "uint8_t" : ((iElemSize == 2) ? "uint16_t" : "uint32_t");
+    FILE *ohandle;
+    int i, iAlign;
+    uint32_t u32;
+    uint8_t uc[4];
+    char szAlign[64];
 
-	iPitch = ((iWidth*iBpp)+7)/8;
-	iPitch = (iPitch + 3) & 0xfffc;
-	s = p;
-	d = &p[iPitch * (iHeight-1)];
-	for (int y=0; y<iHeight/2; y++) {
-           for (int x=0; x<iPitch; x++) {
-              c = s[x];
-	      s[x] = d[x];
-	      d[x] = c; // swap top/bottom lines
-	   }
-	   s += iPitch;
-	   d -= iPitch;
-	}
-} /* FlipBMP() */
+    szAlign[0] = 0;
+    if (pOut->iArrayAlign > 1) {
+        sprintf(szAlign, " __attribute__((aligned(%d)))", pOut->iArrayAlign);
+    }
 
-void RotateImage(int iRotation, uint8_t *pPixels, int *iWidth, int *iHeight, int iBpp)
+    if (pOut->iMode == OUTPUT_C || pOut->iMode == OUTPUT_SPLIT) {
+        if (pOut->iMode == OUTPUT_SPLIT) { // declaration in the header, data in the .c file
+            fprintf(pOut->ohandle, "extern const %s %s[%d]%s PROGMEM;\n", szType, szName, iCount, szAlign);
+            ohandle = pOut->dhandle;
+        } else {
+            ohandle = pOut->ohandle;
+        }
+        fprintf(ohandle, "const %s %s[]%s PROGMEM = {\n", szType, szName, szAlign);
+        if (iElemSize == 1) {
+            WriteHexData(ohandle, (uint8_t *)pData, iCount);
+            return;
+        }
+        for (i=0; i<iCount; i++) {
+            u32 = (iElemSize == 2) ? ((uint16_t *)pData)[i] : ((uint32_t *)pData)[i];
+            if (pOut->iWordSize > 1)
+                fprintf(ohandle, "0x%0*x", iElemSize * 2, (unsigned int)u32);
+            else
+                fprintf(ohandle, "%u", (unsigned int)u32);
+            if (i != iCount-1) fprintf(ohandle, ",");
+            if ((i % BYTES_PER_LINE) == BYTES_PER_LINE-1) fprintf(ohandle, "\n");
+        }
+        fprintf(ohandle, "};\n");
+        return;
+    }
+    // OUTPUT_ASM
+    fprintf(pOut->ohandle, "extern const %s %s[%d] PROGMEM;\n", szType, szName, iCount);
+    fprintf(pOut->dhandle, "\n#ifdef __AVR__\n    .section .progmem.data,\"a\"\n#else\n    .section .rodata.%s,\"a\"\n#endif\n", szName);
+    iAlign = (pOut->iArrayAlign > 4) ? pOut->iArrayAlign : 4;
+    fprintf(pOut->dhandle, "    .global %s\n    .type %s, %%object\n    .balign %d\n", szName, szName, iAlign);
+    fprintf(pOut->dhandle, "%s:\n    .incbin \"%s\", %d, %d\n    .size %s, %d\n", szName, pOut->szBinLeaf, pOut->iBinOffset, iCount * iElemSize, szName, iCount * iElemSize);
+    if (iElemSize == 1) {
+        fwrite(pData, 1, iCount, pOut->bhandle);
+    } else {
+        for (i=0; i<iCount; i++) {
+            u32 = (iElemSize == 2) ? ((uint16_t *)pData)[i] : ((uint32_t *)pData)[i];
+            uc[0] = (uint8_t)u32; uc[1] = (uint8_t)(u32 >> 8);
+            uc[2] = (uint8_t)(u32 >> 16); uc[3] = (uint8_t)(u32 >> 24);
+            fwrite(uc, 1, iElemSize, pOut->bhandle);
+        }
+    }
+    pOut->iBinOffset += iCount * iElemSize;
+    while (pOut->iBinOffset & 3) { // keep the next array aligned in the blob too
+        fputc(0, pOut->bhandle);
+        pOut->iBinOffset++;
+    }
+} /* WriteArrayData() */
+void WriteArray(EPD_OUTPUT *pOut, const char *szName, void *pData, int iElemSize, int iCount)
 {
-    uint8_t *pTemp, *s, *d, x, y;
-    int w = *iWidth, h = *iHeight;
-    int iSrcPitch, iDstPitch;
-    
-    if (iRotation == 0) return; // nothing to do
-    if (iRotation == 180) {
-        FlipBMP(pPixels, w, h, iBpp);
-        MirrorBMP(pPixels, w, h, iBpp);
+    EPD_TIMER timer;
+
+    StatsBegin(&timer, STAGE_EMIT);
+    WriteArrayData(pOut, szName, pData, iElemSize, iCount);
+    StatsEnd(&timer, (int64_t)iElemSize * iCount);
+} /* WriteArray() */
+//
+// Write packed plane data as bytes or as 16/32-bit words
+// (so that it can be sent by word-wide DMA straight from flash)
+// big-endian puts the first byte in the MSB of each word
+//
+void WritePlaneData(EPD_OUTPUT *pOut, const char *szName, uint8_t *pData, int iLen)
+{
+    int i, j, iWord = pOut->iWordSize, iCount;
+    uint32_t u32, *pWords;
+    EPD_TIMER timer;
+
+    if (iWord <= 1) {
+        WriteArray(pOut, szName, pData, 1, iLen);
         return;
     }
-    iSrcPitch = ((w * iBpp)+7)/8;
-    iSrcPitch = (iSrcPitch + 3) & 0xfffc; // dword aligned
-    iDstPitch = ((h * iBpp)+7)/8;
-    iDstPitch = (iDstPitch + 3) & 0xfffc;
-    switch (iBpp) {
-        case 1:
-            break;
-        case 4:
-            pTemp = (uint8_t *) malloc((w+2) * iDstPitch);
-            s = pPixels;
-            for (y = 0; y < h; y+=2)
-            {
-                uint8_t c1, c2, c3;
-                d = pTemp - y + (w - 1)/2; /* Start at right edge */
-                for (x=0; x < (h+1)>>1; x++)
-                {
-                    c1 = *s;
-                    c2 = s[iSrcPitch];
-                    s++;
-                    c3 = (c1 >> 4) | (c2 & 0xf0); /* swap pixels */
-                    c2 = (c2 << 4) | (c1 & 0xf);
-                    *d = c3;
-                    d[iDstPitch] = c2;
-                    d += iDstPitch * 2;
-                }
-                s += (iSrcPitch * 2);
-            }
-            memcpy(pPixels, pTemp, iDstPitch * w);
-            free(pTemp);
-            break;
-        case 8:
-            break;
-        case 24:
-        case 32:
-            break;
+    StatsBegin(&timer, STAGE_EMIT);
+    iCount = (iLen + iWord - 1) / iWord;
+    pWords = (uint32_t *)malloc(iCount * sizeof(uint32_t));
+    for (i=0; i<iCount; i++) {
+        u32 = 0;
+        for (j=0; j<iWord; j++) {
+            uint32_t u8 = (i*iWord + j < iLen) ? pData[i*iWord + j] : 0; // pad the last word
+            if (pOut->bBigEndian)
+                u32 |= u8 << ((iWord - 1 - j) * 8);
+            else
+                u32 |= u8 << (j * 8);
+        }
+        if (iWord == 2)
+            ((uint16_t *)pWords)[i] = (uint16_t)u32;
+        else
+            pWords[i] = u32;
     }
-    if (iRotation == 270) {
-        FlipBMP(pPixels, h, w, iBpp);
-        MirrorBMP(pPixels, h, w, iBpp);
+    WriteArray(pOut, szName, pWords, iWord, iCount); // (not counted twice)
+    free(pWords);
+    StatsEnd(&timer, iLen);
+} /* WritePlaneData() */
+//
+// Create the output file(s)
+// OUTPUT_ASM also creates <name>.S and <name>.bin next to the header
+// returns 1 for success, 0 for failure
+//
+int OpenOutput(EPD_OUTPUT *pOut, char *szOutName, int iMode)
+{
+    char szBase[256], szName[270], *szHeader;
+    int i;
+
+    memset(pOut, 0, sizeof(EPD_OUTPUT));
+    pOut->iMode = iMode;
+    pOut->ohandle = fopen(szOutName, "wb");
+    if (pOut->ohandle == NULL) {
+        printf("Error creating output file: %s\n", szOutName);
+        return 0;
     }
-    if (iRotation == 90 || iRotation == 270) { // swap width/height
-        x = *iWidth;
-        *iWidth = *iHeight;
-        *iHeight = x;
+    fprintf(pOut->ohandle, "//\n// Created with epd_image\n// https://github.com/bitbank2/epd_image\n");
+    if (iMode == OUTPUT_C) return 1;
+    strcpy(szBase, szOutName);
+    for (i=(int)strlen(szBase)-1; i>=0 && szBase[i] != '.' && szBase[i] != '/' && szBase[i] != '\\'; i--) {};
+    if (i >= 0 && szBase[i] == '.') szBase[i] = 0; // remove the extension
+    szHeader = szOutName;
+    for (i=0; szOutName[i]; i++) {
+        if (szOutName[i] == '/' || szOutName[i] == '\\') szHeader = &szOutName[i+1];
     }
-} /* RotateImage() */
+    if (iMode == OUTPUT_ASM) {
+        sprintf(szName, "%s.bin", szBase);
+        GetLeafName(szName, pOut->szBinLeaf);
+        strcat(pOut->szBinLeaf, ".bin"); // GetLeafName() removes it
+        pOut->bhandle = fopen(szName, "wb");
+        if (pOut->bhandle == NULL) {
+            printf("Error creating output file: %s\n", szName);
+            CloseOutput(pOut);
+            return 0;
+        }
+        sprintf(szName, "%s.S", szBase);
+    } else {
+        sprintf(szName, "%s.c", szBase);
+    }
+    pOut->dhandle = fopen(szName, "wb");
+    if (pOut->dhandle == NULL) {
+        printf("Error creating output file: %s\n", szName);
+        CloseOutput(pOut);
+        return 0;
+    }
+    fprintf(pOut->dhandle, "//\n// Created with epd_image\n// https://github.com/bitbank2/epd_image\n//\n");
+    if (iMode == OUTPUT_ASM) {
+        fprintf(pOut->dhandle, "// Image data from %s (the extern declarations are in %s)\n", pOut->szBinLeaf, szHeader);
+        fprintf(pOut->dhandle, "// assemble with the GNU toolchain (add -I<dir of %s> if it's not in the build directory)\n//\n", pOut->szBinLeaf);
+    } else {
+        fprintf(pOut->dhandle, "#include <stdint.h>\n#include \"%s\"\n", szHeader);
+    }
+    return 1;
+} /* OpenOutput() */
 //
-// Pick the best color of black/white/red/yellow
-// depending on the output format option
+// Write the include guard and image constants to the header
+// of the modes which keep the data in a separate file
 //
-void MatchBestColor(uint8_t *pR, uint8_t *pG, uint8_t *pB, int iOutFormat)
+void WriteHeaderInfo(EPD_OUTPUT *pOut, char *szLeaf, EPD_PLANES *pPlanes, int iOption, int bCompressed)
 {
-    int gr;
-    uint8_t r, g, b;
-    
-    r = *pR; g = *pG; b = *pB;
-    gr = (b + r + g*2)>>2; // gray
-    switch (iOutFormat)
-    {
-        case OPTION_BWR:
-            // match the color to closest of black/white/red
-            if (r > g && r > b) { // red is dominant
-                if (gr < 100 && r < 80) {
-                    // black
-                    b = g = r = 0;
-                } else {
-                    if (r-b > 32 && r-g > 32) {
-                        // is red really dominant?
-                        b = g = 0; r = 0xff;
-                    } else { // yellowish should be white
-                        // no, use white instead of pink/yellow
-                        b = g = r = 0xff;
-                    }
-                }
-            } else { // check for white/black
-                if (gr >= 100) {
-                    b = g = r = 0xff;
-                } else {
-                    // black
-                    b = g = r = 0;
-                }
-            }
-            break;
-        case OPTION_BWY:
-            // match the color to closest of black/white/yellow
-            if (r > b && g > b) { // yellow is dominant?
-                if (gr < 100 && r < 80) {
-                    r = g = b = 0;
-                } else {
-                    if (r - b > 32 && g - b > 32) {
-                        // is yellow really dominant?
-                        r = g = 0xff; b = 0;
-                    } else { // yellowish should be white
-                        // no, use white instead of pink/yellow
-                        r = g = b = 0xff;
-                    }
-                }
-            } else { // check for white/black
-                if (gr >= 100) {
-                    r = g = b = 0xff; // white
-                } else {
-                    r = g = b = 0;
-                }
-            }
-            break;
-        case OPTION_BWYR:
-            // match the color to closest of black/white/yellow/red
-            if (r > b || g > b) { // red or yellow is dominant
-                if (gr < 90 || (r < 80 && g < 80)) {
-                    r = g = b = 0; // black
-                } else {
-                    if (r-b > 32 && r-g > 70) {
-                        // is red really dominant?
-                        r = 0xff; g = b = 0; // red
-                    } else if (r-b > 32 && g-b > 32) {
-                        // yellow
-                        r = g = 0xff; b = 0;
-                    } else {
-                        r = g = b = 0xff; // gray/white
-                    }
-                }
-            } else { // check for white/black
-                if (gr >= 100) {
-                    r = g = b = 0xff; // white
-                } else {
-                    r = g = b = 0; // black
-                }
-            }
-            break;
-    } // switch on output display format
-    *pR = r; *pG = g; *pB = b; // store
-} /* MatchBestColor() */
+    FILE *ohandle = pOut->ohandle;
+    char szGuard[256];
+    int i;
+
+    if (pOut->iMode == OUTPUT_C) return;
+    for (i=0; szLeaf[i] && i < (int)sizeof(szGuard)-3; i++)
+        szGuard[i] = (char)toupper((unsigned char)szLeaf[i]);
+    strcpy(&szGuard[i], "_H");
+    fprintf(ohandle, "#ifndef __%s__\n#define __%s__\n#include <stdint.h>\n", szGuard, szGuard);
+    fprintf(ohandle, "#define %s_WIDTH %d\n", szLeaf, pPlanes->iWidth);
+    fprintf(ohandle, "#define %s_HEIGHT %d\n", szLeaf, pPlanes->iHeight);
+    fprintf(ohandle, "#define %s_PITCH %d\n", szLeaf, pPlanes->iPitch);
+    fprintf(ohandle, "#define %s_PLANE_SIZE %d\n", szLeaf, pPlanes->iPlaneSize);
+    fprintf(ohandle, "#define %s_PLANES %d\n", szLeaf, pPlanes->iPlaneCount);
+    fprintf(ohandle, "#define %s_FORMAT %d // %s (0=BW, 1=BWR, 2=BWY, 3=BWYR, 4=4GRAY)\n", szLeaf, iOption, szOptions[iOption]);
+    fprintf(ohandle, "#define %s_COMPRESSED %d\n", szLeaf, bCompressed);
+    if (pPlanes->bVertical) {
+        fprintf(ohandle, "#define %s_VERTICAL 1 // _PITCH bytes per page\n", szLeaf);
+    }
+    pOut->bGuard = 1;
+} /* WriteHeaderInfo() */
 //
-// Dither the image to the destination color scheme
+// Finish and close the output file(s)
 //
-uint8_t * DitherBMP(uint8_t *pPixels, int iWidth, int iHeight, int *pBpp, int iOutFormat)
+void CloseOutput(EPD_OUTPUT *pOut)
 {
-    int x, y, xmask, iDestPitch;
-    int32_t cNew, lFErr, lFErrR, lFErrG, lFErrB, v=0, h;
-    int32_t e1,e2,e3,e4;
-    uint8_t cOut;
-    uint8_t *pDest, *errors, *pErrors=NULL, *d; // destination 8bpp image
-    uint8_t pixelmask=0, shift=0;
-    uint8_t ucTemp[1024];
-    int iSrcPitch, iBpp = *pBpp;
-    int32_t iErrors[1024*3];
-    errors = ucTemp; // plenty of space here for the bitmaps we'll generate
-    memset(ucTemp, 0, sizeof(ucTemp));
-    iDestPitch = (iWidth+7)/8;
-    iDestPitch = (iDestPitch+3) & 0xfffc; // our other code assumes this is a BMP image src
-    iSrcPitch = ((iWidth * iBpp)+7)/8;
-    iSrcPitch = (iSrcPitch + 3) & 0xfffc; // Windows BMP has dword aligned pitch
-    pixelmask = 0x80;
-    shift = 1;
-    xmask = 7;
-    if (iOutFormat == OPTION_BW) { // Black/white version
-        pDest = (uint8_t *)malloc(iDestPitch * iHeight);
-        for (y=0; y<iHeight; y++)
-        {
-            d = &pDest[y * iDestPitch];
-            pErrors = &errors[1]; // point to second pixel to avoid boundary check
-            lFErr = 0;
-            cOut = 0;
-            for (x=0; x<iWidth; x++)
-            {
-                cNew = GetGrayPixel8(x, y, pPixels, iSrcPitch, iBpp); // get grayscale uint8_t pixel
-                cNew = (cNew * 2)/3; // make white end of spectrum less "blown out"
-                // add forward error
-                cNew += lFErr;
-                if (cNew > 255) cNew = 255;     // clip to uint8_t
-                cOut >>= shift;                 // pack new pixels into a byte
-                cOut |= (cNew & 0x80);    // keep top N bits
-                if ((x & xmask) == xmask)       // store it when the byte is full
+    if (pOut->dhandle) {
+        if (pOut->iMode == OUTPUT_ASM)
+            fprintf(pOut->dhandle, "\n#if defined(__linux__) && defined(__ELF__)\n    .section .note.GNU-stack,\"\",%%progbits\n#endif\n");
+        fclose(pOut->dhandle);
+    }
+    if (pOut->bhandle) fclose(pOut->bhandle);
+    if (pOut->ohandle) {
+        if (pOut->bGuard)
+            fprintf(pOut->ohandle, "#endif\n");
+        fflush(pOut->ohandle);
+        fclose(pOut->ohandle);
+    }
+    memset(pOut, 0, sizeof(EPD_OUTPUT));
+} /* CloseOutput() */
+//
+// Create 1 memory plane hex output
+//
+void MakeC_BW(EPD_PLANES *pPlanes, EPD_OUTPUT *pOut, char *szLeaf)
+{
+    FILE *ohandle = pOut->ohandle;
+    char szName[300];
+
+    // show pitch
+    fprintf(ohandle, "// Image size: width %d, height %d\n", pPlanes->iWidth, pPlanes->iHeight);
+    fprintf(ohandle, "// %d bytes per line\n", pPlanes->iPitch);
+    fprintf(ohandle, "// %d bytes per plane\n", pPlanes->iPlaneSize);
+    if (pPlanes->bLSBFirst)
+        fprintf(ohandle, "// LSB on the left\n");
+    else
+        fprintf(ohandle, "// MSB on the left\n");
+    sprintf(szName, "%s_0", szLeaf); // data array (plane 0)
+    WritePlaneData(pOut, szName, pPlanes->pPlane[0], pPlanes->iPlaneSize);
+} /* MakeC_BW() */
+//
+// Read one pixel of a 1-bpp row in the current bit order
+//
+int GetBit(uint8_t *pRow, int x)
+{
+    if (bMSBFirst)
+        return (pRow[x >> 3] >> (7 - (x & 7))) & 1;
+    return (pRow[x >> 3] >> (x & 7)) & 1;
+} /* GetBit() */
+//
+// Draw a shifted copy with EPD_SpriteBlit() into a frame buffer with
+// a border of 1 byte and make sure that every pixel matches
+// returns 1 for success, 0 for failure
+//
+int CheckShift(EPD_PLANES *pPlanes, uint8_t *pData, int iPitch, int iShift, uint8_t *pMasks)
+{
+    int x, y, iFBPitch, xOut, rc = 1;
+    uint8_t *pFB, ucGuard = 0x5c; // not the same in both bit orders
+
+    iFBPitch = iPitch + 2;
+    pFB = (uint8_t *)malloc(iFBPitch * pPlanes->iHeight);
+    memset(pFB, ucGuard, iFBPitch * pPlanes->iHeight); // pattern to check the edges
+    EPD_SpriteBlit(pFB, iFBPitch, 8 + iShift, 0, pData, iPitch, pPlanes->iHeight, pMasks);
+    for (y=0; y<pPlanes->iHeight && rc; y++) {
+        for (xOut=0; xOut<iFBPitch*8; xOut++) {
+            x = xOut - 8 - iShift; // source pixel
+            if (x >= 0 && x < pPlanes->iWidth) {
+                if (GetBit(&pFB[y * iFBPitch], xOut) != GetBit(&pPlanes->pPlane[0][y * pPlanes->iPitch], x))
+                    rc = 0;
+            } else if (GetBit(&pFB[y * iFBPitch], xOut) != GetBit(&ucGuard, xOut & 7)) {
+                rc = 0; // pixel outside of the sprite was changed
+            }
+        }
+    }
+    free(pFB);
+    return rc;
+} /* CheckShift() */
+//
+// Create copies of the BW plane shifted right by 0-7 pixels
+// with an extra byte per row, so that the device can draw it at
+// any x position without shifting (see EPD_SpriteBlit() in epd_decode.h)
+// iShifts has bit N set for each shift N to output
+// bits outside of the image are 0 as in the unshifted plane
+// returns 1 for success, 0 if a copy doesn't draw back to the original
+//
+int MakeC_SHIFTS(EPD_PLANES *pPlanes, EPD_OUTPUT *pOut, char *szLeaf, int iShifts)
+{
+    FILE *ohandle = pOut->ohandle;
+    int x, y, iShift, iPitch, iEnd, iSize, rc = 1;
+    uint8_t *pData, *s, *d, uc, ucPrev, ucMasks[24];
+    char szName[300];
+
+    iPitch = pPlanes->iPitch + 1;
+    iSize = iPitch * pPlanes->iHeight;
+    pData = (uint8_t *)malloc(iSize);
+    fprintf(ohandle, "// Image size: width %d, height %d\n", pPlanes->iWidth, pPlanes->iHeight);
+    fprintf(ohandle, "// pre-shifted copies for drawing at any x position\n");
+    fprintf(ohandle, "// %d bytes per line (1 extra for the shift)\n", iPitch);
+    fprintf(ohandle, "// %d bytes per copy\n", iSize);
+    fprintf(ohandle, "// %s on the left\n", (pPlanes->bLSBFirst) ? "LSB" : "MSB");
+    fprintf(ohandle, "#define %s_SHIFT_PITCH %d\n", szLeaf, iPitch);
+    // first byte mask, last byte mask and number of bytes touched for each shift
+    for (iShift=0; iShift<8; iShift++) {
+        iEnd = iShift + pPlanes->iWidth; // first pixel after the image
+        uc = (uint8_t)(0xff >> iShift);
+        ucPrev = (uint8_t)(0xff00 >> (((iEnd - 1) & 7) + 1));
+        if (!bMSBFirst) {
+            uc = ucMirror[uc];
+            ucPrev = ucMirror[ucPrev];
+        }
+        ucMasks[iShift*3] = uc;
+        ucMasks[iShift*3+1] = ucPrev;
+        ucMasks[iShift*3+2] = (uint8_t)(((iEnd - 1) >> 3) + 1);
+    }
+    sprintf(szName, "%s_masks", szLeaf);
+    WriteArray(pOut, szName, ucMasks, 1, sizeof(ucMasks));
+    for (iShift=0; iShift<8; iShift++) {
+        if (!(iShifts & (1 << iShift))) continue;
+        s = pPlanes->pPlane[0];
+        d = pData;
+        for (y=0; y<pPlanes->iHeight; y++) {
+            ucPrev = 0;
+            for (x=0; x<iPitch; x++) {
+                uc = (x < pPlanes->iPitch) ? *s++ : 0;
+                if (!bMSBFirst) uc = ucMirror[uc]; // shift in MSB first order
+                *d = (uint8_t)((ucPrev << (8 - iShift)) | (uc >> iShift));
+                if (!bMSBFirst) *d = ucMirror[*d];
+                d++;
+                ucPrev = uc;
+            }
+        } // for y
+        if (!CheckShift(pPlanes, pData, iPitch, iShift, ucMasks)) {
+            printf("Shift %d verification failed\n", iShift);
+            rc = 0;
+            break;
+        }
+        fprintf(ohandle, "// Shifted right by %d pixels\n", iShift);
+        sprintf(szName, "%s_shift%d", szLeaf, iShift);
+        WriteArray(pOut, szName, pData, 1, iSize);
+    } // for each shift
+    free(pData);
+    return rc;
+} /* MakeC_SHIFTS() */
+//
+// Convert 2-bit grayscale (4GRAY) into hex 2-plane output
+//
+void MakeC_4GRAY(EPD_PLANES *pPlanes, EPD_OUTPUT *pOut, char *szLeaf)
+{
+    FILE *ohandle = pOut->ohandle;
+    int iPlane;
+    char szName[300];
+
+    // show pitch
+    fprintf(ohandle, "// Image size: width %d, height %d\n", pPlanes->iWidth, pPlanes->iHeight);
+    fprintf(ohandle, "// %d bytes per line\n", pPlanes->iPitch);
+    fprintf(ohandle, "// %d bytes per plane\n", pPlanes->iPlaneSize);
+    for (iPlane=0; iPlane<2; iPlane++) {
+        fprintf(ohandle, "// Plane %d data\n", iPlane);
+        sprintf(szName, "%s_%d", szLeaf, 1-iPlane); // MSB is plane 0 in the UC8151, so reverse the plane number
+        WritePlaneData(pOut, szName, pPlanes->pPlane[1-iPlane], pPlanes->iPlaneSize);
+    } // for each plane
+} /* MakeC_4GRAY() */
+//
+// Convert to Black/White/Yellow/Red packed 1-plane output
+//
+void MakeC_4CLR(EPD_PLANES *pPlanes, EPD_OUTPUT *pOut, char *szLeaf)
+{
+    FILE *ohandle = pOut->ohandle;
+
+    // show pitch
+    fprintf(ohandle, "// Image size: width %d, height %d\n", pPlanes->iWidth, pPlanes->iHeight);
+    fprintf(ohandle, "// %d bytes per line\n", pPlanes->iPitch);
+    fprintf(ohandle, "// %d bytes total\n", pPlanes->iPlaneSize);
+    WritePlaneData(pOut, szLeaf, pPlanes->pPlane[0], pPlanes->iPlaneSize);
+} /* MakeC_4CLR() */
+//
+// Convert BWR/BWY into 2-plane output
+//
+void MakeC_3CLR(EPD_PLANES *pPlanes, EPD_OUTPUT *pOut, char *szLeaf)
+{
+    FILE *ohandle = pOut->ohandle;
+    int iPlane;
+    char szName[300];
+
+    // show pitch
+    fprintf(ohandle, "// Image size: width %d, height %d\n", pPlanes->iWidth, pPlanes->iHeight);
+    fprintf(ohandle, "// %d bytes per line\n", pPlanes->iPitch);
+    fprintf(ohandle, "// %d bytes per plane\n", pPlanes->iPlaneSize);
+    for (iPlane=0; iPlane<2; iPlane++) {
+        fprintf(ohandle, "// Plane %d data\n", iPlane);
+        sprintf(szName, "%s_%d", szLeaf, iPlane);
+        WritePlaneData(pOut, szName, pPlanes->pPlane[iPlane], pPlanes->iPlaneSize);
+    } // for each plane
+} /* MakeC_3CLR() */
+//
+// Write both planes as one array with the lines of plane 0 and
+// plane 1 alternating (for controllers which take a line of each)
+//
+void MakeC_INTERLEAVED(EPD_PLANES *pPlanes, EPD_OUTPUT *pOut, char *szLeaf)
+{
+    FILE *ohandle = pOut->ohandle;
+    uint8_t *pData, *d;
+    int y, iPlane;
+    char szName[300];
+
+    pData = (uint8_t *)malloc(pPlanes->iPlaneSize * 2);
+    d = pData;
+    for (y=0; y<pPlanes->iHeight; y++) {
+        for (iPlane=0; iPlane<2; iPlane++) {
+            memcpy(d, &pPlanes->pPlane[iPlane][y * pPlanes->iPitch], pPlanes->iPitch);
+            d += pPlanes->iPitch;
+        }
+    }
+    fprintf(ohandle, "// Image size: width %d, height %d\n", pPlanes->iWidth, pPlanes->iHeight);
+    fprintf(ohandle, "// %d bytes per line\n", pPlanes->iPitch);
+    fprintf(ohandle, "// %d bytes per plane\n", pPlanes->iPlaneSize);
+    fprintf(ohandle, "// Plane 0 and plane 1 lines interleaved (%d bytes per pair)\n", pPlanes->iPitch * 2);
+    sprintf(szName, "%s_interleaved", szLeaf);
+    WritePlaneData(pOut, szName, pData, pPlanes->iPlaneSize * 2);
+    free(pData);
+} /* MakeC_INTERLEAVED() */
+//
+// Return the byte value of an all-background (white/empty) row
+// of the given plane in the packed output format
+//
+uint8_t PlaneBackground(int iOption, int iPlane)
+{
+    if (iOption == OPTION_BWYR) return 0x55; // 01 = white
+    if ((iOption == OPTION_BWR || iOption == OPTION_BWY) && iPlane == 1) return 0x00; // no red/yellow
+    return 0xff; // white
+} /* PlaneBackground() */
+//
+// Find the bounding box (in bytes/rows) of the non-background
+// pixels of a packed plane. Works on whole bytes; the unused bits of
+// the last byte of each row are ignored
+// returns 0 if the plane is empty, 1 otherwise
+//
+int FindPlaneBounds(EPD_PLANES *pPlanes, int iPlane, int iOption, int *pX, int *pY, int *pCX, int *pCY)
+{
+    int x, y, iLeft, iRight, iTop, iBottom, iBits;
+    uint8_t ucBG, ucMask, *s;
+
+    ucBG = PlaneBackground(iOption, iPlane);
+    // mask of the pixels used in the last byte of each row
+    iBits = (iOption == OPTION_BWYR) ? (pPlanes->iWidth & 3) * 2 : (pPlanes->iWidth & 7);
+    ucMask = (iBits == 0) ? 0xff : (uint8_t)(0xff << (8 - iBits));
+    if (iOption == OPTION_BW && !bMSBFirst) ucMask = ucMirror[ucMask];
+    iLeft = pPlanes->iPitch; iRight = -1;
+    iTop = pPlanes->iHeight; iBottom = -1;
+    for (y=0; y<pPlanes->iHeight; y++) {
+        s = &pPlanes->pPlane[iPlane][y * pPlanes->iPitch];
+        for (x=0; x<pPlanes->iPitch-1; x++) { // left edge
+            if (s[x] != ucBG) break;
+        }
+        if (x == pPlanes->iPitch-1 && ((s[x] ^ ucBG) & ucMask) == 0)
+            continue; // empty row
+        if (x < iLeft) iLeft = x;
+        if (y < iTop) iTop = y;
+        iBottom = y;
+        x = pPlanes->iPitch-1; // right edge
+        if (((s[x] ^ ucBG) & ucMask) == 0) {
+            for (x--; x > iRight && s[x] == ucBG; x--) {};
+        }
+        if (x > iRight) iRight = x;
+    } // for y
+    if (iBottom < 0) { // nothing there
+        *pX = *pY = *pCX = *pCY = 0;
+        return 0;
+    }
+    *pX = iLeft; *pY = iTop;
+    *pCX = iRight - iLeft + 1;
+    *pCY = iBottom - iTop + 1;
+    return 1;
+} /* FindPlaneBounds() */
+//
+// Create output trimmed to the bounding box of each plane
+// along with its placement within the original image
+//
+void MakeC_TRIM(EPD_PLANES *pPlanes, EPD_OUTPUT *pOut, char *szLeaf, int iOption)
+{
+    FILE *ohandle = pOut->ohandle;
+    int iPlane, x, y, cx, cy, iPixels, iTotal = 0;
+    uint8_t *pData;
+    char szName[300], szDef[300];
+
+    iPixels = (iOption == OPTION_BWYR) ? 4 : 8; // pixels per byte
+    fprintf(ohandle, "// Image size: width %d, height %d\n", pPlanes->iWidth, pPlanes->iHeight);
+    fprintf(ohandle, "// %d bytes per plane (untrimmed)\n", pPlanes->iPlaneSize);
+    if (iOption == OPTION_BW)
+        fprintf(ohandle, "// %s on the left\n", (pPlanes->bLSBFirst) ? "LSB" : "MSB");
+    fprintf(ohandle, "// Each plane is trimmed to the bounding box of its non-background pixels\n");
+    fprintf(ohandle, "// draw it at (<plane>_X, <plane>_Y) relative to the original image\n");
+    fprintf(ohandle, "#define %s_FULL_WIDTH %d\n", szLeaf, pPlanes->iWidth);
+    fprintf(ohandle, "#define %s_FULL_HEIGHT %d\n", szLeaf, pPlanes->iHeight);
+    for (iPlane=0; iPlane<pPlanes->iPlaneCount; iPlane++) {
+        if (iOption == OPTION_BWYR)
+            sprintf(szName, "%s", szLeaf);
+        else
+            sprintf(szName, "%s_%d", szLeaf, iPlane);
+        sprintf(szDef, "%s_%d", szLeaf, iPlane); // constants always have the plane number
+        if (!FindPlaneBounds(pPlanes, iPlane, iOption, &x, &y, &cx, &cy)) {
+            fprintf(ohandle, "// Plane %d is empty\n", iPlane);
+            fprintf(ohandle, "#define %s_X 0\n#define %s_Y 0\n#define %s_WIDTH 0\n#define %s_HEIGHT 0\n#define %s_PITCH 0\n", szDef, szDef, szDef, szDef, szDef);
+            pData = (uint8_t *)malloc(1);
+            pData[0] = PlaneBackground(iOption, iPlane); // C doesn't allow empty arrays
+            WriteArray(pOut, szName, pData, 1, 1);
+            free(pData);
+            continue;
+        }
+        pData = (uint8_t *)malloc(cx * cy);
+        for (int i=0; i<cy; i++)
+            memcpy(&pData[i * cx], &pPlanes->pPlane[iPlane][((y + i) * pPlanes->iPitch) + x], cx);
+        fprintf(ohandle, "// Plane %d trimmed to %d bytes\n", iPlane, cx * cy);
+        fprintf(ohandle, "#define %s_X %d\n", szDef, x * iPixels);
+        fprintf(ohandle, "#define %s_Y %d\n", szDef, y);
+        fprintf(ohandle, "#define %s_WIDTH %d\n", szDef, ((x + cx) * iPixels > pPlanes->iWidth) ? pPlanes->iWidth - (x * iPixels) : cx * iPixels);
+        fprintf(ohandle, "#define %s_HEIGHT %d\n", szDef, cy);
+        fprintf(ohandle, "#define %s_PITCH %d\n", szDef, cx);
+        WriteArray(pOut, szName, pData, 1, cx * cy);
+        iTotal += cx * cy;
+        free(pData);
+    } // for each plane
+    printf("Trimmed %d bytes to %d bytes\n", pPlanes->iPlaneSize * pPlanes->iPlaneCount, iTotal);
+} /* MakeC_TRIM() */
+//
+// Compress a memory plane with the run-length codec understood by
+// EPD_RLEDecode() (see epd_decode.h). Runs of 0x00 and 0xFF
+// (empty/white areas) get a 2-byte code which covers up to 8K bytes
+// pDest must hold at least iLen + (iLen/128) + 1 bytes
+// returns the compressed size
+//
+int CompressPlane(uint8_t *pSrc, int iLen, uint8_t *pDest)
+{
+    int i, iRun, iLiteral, iMax;
+    uint8_t uc, *d = pDest, *pLiteral = pSrc;
+
+    i = iLiteral = 0;
+    while (i < iLen) {
+        uc = pSrc[i];
+        iMax = (uc == 0x00 || uc == 0xff) ? EPD_RLE_MAX_LONG : EPD_RLE_MAX_SHORT;
+        iRun = 1;
+        while (i+iRun < iLen && iRun < iMax && pSrc[i+iRun] == uc)
+            iRun++;
+        if (iRun >= 3 || (iRun == 2 && iLiteral == 0)) { // worth encoding as a run
+            if (iLiteral) { // flush pending literals
+                *d++ = (uint8_t)(iLiteral-1);
+                memcpy(d, pLiteral, iLiteral);
+                d += iLiteral;
+                iLiteral = 0;
+            }
+            if (uc == 0x00 || uc == 0xff) {
+                *d++ = (uint8_t)(EPD_RLE_ZERO | ((uc & 1) ? EPD_RLE_ONES : 0) | ((iRun-1) >> 8));
+                *d++ = (uint8_t)(iRun-1);
+            } else {
+                *d++ = (uint8_t)(EPD_RLE_REPEAT | (iRun-2));
+                *d++ = uc;
+            }
+            i += iRun;
+        } else { // add it to the literal run
+            if (iLiteral == 0) pLiteral = &pSrc[i];
+            iLiteral++;
+            i++;
+            if (iLiteral == EPD_RLE_MAX_LITERAL) {
+                *d++ = (uint8_t)(iLiteral-1);
+                memcpy(d, pLiteral, iLiteral);
+                d += iLiteral;
+                iLiteral = 0;
+            }
+        }
+    } // while
+    if (iLiteral) {
+        *d++ = (uint8_t)(iLiteral-1);
+        memcpy(d, pLiteral, iLiteral);
+        d += iLiteral;
+    }
+    return (int)(d - pDest);
+} /* CompressPlane() */
+//
+// Streaming decoder callback used to verify the compressed output
+// pUser points to the current write position in a RAM buffer
+//
+void RLEStreamCheck(const uint8_t *pData, int iLen, void *pUser)
+{
+    uint8_t **pp = (uint8_t **)pUser;
+    memcpy(*pp, pData, iLen);
+    *pp += iLen;
+} /* RLEStreamCheck() */
+//
+// Compress a plane as independent bands of iBandRows rows
+// pIndex receives the starting offset of each band plus the total size
+// returns the compressed size
+//
+int CompressBands(uint8_t *pSrc, int iPitch, int iHeight, int iBandRows, uint8_t *pDest, uint32_t *pIndex)
+{
+    int iBand, iRows, iOut = 0;
+
+    for (iBand = 0; iBand * iBandRows < iHeight; iBand++) {
+        iRows = iHeight - (iBand * iBandRows);
+        if (iRows > iBandRows) iRows = iBandRows;
+        pIndex[iBand] = iOut;
+        iOut += CompressPlane(&pSrc[iBand * iBandRows * iPitch], iRows * iPitch, &pDest[iOut]);
+    }
+    pIndex[iBand] = iOut;
+    return iOut;
+} /* CompressBands() */
+//
+// Decode a few windows of a banded plane with the device code
+// and compare them to the original
+// returns 1 for success, 0 for failure
+//
+int CheckBands(EPD_PLANES *pPlanes, uint8_t *pData, uint32_t *pIndex, int iBandRows, uint8_t *pCheck)
+{
+    int i, x, y, cx, cy, iWin;
+    uint16_t *pIndex16;
+    uint8_t *d;
+
+    pIndex16 = (uint16_t *)malloc(((pPlanes->iHeight + iBandRows - 1)/iBandRows + 1) * sizeof(uint16_t));
+    for (i=0; i<=(pPlanes->iHeight + iBandRows - 1)/iBandRows; i++)
+        pIndex16[i] = (uint16_t)pIndex[i];
+    for (iWin=0; iWin<4; iWin++) {
+        switch (iWin) {
+            case 0: // whole image
+                x = y = 0; cx = pPlanes->iPitch; cy = pPlanes->iHeight;
+                break;
+            case 1: // center
+                x = pPlanes->iPitch/4; y = pPlanes->iHeight/3;
+                cx = (pPlanes->iPitch+1)/2; cy = (pPlanes->iHeight+1)/2;
+                break;
+            case 2: // single row/byte in the bottom right corner
+                x = pPlanes->iPitch-1; y = pPlanes->iHeight-1; cx = cy = 1;
+                break;
+            default: // odd sized window straddling bands
+                x = 1 % pPlanes->iPitch; y = iBandRows/2;
+                cx = pPlanes->iPitch - x; cy = pPlanes->iHeight - y;
+                break;
+        }
+        d = pCheck;
+        if (pIndex[(pPlanes->iHeight + iBandRows - 1)/iBandRows] < 0x10000)
+            EPD_RLEDecodeWindow(pData, pIndex16, 0, pPlanes->iPitch, iBandRows, x, y, cx, cy, RLEStreamCheck, &d);
+        else
+            EPD_RLEDecodeWindow(pData, pIndex, 1, pPlanes->iPitch, iBandRows, x, y, cx, cy, RLEStreamCheck, &d);
+        if (d != pCheck + (cx * cy)) {
+            free(pIndex16);
+            return 0;
+        }
+        for (i=0; i<cy; i++) {
+            if (memcmp(&pCheck[i * cx], &pPlanes->pPlane[0][((y + i) * pPlanes->iPitch) + x], cx) != 0) {
+                free(pIndex16);
+                return 0;
+            }
+        }
+    } // for each window
+    free(pIndex16);
+    return 1;
+} /* CheckBands() */
+//
+// Create run-length compressed plane output
+// Each plane keeps the same array name as the uncompressed version
+// When iBandRows is non-zero, each band of rows is compressed on its own
+// and an offset table (<name>_index) allows decoding any window
+// returns 1 for success, 0 if a plane doesn't decode back to the original
+//
+int MakeC_RLE(EPD_PLANES *pPlanes, EPD_OUTPUT *pOut, char *szLeaf, int iOption, int iBandRows)
+{
+    FILE *ohandle = pOut->ohandle;
+    int i, iPlane, iOutSize, iTotalIn = 0, iTotalOut = 0, iBands = 0, rc = 1;
+    uint8_t *pOutBuf, *pCheck;
+    uint32_t *pIndex = NULL;
+    uint16_t *pIndex16 = NULL;
+    char szName[300], szIndexName[310];
+
+    if (iBandRows > 0) {
+        iBands = (pPlanes->iHeight + iBandRows - 1) / iBandRows;
+        pIndex = (uint32_t *)malloc((iBands + 1) * sizeof(uint32_t));
+        pIndex16 = (uint16_t *)malloc((iBands + 1) * sizeof(uint16_t));
+    }
+    // each band can add 1 control byte per 128 literals plus a partial one
+    pOutBuf = (uint8_t *)malloc(pPlanes->iPlaneSize + (pPlanes->iPlaneSize/EPD_RLE_MAX_LITERAL) + iBands + 1);
+    pCheck = (uint8_t *)malloc(pPlanes->iPlaneSize);
+    fprintf(ohandle, "// Image size: width %d, height %d\n", pPlanes->iWidth, pPlanes->iHeight);
+    fprintf(ohandle, "// %d bytes per line\n", pPlanes->iPitch);
+    fprintf(ohandle, "// %d bytes per plane (uncompressed)\n", pPlanes->iPlaneSize);
+    if (iOption == OPTION_BW)
+        fprintf(ohandle, "// %s on the left\n", (pPlanes->bLSBFirst) ? "LSB" : "MSB");
+    fprintf(ohandle, "// RLE compressed, decompress with EPD_RLEDecode() or EPD_RLEStream() from epd_decode.h\n");
+    if (iBandRows > 0) {
+        fprintf(ohandle, "// Compressed in bands of %d rows; draw part of the image with\n", iBandRows);
+        fprintf(ohandle, "// EPD_RLEDecodeWindow(<name>, <name>_index, sizeof(<name>_index[0]) == 4, %d, %d, x, y, cx, cy, callback, user)\n", pPlanes->iPitch, iBandRows);
+    }
+    for (iPlane=0; iPlane<pPlanes->iPlaneCount; iPlane++) {
+        if (iOption == OPTION_BWYR)
+            sprintf(szName, "%s", szLeaf);
+        else
+            sprintf(szName, "%s_%d", szLeaf, iPlane);
+        if (iBandRows > 0)
+            iOutSize = CompressBands(pPlanes->pPlane[iPlane], pPlanes->iPitch, pPlanes->iHeight, iBandRows, pOutBuf, pIndex);
+        else
+            iOutSize = CompressPlane(pPlanes->pPlane[iPlane], pPlanes->iPlaneSize, pOutBuf);
+        // make sure it survives the trip through the device code
+        // (the bands are complete codes, so the whole plane still decodes in one pass)
+        // see --KERNELBENCH for how fast it unpacks
+        memset(pCheck, 0, pPlanes->iPlaneSize);
+        if (EPD_RLEDecode(pOutBuf, iOutSize, pCheck, pPlanes->iPlaneSize) != pPlanes->iPlaneSize ||
+            memcmp(pCheck, pPlanes->pPlane[iPlane], pPlanes->iPlaneSize) != 0) {
+            printf("RLE verification failed on plane %d\n", iPlane);
+            rc = 0;
+            break;
+        }
+        printf("Plane %d: %d -> %d bytes (%d.%d%%)\n", iPlane, pPlanes->iPlaneSize, iOutSize, (iOutSize * 100) / pPlanes->iPlaneSize, ((iOutSize * 1000) / pPlanes->iPlaneSize) % 10);
+        iTotalIn += pPlanes->iPlaneSize;
+        iTotalOut += iOutSize;
+        if (iBandRows > 0) {
+            EPD_PLANES single = *pPlanes;
+            single.pPlane[0] = pPlanes->pPlane[iPlane];
+            if (!CheckBands(&single, pOutBuf, pIndex, iBandRows, pCheck)) {
+                printf("RLE window verification failed on plane %d\n", iPlane);
+                rc = 0;
+                break;
+            }
+            fprintf(ohandle, "// Plane %d band offsets\n", iPlane);
+            sprintf(szIndexName, "%s_index", szName);
+            if (iOutSize < 0x10000) {
+                for (i=0; i<=iBands; i++)
+                    pIndex16[i] = (uint16_t)pIndex[i];
+                WriteArray(pOut, szIndexName, pIndex16, 2, iBands+1);
+            } else {
+                WriteArray(pOut, szIndexName, pIndex, 4, iBands+1);
+            }
+            iTotalOut += (iBands + 1) * ((iOutSize < 0x10000) ? 2 : 4);
+        }
+        fprintf(ohandle, "// Plane %d data, %d bytes compressed\n", iPlane, iOutSize);
+        WriteArray(pOut, szName, pOutBuf, 1, iOutSize);
+    } // for each plane
+    if (rc)
+        printf("Total: %d -> %d bytes\n", iTotalIn, iTotalOut);
+    free(pIndex);
+    free(pCheck);
+    free(pIndex16);
+    free(pOutBuf);
+    return rc;
+} /* MakeC_RLE() */
+//
+// Encode a plane as spans of non-background bytes (see epd_decode.h)
+// Spans on the same row separated by a gap no larger than a span header
+// are merged since that costs no more flash
+// pDest must hold at least iPlaneSize + (iPlaneSize/2)*EPD_SPAN_HEADER bytes
+// returns the encoded size and the span count in *pSpans
+//
+int SparsePlane(EPD_PLANES *pPlanes, int iPlane, uint8_t ucBG, uint8_t *pDest, int *pSpans)
+{
+    int x, y, iStart, iEnd, iNext, iSpans = 0;
+    uint8_t *s, *d = pDest;
+
+    for (y=0; y<pPlanes->iHeight; y++) {
+        s = &pPlanes->pPlane[iPlane][y * pPlanes->iPitch];
+        x = 0;
+        while (x < pPlanes->iPitch) {
+            while (x < pPlanes->iPitch && s[x] == ucBG) x++;
+            if (x == pPlanes->iPitch) break;
+            iStart = x;
+            iEnd = x + 1; // end of the span (exclusive)
+            for (iNext = iEnd; iNext < pPlanes->iPitch && iNext - iEnd <= EPD_SPAN_HEADER && iNext - iStart < 255; iNext++) {
+                if (s[iNext] != ucBG) iEnd = iNext + 1;
+            }
+            *d++ = (uint8_t)y; *d++ = (uint8_t)(y >> 8);
+            *d++ = (uint8_t)iStart; *d++ = (uint8_t)(iEnd - iStart);
+            memcpy(d, &s[iStart], iEnd - iStart);
+            d += iEnd - iStart;
+            iSpans++;
+            x = iEnd;
+        } // while
+    } // for y
+    *pSpans = iSpans;
+    return (int)(d - pDest);
+} /* SparsePlane() */
+//
+// Span callback used to check EPD_SparseSpans()
+//
+void SparseSpanCheck(int x, int y, const uint8_t *pData, int iLen, void *pUser)
+{
+    EPD_PLANES *pPlanes = (EPD_PLANES *)pUser;
+    memcpy(&pPlanes->pPlane[0][(y * pPlanes->iPitch) + x], pData, iLen);
+} /* SparseSpanCheck() */
+//
+// Make sure the device side code gets back the original plane
+// returns 1 for success, 0 for failure
+//
+int CheckSparse(EPD_PLANES *pPlanes, uint8_t *pData, int iSize, int iSpans)
+{
+    EPD_PLANES check;
+    uint8_t *pCheck, *d;
+    int rc = 1;
+
+    pCheck = (uint8_t *)calloc(1, pPlanes->iPlaneSize);
+    if (EPD_SparseApply(pData, iSize, pCheck, pPlanes->iPitch) != iSpans ||
+        memcmp(pCheck, pPlanes->pPlane[1], pPlanes->iPlaneSize) != 0)
+        rc = 0;
+    memset(pCheck, 0, pPlanes->iPlaneSize);
+    check = *pPlanes;
+    check.pPlane[0] = pCheck;
+    if (EPD_SparseSpans(pData, iSize, SparseSpanCheck, &check) != iSpans ||
+        memcmp(pCheck, pPlanes->pPlane[1], pPlanes->iPlaneSize) != 0)
+        rc = 0;
+    memset(pCheck, 0xff, pPlanes->iPlaneSize);
+    d = pCheck;
+    EPD_SparseStream(pData, iSize, pPlanes->iPitch, pPlanes->iHeight, 0x00, RLEStreamCheck, &d);
+    if (d != pCheck + pPlanes->iPlaneSize || memcmp(pCheck, pPlanes->pPlane[1], pPlanes->iPlaneSize) != 0)
+        rc = 0;
+    free(pCheck);
+    return rc;
+} /* CheckSparse() */
+//
+// Create BWR/BWY output with plane 0 as-is and the mostly empty
+// red/yellow plane 1 stored as a list of spans
+// returns 1 for success, 0 if the spans don't rebuild the plane
+//
+int MakeC_SPARSE(EPD_PLANES *pPlanes, EPD_OUTPUT *pOut, char *szLeaf)
+{
+    FILE *ohandle = pOut->ohandle;
+    int iSize, iSpans;
+    uint8_t *pData;
+    char szName[300];
+
+    pData = (uint8_t *)malloc(pPlanes->iPlaneSize + ((pPlanes->iPlaneSize/2) + 1) * EPD_SPAN_HEADER);
+    iSize = SparsePlane(pPlanes, 1, 0x00, pData, &iSpans);
+    if (!CheckSparse(pPlanes, pData, iSize, iSpans)) {
+        printf("Sparse verification failed\n");
+        free(pData);
+        return 0;
+    }
+    fprintf(ohandle, "// Image size: width %d, height %d\n", pPlanes->iWidth, pPlanes->iHeight);
+    fprintf(ohandle, "// %d bytes per line\n", pPlanes->iPitch);
+    fprintf(ohandle, "// %d bytes per plane\n", pPlanes->iPlaneSize);
+    fprintf(ohandle, "// Plane 0 data\n");
+    sprintf(szName, "%s_0", szLeaf);
+    WriteArray(pOut, szName, pPlanes->pPlane[0], 1, pPlanes->iPlaneSize);
+    fprintf(ohandle, "// Plane 1 data, %d spans in %d bytes (%d bytes as a full plane)\n", iSpans, iSize, pPlanes->iPlaneSize);
+    fprintf(ohandle, "// apply it with EPD_SparseApply(), EPD_SparseSpans() or EPD_SparseStream() from epd_decode.h\n");
+    fprintf(ohandle, "#define %s_1_SPANS %d\n", szLeaf, iSpans);
+    sprintf(szName, "%s_1", szLeaf);
+    if (iSize == 0) { // C doesn't allow empty arrays; a partial span header is ignored
+        pData[0] = 0;
+        WriteArray(pOut, szName, pData, 1, 1);
+    } else {
+        WriteArray(pOut, szName, pData, 1, iSize);
+    }
+    printf("Plane 1: %d bytes -> %d spans in %d bytes\n", pPlanes->iPlaneSize, iSpans, iSize);
+    if (iSize > pPlanes->iPlaneSize) {
+        printf("Warning: the plane isn't sparse enough to benefit\n");
+    }
+    free(pData);
+    return 1;
+} /* MakeC_SPARSE() */
+//
+// Merge rectangle b into a (the smallest rectangle holding both)
+//
+void UnionRect(EPD_RECT *a, EPD_RECT *b)
+{
+    int iRight = (a->x + a->cx > b->x + b->cx) ? a->x + a->cx : b->x + b->cx;
+    int iBottom = (a->y + a->cy > b->y + b->cy) ? a->y + a->cy : b->y + b->cy;
+
+    if (b->x < a->x) a->x = b->x;
+    if (b->y < a->y) a->y = b->y;
+    a->cx = iRight - a->x;
+    a->cy = iBottom - a->y;
+} /* UnionRect() */
+//
+// Sort rectangles top to bottom, left to right
+//
+int CompareRects(const void *p1, const void *p2)
+{
+    const EPD_RECT *a = (const EPD_RECT *)p1, *b = (const EPD_RECT *)p2;
+    if (a->y != b->y) return a->y - b->y;
+    return a->x - b->x;
+} /* CompareRects() */
+//
+// Find the byte aligned rectangles which cover every byte that differs
+// between the old and new planes. Each rectangle costs iCost bytes (the
+// controller window setup) plus its data, so rectangles are merged when
+// the bytes sent for the unchanged area in between cost less than
+// setting up another window
+// returns the number of rectangles (*ppRects must be freed)
+//
+int FindDeltaRects(EPD_PLANES *pOld, EPD_PLANES *pNew, int iCost, EPD_RECT **ppRects)
+{
+    EPD_RECT *pRects, span, u;
+    int x, y, i, j, iPlane, iCount = 0, iMax = 64, iBest, iExtra, iBestExtra, bMerged;
+    int iPlanes = pNew->iPlaneCount;
+    uint8_t *pChanged;
+
+    pRects = (EPD_RECT *)malloc(iMax * sizeof(EPD_RECT));
+    pChanged = (uint8_t *)malloc(pNew->iPitch);
+    for (y=0; y<pNew->iHeight; y++) {
+        memset(pChanged, 0, pNew->iPitch);
+        for (iPlane=0; iPlane<iPlanes; iPlane++) {
+            uint8_t *s = &pOld->pPlane[iPlane][y * pNew->iPitch];
+            uint8_t *d = &pNew->pPlane[iPlane][y * pNew->iPitch];
+            for (x=0; x<pNew->iPitch; x++)
+                pChanged[x] |= s[x] ^ d[x];
+        }
+        x = 0;
+        while (x < pNew->iPitch) {
+            while (x < pNew->iPitch && !pChanged[x]) x++;
+            if (x == pNew->iPitch) break;
+            span.x = x; span.y = y; span.cy = 1;
+            // extend the span over gaps cheaper than a new window
+            for (i = x+1; i < pNew->iPitch && (i - x - 1) * iPlanes < iCost; i++) {
+                if (pChanged[i]) x = i;
+            }
+            span.cx = x + 1 - span.x;
+            x++;
+            // grow the cheapest rectangle reaching down to this line
+            iBest = -1; iBestExtra = 0;
+            for (i=0; i<iCount; i++) {
+                if (pRects[i].y + pRects[i].cy < y) continue;
+                u = pRects[i];
+                UnionRect(&u, &span);
+                iExtra = (u.cx * u.cy) - (pRects[i].cx * pRects[i].cy) - span.cx;
+                if (iExtra * iPlanes <= iCost && (iBest < 0 || iExtra < iBestExtra)) {
+                    iBest = i;
+                    iBestExtra = iExtra;
+                }
+            }
+            if (iBest >= 0) {
+                UnionRect(&pRects[iBest], &span);
+            } else {
+                if (iCount == iMax) {
+                    iMax *= 2;
+                    pRects = (EPD_RECT *)realloc(pRects, iMax * sizeof(EPD_RECT));
+                }
+                pRects[iCount++] = span;
+            }
+        } // while
+    } // for y
+    do { // merge any pairs which are cheaper (or overlap)
+        bMerged = 0;
+        for (i=0; i<iCount; i++) {
+            for (j=i+1; j<iCount; j++) {
+                u = pRects[i];
+                UnionRect(&u, &pRects[j]);
+                iExtra = (u.cx * u.cy) - (pRects[i].cx * pRects[i].cy) - (pRects[j].cx * pRects[j].cy);
+                if (iExtra * iPlanes <= iCost) {
+                    pRects[i] = u;
+                    pRects[j] = pRects[--iCount];
+                    bMerged = 1;
+                    j = i; // check the bigger rectangle against all of the others
+                }
+            }
+        }
+    } while (bMerged);
+    qsort(pRects, iCount, sizeof(EPD_RECT), CompareRects);
+    free(pChanged);
+    *ppRects = pRects;
+    return iCount;
+} /* FindDeltaRects() */
+//
+// Rectangle callback used to check EPD_DeltaRects()
+//
+void DeltaRectCheck(int x, int y, int cx, int cy, const uint8_t *pData, void *pUser)
+{
+    EPD_PLANES *pPlanes = (EPD_PLANES *)pUser;
+    int i;
+
+    for (i=0; i<cy; i++) {
+        if (memcmp(&pPlanes->pPlane[0][((y + i) * pPlanes->iPitch) + x], &pData[i * cx], cx) != 0)
+            pPlanes->iPlaneCount = 0; // flag the error
+    }
+} /* DeltaRectCheck() */
+//
+// Create partial update output: the rectangles which changed between
+// the old and new image and the new data of each plane within them
+// returns 1 for success, 0 if the device code doesn't rebuild the new image
+//
+int MakeC_DELTA(EPD_PLANES *pOld, EPD_PLANES *pNew, EPD_OUTPUT *pOut, char *szLeaf, int iOption, int iCost)
+{
+    FILE *ohandle = pOut->ohandle;
+    EPD_RECT *pRects;
+    EPD_PLANES check;
+    uint16_t *pTable;
+    uint8_t *pData, *d;
+    int i, y, iPass, iPlane, iCount, iSize = 0, iChanged = 0, rc = 1;
+    char szName[300];
+
+    iCount = FindDeltaRects(pOld, pNew, iCost, &pRects);
+    for (i=0; i<iCount; i++) {
+        iSize += pRects[i].cx * pRects[i].cy;
+    }
+    for (i=0; i<pNew->iPlaneSize; i++) {
+        for (iPlane=0; iPlane<pNew->iPlaneCount; iPlane++) {
+            if (pOld->pPlane[iPlane][i] != pNew->pPlane[iPlane][i]) {
+                iChanged++;
+                break;
+            }
+        }
+    }
+    pTable = (uint16_t *)malloc((iCount * 4 + 1) * sizeof(uint16_t));
+    pTable[0] = 0; // C doesn't allow empty arrays
+    for (i=0; i<iCount; i++) {
+        pTable[i*4] = (uint16_t)pRects[i].x; pTable[i*4+1] = (uint16_t)pRects[i].y;
+        pTable[i*4+2] = (uint16_t)pRects[i].cx; pTable[i*4+3] = (uint16_t)pRects[i].cy;
+    }
+    pData = (uint8_t *)malloc(iSize + 1);
+    check = *pOld;
+    // the first pass checks every plane, the second one writes them
+    for (iPass=0; iPass<2 && rc; iPass++) {
+        if (iPass == 1) {
+            fprintf(ohandle, "// Image size: width %d, height %d\n", pNew->iWidth, pNew->iHeight);
+            fprintf(ohandle, "// %d bytes per line\n", pNew->iPitch);
+            fprintf(ohandle, "// Partial update: %d of %d bytes per plane changed\n", iChanged, pNew->iPlaneSize);
+            fprintf(ohandle, "// %d rectangles with %d bytes per plane (window cost %d bytes)\n", iCount, iSize, iCost);
+            fprintf(ohandle, "// x, y, width, height of each (x and width in bytes)\n");
+            fprintf(ohandle, "// use EPD_DeltaRects() or EPD_DeltaApply() from epd_decode.h\n");
+            fprintf(ohandle, "#define %s_RECTS %d\n", szLeaf, iCount);
+            sprintf(szName, "%s_rects", szLeaf);
+            WriteArray(pOut, szName, pTable, 2, (iCount) ? iCount * 4 : 1);
+        }
+        for (iPlane=0; iPlane<pNew->iPlaneCount; iPlane++) {
+            d = pData;
+            for (i=0; i<iCount; i++) {
+                for (y=0; y<pRects[i].cy; y++) {
+                    memcpy(d, &pNew->pPlane[iPlane][((pRects[i].y + y) * pNew->iPitch) + pRects[i].x], pRects[i].cx);
+                    d += pRects[i].cx;
+                }
+            }
+            if (iPass == 0) {
+                // make sure that the device code turns the old image into the new one
+                check.pPlane[0] = (uint8_t *)malloc(pNew->iPlaneSize);
+                memcpy(check.pPlane[0], pOld->pPlane[iPlane], pNew->iPlaneSize);
+                EPD_DeltaApply(pTable, iCount, pData, check.pPlane[0], pNew->iPitch);
+                if (memcmp(check.pPlane[0], pNew->pPlane[iPlane], pNew->iPlaneSize) != 0) {
+                    printf("Plane %d delta verification failed\n", iPlane);
+                    rc = 0;
+                }
+                check.iPlaneCount = 1;
+                if (rc && (EPD_DeltaRects(pTable, iCount, pData, DeltaRectCheck, &check) != iSize || check.iPlaneCount == 0)) {
+                    printf("Plane %d delta rectangle check failed\n", iPlane);
+                    rc = 0;
+                }
+                free(check.pPlane[0]);
+                if (!rc)
+                    break;
+                continue;
+            }
+            if (iOption == OPTION_BWYR)
+                strcpy(szName, szLeaf);
+            else
+                sprintf(szName, "%s_%d", szLeaf, iPlane);
+            fprintf(ohandle, "// Plane %d data\n", iPlane);
+            if (iSize == 0) pData[0] = 0;
+            WriteArray(pOut, szName, pData, 1, (iSize) ? iSize : 1);
+        } // for each plane
+    } // for each pass
+    if (rc)
+        printf("%d of %d bytes per plane changed, %d rectangles, %d bytes per plane (%d%% of a full update)\n", iChanged, pNew->iPlaneSize, iCount, iSize, (iSize * 100) / pNew->iPlaneSize);
+    free(pData);
+    free(pTable);
+    free(pRects);
+    return rc;
+} /* MakeC_DELTA() */
+//
+// mirror image horizontally
+//
+void MirrorBMP(uint8_t *pPixels, int iWidth, int iHeight, int iBpp)
+{
+    int y;
+    uint8_t c1,c2,c3, *s, *d;
+    uint32_t lTemp, *ld, *ls;
+    int x, iPitch;
+
+       iPitch = ((iWidth * iBpp) + 7)/8;
+       iPitch = (iPitch + 3) & 0xfffc;
+       switch (iBpp)
+          {
+          case 1:
+                  if ((iWidth & 7) == 0) { // multiple of 8 wide
+                      for (y=0; y<iHeight; y++)
+                      {
+                          s = &pPixels[y * iPitch];
+                          d = s + (iWidth>>3) - 1;
+                          x = iWidth >> 4;
+                          while (x)
+                          {
+                              c1 = ucMirror[*s];
+                              c2 = ucMirror[*d];
+                              *s++ = c2;
+                              *d-- = c1;
+                              x--;
+                          }
+                      }
+                  } else {
+                      // DEBUG
+                  }
+             break;
+          case 4:
+             for (y=0; y<iHeight; y++)
                 {
-                    *d++ = cOut;
-                    cOut = 0;
+                s = &pPixels[y * iPitch];
+                d = s + (iWidth>>1) - 1;
+                x = iWidth >> 2;
+                while (x)
+                   {
+                   c1 = *s;
+                   c2 = *d;
+                   c1 = (c1 << 4) | (c1 >> 4);
+                   c2 = (c2 << 4) | (c2 >> 4);
+                   *s++ = c2;
+                   *d-- = c1;
+                   x--;
+                   }
+                }
+             break;
+          case 8:
+             for (y=0; y<iHeight; y++)
+                {
+                s = &pPixels[y * iPitch];
+                d = s + iWidth - 1;
+                    x = iWidth >> 1;
+                    while (x)
+                       {
+                       c1 = *s;
+                       *s++ = *d;
+                       *d-- = c1;
+                       x--;
+                       }
+                    }
+                 break;
+              case 24:
+                  for (y=0; y<iHeight; y++)
+                    {
+                    s = &pPixels[y * iPitch];
+                    d = s + (iWidth - 1)*3;
+                    x = iWidth >> 1;
+                    while (x)
+                       {
+                       c1 = s[0];
+                       c2 = s[1];
+                       c3 = s[2];
+                           s[0] = d[0];
+                           s[1] = d[1];
+                           s[2] = d[2];
+                           s += 3;
+                           d[0] = c1;
+                           d[1] = c2;
+                           d[2] = c3;
+                           d -= 3;
+                           x--;
+                           }
+                        }
+                     break;
+                  case 32:
+                  for (y=0; y<iHeight; y++)
+                    {
+                        ls = (uint32_t *)&pPixels[y * iPitch];
+                        ld = ls + iWidth - 1;
+                        x = iWidth >> 1;
+                        while (x)
+                           {
+                           lTemp = *ls;
+                           *ls++ = *ld;
+                           *ld-- = lTemp;
+                           x--;
+                           }
+                        }
+                     break;
+                  }
+} /* MirrorBMP() */
+//
+// flip image vertically
+//
+void FlipBMP(uint8_t *p, int iWidth, int iHeight, int iBpp)
+{
+int iPitch;
+uint8_t c, *s, *d;
+
+	iPitch = ((iWidth*iBpp)+7)/8;
+	iPitch = (iPitch + 3) & 0xfffc;
+	s = p;
+	d = &p[iPitch * (iHeight-1)];
+	for (int y=0; y<iHeight/2; y++) {
+           for (int x=0; x<iPitch; x++) {
+              c = s[x];
+	      s[x] = d[x];
+	      d[x] = c; // swap top/bottom lines
+	   }
+	   s += iPitch;
+	   d -= iPitch;
+	}
+} /* FlipBMP() */
+
+void RotateImage(int iRotation, uint8_t *pPixels, int *iWidth, int *iHeight, int iBpp)
+{
+    uint8_t *pTemp, *s, *d;
+    int x, y, w = *iWidth, h = *iHeight;
+    int iSrcPitch, iDstPitch;
+    
+    if (iRotation == 0) return; // nothing to do
+    if (iRotation == 180) {
+        FlipBMP(pPixels, w, h, iBpp);
+        MirrorBMP(pPixels, w, h, iBpp);
+        return;
+    }
+    iSrcPitch = ((w * iBpp)+7)/8;
+    iSrcPitch = (iSrcPitch + 3) & 0xfffc; // dword aligned
+    iDstPitch = ((h * iBpp)+7)/8;
+    iDstPitch = (iDstPitch + 3) & 0xfffc;
+    switch (iBpp) {
+        case 1:
+        case 4:
+        case 8:
+        case 24:
+        case 32:
+            pTemp = (uint8_t *)calloc(w, iDstPitch);
+            for (y=0; y<h; y++)
+            {
+                s = &pPixels[y * iSrcPitch];
+                for (x=0; x<w; x++) // source line y becomes column h-1-y
+                {
+                    d = &pTemp[x * iDstPitch];
+                    if (iBpp == 1) { // same bit order as GetGrayPixel()
+                        if (s[x >> 3] & (1 << (x & 7)))
+                            d[(h-1-y) >> 3] |= (uint8_t)(1 << ((h-1-y) & 7));
+                    } else if (iBpp == 4) { // even pixels in the upper nibble
+                        uint8_t c = (x & 1) ? (s[x >> 1] & 0xf) : (s[x >> 1] >> 4);
+                        d[(h-1-y) >> 1] |= ((h-1-y) & 1) ? c : (uint8_t)(c << 4);
+                    } else {
+                        memcpy(&d[(h-1-y) * (iBpp/8)], &s[x * (iBpp/8)], iBpp/8);
+                    }
+                }
+            }
+            memcpy(pPixels, pTemp, iDstPitch * w);
+            free(pTemp);
+            break;
+    }
+    if (iRotation == 270) {
+        FlipBMP(pPixels, h, w, iBpp);
+        MirrorBMP(pPixels, h, w, iBpp);
+    }
+    if (iRotation == 90 || iRotation == 270) { // swap width/height
+        x = *iWidth;
+        *iWidth = *iHeight;
+        *iHeight = x;
+    }
+} /* RotateImage() */
+//
+// Pick the best color of black/white/red/yellow
+// depending on the output format option
+//
+void MatchBestColor(uint8_t *pR, uint8_t *pG, uint8_t *pB, int iOutFormat)
+{
+    int gr;
+    uint8_t r, g, b;
+    
+    r = *pR; g = *pG; b = *pB;
+    gr = (b + r + g*2)>>2; // gray
+    switch (iOutFormat)
+    {
+        case OPTION_BWR:
+            // match the color to closest of black/white/red
+            if (r > g && r > b) { // red is dominant
+                if (gr < 100 && r < 80) {
+                    // black
+                    b = g = r = 0;
+                } else {
+                    if (r-b > 32 && r-g > 32) {
+                        // is red really dominant?
+                        b = g = 0; r = 0xff;
+                    } else { // yellowish should be white
+                        // no, use white instead of pink/yellow
+                        b = g = r = 0xff;
+                    }
+                }
+            } else { // check for white/black
+                if (gr >= 100) {
+                    b = g = r = 0xff;
+                } else {
+                    // black
+                    b = g = r = 0;
+                }
+            }
+            break;
+        case OPTION_BWY:
+            // match the color to closest of black/white/yellow
+            if (r > b && g > b) { // yellow is dominant?
+                if (gr < 100 && r < 80) {
+                    r = g = b = 0;
+                } else {
+                    if (r - b > 32 && g - b > 32) {
+                        // is yellow really dominant?
+                        r = g = 0xff; b = 0;
+                    } else { // yellowish should be white
+                        // no, use white instead of pink/yellow
+                        r = g = b = 0xff;
+                    }
+                }
+            } else { // check for white/black
+                if (gr >= 100) {
+                    r = g = b = 0xff; // white
+                } else {
+                    r = g = b = 0;
+                }
+            }
+            break;
+        case OPTION_BWYR:
+            // match the color to closest of black/white/yellow/red
+            if (r > b || g > b) { // red or yellow is dominant
+                if (gr < 90 || (r < 80 && g < 80)) {
+                    r = g = b = 0; // black
+                } else {
+                    if (r-b > 32 && r-g > 70) {
+                        // is red really dominant?
+                        r = 0xff; g = b = 0; // red
+                    } else if (r-b > 32 && g-b > 32) {
+                        // yellow
+                        r = g = 0xff; b = 0;
+                    } else {
+                        r = g = b = 0xff; // gray/white
+                    }
+                }
+            } else { // check for white/black
+                if (gr >= 100) {
+                    r = g = b = 0xff; // white
+                } else {
+                    r = g = b = 0; // black
+                }
+            }
+            break;
+    } // switch on output display format
+    *pR = r; *pG = g; *pB = b; // store
+} /* MatchBestColor() */
+//
+// Dither the image to the destination color scheme
+//
+uint8_t * DitherBMP(uint8_t *pPixels, int iWidth, int iHeight, int *pBpp, int iOutFormat, EPD_STABLE *pStable)
+{
+    int x, y, xmask, iDestPitch, iSrc = 0, bKeep = 0, bPrev = 0;
+    int32_t cNew, lFErr, lFErrR, lFErrG, lFErrB, v=0, h;
+    int32_t e1,e2,e3,e4;
+    uint8_t cOut;
+    uint8_t *pDest, *errors, *pErrors=NULL, *d; // destination 8bpp image
+    uint8_t pixelmask=0, shift=0;
+    int iSrcPitch, iBpp = *pBpp;
+    int32_t *iErrors;
+    uint8_t *pPrevSrc = NULL, *pPrevOut = NULL, ucLevel;
+    if (pStable) {
+        bPrev = (pStable->pSrc && pStable->iWidth == iWidth && pStable->iHeight == iHeight && pStable->iFormat == iOutFormat);
+        if (!bPrev) { // first frame (or a different size); start over
+            free(pStable->pSrc);
+            free(pStable->pOut);
+            pStable->pSrc = (uint8_t *)malloc(iWidth * iHeight * 3);
+            pStable->pOut = (uint8_t *)malloc(iWidth * iHeight * 3);
+            pStable->iWidth = iWidth;
+            pStable->iHeight = iHeight;
+            pStable->iFormat = iOutFormat;
+        }
+    }
+    // one line of errors with a pixel to spare on each side
+    errors = (uint8_t *)calloc(iWidth + 2, 1);
+    iErrors = (int32_t *)calloc((iWidth + 2) * 3, sizeof(int32_t));
+    iDestPitch = (iWidth+7)/8;
+    iDestPitch = (iDestPitch+3) & 0xfffc; // our other code assumes this is a BMP image src
+    iSrcPitch = ((iWidth * iBpp)+7)/8;
+    iSrcPitch = (iSrcPitch + 3) & 0xfffc; // Windows BMP has dword aligned pitch
+    pixelmask = 0x80;
+    shift = 1;
+    xmask = 7;
+    if (iOutFormat == OPTION_BW) { // Black/white version
+        pDest = (uint8_t *)malloc(iDestPitch * iHeight);
+        for (y=0; y<iHeight; y++)
+        {
+            d = &pDest[y * iDestPitch];
+            pErrors = &errors[1]; // point to second pixel to avoid boundary check
+            lFErr = 0;
+            cOut = 0;
+            if (pStable) {
+                pPrevSrc = &pStable->pSrc[y * iWidth];
+                pPrevOut = &pStable->pOut[y * iWidth];
+            }
+            for (x=0; x<iWidth; x++)
+            {
+                cNew = GetGrayPixel8(x, y, pPixels, iSrcPitch, iBpp); // get grayscale uint8_t pixel
+                iSrc = cNew;
+                cNew = (cNew * 2)/3; // make white end of spectrum less "blown out"
+                // add forward error
+                cNew += lFErr;
+                if (cNew > 255) cNew = 255;     // clip to uint8_t
+                ucLevel = (uint8_t)(cNew & pixelmask);
+                if (pStable) {
+                    bKeep = (bPrev && abs(iSrc - pPrevSrc[x]) <= pStable->iThreshold);
+                    if (bKeep) { // source didn't change; keep the old pixel
+                        ucLevel = pPrevOut[x];
+                    } else {
+                        pPrevSrc[x] = (uint8_t)iSrc;
+                        pPrevOut[x] = ucLevel;
+                    }
+                }
+                cOut >>= shift;                 // pack new pixels into a byte
+                cOut |= ucLevel;    // keep top N bits
+                if ((x & xmask) == xmask)       // store it when the byte is full
+                {
+                    *d++ = cOut;
+                    cOut = 0;
+                }
+                // calculate the Floyd-Steinberg error for this pixel
+                v = cNew - ucLevel; // new error for N-bit gray output
+                if (v < 0) v = 0; // (only a kept pixel can be brighter)
+                h = v >> 1;
+                e1 = (7*h)>>3;  // 7/16
+                e2 = h - e1;  // 1/16
+                e3 = (5*h) >> 3;   // 5/16
+                e4 = h - e3;  // 3/16
+                // distribute error to neighbors
+                lFErr = e1 + pErrors[1];
+                pErrors[1] = (uint8_t)e2;
+                pErrors[0] += e3;
+                pErrors[-1] += e4;
+                pErrors++;
+            } // for x
+            if (iWidth & 7) {
+                cOut <<= (8-(x & 7));
+                *d++ = cOut; // store partial byte
+            }
+        } // for y
+        *pBpp = 1; // now it's 1-bit per pixel
+        free(errors);
+        free(iErrors);
+        return pDest;
+    } else if (iOutFormat == OPTION_4GRAY) {
+        iDestPitch = (iWidth+3) & 0xfffc;
+        pDest = (uint8_t *)malloc(iDestPitch * iHeight); // create grayscale output
+        for (y=0; y<iHeight; y++)
+        {
+            d = &pDest[y * iDestPitch];
+            pErrors = &errors[1]; // point to second pixel to avoid boundary check
+            lFErr = 0;
+            if (pStable) {
+                pPrevSrc = &pStable->pSrc[y * iWidth];
+                pPrevOut = &pStable->pOut[y * iWidth];
+            }
+            for (x=0; x<iWidth; x++)
+            {
+                cNew = GetGrayPixel8(x, y, pPixels, iSrcPitch, iBpp); // get grayscale uint8_t pixel
+                iSrc = cNew;
+                cNew = (cNew * 2)/3; // make white end of spectrum less "blown out"
+                // add forward error
+                cNew += lFErr;
+                if (cNew > 255) cNew = 255;     // clip to uint8_t
+                ucLevel = (uint8_t)(cNew & 0xc0);
+                if (pStable) {
+                    bKeep = (bPrev && abs(iSrc - pPrevSrc[x]) <= pStable->iThreshold);
+                    if (bKeep) { // source didn't change; keep the old gray level
+                        ucLevel = pPrevOut[x];
+                        cNew = (ucLevel > cNew) ? ucLevel : cNew; // no negative error
+                        *d++ = ucLevel;
+                    } else {
+                        pPrevSrc[x] = (uint8_t)iSrc;
+                        pPrevOut[x] = ucLevel;
+                        *d++ = (uint8_t)cNew;
+                    }
+                } else {
+                    *d++ = (uint8_t)cNew;
+                }
+                // calculate the Floyd-Steinberg error for this pixel
+                v = cNew - ucLevel; // new error for 2-bit gray output (always positive)
+                h = v >> 1;
+                e1 = (7*h)>>3;  // 7/16
+                e2 = h - e1;  // 1/16
+                e3 = (5*h) >> 3;   // 5/16
+                e4 = h - e3;  // 3/16
+                // distribute error to neighbors
+                lFErr = e1 + pErrors[1];
+                pErrors[1] = (uint8_t)e2;
+                pErrors[0] += e3;
+                pErrors[-1] += e4;
+                pErrors++;
+            } // for x
+        } // for y
+        for (y=0; y<256; y++) {
+            ucRed[y] = y;
+            ucGreen[y] = y;
+            ucBlue[y] = y; // create grayscale palette
+        }
+        *pBpp = 8; // now it's 8-bit per pixel
+        free(errors);
+        free(iErrors);
+        return pDest;
+    } else { // black/white/red/yellow
+        int32_t *pErr, iDelta;
+        iDelta = (iBpp == 32) ? 4:3; // bytes per pixel
+    // Do the dithering in-place
+    for (y=0; y<iHeight; y++)
+    {
+        uint8_t *s, r, g, b, r1, g1, b1;
+        s = &pPixels[y * iSrcPitch];
+        pErr = &iErrors[3]; // point to second pixel to avoid boundary check
+        lFErrR = lFErrG = lFErrB = 0;
+        if (pStable) {
+            pPrevSrc = &pStable->pSrc[y * iWidth * 3];
+            pPrevOut = &pStable->pOut[y * iWidth * 3];
+        }
+        for (x=0; x<iWidth; x++)
+        {
+            r = s[2]; g = s[1]; b = s[0]; // read a color pixel
+            lFErr = r + lFErrR;
+            if (lFErr < 0) lFErr = 0;
+            else if (lFErr > 255) lFErr = 255;
+            r1 = lFErr;
+            lFErr = g + lFErrG;
+            if (lFErr < 0) lFErr = 0;
+            else if (lFErr > 255) lFErr = 255;
+            g1 = lFErr;
+            lFErr = b + lFErrB;
+            if (lFErr < 0) lFErr = 0;
+            else if (lFErr > 255) lFErr = 255;
+            b1 = lFErr;
+            MatchBestColor(&r1, &g1, &b1, iOutFormat);
+            if (pStable) {
+                uint8_t *ps = &pPrevSrc[x*3], *po = &pPrevOut[x*3];
+                bKeep = (bPrev && abs(r - ps[2]) <= pStable->iThreshold && abs(g - ps[1]) <= pStable->iThreshold && abs(b - ps[0]) <= pStable->iThreshold);
+                if (bKeep) { // source didn't change; keep the old color
+                    r1 = po[2]; g1 = po[1]; b1 = po[0];
+                } else {
+                    ps[2] = r; ps[1] = g; ps[0] = b;
+                    po[2] = r1; po[1] = g1; po[0] = b1;
+                }
+            }
+            // accumulate the R/G/B error of the matched color vs original
+            // calculate the Floyd-Steinberg error for this pixel
+            v = (int32_t)(r - r1); // new error for red
+            h = v >> 1;
+            e1 = (7*h)>>3;  // 7/16
+            e2 = h - e1;  // 1/16
+            e3 = (5*h) >> 3;   // 5/16
+            e4 = h - e3;  // 3/16
+            // distribute error to neighbors
+            lFErrR = e1 + pErr[3];
+            pErr[3] = e2;
+            pErr[0] += e3;
+            pErr[-3] += e4;
+            v = (int32_t)(g - g1); // new error for green
+            h = v >> 1;
+            e1 = (7*h)>>3;  // 7/16
+            e2 = h - e1;  // 1/16
+            e3 = (5*h) >> 3;   // 5/16
+            e4 = h - e3;  // 3/16
+            // distribute error to neighbors
+            lFErrG = e1 + pErr[4];
+            pErr[4] = e2;
+            pErr[1] += e3;
+            pErr[-2] += e4;
+            v = (int32_t)(b - b1); // new error for blue
+            h = v >> 1;
+            e1 = (7*h)>>3;  // 7/16
+            e2 = h - e1;  // 1/16
+            e3 = (5*h) >> 3;   // 5/16
+            e4 = h - e3;  // 3/16
+            // distribute error to neighbors
+            lFErrB = e1 + pErr[5];
+            pErr[5] = e2;
+            pErr[2] += e3;
+            pErr[-1] += e4;
+            pErr += 3;
+            // Store back the dithered pixel (in place)
+            s[2] = r1; s[1] = g1; s[0] = b1;
+            s += iDelta;
+        } // for x
+        } // for y
+        free(errors);
+        free(iErrors);
+        return NULL; // signals to keep the original bitmap
+    } // BWR
+    free(errors);
+    free(iErrors);
+    return NULL;
+} /* DitherBMP() */
+
+int JPEGDraw(JPEGDRAW *pDraw)
+{
+    // defaults to RGB565 little endian
+    int x, y, iCount, iRows, iPitch;
+    // convert each pixel to RGB888 and store in our image buffer
+    uint8_t r, g, b, *s8, *d, *pDst = (uint8_t *)pDraw->pUser;
+    uint16_t u16, *s;
+    int64_t llTrace = (iTrace) ? GetTraceTime() : 0;
+    // the MCUs on the right and bottom edges can extend past the image
+    iCount = iWidth - pDraw->x;
+    if (iCount > pDraw->iWidth) iCount = pDraw->iWidth;
+    iRows = ((iHeight < 0) ? -iHeight : iHeight) - pDraw->y;
+    if (iRows > pDraw->iHeight) iRows = pDraw->iHeight;
+    iPitch = ((iWidth * iBpp)/8 + 3) & ~3; // dword aligned lines like a BMP
+    for (y=0; y<iRows; y++) {
+        if (pDraw->iBpp == 16) {
+            d = &pDst[((pDraw->y + y) * iPitch) + (pDraw->x * 3)];
+            s = &pDraw->pPixels[y * pDraw->iWidth];
+            for (x=0; x<iCount; x++) {
+                u16 = *s++;
+                r = (u16 >> 11); // top 5 bits = R
+                r = (r << 3) | (r >> 2);
+                g = (u16 >> 5) & 0x3f; // middle 6 bits = G
+                g = (g << 2) | (g >> 4);
+                b = (u16 & 0x1f); // bottom 5 bits = B
+                b = (b << 3) | (b >> 2);
+                d[0] = b; d[1] = g; d[2] = r;
+                d += 3; // 24-bpp output
+            } // for x
+        } else { // 8bpp
+            s8 = (uint8_t *)pDraw->pPixels;
+            s8 += (y * pDraw->iWidth);
+            d = &pDst[((pDraw->y + y) * iPitch) + pDraw->x]; // must be 8bpp
+            memcpy(d, s8, iCount);
+        }
+    } // for y
+    if (iTrace) TraceEvent("JPEGDraw", "jpeg", llTrace, "y", pDraw->y);
+    return 1; // returning true (1) tells JPEGDEC to continue decoding. Returning false (0) would quit decoding immediately.
+} /* JPEGDraw() */
+
+//
+// Decode a JPEG image
+// If iMinWidth/iMinHeight are given, the largest DCT scaling (1/2, 1/4, 1/8)
+// which keeps the image at least that size is used to decode it faster
+//
+uint8_t * ReadJPEG(uint8_t *pData, int iSize, int *pWidth, int *pHeight, int *pBpp, int iMinWidth, int iMinHeight)
+{
+    int rc, iScale, iOptions = 0, iPitch;
+    JPEGIMAGE jpg;
+    
+    rc = JPEG_openRAM(&jpg, pData, iSize, JPEGDraw);
+    if (rc) {
+        *pBpp = jpg.ucBpp;
+        *pWidth = jpg.iWidth;
+        *pHeight = jpg.iHeight;
+        if (iMinWidth > 0 && iMinHeight > 0) {
+            for (iScale = 8; iScale > 1; iScale >>= 1) {
+                if (jpg.iWidth / iScale >= iMinWidth && jpg.iHeight / iScale >= iMinHeight)
+                    break;
+            }
+            if (iScale > 1) {
+                iOptions = (iScale == 2) ? JPEG_SCALE_HALF : ((iScale == 4) ? JPEG_SCALE_QUARTER : JPEG_SCALE_EIGHTH);
+                *pWidth = (jpg.iWidth + iScale - 1) / iScale;
+                *pHeight = (jpg.iHeight + iScale - 1) / iScale;
+            }
+        }
+        iPitch = ((*pWidth * jpg.ucBpp)/8 + 3) & ~3;
+        if (jpg.ucBpp == 8) {
+            // create a fake grayscale palette
+            for (int i=0; i<256; i++) {
+                ucRed[i] = i;
+                ucGreen[i] = i;
+                ucBlue[i] = i;
+            }
+            jpg.ucPixelType = EIGHT_BIT_GRAYSCALE;
+        }
+        jpg.pUser = malloc(iPitch * *pHeight);
+        *pHeight = 0 - *pHeight; // negative because it will be seen as a WinBMP height
+        iWidth = *pWidth; // JPEGDraw() uses the output size
+        iHeight = *pHeight;
+        iBpp = *pBpp;
+        rc = JPEG_decode(&jpg, 0, 0, iOptions);
+    }
+    return jpg.pUser;
+} /* ReadJPEG() */
+//
+// Read an image file and decode it to top-down pixels
+// returns 1 for success, 0 for failure
+//
+int DecodeImage(char *szInName, EPD_IMAGE *pImage, int iMinWidth, int iMinHeight)
+{
+    int iSize, iOffBits;
+    uint8_t *p;
+    EPD_TIMER timer;
+
+    memset(pImage, 0, sizeof(EPD_IMAGE));
+    StatsBegin(&timer, STAGE_READ);
+    ihandle = fopen(szInName,"rb"); // open input file
+    if (ihandle == NULL)
+    {
+        fprintf(stderr, "Unable to open file: %s\n", szInName);
+        return 0; // bad filename passed
+    }
+    
+    fseek(ihandle, 0L, SEEK_END); // get the file size
+    iSize = (int)ftell(ihandle);
+    fseek(ihandle, 0, SEEK_SET);
+    p = (unsigned char *)malloc(iSize); // read it into RAM
+    fread(p, 1, iSize, ihandle);
+    fclose(ihandle);
+    StatsEnd(&timer, iSize);
+    StatsBegin(&timer, STAGE_DECODE);
+    if (p[0] == 'B' && p[1] == 'M') {
+        if (ReadBMP(p, &iOffBits, &iWidth, &iHeight, &iBpp) == 0) {
+            printf("Invalid BMP file, exiting...\n");
+            free(p);
+            return 0;
+        }
+    } else if (p[0] == 0xff && p[1] == 0xd8) {
+        uint8_t *pOut = ReadJPEG(p, iSize, &iWidth, &iHeight, &iBpp, iMinWidth, iMinHeight);
+        if (!pOut) {
+            printf("Invalid JPEG file, exiting...\n");
+            free(p);
+            return 0;
+        }
+        free(p);
+        p = pOut;
+        iOffBits = 0;
+        iSize = (((iWidth * iBpp)/8 + 3) & ~3) * (-iHeight); // size of the decoded pixels
+    } else {
+        printf("Unrecognized file format. For now, only BMP and JPEG are supported\n");
+        free(p);
+        return 0;
+    }
+    if (iHeight > 0) FlipBMP(&p[iOffBits], iWidth, iHeight, iBpp); // positive means bottom-up
+    else iHeight = -iHeight; // negative means top-down
+    StatsEnd(&timer, iSize - iOffBits);
+    pImage->pData = p;
+    pImage->iOffBits = iOffBits;
+    pImage->iSize = iSize - iOffBits;
+    pImage->iWidth = iWidth;
+    pImage->iHeight = iHeight;
+    pImage->iBpp = iBpp;
+    memcpy(pImage->ucRed, ucRed, 256);
+    memcpy(pImage->ucGreen, ucGreen, 256);
+    memcpy(pImage->ucBlue, ucBlue, 256);
+    return 1;
+} /* DecodeImage() */
+
+void FreeImage(EPD_IMAGE *pImage)
+{
+    free(pImage->pData);
+    pImage->pData = NULL;
+} /* FreeImage() */
+//
+// First half of the conversion pipeline (orient, invert, dither)
+// Works on a private copy of the pixels so that several conversions
+// can run on the same image at the same time
+// pOut gets the new pixels and palette with room to rotate them
+// returns 1 for success, 0 for failure
+//
+int PrepareImage(EPD_IMAGE *pImage, EPD_OPTIONS *pOpts, EPD_IMAGE *pOut)
+{
+    int iWidth = pImage->iWidth, iHeight = pImage->iHeight, iBpp = pImage->iBpp;
+    int iSize = pImage->iSize, iRotSize;
+    uint8_t *p;
+    EPD_TIMER timer;
+
+    memcpy(ucRed, pImage->ucRed, 256); // this thread's copy of the palette
+    memcpy(ucGreen, pImage->ucGreen, 256);
+    memcpy(ucBlue, pImage->ucBlue, 256);
+    iRotSize = ((((iHeight * iBpp) + 7)/8 + 3) & 0xfffc) * iWidth; // after a 90 degree rotation
+    p = (uint8_t *)malloc(((iRotSize > iSize) ? iRotSize : iSize) + 4);
+    if (p == NULL) {
+        printf("Error allocating memory\n");
+        return 0;
+    }
+    memcpy(p, &pImage->pData[pImage->iOffBits], iSize);
+    if (pOpts->bMirror || pOpts->bFlipv) {
+        StatsBegin(&timer, STAGE_ORIENT);
+        if (pOpts->bMirror) {
+            MirrorBMP(p, iWidth, iHeight, iBpp);
+        }
+        if (pOpts->bFlipv) {
+            FlipBMP(p, iWidth, iHeight, iBpp);
+        }
+        StatsEnd(&timer, iSize * (pOpts->bMirror + pOpts->bFlipv));
+    }
+    if (pOpts->bInvert) {
+        StatsBegin(&timer, STAGE_INVERT);
+        for (int i=0; i<iSize; i++) {
+            p[i] = ~p[i];
+        }
+        StatsEnd(&timer, iSize);
+    }
+    if (pOpts->bDither) {
+        if (iBpp < 24 && (pOpts->iOption == OPTION_BWR || pOpts->iOption == OPTION_BWY || pOpts->iOption == OPTION_BWYR))
+        {
+            printf("Color dithering requires a full color (24/32-bit) source image\n");
+            free(p);
+            return 0;
+        }
+        StatsBegin(&timer, STAGE_DITHER);
+        uint8_t *pNew = DitherBMP(p, iWidth, iHeight, &iBpp, pOpts->iOption, pOpts->pStable);
+        StatsEnd(&timer, iSize);
+        if (pNew) { // the bitmap image was replaced
+            free(p);
+            p = pNew; // bitmap has been replaced
+            iSize = ((((iWidth * iBpp) + 7)/8 + 3) & 0xfffc) * iHeight;
+            iRotSize = ((((iHeight * iBpp) + 7)/8 + 3) & 0xfffc) * iWidth;
+            if (iRotSize > iSize) { // keep room to rotate it in place
+                p = (uint8_t *)realloc(p, iRotSize);
+            }
+        }
+    }
+    memset(pOut, 0, sizeof(EPD_IMAGE));
+    pOut->pData = p;
+    pOut->iWidth = iWidth;
+    pOut->iHeight = iHeight;
+    pOut->iBpp = iBpp;
+    pOut->iSize = ((((iWidth * iBpp) + 7)/8 + 3) & 0xfffc) * iHeight;
+    memcpy(pOut->ucRed, ucRed, 256); // the dither may have changed it
+    memcpy(pOut->ucGreen, ucGreen, 256);
+    memcpy(pOut->ucBlue, ucBlue, 256);
+    return 1;
+} /* PrepareImage() */
+//
+// Second half of the conversion pipeline (rotate, pack into memory planes)
+// The pixels are rotated in place so the buffer must have room for it
+// returns 1 for success, 0 for failure
+//
+int PackImage(EPD_IMAGE *pImage, EPD_OPTIONS *pOpts, EPD_PLANES *pPlanes)
+{
+    int iWidth = pImage->iWidth, iHeight = pImage->iHeight, rc;
+    EPD_TIMER timer;
+
+    memcpy(ucRed, pImage->ucRed, 256);
+    memcpy(ucGreen, pImage->ucGreen, 256);
+    memcpy(ucBlue, pImage->ucBlue, 256);
+    if (pOpts->iRotation) {
+        StatsBegin(&timer, STAGE_ORIENT);
+        RotateImage(pOpts->iRotation, pImage->pData, &iWidth, &iHeight, pImage->iBpp);
+        StatsEnd(&timer, pImage->iSize);
+    }
+    StatsBegin(&timer, STAGE_PACK);
+    // vertical bytes are made from the packed planes, so they get the plan afterwards
+    rc = PackPlanes(pImage->pData, 0, iWidth, iHeight, pImage->iBpp, pOpts->iOption, pOpts->iRowAlign, (pOpts->bVertical) ? NULL : pOpts->pPlan, pPlanes);
+    if (rc && pOpts->bVertical) {
+        rc = VerticalPlanes(pPlanes, pOpts->iOption);
+        if (!rc) FreePlanes(pPlanes);
+        else if (pOpts->pPlan) ApplyPlan(pPlanes, pOpts->pPlan);
+    }
+    StatsEnd(&timer, pImage->iSize);
+    if (!rc) {
+        printf("Error allocating memory planes\n");
+    }
+    return rc;
+} /* PackImage() */
+//
+// Run a decoded image through the rest of the conversion pipeline
+// (orient, invert, dither, rotate) into packed memory planes
+// returns 1 for success, 0 for failure
+//
+int ProcessImage(EPD_IMAGE *pImage, EPD_OPTIONS *pOpts, EPD_PLANES *pPlanes)
+{
+    EPD_IMAGE image;
+    int rc;
+
+    if (!PrepareImage(pImage, pOpts, &image))
+        return 0;
+    rc = PackImage(&image, pOpts, pPlanes);
+    FreeImage(&image);
+    return rc;
+} /* ProcessImage() */
+//
+// Read an image file and run it through the conversion pipeline
+// (decode, orient, invert, dither, rotate) into packed memory planes
+// returns 1 for success, 0 for failure
+//
+int ConvertImage(char *szInName, EPD_OPTIONS *pOpts, EPD_PLANES *pPlanes)
+{
+    EPD_IMAGE image;
+    int rc;
+
+    if (!DecodeImage(szInName, &image, 0, 0))
+        return 0;
+    rc = ProcessImage(&image, pOpts, pPlanes);
+    FreeImage(&image);
+    return rc;
+} /* ConvertImage() */
+#ifdef _WIN32
+typedef struct tag_epd_jobs
+{
+    EPD_JOB_FUNC *pfnJob;
+    void *pUser;
+    int iJobs, iNext;
+    CRITICAL_SECTION cs;
+} EPD_JOBS;
+#else
+typedef struct tag_epd_jobs
+{
+    EPD_JOB_FUNC *pfnJob;
+    void *pUser;
+    int iJobs, iNext;
+    pthread_mutex_t mutex;
+} EPD_JOBS;
+#endif
+//
+// Worker thread: keep taking the next job until they're all done
+//
+#ifdef _WIN32
+DWORD WINAPI JobThread(LPVOID pArg)
+#else
+void *JobThread(void *pArg)
+#endif
+{
+    EPD_JOBS *pJobs = (EPD_JOBS *)pArg;
+    int iJob;
+
+    while (1) {
+#ifdef _WIN32
+        EnterCriticalSection(&pJobs->cs);
+        iJob = pJobs->iNext++;
+        LeaveCriticalSection(&pJobs->cs);
+#else
+        pthread_mutex_lock(&pJobs->mutex);
+        iJob = pJobs->iNext++;
+        pthread_mutex_unlock(&pJobs->mutex);
+#endif
+        if (iJob >= pJobs->iJobs) break;
+        (*pJobs->pfnJob)(pJobs->pUser, iJob);
+    }
+    return 0;
+} /* JobThread() */
+//
+// Number of CPUs to use when iThreads is 0
+//
+int GetCPUCount(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return (int)si.dwNumberOfProcessors;
+#else
+    long l = sysconf(_SC_NPROCESSORS_ONLN);
+    return (l > 0) ? (int)l : 1;
+#endif
+} /* GetCPUCount() */
+//
+// Run pfnJob for jobs 0 to iJobs-1 on a pool of worker threads
+// (the calling thread does its share of the work too)
+//
+void RunJobs(EPD_JOB_FUNC *pfnJob, void *pUser, int iJobs)
+{
+    EPD_JOBS jobs;
+    int i, iCount;
+#ifdef _WIN32
+    HANDLE hThreads[64];
+#else
+    pthread_t tThreads[64];
+#endif
+
+    iCount = (iThreads > 0) ? iThreads : GetCPUCount();
+    if (iCount > iJobs) iCount = iJobs;
+    if (iCount > 64) iCount = 64;
+    jobs.pfnJob = pfnJob;
+    jobs.pUser = pUser;
+    jobs.iJobs = iJobs;
+    jobs.iNext = 0;
+#ifdef _WIN32
+    InitializeCriticalSection(&jobs.cs);
+    for (i=0; i<iCount-1; i++)
+        hThreads[i] = CreateThread(NULL, 0, JobThread, &jobs, 0, NULL);
+    JobThread(&jobs);
+    for (i=0; i<iCount-1; i++) {
+        WaitForSingleObject(hThreads[i], INFINITE);
+        CloseHandle(hThreads[i]);
+    }
+    DeleteCriticalSection(&jobs.cs);
+#else
+    pthread_mutex_init(&jobs.mutex, NULL);
+    for (i=0; i<iCount-1; i++) {
+        if (pthread_create(&tThreads[i], NULL, JobThread, &jobs) != 0)
+            break; // the remaining threads will do the work
+    }
+    iCount = i;
+    JobThread(&jobs);
+    for (i=0; i<iCount; i++)
+        pthread_join(tThreads[i], NULL);
+    pthread_mutex_destroy(&jobs.mutex);
+#endif
+} /* RunJobs() */
+//
+// qsort callback to order the bundle index by name hash
+//
+int CompareBundleEntries(const void *p1, const void *p2)
+{
+    uint32_t u32_1 = EPD_Get32((const uint8_t *)p1);
+    uint32_t u32_2 = EPD_Get32((const uint8_t *)p2);
+    return (u32_1 < u32_2) ? -1 : (u32_1 > u32_2);
+} /* CompareBundleEntries() */
+//
+// Convert a list of images and pack them into a single bundle file
+// with a hash index (read it on the device with epd_bundle.h)
+// Each image's data starts on an iAlign byte boundary
+// returns 1 for success, 0 for failure
+//
+int MakeBundle(char **pInNames, int iCount, EPD_OPTIONS *pOpts, int bRLE, int iAlign, char *szOutName)
+{
+    EPD_PLANES planes;
+    EPD_BUNDLE bundle;
+    EPD_BUNDLE_IMAGE img;
+    uint8_t *pBundle, *pEntry, *pEntries, *pComp = NULL, *pPlaneData;
+    uint32_t u32Hash, u32Size, u32Off, u32Off2, u32Max;
+    int i, j, iPlane, iPlaneSize, rc = 0;
+    char szLeaf[256];
+    FILE *ohandle;
+
+    u32Max = EPD_BUNDLE_HEADER_SIZE + (iCount * EPD_BUNDLE_ENTRY_SIZE);
+    u32Max = (u32Max + iAlign - 1) & ~(iAlign - 1);
+    u32Size = u32Max;
+    pBundle = (uint8_t *)calloc(1, u32Max);
+    pEntries = (uint8_t *)calloc(iCount, EPD_BUNDLE_ENTRY_SIZE);
+    for (i=0; i<iCount; i++) {
+        if (!ConvertImage(pInNames[i], pOpts, &planes))
+            goto bundle_exit;
+        GetLeafName(pInNames[i], szLeaf);
+        FixName(szLeaf);
+        u32Hash = EPD_BundleHash(szLeaf);
+        for (j=0; j<i; j++) {
+            if (EPD_Get32(&pEntries[j * EPD_BUNDLE_ENTRY_SIZE]) == u32Hash) {
+                printf("Image name %s is used twice (or its hash collides), rename one of them\n", szLeaf);
+                FreePlanes(&planes);
+                goto bundle_exit;
+            }
+        }
+        if (planes.iWidth > 0xffff || planes.iHeight > 0xffff) {
+            printf("%s is too large for a bundle\n", szLeaf);
+            FreePlanes(&planes);
+            goto bundle_exit;
+        }
+        pEntry = &pEntries[i * EPD_BUNDLE_ENTRY_SIZE];
+        pEntry[0] = (uint8_t)u32Hash; pEntry[1] = (uint8_t)(u32Hash >> 8);
+        pEntry[2] = (uint8_t)(u32Hash >> 16); pEntry[3] = (uint8_t)(u32Hash >> 24);
+        pEntry[4] = (uint8_t)pOpts->iOption;
+        pEntry[5] = (uint8_t)planes.iPlaneCount;
+        pEntry[6] = (bRLE) ? EPD_BUNDLE_RLE : 0;
+        pEntry[8] = (uint8_t)planes.iWidth; pEntry[9] = (uint8_t)(planes.iWidth >> 8);
+        pEntry[10] = (uint8_t)planes.iHeight; pEntry[11] = (uint8_t)(planes.iHeight >> 8);
+        pEntry[12] = (uint8_t)planes.iPitch; pEntry[13] = (uint8_t)(planes.iPitch >> 8);
+        u32Off = (u32Size + iAlign - 1) & ~(iAlign - 1); // each image starts on an aligned boundary
+        if (bRLE) pComp = (uint8_t *)malloc(planes.iPlaneSize + (planes.iPlaneSize/EPD_RLE_MAX_LITERAL) + 1);
+        for (iPlane=0; iPlane<planes.iPlaneCount; iPlane++) {
+            if (bRLE) {
+                iPlaneSize = CompressPlane(planes.pPlane[iPlane], planes.iPlaneSize, pComp);
+                pPlaneData = pComp;
+            } else {
+                iPlaneSize = planes.iPlaneSize;
+                pPlaneData = planes.pPlane[iPlane];
+            }
+            u32Size = u32Off + iPlaneSize;
+            if (u32Size > u32Max) { // grow the buffer; padding between images must stay zeroed
+                u32Off2 = u32Max;
+                u32Max = u32Size + (u32Size >> 1);
+                pBundle = (uint8_t *)realloc(pBundle, u32Max);
+                memset(&pBundle[u32Off2], 0, u32Max - u32Off2);
+            }
+            memcpy(&pBundle[u32Off], pPlaneData, iPlaneSize);
+            for (j=0; j<4; j++) {
+                pEntry[16 + iPlane*4 + j] = (uint8_t)(u32Off >> (j*8));
+                pEntry[24 + iPlane*4 + j] = (uint8_t)(iPlaneSize >> (j*8));
+            }
+            u32Off = (u32Size + 3) & ~3; // planes of the same image are 4-byte aligned
+        }
+        free(pComp);
+        pComp = NULL;
+        printf("%s: %dx%d, %d plane(s) at offset %d\n", szLeaf, planes.iWidth, planes.iHeight, planes.iPlaneCount, EPD_Get32(&pEntry[16]));
+        FreePlanes(&planes);
+    } // for each image
+    // sort the index by hash so that the device can do a binary search
+    qsort(pEntries, iCount, EPD_BUNDLE_ENTRY_SIZE, CompareBundleEntries);
+    memcpy(pBundle, "EPDB", 4);
+    pBundle[4] = EPD_BUNDLE_VERSION; pBundle[5] = 0;
+    pBundle[6] = (uint8_t)iCount; pBundle[7] = (uint8_t)(iCount >> 8);
+    for (j=0; j<4; j++) {
+        pBundle[8+j] = (uint8_t)(iAlign >> (j*8));
+        pBundle[12+j] = (uint8_t)(u32Size >> (j*8));
+    }
+    memcpy(&pBundle[EPD_BUNDLE_HEADER_SIZE], pEntries, iCount * EPD_BUNDLE_ENTRY_SIZE);
+    // make sure the device code can find everything
+    if (!EPD_BundleOpen(&bundle, pBundle, u32Size)) {
+        printf("Bundle verification failed\n");
+        goto bundle_exit;
+    }
+    for (i=0; i<iCount; i++) {
+        GetLeafName(pInNames[i], szLeaf);
+        FixName(szLeaf);
+        if (!EPD_BundleFind(&bundle, szLeaf, &img) || img.pPlane[0] < pBundle || img.pPlane[0] + img.u32PlaneSize[0] > pBundle + u32Size) {
+            printf("Bundle verification failed on %s\n", szLeaf);
+            goto bundle_exit;
+        }
+    }
+    ohandle = fopen(szOutName, "wb");
+    if (ohandle == NULL) {
+        printf("Error creating output file: %s\n", szOutName);
+        goto bundle_exit;
+    }
+    fwrite(pBundle, 1, u32Size, ohandle);
+    fclose(ohandle);
+    printf("%d images, %d bytes written to %s\n", iCount, (int)u32Size, szOutName);
+    rc = 1;
+bundle_exit:
+    free(pComp);
+    free(pEntries);
+    free(pBundle);
+    return rc;
+} /* MakeBundle() */
+//
+// Convert a batch of images and store their planes as maps of
+// iTileSize x iTileSize pixel tiles. Identical tiles (across all planes
+// of all images) are stored once in a shared <outname>_tiles array
+// Expand the maps on the device with EPD_TileBlit() from epd_decode.h
+// returns 1 for success, 0 for failure
+//
+int MakeTiles(char **pInNames, int iCount, EPD_OPTIONS *pOpts, int iTileSize, char *szOutName, int iOutMode)
+{
+    EPD_PLANES *pPlanes;
+    EPD_OUTPUT out;
+    int i, j, x, y, iPlane, iTileBytes, iTileLen, iMapW, iMapH, iMapLen;
+    int iUnique = 0, iMaxTiles = 0, iHashSize, iMapSize, iRawSize = 0, rc = 0;
+    int *pHash = NULL, **pMaps = NULL;
+    uint8_t *pTiles = NULL, *pTile = NULL, *pCheck = NULL, *d;
+    uint16_t *pMap16 = NULL;
+    uint32_t u32;
+    char szLeaf[256], szName[300], szSetName[256];
+
+    pPlanes = (EPD_PLANES *)calloc(iCount, sizeof(EPD_PLANES));
+    pMaps = (int **)calloc(iCount * 2, sizeof(int *));
+    for (i=0; i<iCount; i++) {
+        if (!ConvertImage(pInNames[i], pOpts, &pPlanes[i]))
+            goto tiles_exit;
+    }
+    iTileBytes = (iTileSize * ((pOpts->iOption == OPTION_BWYR) ? 2 : 1)) / 8; // bytes per tile row
+    iTileLen = iTileBytes * iTileSize;
+    for (i=0; i<iCount; i++) {
+        iMaxTiles += ((pPlanes[i].iPitch + iTileBytes - 1) / iTileBytes) * ((pPlanes[i].iHeight + iTileSize - 1) / iTileSize) * pPlanes[i].iPlaneCount;
+    }
+    for (iHashSize = 256; iHashSize < iMaxTiles * 2; iHashSize <<= 1) {};
+    pHash = (int *)malloc(iHashSize * sizeof(int));
+    memset(pHash, 0xff, iHashSize * sizeof(int)); // -1 = empty slot
+    pTiles = (uint8_t *)malloc(iMaxTiles * iTileLen);
+    pTile = (uint8_t *)malloc(iTileLen);
+    // Find the unique tiles and build the maps
+    for (i=0; i<iCount; i++) {
+        iMapW = (pPlanes[i].iPitch + iTileBytes - 1) / iTileBytes;
+        iMapH = (pPlanes[i].iHeight + iTileSize - 1) / iTileSize;
+        for (iPlane=0; iPlane<pPlanes[i].iPlaneCount; iPlane++) {
+            pMaps[i*2 + iPlane] = (int *)malloc(iMapW * iMapH * sizeof(int));
+            iRawSize += pPlanes[i].iPlaneSize;
+            for (y=0; y<iMapH; y++) {
+                for (x=0; x<iMapW; x++) {
+                    memset(pTile, PlaneBackground(pOpts->iOption, iPlane), iTileLen); // pad the tiles which hang off the edges with white
+                    for (j=0; j<iTileSize && (y*iTileSize)+j < pPlanes[i].iHeight; j++) {
+                        int iLen = pPlanes[i].iPitch - (x * iTileBytes);
+                        if (iLen > iTileBytes) iLen = iTileBytes;
+                        memcpy(&pTile[j * iTileBytes], &pPlanes[i].pPlane[iPlane][(((y*iTileSize)+j) * pPlanes[i].iPitch) + (x * iTileBytes)], iLen);
+                    }
+                    u32 = 0x811c9dc5; // FNV-1a
+                    for (j=0; j<iTileLen; j++) {
+                        u32 ^= pTile[j];
+                        u32 *= 0x01000193;
+                    }
+                    j = u32 & (iHashSize-1);
+                    while (pHash[j] >= 0 && memcmp(&pTiles[pHash[j] * iTileLen], pTile, iTileLen) != 0)
+                        j = (j + 1) & (iHashSize-1); // linear probing
+                    if (pHash[j] < 0) { // new tile
+                        pHash[j] = iUnique;
+                        memcpy(&pTiles[iUnique * iTileLen], pTile, iTileLen);
+                        iUnique++;
+                    }
+                    pMaps[i*2 + iPlane][(y * iMapW) + x] = pHash[j];
+                } // for x
+            } // for y
+        } // for each plane
+    } // for each image
+    if (iUnique > 65536) {
+        printf("Too many unique tiles (%d), try a larger tile size\n", iUnique);
+        goto tiles_exit;
+    }
+    iMapSize = (iUnique > 256) ? 2 : 1;
+    if (!OpenOutput(&out, szOutName, iOutMode))
+        goto tiles_exit;
+    GetLeafName(szOutName, szSetName);
+    FixName(szSetName);
+    fprintf(out.ohandle, "//\n// %s tile set\n//\n", szSetName);
+    fprintf(out.ohandle, "// for non-Arduino builds...\n");
+    fprintf(out.ohandle, "#ifndef PROGMEM\n#define PROGMEM\n#endif\n");
+    fprintf(out.ohandle, "// %dx%d pixel tiles, %d bytes per tile row, %d bytes per tile\n", iTileSize, iTileSize, iTileBytes, iTileLen);
+    fprintf(out.ohandle, "// %d unique tiles out of %d\n", iUnique, iMaxTiles);
+    fprintf(out.ohandle, "// Draw a plane with EPD_TileBlit(%s_tiles, %d, %d, <map>, %d, <tiles per row>, <pitch>, <height>, callback, user)\n", szSetName, iTileBytes, iTileSize, iMapSize == 2);
+    sprintf(szName, "%s_tiles", szSetName);
+    WriteArray(&out, szName, pTiles, 1, iUnique * iTileLen);
+    pMap16 = (uint16_t *)malloc(iMaxTiles * sizeof(uint16_t));
+    pCheck = (uint8_t *)malloc(iMaxTiles * iTileLen);
+    iMapLen = 0;
+    for (i=0; i<iCount; i++) {
+        iMapW = (pPlanes[i].iPitch + iTileBytes - 1) / iTileBytes;
+        iMapH = (pPlanes[i].iHeight + iTileSize - 1) / iTileSize;
+        GetLeafName(pInNames[i], szLeaf);
+        FixName(szLeaf);
+        fprintf(out.ohandle, "// %s: width %d, height %d, %d bytes per line, map of %dx%d tiles\n", szLeaf, pPlanes[i].iWidth, pPlanes[i].iHeight, pPlanes[i].iPitch, iMapW, iMapH);
+        for (iPlane=0; iPlane<pPlanes[i].iPlaneCount; iPlane++) {
+            uint8_t *pMap8 = (uint8_t *)pMap16;
+            for (j=0; j<iMapW * iMapH; j++) {
+                if (iMapSize == 2) pMap16[j] = (uint16_t)pMaps[i*2 + iPlane][j];
+                else pMap8[j] = (uint8_t)pMaps[i*2 + iPlane][j];
+            }
+            // make sure the device code rebuilds the original plane
+            d = pCheck;
+            EPD_TileBlit(pTiles, iTileBytes, iTileSize, pMap16, iMapSize == 2, iMapW, pPlanes[i].iPitch, pPlanes[i].iHeight, RLEStreamCheck, &d);
+            if (d != pCheck + pPlanes[i].iPlaneSize || memcmp(pCheck, pPlanes[i].pPlane[iPlane], pPlanes[i].iPlaneSize) != 0) {
+                printf("Tile verification failed on %s plane %d\n", szLeaf, iPlane);
+                CloseOutput(&out);
+                rc = 0;
+                goto tiles_exit;
+            }
+            if (pOpts->iOption == OPTION_BWYR)
+                sprintf(szName, "%s_map", szLeaf);
+            else
+                sprintf(szName, "%s_%d_map", szLeaf, iPlane);
+            WriteArray(&out, szName, pMap16, iMapSize, iMapW * iMapH);
+            iMapLen += iMapW * iMapH * iMapSize;
+        } // for each plane
+    } // for each image
+    fprintf(out.ohandle, "// %d bytes of planes stored in %d bytes (tiles %d + maps %d), %d bytes saved\n", iRawSize, (iUnique * iTileLen) + iMapLen, iUnique * iTileLen, iMapLen, iRawSize - ((iUnique * iTileLen) + iMapLen));
+    printf("%d unique tiles of %d, %d bytes of planes stored in %d bytes (tiles %d + maps %d), %d bytes saved\n", iUnique, iMaxTiles, iRawSize, (iUnique * iTileLen) + iMapLen, iUnique * iTileLen, iMapLen, iRawSize - ((iUnique * iTileLen) + iMapLen));
+    CloseOutput(&out);
+    rc = 1;
+tiles_exit:
+    for (i=0; i<iCount; i++) {
+        FreePlanes(&pPlanes[i]);
+        free(pMaps[i*2]);
+        free(pMaps[i*2+1]);
+    }
+    free(pPlanes);
+    free(pMaps);
+    free(pHash);
+    free(pTiles);
+    free(pTile);
+    free(pMap16);
+    free(pCheck);
+    return rc;
+} /* MakeTiles() */
+//
+// Add bytes to a growing buffer
+//
+void AppendBytes(uint8_t **ppBuf, int *pLen, int *pMax, const void *pData, int iLen)
+{
+    if (*pLen + iLen > *pMax) {
+        while (*pLen + iLen > *pMax) *pMax = (*pMax) ? *pMax * 2 : 4096;
+        *ppBuf = (uint8_t *)realloc(*ppBuf, *pMax);
+    }
+    memcpy(&(*ppBuf)[*pLen], pData, iLen);
+    *pLen += iLen;
+} /* AppendBytes() */
+//
+// Rectangle callback used to check EPD_SeqPlayFrame()
+// copies each area into the planes of the simulated panel
+//
+void SeqRectCheck(int iPlane, int x, int y, int cx, int cy, const uint8_t *pData, void *pUser)
+{
+    EPD_PLANES *pPlanes = (EPD_PLANES *)pUser;
+
+    while (cy--) {
+        memcpy(&pPlanes->pPlane[iPlane][(y++ * pPlanes->iPitch) + x], pData, cx);
+        pData += cx;
+    }
+} /* SeqRectCheck() */
+//
+// Create an animation/slideshow sequence: a keyframe followed by the
+// rectangles which changed from one frame to the next
+// (see EPD_SeqPlayFrame() in epd_decode.h)
+// A keyframe is stored every iKeyInterval frames (0 = only the first)
+// or whenever the delta would be larger
+// returns 1 for success, 0 for failure
+//
+int MakeSequence(char **pInNames, int iCount, EPD_OPTIONS *pOpts, int iKeyInterval, int iCost, char *szOutName, int iOutMode)
+{
+    EPD_PLANES prev, cur, panel;
+    EPD_OUTPUT out;
+    EPD_RECT *pRects;
+    uint8_t *pSeq = NULL, uc[8];
+    uint32_t *pFrames;
+    int i, j, y, iPlane, iRects, iSize, iLen = 0, iMax = 0, iKeyframes = 0, iLastKey = 0, rc = 0;
+    char szLeaf[256], szName[300], szSetName[256];
+
+    memset(&prev, 0, sizeof(prev));
+    memset(&panel, 0, sizeof(panel));
+    pFrames = (uint32_t *)malloc((iCount + 1) * sizeof(uint32_t));
+    if (!OpenOutput(&out, szOutName, iOutMode)) {
+        free(pFrames);
+        return 0;
+    }
+    GetLeafName(szOutName, szSetName);
+    FixName(szSetName);
+    fprintf(out.ohandle, "//\n// %s sequence\n//\n", szSetName);
+    fprintf(out.ohandle, "// for non-Arduino builds...\n");
+    fprintf(out.ohandle, "#ifndef PROGMEM\n#define PROGMEM\n#endif\n");
+    for (i=0; i<iCount; i++) {
+        if (!ConvertImage(pInNames[i], pOpts, &cur))
+            goto seq_exit;
+        if (i == 0) {
+            panel = cur; // simulated display memory
+            for (iPlane=0; iPlane<cur.iPlaneCount; iPlane++)
+                panel.pPlane[iPlane] = (uint8_t *)calloc(1, cur.iPlaneSize);
+            fprintf(out.ohandle, "// Image size: width %d, height %d\n", cur.iWidth, cur.iHeight);
+            fprintf(out.ohandle, "// %d bytes per line\n", cur.iPitch);
+            fprintf(out.ohandle, "// %d bytes per plane, %d plane(s)\n", cur.iPlaneSize, cur.iPlaneCount);
+            fprintf(out.ohandle, "#define %s_WIDTH %d\n#define %s_HEIGHT %d\n#define %s_PITCH %d\n", szSetName, cur.iWidth, szSetName, cur.iHeight, szSetName, cur.iPitch);
+            fprintf(out.ohandle, "#define %s_PLANES %d\n#define %s_FRAMES %d\n", szSetName, cur.iPlaneCount, szSetName, iCount);
+        } else if (cur.iWidth != prev.iWidth || cur.iHeight != prev.iHeight) {
+            printf("%s isn't the same size as the first frame\n", pInNames[i]);
+            FreePlanes(&cur);
+            goto seq_exit;
+        }
+        pFrames[i] = (uint32_t)iLen;
+        GetLeafName(pInNames[i], szLeaf);
+        iRects = 0; pRects = NULL;
+        iSize = cur.iPlaneSize * cur.iPlaneCount + 1; // keyframe size
+        if (i != 0 && (iKeyInterval == 0 || (i % iKeyInterval) != 0)) {
+            iRects = FindDeltaRects(&prev, &cur, iCost, &pRects);
+            j = 3 + (iRects * 8);
+            for (y=0; y<iRects; y++)
+                j += pRects[y].cx * pRects[y].cy * cur.iPlaneCount;
+            if (j < iSize && iRects < 65536) {
+                iSize = j;
+            } else { // cheaper to store all of it
+                free(pRects);
+                pRects = NULL;
+            }
+        }
+        if (pRects == NULL) {
+            uc[0] = EPD_SEQ_KEYFRAME;
+            AppendBytes(&pSeq, &iLen, &iMax, uc, 1);
+            for (iPlane=0; iPlane<cur.iPlaneCount; iPlane++)
+                AppendBytes(&pSeq, &iLen, &iMax, cur.pPlane[iPlane], cur.iPlaneSize);
+            iKeyframes++;
+            iLastKey = i;
+            fprintf(out.ohandle, "// frame %d (%s): keyframe, %d bytes\n", i, szLeaf, iSize);
+        } else {
+            uc[0] = EPD_SEQ_DELTA; uc[1] = (uint8_t)iRects; uc[2] = (uint8_t)(iRects >> 8);
+            AppendBytes(&pSeq, &iLen, &iMax, uc, 3);
+            for (j=0; j<iRects; j++) {
+                uc[0] = (uint8_t)pRects[j].x; uc[1] = (uint8_t)(pRects[j].x >> 8);
+                uc[2] = (uint8_t)pRects[j].y; uc[3] = (uint8_t)(pRects[j].y >> 8);
+                uc[4] = (uint8_t)pRects[j].cx; uc[5] = (uint8_t)(pRects[j].cx >> 8);
+                uc[6] = (uint8_t)pRects[j].cy; uc[7] = (uint8_t)(pRects[j].cy >> 8);
+                AppendBytes(&pSeq, &iLen, &iMax, uc, 8);
+                for (iPlane=0; iPlane<cur.iPlaneCount; iPlane++) {
+                    for (y=0; y<pRects[j].cy; y++)
+                        AppendBytes(&pSeq, &iLen, &iMax, &cur.pPlane[iPlane][((pRects[j].y + y) * cur.iPitch) + pRects[j].x], pRects[j].cx);
+                }
+            }
+            fprintf(out.ohandle, "// frame %d (%s): %d rectangles, %d bytes\n", i, szLeaf, iRects, iSize);
+            free(pRects);
+        }
+        // make sure that the device code gets to the same image
+        EPD_SeqPlayFrame(&pSeq[pFrames[i]], cur.iPlaneCount, cur.iPitch, cur.iHeight, SeqRectCheck, &panel);
+        for (iPlane=0; iPlane<cur.iPlaneCount; iPlane++) {
+            if (memcmp(panel.pPlane[iPlane], cur.pPlane[iPlane], cur.iPlaneSize) != 0) {
+                printf("Sequence verification failed on frame %d plane %d\n", i, iPlane);
+                FreePlanes(&cur);
+                goto seq_exit; // rc is still 0
+            }
+        }
+        if (EPD_SeqFindKeyframe(pSeq, pFrames, i) != iLastKey) {
+            printf("Sequence seek check failed on frame %d\n", i);
+            FreePlanes(&cur);
+            goto seq_exit;
+        }
+        FreePlanes(&prev);
+        prev = cur;
+    } // for each frame
+    pFrames[iCount] = (uint32_t)iLen;
+    j = prev.iPlaneSize * prev.iPlaneCount * iCount; // as separate full frames
+    fprintf(out.ohandle, "// %d frames (%d keyframes) in %d bytes, %d bytes as full frames (%d%%)\n", iCount, iKeyframes, iLen, j, (int)(((int64_t)iLen * 100) / j));
+    fprintf(out.ohandle, "// play each frame with EPD_SeqPlayFrame(&%s_seq[%s_frames[n]], ...) from epd_decode.h\n", szSetName, szSetName);
+    sprintf(szName, "%s_frames", szSetName);
+    WriteArray(&out, szName, pFrames, 4, iCount + 1);
+    sprintf(szName, "%s_seq", szSetName);
+    WriteArray(&out, szName, pSeq, 1, iLen);
+    printf("%d frames (%d keyframes), %d bytes as full frames stored in %d bytes (%d%%)\n", iCount, iKeyframes, j, iLen, (int)(((int64_t)iLen * 100) / j));
+    rc = 1;
+seq_exit:
+    CloseOutput(&out);
+    FreePlanes(&prev);
+    FreePlanes(&panel);
+    free(pSeq);
+    free(pFrames);
+    return rc;
+} /* MakeSequence() */
+//
+// Form the full output file name (relative names are in the current directory)
+//
+void MakeOutName(char *szArg, char *szOutName)
+{
+    if (szArg[0] != SLASH_CHAR) { // need to form full name
+       if (getcwd(szOutName, 256)) {
+	  int i;
+	  i = (int)strlen(szOutName);
+          szOutName[i] = SLASH_CHAR;
+	  szOutName[i+1] = 0;
+          strcat(szOutName, szArg);
+       }
+    } else {
+       strcpy(szOutName, szArg);
+    }
+} /* MakeOutName() */
+//
+// Create the output file(s) with the settings of pSettings (mode, word size,
+// endianness, alignment) and write the common header
+// szLeaf is changed into a usable C name
+// returns 1 for success, 0 for failure
+//
+int StartOutput(EPD_OUTPUT *pOut, EPD_OUTPUT *pSettings, char *szOutName, char *szLeaf, EPD_PLANES *pPlanes, int iOption, int bCompressed)
+{
+    if (!OpenOutput(pOut, szOutName, pSettings->iMode))
+       return 0;
+    pOut->iWordSize = pSettings->iWordSize;
+    pOut->bBigEndian = pSettings->bBigEndian;
+    pOut->iArrayAlign = pSettings->iArrayAlign;
+    fprintf(pOut->ohandle, "//\n// %s\n//\n", szLeaf); // comment header with filename
+    FixName(szLeaf); // remove unusable characters
+    fprintf(pOut->ohandle, "// for non-Arduino builds...\n");
+    fprintf(pOut->ohandle, "#ifndef PROGMEM\n#define PROGMEM\n#endif\n");
+    WriteHeaderInfo(pOut, szLeaf, pPlanes, iOption, bCompressed);
+    if (pPlanes->bVertical) {
+        fprintf(pOut->ohandle, "// Vertical bytes: %d pixels tall (top pixel in the LSBs), %d pages of %d bytes\n", (iOption == OPTION_BWYR) ? 4 : 8, pPlanes->iPlaneSize / pPlanes->iPitch, pPlanes->iPitch);
+    }
+    return 1;
+} /* StartOutput() */
+//
+// Write the uncompressed planes in the layout of the output format
+//
+void MakeC_PLAIN(EPD_PLANES *pPlanes, EPD_OUTPUT *pOut, char *szLeaf, int iOption, int bInterleave)
+{
+    if (bInterleave) {
+        MakeC_INTERLEAVED(pPlanes, pOut, szLeaf);
+        return;
+    }
+    switch (iOption) {
+        case OPTION_BW:
+            MakeC_BW(pPlanes, pOut, szLeaf); // create the output data
+            break;
+        case OPTION_BWR:
+        case OPTION_BWY:
+            MakeC_3CLR(pPlanes, pOut, szLeaf);
+            break;
+        case OPTION_BWYR:
+            MakeC_4CLR(pPlanes, pOut, szLeaf);
+            break;
+        case OPTION_4GRAY:
+            MakeC_4GRAY(pPlanes, pOut, szLeaf);
+            break;
+    } // switch
+} /* MakeC_PLAIN() */
+//
+// Parse an output spec for --TARGET: the format name followed by any of
+// :<degrees> :DITHER :MIRROR :FLIPV :INVERT (e.g. BWR:90:DITHER)
+// pOpts starts with the command line options and is changed to match
+// returns 1 for success, 0 for failure
+//
+int ParseTarget(char *szSpec, EPD_OPTIONS *pOpts)
+{
+    char szTemp[256], *szTok;
+    int i;
+
+    strncpy(szTemp, szSpec, sizeof(szTemp)-1);
+    szTemp[sizeof(szTemp)-1] = 0;
+    szTok = strtok(szTemp, ":");
+    for (i=0; szTok && i<OPTION_COUNT; i++) {
+        if (strcmp(szTok, szOptions[i]) == 0) break;
+    }
+    if (szTok == NULL || i == OPTION_COUNT) {
+        printf("Invalid target format: %s\n", szSpec);
+        return 0;
+    }
+    pOpts->iOption = i;
+    while ((szTok = strtok(NULL, ":")) != NULL) {
+        if (isdigit((unsigned char)szTok[0])) {
+            pOpts->iRotation = atoi(szTok);
+            if (pOpts->iRotation % 90 != 0 || pOpts->iRotation > 270) {
+                printf("Rotation angle must be 0, 90, 180 or 270\n");
+                return 0;
+            }
+        } else if (strcmp(szTok, "DITHER") == 0) {
+            pOpts->bDither = 1;
+        } else if (strcmp(szTok, "MIRROR") == 0) {
+            pOpts->bMirror = 1;
+        } else if (strcmp(szTok, "FLIPV") == 0) {
+            pOpts->bFlipv = 1;
+        } else if (strcmp(szTok, "INVERT") == 0) {
+            pOpts->bInvert = 1;
+        } else {
+            printf("Invalid target option: %s\n", szTok);
+            return 0;
+        }
+    }
+    return 1;
+} /* ParseTarget() */
+//
+// Convert the shared image for one target (runs on a worker thread)
+//
+void TargetJob(void *pUser, int iJob)
+{
+    EPD_TARGET *pTarget = &((EPD_TARGET *)pUser)[iJob];
+    pTarget->rc = ProcessImage(pTarget->pImage, &pTarget->opts, &pTarget->planes);
+} /* TargetJob() */
+//
+// Decode the input image once and create every --TARGET output from it
+// The dither/pack stages of the targets run in parallel, then the
+// output files are written in order
+// The arrays are named after each output file
+// returns 1 for success, 0 for failure
+//
+int MakeTargets(char *szInName, EPD_TARGET *pTargets, int iCount, EPD_OUTPUT *pSettings, int bInterleave)
+{
+    EPD_IMAGE image;
+    EPD_OUTPUT out;
+    int i, rc = 1;
+    int64_t llTime;
+    char szLeaf[256], szOutName[256];
+
+    llTime = GetMicros();
+    if (!DecodeImage(szInName, &image, 0, 0))
+        return 0;
+    for (i=0; i<iCount; i++) {
+        pTargets[i].pImage = &image;
+    }
+    RunJobs(TargetJob, pTargets, iCount);
+    llTime = GetMicros() - llTime;
+    for (i=0; i<iCount; i++) {
+        if (!pTargets[i].rc) {
+            rc = 0;
+            continue;
+        }
+        if (bInterleave && pTargets[i].planes.iPlaneCount != 2) {
+            printf("INTERLEAVE needs a 2-plane output format (%s)\n", pTargets[i].szOutName);
+            FreePlanes(&pTargets[i].planes);
+            rc = 0;
+            continue;
+        }
+        GetLeafName(pTargets[i].szOutName, szLeaf);
+        MakeOutName(pTargets[i].szOutName, szOutName);
+        if (StartOutput(&out, pSettings, szOutName, szLeaf, &pTargets[i].planes, pTargets[i].opts.iOption, 0)) {
+            MakeC_PLAIN(&pTargets[i].planes, &out, szLeaf, pTargets[i].opts.iOption, bInterleave);
+            CloseOutput(&out);
+            printf("%s: %s %dx%d\n", pTargets[i].szOutName, szOptions[pTargets[i].opts.iOption], pTargets[i].planes.iWidth, pTargets[i].planes.iHeight);
+        } else {
+            rc = 0;
+        }
+        FreePlanes(&pTargets[i].planes);
+    }
+    printf("%d targets from one decode, converted in %d ms\n", iCount, (int)(llTime / 1000));
+    FreeImage(&image);
+    return rc;
+} /* MakeTargets() */
+//
+// Convert a decoded image to 24-bpp (B,G,R) so that it can be resampled
+// returns 1 for success, 0 for failure
+//
+int MakeRGBImage(EPD_IMAGE *pSrc, EPD_IMAGE *pDest)
+{
+    int x, y, iSrcPitch, iPitch, iPixel;
+    uint8_t *s, *d;
+    EPD_TIMER timer;
+
+    memset(pDest, 0, sizeof(EPD_IMAGE));
+    if (pSrc->iBpp != 1 && pSrc->iBpp != 4 && pSrc->iBpp != 8 && pSrc->iBpp != 24 && pSrc->iBpp != 32) {
+        printf("Resizing doesn't support %d-bpp images\n", pSrc->iBpp);
+        return 0;
+    }
+    iSrcPitch = (((pSrc->iWidth * pSrc->iBpp) + 7)/8 + 3) & 0xfffc;
+    iPitch = ((pSrc->iWidth * 3) + 3) & 0xfffc;
+    pDest->pData = (uint8_t *)malloc(iPitch * pSrc->iHeight);
+    if (pDest->pData == NULL) {
+        printf("Error allocating memory\n");
+        return 0;
+    }
+    StatsBegin(&timer, STAGE_SCALE);
+    for (y=0; y<pSrc->iHeight; y++) {
+        s = &pSrc->pData[pSrc->iOffBits + (y * iSrcPitch)];
+        d = &pDest->pData[y * iPitch];
+        for (x=0; x<pSrc->iWidth; x++) {
+            if (pSrc->iBpp >= 24) {
+                memcpy(d, &s[x * (pSrc->iBpp/8)], 3);
+            } else {
+                if (pSrc->iBpp == 1)
+                    iPixel = (s[x >> 3] >> (7 - (x & 7))) & 1;
+                else if (pSrc->iBpp == 4)
+                    iPixel = (s[x >> 1] >> ((x & 1) ? 0 : 4)) & 0xf;
+                else
+                    iPixel = s[x];
+                d[0] = pSrc->ucBlue[iPixel];
+                d[1] = pSrc->ucGreen[iPixel];
+                d[2] = pSrc->ucRed[iPixel];
+            }
+            d += 3;
+        } // for x
+    } // for y
+    StatsEnd(&timer, iPitch * pSrc->iHeight);
+    pDest->iWidth = pSrc->iWidth;
+    pDest->iHeight = pSrc->iHeight;
+    pDest->iBpp = 24;
+    pDest->iSize = iPitch * pSrc->iHeight;
+    return 1;
+} /* MakeRGBImage() */
+//
+// Create the next level of a resampling pyramid (half the width and
+// height) by averaging each 2x2 block of a 24-bpp image
+// returns 1 for success, 0 for failure
+//
+int HalveImage(EPD_IMAGE *pSrc, EPD_IMAGE *pDest)
+{
+    int x, y, i, iSrcPitch, iPitch;
+    uint8_t *s, *d;
+    EPD_TIMER timer;
+
+    memset(pDest, 0, sizeof(EPD_IMAGE));
+    pDest->iWidth = pSrc->iWidth / 2;
+    pDest->iHeight = pSrc->iHeight / 2;
+    pDest->iBpp = 24;
+    iSrcPitch = ((pSrc->iWidth * 3) + 3) & 0xfffc;
+    iPitch = ((pDest->iWidth * 3) + 3) & 0xfffc;
+    pDest->iSize = iPitch * pDest->iHeight;
+    pDest->pData = (uint8_t *)malloc(pDest->iSize);
+    if (pDest->pData == NULL) {
+        printf("Error allocating memory\n");
+        return 0;
+    }
+    StatsBegin(&timer, STAGE_SCALE);
+    for (y=0; y<pDest->iHeight; y++) {
+        s = &pSrc->pData[(y * 2) * iSrcPitch];
+        d = &pDest->pData[y * iPitch];
+        for (x=0; x<pDest->iWidth; x++) {
+            for (i=0; i<3; i++) { // B,G,R
+                d[i] = (uint8_t)((s[i] + s[i+3] + s[iSrcPitch+i] + s[iSrcPitch+i+3] + 2) >> 2);
+            }
+            s += 6;
+            d += 3;
+        }
+    }
+    StatsEnd(&timer, pDest->iSize);
+    return 1;
+} /* HalveImage() */
+//
+// Size of an iWidth x iHeight image scaled to fit in cx x cy
+// (keeping its aspect ratio unless bStretch is set)
+//
+void FitSize(int iWidth, int iHeight, int cx, int cy, int bStretch, int *pCX, int *pCY)
+{
+    *pCX = cx;
+    *pCY = cy;
+    if (bStretch) return;
+    if ((int64_t)iWidth * cy > (int64_t)iHeight * cx) { // width is the limit
+        *pCY = (int)(((int64_t)iHeight * cx + iWidth/2) / iWidth);
+    } else {
+        *pCX = (int)(((int64_t)iWidth * cy + iHeight/2) / iHeight);
+    }
+    if (*pCX < 1) *pCX = 1;
+    if (*pCY < 1) *pCY = 1;
+} /* FitSize() */
+//
+// Resample a 24-bpp image to cx x cy with bilinear filtering and center it
+// in a white iWidth x iHeight image
+// returns 1 for success, 0 for failure
+//
+int ResampleImage(EPD_IMAGE *pSrc, EPD_IMAGE *pDest, int iWidth, int iHeight, int cx, int cy)
+{
+    int x, y, i, c, iSrcPitch, iPitch, fx, fy, *pX;
+    int32_t s32, t, b;
+    uint8_t *s0, *s1, *d;
+    EPD_TIMER timer;
+
+    memset(pDest, 0, sizeof(EPD_IMAGE));
+    iSrcPitch = ((pSrc->iWidth * 3) + 3) & 0xfffc;
+    iPitch = ((iWidth * 3) + 3) & 0xfffc;
+    pDest->iWidth = iWidth;
+    pDest->iHeight = iHeight;
+    pDest->iBpp = 24;
+    pDest->iSize = iPitch * iHeight;
+    pDest->pData = (uint8_t *)malloc(pDest->iSize);
+    pX = (int *)malloc(cx * 2 * sizeof(int)); // source column + weight of each output column
+    if (pDest->pData == NULL || pX == NULL) {
+        printf("Error allocating memory\n");
+        free(pX);
+        FreeImage(pDest);
+        return 0;
+    }
+    StatsBegin(&timer, STAGE_SCALE);
+    memset(pDest->pData, 0xff, pDest->iSize); // white border
+    for (x=0; x<cx; x++) { // 16.16 fixed point centers of the output pixels
+        s32 = (int32_t)((((int64_t)x * 2 + 1) * pSrc->iWidth * 32768) / cx) - 32768;
+        if (s32 < 0) s32 = 0;
+        pX[x*2] = s32 >> 16;
+        pX[x*2+1] = (s32 >> 8) & 0xff;
+        if (pX[x*2] >= pSrc->iWidth - 1) {
+            pX[x*2] = pSrc->iWidth - 1;
+            pX[x*2+1] = 0;
+        }
+    }
+    for (y=0; y<cy; y++) {
+        s32 = (int32_t)((((int64_t)y * 2 + 1) * pSrc->iHeight * 32768) / cy) - 32768;
+        if (s32 < 0) s32 = 0;
+        fy = (s32 >> 8) & 0xff;
+        s0 = &pSrc->pData[(s32 >> 16) * iSrcPitch];
+        s1 = ((s32 >> 16) < pSrc->iHeight - 1) ? s0 + iSrcPitch : s0;
+        d = &pDest->pData[((y + (iHeight - cy)/2) * iPitch) + (((iWidth - cx)/2) * 3)];
+        for (x=0; x<cx; x++) {
+            i = pX[x*2] * 3;
+            fx = pX[x*2+1];
+            for (c=0; c<3; c++) { // B,G,R
+                t = s0[i+c] << 8;
+                b = s1[i+c] << 8;
+                if (fx) { // (the last column has no right neighbor)
+                    t += (s0[i+c+3] - s0[i+c]) * fx;
+                    b += (s1[i+c+3] - s1[i+c]) * fx;
+                }
+                *d++ = (uint8_t)(((t << 8) + (b - t) * fy + 32768) >> 16);
+            }
+        } // for x
+    } // for y
+    StatsEnd(&timer, pDest->iSize);
+    free(pX);
+    return 1;
+} /* ResampleImage() */
+//
+// Parse one entry of the --SIZES list: <width>x<height>[!][:<target spec>]
+// (e.g. 296x128:BWR:DITHER); ! stretches the image to fill the size
+// pSize->opts starts with the command line options and is changed to match
+// returns 1 for success, 0 for failure
+//
+int ParseSize(char *szSpec, EPD_SIZE *pSize)
+{
+    char *s;
+
+    pSize->iWidth = (int)strtol(szSpec, &s, 10);
+    if (*s == 'x' || *s == 'X')
+        pSize->iHeight = (int)strtol(s+1, &s, 10);
+    if (*s == '!') {
+        pSize->bStretch = 1;
+        s++;
+    }
+    if (pSize->iWidth < 1 || pSize->iHeight < 1 || pSize->iWidth > 8192 || pSize->iHeight > 8192 || (*s && *s != ':')) {
+        printf("Invalid size: %s (expected e.g. 250x122 or 296x128:BWR)\n", szSpec);
+        return 0;
+    }
+    if (*s == ':')
+        return ParseTarget(s+1, &pSize->opts);
+    return 1;
+} /* ParseSize() */
+//
+// Resample the pyramid to one size and convert it (runs on a worker thread)
+//
+void SizeJob(void *pUser, int iJob)
+{
+    EPD_SIZE *pSize = &((EPD_SIZE *)pUser)[iJob];
+    EPD_IMAGE image;
+    int i, w = pSize->iWidth, h = pSize->iHeight, cx, cy;
+
+    if (pSize->opts.iRotation == 90 || pSize->opts.iRotation == 270) { // resample before rotating
+        w = pSize->iHeight;
+        h = pSize->iWidth;
+    }
+    FitSize(pSize->pLevels[0].iWidth, pSize->pLevels[0].iHeight, w, h, pSize->bStretch, &cx, &cy);
+    // the smallest level which is still at least as large as the output
+    for (i=pSize->iLevels-1; i>0; i--) {
+        if (pSize->pLevels[i].iWidth >= cx && pSize->pLevels[i].iHeight >= cy) break;
+    }
+    pSize->rc = ResampleImage(&pSize->pLevels[i], &image, w, h, cx, cy);
+    if (pSize->rc) {
+        pSize->rc = ProcessImage(&image, &pSize->opts, &pSize->planes);
+        FreeImage(&image);
+    }
+} /* SizeJob() */
+//
+// Decode the input image once and write every --SIZES variant of it to
+// one output file. JPEG images are decoded with the largest DCT scaling
+// which still covers the biggest size. The image is reduced by a pyramid
+// of 2x2 averages, then each size is resampled from the closest level
+// and converted in parallel
+// The arrays are named <leaf>_<width>x<height>
+// returns 1 for success, 0 for failure
+//
+int MakeSizes(char *szInName, EPD_SIZE *pSizes, int iCount, EPD_OUTPUT *pSettings, char *szOutName, int bInterleave)
+{
+    EPD_IMAGE image, levels[MAX_LEVELS];
+    EPD_OUTPUT out;
+    int i, w, h, cx, cy, iMinW = 0, iMinH = 0, iNeedW = 0x7fffffff, iNeedH = 0x7fffffff, iLevels, rc = 1;
+    int64_t llTime;
+    char szLeaf[256], szName[300];
+
+    llTime = GetMicros();
+    for (i=0; i<iCount; i++) { // decode at least as large as the largest size
+        w = pSizes[i].iWidth; h = pSizes[i].iHeight;
+        if (pSizes[i].opts.iRotation == 90 || pSizes[i].opts.iRotation == 270) {
+            w = pSizes[i].iHeight; h = pSizes[i].iWidth;
+        }
+        if (w > iMinW) iMinW = w;
+        if (h > iMinH) iMinH = h;
+    }
+    if (!DecodeImage(szInName, &image, iMinW, iMinH))
+        return 0;
+    i = MakeRGBImage(&image, &levels[0]);
+    FreeImage(&image);
+    if (!i)
+        return 0;
+    for (i=0; i<iCount; i++) { // the smallest image needed
+        w = pSizes[i].iWidth; h = pSizes[i].iHeight;
+        if (pSizes[i].opts.iRotation == 90 || pSizes[i].opts.iRotation == 270) {
+            w = pSizes[i].iHeight; h = pSizes[i].iWidth;
+        }
+        FitSize(levels[0].iWidth, levels[0].iHeight, w, h, pSizes[i].bStretch, &cx, &cy);
+        if (cx < iNeedW) iNeedW = cx;
+        if (cy < iNeedH) iNeedH = cy;
+    }
+    for (iLevels=1; iLevels<MAX_LEVELS; iLevels++) {
+        if (levels[iLevels-1].iWidth/2 < iNeedW || levels[iLevels-1].iHeight/2 < iNeedH)
+            break; // no size would use a smaller level
+        if (!HalveImage(&levels[iLevels-1], &levels[iLevels]))
+            break;
+    }
+    for (i=0; i<iCount; i++) {
+        pSizes[i].pLevels = levels;
+        pSizes[i].iLevels = iLevels;
+    }
+    RunJobs(SizeJob, pSizes, iCount);
+    llTime = GetMicros() - llTime;
+    if (!OpenOutput(&out, szOutName, pSettings->iMode)) {
+        rc = 0;
+    } else {
+        out.iWordSize = pSettings->iWordSize;
+        out.bBigEndian = pSettings->bBigEndian;
+        out.iArrayAlign = pSettings->iArrayAlign;
+        GetLeafName(szInName, szLeaf);
+        fprintf(out.ohandle, "//\n// %s in %d sizes\n//\n", szLeaf, iCount);
+        FixName(szLeaf);
+        fprintf(out.ohandle, "// for non-Arduino builds...\n");
+        fprintf(out.ohandle, "#ifndef PROGMEM\n#define PROGMEM\n#endif\n");
+    }
+    for (i=0; i<iCount; i++) {
+        if (!pSizes[i].rc) {
+            rc = 0;
+            continue;
+        }
+        if (bInterleave && pSizes[i].planes.iPlaneCount != 2) {
+            printf("INTERLEAVE needs a 2-plane output format (%dx%d)\n", pSizes[i].iWidth, pSizes[i].iHeight);
+            rc = 0;
+        }
+        if (rc) {
+            sprintf(szName, "%s_%dx%d", szLeaf, pSizes[i].iWidth, pSizes[i].iHeight);
+            fprintf(out.ohandle, "#define %s_WIDTH %d\n#define %s_HEIGHT %d\n#define %s_PITCH %d\n", szName, pSizes[i].planes.iWidth, szName, pSizes[i].planes.iHeight, szName, pSizes[i].planes.iPitch);
+            fprintf(out.ohandle, "#define %s_PLANES %d\n", szName, pSizes[i].planes.iPlaneCount);
+            fprintf(out.ohandle, "#define %s_FORMAT %d // %s (0=BW, 1=BWR, 2=BWY, 3=BWYR, 4=4GRAY)\n", szName, pSizes[i].opts.iOption, szOptions[pSizes[i].opts.iOption]);
+            if (pSizes[i].planes.bVertical) {
+                fprintf(out.ohandle, "#define %s_VERTICAL 1 // _PITCH bytes per page\n", szName);
+            }
+            MakeC_PLAIN(&pSizes[i].planes, &out, szName, pSizes[i].opts.iOption, bInterleave);
+            printf("%s: %s %dx%d\n", szName, szOptions[pSizes[i].opts.iOption], pSizes[i].planes.iWidth, pSizes[i].planes.iHeight);
+        }
+        FreePlanes(&pSizes[i].planes);
+    }
+    if (out.ohandle) CloseOutput(&out);
+    printf("%d sizes from one decode (%dx%d, %d pyramid levels), converted in %d ms\n", iCount, levels[0].iWidth, levels[0].iHeight, iLevels, (int)(llTime / 1000));
+    for (i=0; i<iLevels; i++)
+        FreeImage(&levels[i]);
+    return rc;
+} /* MakeSizes() */
+//
+// Scale a decoded image to fit in iWidth x iHeight (centered on white)
+// or to fill it if bStretch is set. The image is halved with 2x2 averages
+// until it's less than twice the size, then resampled bilinearly
+// returns 1 for success, 0 for failure
+//
+int ScaleImage(EPD_IMAGE *pSrc, int iWidth, int iHeight, int bStretch, EPD_IMAGE *pDest)
+{
+    EPD_IMAGE level, half;
+    int cx, cy, rc;
+
+    if (!MakeRGBImage(pSrc, &level))
+        return 0;
+    FitSize(level.iWidth, level.iHeight, iWidth, iHeight, bStretch, &cx, &cy);
+    while (level.iWidth/2 >= cx && level.iHeight/2 >= cy) {
+        if (!HalveImage(&level, &half))
+            break;
+        FreeImage(&level);
+        level = half;
+    }
+    rc = ResampleImage(&level, pDest, iWidth, iHeight, cx, cy);
+    FreeImage(&level);
+    return rc;
+} /* ScaleImage() */
+//
+// Copy the cx x cy area at x,y of a prepared image (any bpp) with
+// enough room to rotate it by iRotation degrees
+// returns 1 for success, 0 for failure
+//
+int CropImage(EPD_IMAGE *pSrc, int x, int y, int cx, int cy, int iRotation, EPD_IMAGE *pDest)
+{
+    int i, j, iSrcPitch, iPitch, iSize, iBpp = pSrc->iBpp;
+    uint8_t *s, *d;
+    EPD_TIMER timer;
+
+    memcpy(pDest, pSrc, sizeof(EPD_IMAGE)); // size and palette
+    iSrcPitch = (((pSrc->iWidth * iBpp) + 7)/8 + 3) & 0xfffc;
+    iPitch = (((cx * iBpp) + 7)/8 + 3) & 0xfffc;
+    pDest->iWidth = cx;
+    pDest->iHeight = cy;
+    pDest->iOffBits = 0;
+    pDest->iSize = iPitch * cy;
+    iSize = pDest->iSize;
+    if (iRotation == 90 || iRotation == 270) {
+        i = ((((cy * iBpp) + 7)/8 + 3) & 0xfffc) * cx;
+        if (i > iSize) iSize = i;
+    }
+    pDest->pData = (uint8_t *)calloc(1, iSize + 4);
+    if (pDest->pData == NULL) {
+        printf("Error allocating memory\n");
+        return 0;
+    }
+    StatsBegin(&timer, STAGE_ORIENT);
+    for (j=0; j<cy; j++) {
+        s = &pSrc->pData[pSrc->iOffBits + ((y + j) * iSrcPitch)];
+        d = &pDest->pData[j * iPitch];
+        if (iBpp >= 8) {
+            memcpy(d, &s[(x * iBpp)/8], (cx * iBpp)/8);
+        } else if (iBpp == 4) { // first pixel in the upper nibble
+            for (i=0; i<cx; i++) {
+                uint8_t uc = (uint8_t)((s[(x+i) >> 1] >> (((x+i) & 1) ? 0 : 4)) & 0xf);
+                d[i >> 1] |= (i & 1) ? uc : (uint8_t)(uc << 4);
+            }
+        } else { // 1-bpp, same bit order as GetGrayPixel()
+            for (i=0; i<cx; i++) {
+                if (s[(x+i) >> 3] & (1 << ((x+i) & 7)))
+                    d[i >> 3] |= (uint8_t)(1 << (i & 7));
+            }
+        }
+    }
+    StatsEnd(&timer, pDest->iSize);
+    return 1;
+} /* CropImage() */
+//
+// Parse one --WALLPANEL entry: <col>,<row>:<format>[:<degrees>]
+// returns 1 for success, 0 for failure
+//
+int ParsePanel(char *szSpec, EPD_PANEL *pPanel, int iCols, int iRows)
+{
+    EPD_OPTIONS opts = pPanel->opts;
+    char *s;
+
+    pPanel->iCol = (int)strtol(szSpec, &s, 10);
+    if (*s == ',')
+        pPanel->iRow = (int)strtol(s+1, &s, 10);
+    if (s == szSpec || *s != ':' || pPanel->iCol < 0 || pPanel->iCol >= iCols || pPanel->iRow < 0 || pPanel->iRow >= iRows) {
+        printf("Invalid wall panel: %s (expected <col>,<row>:<format>[:<degrees>] inside the %dx%d wall)\n", szSpec, iCols, iRows);
+        return 0;
+    }
+    if (!ParseTarget(s+1, &pPanel->opts))
+        return 0;
+    if (opts.bDither != pPanel->opts.bDither || opts.bMirror != pPanel->opts.bMirror || opts.bFlipv != pPanel->opts.bFlipv || opts.bInvert != pPanel->opts.bInvert) {
+        printf("Wall panels can only change the format and rotation (%s)\n", szSpec);
+        return 0;
+    }
+    return 1;
+} /* ParsePanel() */
+//
+// Orient/invert/dither the whole wall canvas for one format (worker thread)
+//
+void CanvasJob(void *pUser, int iJob)
+{
+    EPD_CANVAS *pCanvas = &((EPD_CANVAS *)pUser)[iJob];
+    pCanvas->rc = PrepareImage(pCanvas->pSource, &pCanvas->opts, &pCanvas->image);
+} /* CanvasJob() */
+//
+// Cut one panel out of its canvas, rotate and pack it (worker thread)
+//
+void PanelJob(void *pUser, int iJob)
+{
+    EPD_PANEL *pPanel = &((EPD_PANEL *)pUser)[iJob];
+    EPD_IMAGE image;
+
+    pPanel->rc = CropImage(pPanel->pCanvas, pPanel->x, pPanel->y, pPanel->cx, pPanel->cy, pPanel->opts.iRotation, &image);
+    if (pPanel->rc) {
+        pPanel->rc = PackImage(&image, &pPanel->opts, &pPanel->planes);
+        FreeImage(&image);
+    }
+} /* PanelJob() */
+//
+// Convert an image for a video wall of iCols x iRows panels of
+// iWidth x iHeight pixels, with iGapX/iGapY pixels hidden behind the
+// bezels between them. The image is decoded and scaled to the whole wall
+// once and each output format is dithered in one pass over the whole
+// canvas, so the dither pattern continues across the panels. Then each
+// panel is cut out, rotated for the way it's mounted and packed
+// The arrays are named <leaf>_c<col>r<row>
+// returns 1 for success, 0 for failure
+//
+int MakeWall(char *szInName, EPD_PANEL *pPanels, int iCols, int iRows, int iWidth, int iHeight, int iGapX, int iGapY, EPD_OUTPUT *pSettings, char *szOutName, int bInterleave)
+{
+    EPD_IMAGE image, scaled, *pSource;
+    EPD_CANVAS canvas[OPTION_COUNT];
+    EPD_OUTPUT out;
+    int i, j, iCanvases = 0, iPanels = iCols * iRows, iCanvasW, iCanvasH, rc = 1;
+    int64_t llTime;
+    char szLeaf[256], szName[300];
+
+    llTime = GetMicros();
+    iCanvasW = (iCols * iWidth) + ((iCols - 1) * iGapX);
+    iCanvasH = (iRows * iHeight) + ((iRows - 1) * iGapY);
+    if (!DecodeImage(szInName, &image, iCanvasW, iCanvasH))
+        return 0;
+    pSource = &image;
+    if (image.iWidth != iCanvasW || image.iHeight != iCanvasH) {
+        if (!ScaleImage(&image, iCanvasW, iCanvasH, 0, &scaled)) {
+            FreeImage(&image);
+            return 0;
+        }
+        FreeImage(&image);
+        pSource = &scaled;
+    }
+    // one dither pass over the whole canvas for each format used
+    for (i=0; i<iPanels; i++) {
+        for (j=0; j<iCanvases && canvas[j].opts.iOption != pPanels[i].opts.iOption; j++) {};
+        if (j == iCanvases) {
+            memset(&canvas[j], 0, sizeof(EPD_CANVAS));
+            canvas[j].opts = pPanels[i].opts;
+            canvas[j].opts.iRotation = 0; // each panel is rotated after it's cut out
+            canvas[j].pSource = pSource;
+            iCanvases++;
+        }
+        pPanels[i].pCanvas = &canvas[j].image;
+        pPanels[i].x = pPanels[i].iCol * (iWidth + iGapX);
+        pPanels[i].y = pPanels[i].iRow * (iHeight + iGapY);
+        pPanels[i].cx = iWidth;
+        pPanels[i].cy = iHeight;
+    }
+    RunJobs(CanvasJob, canvas, iCanvases);
+    FreeImage(pSource);
+    for (j=0; j<iCanvases; j++) {
+        if (!canvas[j].rc) rc = 0;
+    }
+    if (rc) {
+        RunJobs(PanelJob, pPanels, iPanels);
+    }
+    for (j=0; j<iCanvases; j++) {
+        if (canvas[j].rc) FreeImage(&canvas[j].image);
+    }
+    if (!rc)
+        return 0;
+    llTime = GetMicros() - llTime;
+    if (!OpenOutput(&out, szOutName, pSettings->iMode)) {
+        rc = 0;
+    } else {
+        out.iWordSize = pSettings->iWordSize;
+        out.bBigEndian = pSettings->bBigEndian;
+        out.iArrayAlign = pSettings->iArrayAlign;
+        GetLeafName(szInName, szLeaf);
+        fprintf(out.ohandle, "//\n// %s on a %dx%d wall of %dx%d panels\n//\n", szLeaf, iCols, iRows, iWidth, iHeight);
+        FixName(szLeaf);
+        fprintf(out.ohandle, "// for non-Arduino builds...\n");
+        fprintf(out.ohandle, "#ifndef PROGMEM\n#define PROGMEM\n#endif\n");
+        fprintf(out.ohandle, "#define %s_WALL_COLS %d\n#define %s_WALL_ROWS %d\n", szLeaf, iCols, szLeaf, iRows);
+    }
+    for (i=0; i<iPanels; i++) {
+        if (!pPanels[i].rc) {
+            rc = 0;
+            continue;
+        }
+        if (bInterleave && pPanels[i].planes.iPlaneCount != 2) {
+            printf("INTERLEAVE needs a 2-plane output format (panel %d,%d)\n", pPanels[i].iCol, pPanels[i].iRow);
+            rc = 0;
+        }
+        if (rc) {
+            sprintf(szName, "%s_c%dr%d", szLeaf, pPanels[i].iCol, pPanels[i].iRow);
+            fprintf(out.ohandle, "#define %s_WIDTH %d\n#define %s_HEIGHT %d\n#define %s_PITCH %d\n", szName, pPanels[i].planes.iWidth, szName, pPanels[i].planes.iHeight, szName, pPanels[i].planes.iPitch);
+            fprintf(out.ohandle, "#define %s_PLANES %d\n", szName, pPanels[i].planes.iPlaneCount);
+            fprintf(out.ohandle, "#define %s_FORMAT %d // %s (0=BW, 1=BWR, 2=BWY, 3=BWYR, 4=4GRAY)\n", szName, pPanels[i].opts.iOption, szOptions[pPanels[i].opts.iOption]);
+            fprintf(out.ohandle, "#define %s_ROTATION %d\n", szName, pPanels[i].opts.iRotation);
+            if (pPanels[i].planes.bVertical) {
+                fprintf(out.ohandle, "#define %s_VERTICAL 1 // _PITCH bytes per page\n", szName);
+            }
+            MakeC_PLAIN(&pPanels[i].planes, &out, szName, pPanels[i].opts.iOption, bInterleave);
+        }
+        FreePlanes(&pPanels[i].planes);
+    }
+    if (out.ohandle) CloseOutput(&out);
+    printf("%d panels (%dx%d canvas) from one decode and %d dither pass(es), converted in %d ms\n", iPanels, iCanvasW, iCanvasH, iCanvases, (int)(llTime / 1000));
+    return rc;
+} /* MakeWall() */
+//
+// Add a frame to the list (grows it as needed)
+// returns 1 for success, 0 for failure
+//
+int AddFrame(EPD_FRAME **ppFrames, int *pCount, const char *szName, int x, int y, int cx, int cy)
+{
+    EPD_FRAME *pFrame;
+
+    if (*pCount == MAX_FRAMES) {
+        printf("Too many frames (up to %d)\n", MAX_FRAMES);
+        return 0;
+    }
+    if ((*pCount & 63) == 0) {
+        *ppFrames = (EPD_FRAME *)realloc(*ppFrames, (*pCount + 64) * sizeof(EPD_FRAME));
+    }
+    pFrame = &(*ppFrames)[(*pCount)++];
+    memset(pFrame, 0, sizeof(EPD_FRAME));
+    strncpy(pFrame->szName, szName, sizeof(pFrame->szName)-1);
+    pFrame->x = x; pFrame->y = y;
+    pFrame->cx = cx; pFrame->cy = cy;
+    return 1;
+} /* AddFrame() */
+//
+// Read a JSON string starting at the opening quote
+// returns a pointer past the closing quote
+//
+char *ReadJSONString(char *s, char *szDest, int iMax)
+{
+    int i = 0;
+
+    s++; // skip the quote
+    while (*s && *s != '"') {
+        if (*s == '\\' && s[1]) s++; // keep the escaped character
+        if (i < iMax-1) szDest[i++] = *s;
+        s++;
+    }
+    szDest[i] = 0;
+    return (*s) ? s+1 : s;
+} /* ReadJSONString() */
+//
+// Read a JSON frame list (the TexturePacker style "hash" or "array"
+// exports used by most sprite tools). Every "frame":{"x":,"y":,"w":,"h":}
+// object becomes a frame, named by the "filename" of its entry or by the
+// key of the object holding it
+// returns the number of frames, 0 for failure
+//
+int ReadFrameList(char *szFile, EPD_FRAME **ppFrames)
+{
+    FILE *f;
+    char *pText, *s, szKey[256], szFile2[256], szParent[256], szName[256];
+    int i, iSize, iCount = 0, x, y, cx, cy, bRotated = 0;
+
+    *ppFrames = NULL;
+    f = fopen(szFile, "rb");
+    if (f == NULL) {
+        printf("Unable to open frame list: %s\n", szFile);
+        return 0;
+    }
+    fseek(f, 0L, SEEK_END);
+    iSize = (int)ftell(f);
+    fseek(f, 0, SEEK_SET);
+    pText = (char *)malloc(iSize + 1);
+    iSize = (int)fread(pText, 1, iSize, f);
+    pText[iSize] = 0;
+    fclose(f);
+    szFile2[0] = szParent[0] = 0;
+    s = pText;
+    while (*s) {
+        if (*s != '"') {
+            s++;
+            continue;
+        }
+        s = ReadJSONString(s, szKey, sizeof(szKey));
+        while (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n') s++;
+        if (*s != ':') continue; // a value, not a key
+        s++;
+        while (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n') s++;
+        if (strcmp(szKey, "filename") == 0 && *s == '"') {
+            s = ReadJSONString(s, szFile2, sizeof(szFile2));
+        } else if (strcmp(szKey, "rotated") == 0 && strncmp(s, "true", 4) == 0) {
+            bRotated = 1;
+        } else if (strcmp(szKey, "frame") == 0 && *s == '{') {
+            x = y = cx = cy = -1;
+            while (*s && *s != '}') { // the x/y/w/h members
+                if (*s == '"') {
+                    s = ReadJSONString(s, szKey, sizeof(szKey));
+                    while (*s && *s != ':' && *s != '}') s++;
+                    if (*s != ':') continue;
+                    i = (int)strtol(s+1, &s, 10);
+                    if (strcmp(szKey, "x") == 0) x = i;
+                    else if (strcmp(szKey, "y") == 0) y = i;
+                    else if (strcmp(szKey, "w") == 0) cx = i;
+                    else if (strcmp(szKey, "h") == 0) cy = i;
+                } else {
+                    s++;
+                }
+            }
+            if (x < 0 || y < 0 || cx < 1 || cy < 1) {
+                printf("Invalid frame in %s\n", szFile);
+                iCount = 0;
+                break;
+            }
+            GetLeafName((szFile2[0]) ? szFile2 : szParent, szName); // without a path or extension
+            if (szName[0] == 0) sprintf(szName, "f%d", iCount);
+            if (!AddFrame(ppFrames, &iCount, szName, x, y, cx, cy)) {
+                iCount = 0;
+                break;
+            }
+            szFile2[0] = 0;
+        } else if (*s == '{') {
+            strcpy(szParent, szKey); // a frame may be inside this object
+        }
+    }
+    free(pText);
+    if (iCount && bRotated) {
+        printf("Rotated frames aren't supported; export the sheet without rotation\n");
+        iCount = 0;
+    }
+    if (iCount == 0) {
+        free(*ppFrames);
+        *ppFrames = NULL;
+        printf("No frames found in %s\n", szFile);
+    }
+    return iCount;
+} /* ReadFrameList() */
+//
+// Cut one frame out of the sheet and convert it (runs on a worker thread)
+// Each frame is dithered on its own so that its edges don't depend on
+// its neighbors
+//
+void FrameJob(void *pUser, int iJob)
+{
+    EPD_FRAME *pFrame = &((EPD_FRAME *)pUser)[iJob];
+    EPD_IMAGE image;
+
+    pFrame->rc = CropImage(pFrame->pSheet, pFrame->x, pFrame->y, pFrame->cx, pFrame->cy, 0, &image);
+    if (pFrame->rc) {
+        pFrame->rc = ProcessImage(&image, &pFrame->opts, &pFrame->planes);
+        FreeImage(&image);
+    }
+} /* FrameJob() */
+//
+// Decode a sprite sheet once and convert each frame of it in parallel
+// The frames are given by a grid (szSpec = <width>x<height>[:<count>],
+// left to right, top to bottom) or by a JSON frame list (szSpec = file)
+// Each frame is written as its own arrays (<leaf>_<frame name>_N) or, with
+// bOneArray, all of them go in <leaf>_data with an offset table
+// returns 1 for success, 0 for failure
+//
+int MakeSprites(char *szInName, char *szSpec, EPD_OPTIONS *pOpts, EPD_OUTPUT *pSettings, char *szOutName, int bOneArray, int bInterleave)
+{
+    EPD_IMAGE sheet;
+    EPD_FRAME *pFrames = NULL;
+    EPD_OUTPUT out;
+    int i, j, x, y, cx = 0, cy = 0, iCount = 0, iMax = 0, iLen, iWord, rc = 1;
+    uint8_t *pData = NULL;
+    uint32_t *pOffsets = NULL;
+    uint16_t *pSizes = NULL;
+    int64_t llTime;
+    char szLeaf[256], szName[256 + 64]; // <leaf>_<frame name>
+
+    llTime = GetMicros();
+    if (!DecodeImage(szInName, &sheet, 0, 0))
+        return 0;
+    if (isdigit((unsigned char)szSpec[0])) { // a grid of equal cells
+        iMax = 0x7fffffff;
+        if (sscanf(szSpec, "%dx%d:%d", &cx, &cy, &iMax) < 2 || cx < 1 || cy < 1 || iMax < 1) {
+            printf("Invalid sprite grid: %s (expected <width>x<height>[:<count>])\n", szSpec);
+            FreeImage(&sheet);
+            return 0;
+        }
+        for (y=0; y+cy <= sheet.iHeight && iCount < iMax; y += cy) {
+            for (x=0; x+cx <= sheet.iWidth && iCount < iMax; x += cx) {
+                snprintf(szName, sizeof(szName), "f%d", iCount);
+                if (!AddFrame(&pFrames, &iCount, szName, x, y, cx, cy)) {
+                    rc = 0;
+                    break;
+                }
+            }
+        }
+    } else {
+        iCount = ReadFrameList(szSpec, &pFrames);
+    }
+    if (iCount == 0)
+        rc = 0;
+    for (i=0; rc && i<iCount; i++) {
+        if (pFrames[i].x + pFrames[i].cx > sheet.iWidth || pFrames[i].y + pFrames[i].cy > sheet.iHeight) {
+            printf("Frame %s is outside of the %dx%d sheet\n", pFrames[i].szName, sheet.iWidth, sheet.iHeight);
+            rc = 0;
+        }
+        FixName(pFrames[i].szName);
+        for (j=0; rc && j<i; j++) {
+            if (strcmp(pFrames[i].szName, pFrames[j].szName) == 0) {
+                printf("Two frames are named %s\n", pFrames[i].szName);
+                rc = 0;
+            }
+        }
+        pFrames[i].opts = *pOpts;
+        pFrames[i].pSheet = &sheet;
+    }
+    if (!rc) {
+        free(pFrames);
+        FreeImage(&sheet);
+        return 0;
+    }
+    RunJobs(FrameJob, pFrames, iCount);
+    FreeImage(&sheet);
+    llTime = GetMicros() - llTime;
+    for (i=0; i<iCount; i++) {
+        if (!pFrames[i].rc) rc = 0;
+        else if (bInterleave && pFrames[i].planes.iPlaneCount != 2) {
+            printf("INTERLEAVE needs a 2-plane output format\n");
+            rc = 0;
+        }
+    }
+    if (rc && OpenOutput(&out, szOutName, pSettings->iMode)) {
+        out.iWordSize = pSettings->iWordSize;
+        out.bBigEndian = pSettings->bBigEndian;
+        out.iArrayAlign = pSettings->iArrayAlign;
+        GetLeafName(szInName, szLeaf);
+        fprintf(out.ohandle, "//\n// %s sprite sheet, %d frames\n//\n", szLeaf, iCount);
+        FixName(szLeaf);
+        fprintf(out.ohandle, "// for non-Arduino builds...\n");
+        fprintf(out.ohandle, "#ifndef PROGMEM\n#define PROGMEM\n#endif\n");
+        fprintf(out.ohandle, "#define %s_FRAMES %d\n#define %s_PLANES %d\n", szLeaf, iCount, szLeaf, pFrames[0].planes.iPlaneCount);
+        fprintf(out.ohandle, "#define %s_FORMAT %d // %s (0=BW, 1=BWR, 2=BWY, 3=BWYR, 4=4GRAY)\n", szLeaf, pOpts->iOption, szOptions[pOpts->iOption]);
+        if (bOneArray) { // frame = planes one after the other, starting on a word boundary
+            iWord = (out.iWordSize > 1) ? out.iWordSize : 1;
+            pOffsets = (uint32_t *)malloc((iCount + 1) * sizeof(uint32_t));
+            pSizes = (uint16_t *)malloc(iCount * 3 * sizeof(uint16_t));
+            for (i=0, iLen=0; i<iCount; i++) {
+                iLen += pFrames[i].planes.iPlaneSize * pFrames[i].planes.iPlaneCount;
+                iLen = ((iLen + iWord - 1) / iWord) * iWord;
+            }
+            pData = (uint8_t *)calloc(1, iLen + 1);
+            for (i=0, iLen=0; i<iCount; i++) {
+                fprintf(out.ohandle, "#define %s_%s %d // %dx%d\n", szLeaf, pFrames[i].szName, i, pFrames[i].planes.iWidth, pFrames[i].planes.iHeight);
+                pOffsets[i] = (uint32_t)iLen;
+                pSizes[i*3] = (uint16_t)pFrames[i].planes.iWidth;
+                pSizes[i*3+1] = (uint16_t)pFrames[i].planes.iHeight;
+                pSizes[i*3+2] = (uint16_t)pFrames[i].planes.iPitch;
+                for (j=0; j<pFrames[i].planes.iPlaneCount; j++) {
+                    memcpy(&pData[iLen], pFrames[i].planes.pPlane[j], pFrames[i].planes.iPlaneSize);
+                    iLen += pFrames[i].planes.iPlaneSize;
                 }
-                // calculate the Floyd-Steinberg error for this pixel
-                v = cNew - (cNew & pixelmask); // new error for N-bit gray output (always positive)
-                h = v >> 1;
-                e1 = (7*h)>>3;  // 7/16
-                e2 = h - e1;  // 1/16
-                e3 = (5*h) >> 3;   // 5/16
-                e4 = h - e3;  // 3/16
-                // distribute error to neighbors
-                lFErr = e1 + pErrors[1];
-                pErrors[1] = (uint8_t)e2;
-                pErrors[0] += e3;
-                pErrors[-1] += e4;
-                pErrors++;
-            } // for x
-            if (iWidth & 7) {
-                cOut <<= (8-(x & 7));
-                *d++ = cOut; // store partial byte
+                iLen = ((iLen + iWord - 1) / iWord) * iWord;
+            }
+            pOffsets[iCount] = (uint32_t)iLen;
+            fprintf(out.ohandle, "// Offset of each frame in %s_data (+ the total size), the planes of a frame follow each other\n", szLeaf);
+            snprintf(szName, sizeof(szName), "%s_offsets", szLeaf);
+            WriteArray(&out, szName, pOffsets, 4, iCount + 1);
+            fprintf(out.ohandle, "// Width, height and bytes per line of each frame\n");
+            snprintf(szName, sizeof(szName), "%s_sizes", szLeaf);
+            WriteArray(&out, szName, pSizes, 2, iCount * 3);
+            snprintf(szName, sizeof(szName), "%s_data", szLeaf);
+            WritePlaneData(&out, szName, pData, iLen);
+            free(pOffsets);
+            free(pSizes);
+            free(pData);
+        } else {
+            for (i=0; i<iCount; i++) {
+                snprintf(szName, sizeof(szName), "%s_%s", szLeaf, pFrames[i].szName);
+                fprintf(out.ohandle, "#define %s_WIDTH %d\n#define %s_HEIGHT %d\n#define %s_PITCH %d\n", szName, pFrames[i].planes.iWidth, szName, pFrames[i].planes.iHeight, szName, pFrames[i].planes.iPitch);
+                MakeC_PLAIN(&pFrames[i].planes, &out, szName, pOpts->iOption, bInterleave);
             }
-        } // for y
-        *pBpp = 1; // now it's 1-bit per pixel
-        return pDest;
-    } else if (iOutFormat == OPTION_4GRAY) {
-        iDestPitch = (iWidth+3) & 0xfffc;
-        pDest = (uint8_t *)malloc(iDestPitch * iHeight); // create grayscale output
-        for (y=0; y<iHeight; y++)
-        {
-            d = &pDest[y * iDestPitch];
-            pErrors = &errors[1]; // point to second pixel to avoid boundary check
-            lFErr = 0;
-            for (x=0; x<iWidth; x++)
-            {
-                cNew = GetGrayPixel8(x, y, pPixels, iSrcPitch, iBpp); // get grayscale uint8_t pixel
-                cNew = (cNew * 2)/3; // make white end of spectrum less "blown out"
-                // add forward error
-                cNew += lFErr;
-                if (cNew > 255) cNew = 255;     // clip to uint8_t
-                *d++ = (uint8_t)cNew;
-                // calculate the Floyd-Steinberg error for this pixel
-                v = cNew - (cNew & 0xc0); // new error for 2-bit gray output (always positive)
-                h = v >> 1;
-                e1 = (7*h)>>3;  // 7/16
-                e2 = h - e1;  // 1/16
-                e3 = (5*h) >> 3;   // 5/16
-                e4 = h - e3;  // 3/16
-                // distribute error to neighbors
-                lFErr = e1 + pErrors[1];
-                pErrors[1] = (uint8_t)e2;
-                pErrors[0] += e3;
-                pErrors[-1] += e4;
-                pErrors++;
-            } // for x
-        } // for y
-        for (y=0; y<256; y++) {
-            ucRed[y] = y;
-            ucGreen[y] = y;
-            ucBlue[y] = y; // create grayscale palette
         }
-        *pBpp = 8; // now it's 8-bit per pixel
-        return pDest;
-    } else { // black/white/red/yellow
-        int32_t *pErr, iDelta;
-        memset(iErrors, 0, sizeof(iErrors));
-        iDelta = (iBpp == 32) ? 4:3; // bytes per pixel
-    // Do the dithering in-place
-    for (y=0; y<iHeight; y++)
-    {
-        uint8_t *s, r, g, b, r1, g1, b1;
-        s = &pPixels[y * iSrcPitch];
-        pErr = &iErrors[3]; // point to second pixel to avoid boundary check
-        lFErrR = lFErrG = lFErrB = 0;
-        for (x=0; x<iWidth; x++)
-        {
-            r = s[2]; g = s[1]; b = s[0]; // read a color pixel
-            lFErr = r + lFErrR;
-            if (lFErr < 0) lFErr = 0;
-            else if (lFErr > 255) lFErr = 255;
-            r1 = lFErr;
-            lFErr = g + lFErrG;
-            if (lFErr < 0) lFErr = 0;
-            else if (lFErr > 255) lFErr = 255;
-            g1 = lFErr;
-            lFErr = b + lFErrB;
-            if (lFErr < 0) lFErr = 0;
-            else if (lFErr > 255) lFErr = 255;
-            b1 = lFErr;
-            MatchBestColor(&r1, &g1, &b1, iOutFormat);
-            // accumulate the R/G/B error of the matched color vs original
-            // calculate the Floyd-Steinberg error for this pixel
-            v = (int32_t)(r - r1); // new error for red
-            h = v >> 1;
-            e1 = (7*h)>>3;  // 7/16
-            e2 = h - e1;  // 1/16
-            e3 = (5*h) >> 3;   // 5/16
-            e4 = h - e3;  // 3/16
-            // distribute error to neighbors
-            lFErrR = e1 + pErr[3];
-            pErr[3] = e2;
-            pErr[0] += e3;
-            pErr[-3] += e4;
-            v = (int32_t)(g - g1); // new error for green
-            h = v >> 1;
-            e1 = (7*h)>>3;  // 7/16
-            e2 = h - e1;  // 1/16
-            e3 = (5*h) >> 3;   // 5/16
-            e4 = h - e3;  // 3/16
-            // distribute error to neighbors
-            lFErrG = e1 + pErr[4];
-            pErr[4] = e2;
-            pErr[1] += e3;
-            pErr[-2] += e4;
-            v = (int32_t)(b - b1); // new error for blue
-            h = v >> 1;
-            e1 = (7*h)>>3;  // 7/16
-            e2 = h - e1;  // 1/16
-            e3 = (5*h) >> 3;   // 5/16
-            e4 = h - e3;  // 3/16
-            // distribute error to neighbors
-            lFErrB = e1 + pErr[5];
-            pErr[5] = e2;
-            pErr[2] += e3;
-            pErr[-1] += e4;
-            pErr += 3;
-            // Store back the dithered pixel (in place)
-            s[2] = r1; s[1] = g1; s[0] = b1;
-            s += iDelta;
-        } // for x
-        } // for y
-        return NULL; // signals to keep the original bitmap
-    } // BWR
-     return NULL;
-} /* DitherBMP() */
+        CloseOutput(&out);
+        printf("%d frames from one decode, converted in %d ms\n", iCount, (int)(llTime / 1000));
+    } else {
+        rc = 0;
+    }
+    for (i=0; i<iCount; i++) {
+        if (pFrames[i].rc) FreePlanes(&pFrames[i].planes);
+    }
+    free(pFrames);
+    return rc;
+} /* MakeSprites() */
+//
+// Time one packer on a synthetic image (best of several runs)
+// returns the time in microseconds
+//
+int64_t TimePacker(uint8_t *pSrc, int iSrcPitch, int iBpp, int iOption, EPD_PACKER *pfnPack, EPD_PLAN *pPlan, EPD_PLANES *pPlanes)
+{
+    int64_t llTime, llBest = 0x7fffffffffffLL;
+    uint8_t ucLUT[256], *pDest[2];
+    int i;
+
+    for (i=0; i<5; i++) {
+        FreePlanes(pPlanes);
+        AllocPlanes(pPlanes->iWidth, pPlanes->iHeight, iOption, 1, pPlanes);
+        llTime = GetMicros();
+        if (pfnPack) {
+            if (iBpp <= 8)
+                MakePackLUT(iBpp, iOption, ucLUT);
+            pDest[0] = pPlanes->pPlane[(pPlan) ? pPlan->iSwap : 0];
+            pDest[1] = pPlanes->pPlane[(pPlan) ? 1 - pPlan->iSwap : 1];
+            (*pfnPack)(pSrc, iSrcPitch, pPlanes->iWidth, pPlanes->iHeight, ucLUT, (pPlan) ? &pPlan->ucXform[0][0] : NULL, pDest, pPlanes->iPitch);
+        } else {
+            PackGeneric(pSrc, iSrcPitch, iBpp, iOption, pPlanes);
+            if (pPlan)
+                ApplyPlan(pPlanes, pPlan);
+        }
+        llTime = GetMicros() - llTime;
+        if (llTime < llBest) llBest = llTime;
+    }
+    return (llBest > 0) ? llBest : 1;
+} /* TimePacker() */
+//
+// Benchmark the specialized packers against the generic one for every
+// (source bpp, output format, bit order) combination on random images
+// and check that they produce the same planes. The "plan" rows use a
+// panel profile with every option (LSB first, swapped planes, inverted
+// plane 1) against the generic packer followed by ApplyPlan()
+// returns 1 if they all match, 0 if not
+//
+int PackBench(int iWidth, int iHeight)
+{
+    static const int iBpps[5] = {1, 4, 8, 24, 32};
+    static const char *szOrders[3] = {"LSB", "MSB", "plan"};
+    EPD_PLANES ref, fast;
+    EPD_PROFILE profile;
+    EPD_PLAN plan, *pPlan;
+    int i, iOption, iOrder, iSrcPitch, iPlane, bOK, rc = 1;
+    int64_t llRef, llFast;
+    uint8_t *pSrc;
+
+    printf("Packing a %dx%d image (Mpixels/sec, best of 5)\n", iWidth, iHeight);
+    printf(" bpp  format order  generic  specialized  speedup\n");
+    srand(1234);
+    for (i=0; i<256; i++) { // random palette
+        ucRed[i] = (uint8_t)rand();
+        ucGreen[i] = (uint8_t)rand();
+        ucBlue[i] = (uint8_t)rand();
+    }
+    for (i=0; i<5; i++) {
+        iSrcPitch = (((iWidth * iBpps[i]) + 7)/8 + 3) & 0xfffc;
+        pSrc = (uint8_t *)malloc(iSrcPitch * iHeight);
+        for (int j=0; j<iSrcPitch * iHeight; j++)
+            pSrc[j] = (uint8_t)rand();
+        for (iOption=0; iOption<OPTION_COUNT; iOption++) {
+            memset(&profile, 0, sizeof(profile));
+            profile.iOption = iOption;
+            profile.bLSBFirst = profile.bSwapPlanes = 1;
+            profile.iInvert = 2;
+            MakePlan(&profile, &plan);
+            for (iOrder=1; iOrder>=0; iOrder = (iOrder == 1) ? 2 : ((iOrder == 2) ? 0 : -1)) { // MSB, plan, LSB
+                if (iOrder == 0 && iOption != OPTION_BW) continue; // only BW has a bit order
+                bMSBFirst = (iOrder != 0);
+                pPlan = (iOrder == 2) ? &plan : NULL;
+                memset(&ref, 0, sizeof(ref));
+                ref.iWidth = iWidth; ref.iHeight = iHeight;
+                fast = ref;
+                llRef = TimePacker(pSrc, iSrcPitch, iBpps[i], iOption, NULL, pPlan, &ref);
+                llFast = TimePacker(pSrc, iSrcPitch, iBpps[i], iOption, GetPacker(iBpps[i], iOption, bMSBFirst, pPlan != NULL), pPlan, &fast);
+                bOK = 1;
+                for (iPlane=0; iPlane<ref.iPlaneCount; iPlane++) {
+                    if (memcmp(ref.pPlane[iPlane], fast.pPlane[iPlane], ref.iPlaneSize) != 0) bOK = 0;
+                }
+                printf("%4d  %-6s %-4s  %8.1f  %11.1f  %6.1fx%s\n", iBpps[i], szOptions[iOption], (iOption != OPTION_BW && !pPlan) ? " -" : szOrders[iOrder],
+                       (double)iWidth * iHeight / llRef, (double)iWidth * iHeight / llFast, (double)llRef / llFast, (bOK) ? "" : "  MISMATCH");
+                if (!bOK) rc = 0;
+                FreePlanes(&ref);
+                FreePlanes(&fast);
+            }
+        }
+        free(pSrc);
+    }
+    bMSBFirst = 1;
+    printf("%s\n", (rc) ? "All of the specialized packers match the generic one" : "Some packers don't match!");
+    return rc;
+} /* PackBench() */
+//
+// Kernel microbenchmarks (--KERNELBENCH)
+// Each kernel is run over a whole synthetic image (or a buffer of JPEG
+// blocks) enough times per sample to take a few milliseconds, after a
+// warmup, and the median and 95th percentile of the samples are reported
+//
+#define KERNEL_SAMPLES 21
+#define KERNEL_SAMPLE_US 5000
+#define KERNEL_MAX_BLOCKS 1024
+enum {
+    KERNEL_GETPIXEL = 0,
+    KERNEL_MATCH,
+    KERNEL_MIRROR,
+    KERNEL_FLIP,
+    KERNEL_ROTATE,
+    KERNEL_DITHER,
+    KERNEL_IDCT,
+    KERNEL_DECODEMCU,
+    KERNEL_HEX,
+    KERNEL_RLEDECODE,
+    KERNEL_RLESTREAM
+};
+typedef struct tag_epd_kernel
+{
+    int iKernel;
+    uint8_t *pSrc; // pixels (not changed by the kernels)
+    uint8_t *pWork; // in place kernels work on this copy
+    int iWidth, iHeight, iBpp, iPitch;
+    int iOption; // output format or rotation angle
+    JPEGIMAGE *pJPEG; // JPEG kernels
+    BUFFERED_BITS bb; // bit buffer at the start of the entropy coded data
+    int iVLCOff;
+    int iBlocks; // blocks decoded from the first buffer of data
+    int iMCUBlocks; // blocks per MCU (1, 3, 4 or 6)
+    int16_t *pCoefs; // captured blocks with AC coefficients for the IDCT
+    int *pACFlags, *pQuant, iIDCTBlocks;
+    EPD_OUTPUT out; // hex emitter writes to the null device
+    uint8_t *pRLE; // compressed plane for the RLE decoders
+    int iRLESize;
+    uint32_t u32Sink; // keeps the compiler from removing the work
+} EPD_KERNEL;
+//
+// Run a kernel once over its data
+// returns the number of pixels (or bytes for the hex emitter) processed
+//
+int RunKernel(EPD_KERNEL *pK)
+{
+    int x, y, i, iBpp, iDC[3], iCount = pK->iWidth * pK->iHeight;
+    uint8_t r, g, b, *s, *pOut;
+    uint32_t u32 = 0;
+
+    switch (pK->iKernel) {
+        case KERNEL_GETPIXEL:
+            for (y=0; y<pK->iHeight; y++) {
+                for (x=0; x<pK->iWidth; x++) {
+                    switch (pK->iOption) {
+                        case OPTION_BWR:
+                            u32 += GetRedPixel(x, y, pK->pSrc, pK->iPitch, pK->iBpp);
+                            break;
+                        case OPTION_BWY:
+                            u32 += GetYellowPixel(x, y, pK->pSrc, pK->iPitch, pK->iBpp);
+                            break;
+                        case OPTION_BWYR:
+                            u32 += GetBWYRPixel(x, y, pK->pSrc, pK->iPitch, pK->iBpp);
+                            break;
+                        default:
+                            u32 += GetGrayPixel(x, y, pK->pSrc, pK->iPitch, pK->iBpp);
+                            break;
+                    }
+                }
+            }
+            break;
+        case KERNEL_MATCH:
+            for (y=0; y<pK->iHeight; y++) {
+                s = &pK->pSrc[y * pK->iPitch];
+                for (x=0; x<pK->iWidth; x++, s+=3) {
+                    b = s[0]; g = s[1]; r = s[2];
+                    MatchBestColor(&r, &g, &b, pK->iOption);
+                    u32 += r + g + b;
+                }
+            }
+            break;
+        case KERNEL_MIRROR:
+            MirrorBMP(pK->pWork, pK->iWidth, pK->iHeight, pK->iBpp);
+            break;
+        case KERNEL_FLIP:
+            FlipBMP(pK->pWork, pK->iWidth, pK->iHeight, pK->iBpp);
+            break;
+        case KERNEL_ROTATE: // 90/270 swap the size each time
+            RotateImage(pK->iOption, pK->pWork, &pK->iWidth, &pK->iHeight, pK->iBpp);
+            break;
+        case KERNEL_DITHER:
+            iBpp = pK->iBpp;
+            if (pK->iOption == OPTION_BW || pK->iOption == OPTION_4GRAY) {
+                pOut = DitherBMP(pK->pSrc, pK->iWidth, pK->iHeight, &iBpp, pK->iOption, NULL);
+                u32 += pOut[0];
+                free(pOut);
+            } else { // colors are dithered in place (on a fresh copy each time)
+                memcpy(pK->pWork, pK->pSrc, pK->iPitch * pK->iHeight);
+                DitherBMP(pK->pWork, pK->iWidth, pK->iHeight, &iBpp, pK->iOption, NULL);
+                u32 += pK->pWork[0];
+            }
+            break;
+        case KERNEL_IDCT:
+            for (i=0; i<pK->iIDCTBlocks; i++) {
+                memcpy(pK->pJPEG->sMCUs, &pK->pCoefs[i * DCTSIZE], DCTSIZE * sizeof(int16_t));
+                JPEGIDCT(pK->pJPEG, 0, pK->pQuant[i], pK->pACFlags[i]);
+                u32 += pK->pJPEG->sMCUs[0];
+            }
+            iCount = pK->iIDCTBlocks * DCTSIZE;
+            break;
+        case KERNEL_DECODEMCU:
+            pK->pJPEG->bb = pK->bb;
+            pK->pJPEG->iVLCOff = pK->iVLCOff;
+            iDC[0] = iDC[1] = iDC[2] = 0;
+            for (i=0; i<pK->iBlocks; i++) {
+                x = i % pK->iMCUBlocks; // block within the MCU
+                y = (x < pK->iMCUBlocks - 2 || pK->iMCUBlocks == 1) ? 0 : x - (pK->iMCUBlocks - 3); // component
+                pK->pJPEG->ucDCTable = pK->pJPEG->JPCI[y].dc_tbl_no;
+                pK->pJPEG->ucACTable = pK->pJPEG->JPCI[y].ac_tbl_no;
+                JPEGDecodeMCU(pK->pJPEG, x * DCTSIZE, &iDC[y]);
+            }
+            u32 += iDC[0];
+            iCount = pK->iBlocks * DCTSIZE;
+            break;
+        case KERNEL_HEX:
+            iCount = pK->iPitch * pK->iHeight;
+            WritePlaneData(&pK->out, "kernel", pK->pSrc, iCount);
+            break;
+        case KERNEL_RLEDECODE:
+            iCount = EPD_RLEDecode(pK->pRLE, pK->iRLESize, pK->pWork, pK->iPitch * pK->iHeight);
+            u32 += pK->pWork[0];
+            break;
+        case KERNEL_RLESTREAM:
+            pOut = pK->pWork;
+            EPD_RLEStream(pK->pRLE, pK->iRLESize, RLEStreamCheck, &pOut);
+            iCount = (int)(pOut - pK->pWork);
+            break;
+    }
+    pK->u32Sink += u32;
+    return iCount;
+} /* RunKernel() */
+//
+// Time a kernel and print the median and 95th percentile
+// of the samples in ns/pixel (or MB/s for bytes)
+//
+void TimeKernel(EPD_KERNEL *pK, const char *szKernel, const char *szVariant, int bBytes)
+{
+    double dSamples[KERNEL_SAMPLES], d;
+    int64_t llTime;
+    int i, j, iRuns, iCount = 0;
+
+    llTime = GetMicros(); // warm up and see how many runs fill a sample
+    iRuns = 0;
+    do {
+        iCount = RunKernel(pK);
+        iRuns++;
+    } while (GetMicros() - llTime < KERNEL_SAMPLE_US || iRuns < 3);
+    iRuns = (int)((iRuns * (int64_t)KERNEL_SAMPLE_US) / (GetMicros() - llTime));
+    if (iRuns < 1) iRuns = 1;
+    for (i=0; i<KERNEL_SAMPLES; i++) {
+        llTime = GetMicros();
+        for (j=0; j<iRuns; j++)
+            RunKernel(pK);
+        llTime = GetMicros() - llTime;
+        d = (double)llTime * 1000.0 / ((double)iCount * iRuns); // ns per unit
+        for (j=i; j>0 && dSamples[j-1] > d; j--) // insertion sort
+            dSamples[j] = dSamples[j-1];
+        dSamples[j] = d;
+    }
+    i = (KERNEL_SAMPLES * 95 + 99) / 100 - 1;
+    if (bBytes) // slower samples have a lower throughput
+        printf("%-14s %-12s %10.1f %10.1f  MB/s\n", szKernel, szVariant, 1000.0 / dSamples[KERNEL_SAMPLES/2], 1000.0 / dSamples[i]);
+    else
+        printf("%-14s %-12s %10.2f %10.2f  ns/pixel\n", szKernel, szVariant, dSamples[KERNEL_SAMPLES/2], dSamples[i]);
+} /* TimeKernel() */
+//
+// Prepare the JPEG kernels: decode the blocks in the first buffer of
+// entropy coded data (the same way DecodeJPEG() does) and keep
+// the ones with AC coefficients for the IDCT
+// returns 1 for success, 0 for failure
+//
+int PrepareJPEGKernels(char *szName, EPD_KERNEL *pK)
+{
+    uint8_t *pData;
+    int i, x, y, iSize, iDC[3];
+
+    ihandle = fopen(szName, "rb");
+    if (ihandle == NULL) {
+        printf("Unable to open file: %s\n", szName);
+        return 0;
+    }
+    fseek(ihandle, 0L, SEEK_END);
+    iSize = (int)ftell(ihandle);
+    fseek(ihandle, 0, SEEK_SET);
+    pData = (uint8_t *)malloc(iSize);
+    iSize = (int)fread(pData, 1, iSize, ihandle);
+    fclose(ihandle);
+    pK->pJPEG = (JPEGIMAGE *)malloc(sizeof(JPEGIMAGE));
+    if (!JPEG_openRAM(pK->pJPEG, pData, iSize, JPEGDraw) || pK->pJPEG->iResInterval) {
+        printf("%s is not a baseline JPEG without restart markers\n", szName);
+        free(pK->pJPEG);
+        free(pData);
+        return 0;
+    }
+    switch (pK->pJPEG->ucSubSample) {
+        case 0x00:
+            pK->iMCUBlocks = 1;
+            break;
+        case 0x12:
+        case 0x21:
+            pK->iMCUBlocks = 4;
+            break;
+        case 0x22:
+            pK->iMCUBlocks = 6;
+            break;
+        default:
+            pK->iMCUBlocks = 3;
+            break;
+    }
+    JPEGFixQuantD(pK->pJPEG);
+    pK->pJPEG->bb.ulBits = MOTOLONG(&pK->pJPEG->ucFileBuf[0]); // preload first 4 bytes
+    pK->pJPEG->bb.pBuf = pK->pJPEG->ucFileBuf;
+    pK->pJPEG->bb.ulBitOff = 0;
+    pK->bb = pK->pJPEG->bb;
+    pK->iVLCOff = pK->pJPEG->iVLCOff;
+    pK->pCoefs = (int16_t *)malloc(KERNEL_MAX_BLOCKS * DCTSIZE * sizeof(int16_t));
+    pK->pACFlags = (int *)malloc(KERNEL_MAX_BLOCKS * sizeof(int));
+    pK->pQuant = (int *)malloc(KERNEL_MAX_BLOCKS * sizeof(int));
+    iDC[0] = iDC[1] = iDC[2] = 0;
+    // whole MCUs until DecodeJPEG() would need to read more data
+    for (i=0; pK->pJPEG->iVLCOff < FILE_HIGHWATER && i < KERNEL_MAX_BLOCKS; i++) {
+        x = i % pK->iMCUBlocks;
+        y = (x < pK->iMCUBlocks - 2 || pK->iMCUBlocks == 1) ? 0 : x - (pK->iMCUBlocks - 3);
+        pK->pJPEG->ucDCTable = pK->pJPEG->JPCI[y].dc_tbl_no;
+        pK->pJPEG->ucACTable = pK->pJPEG->JPCI[y].ac_tbl_no;
+        if (JPEGDecodeMCU(pK->pJPEG, 0, &iDC[y]) != 0) break;
+        if (pK->pJPEG->ucMaxACCol) { // DecodeJPEG() skips the IDCT of DC only blocks
+            memcpy(&pK->pCoefs[pK->iIDCTBlocks * DCTSIZE], pK->pJPEG->sMCUs, DCTSIZE * sizeof(int16_t));
+            pK->pACFlags[pK->iIDCTBlocks] = pK->pJPEG->ucMaxACCol | (pK->pJPEG->ucMaxACRow << 8);
+            pK->pQuant[pK->iIDCTBlocks++] = pK->pJPEG->JPCI[y].quant_tbl_no;
+        }
+        if (x == pK->iMCUBlocks - 1) pK->iBlocks = i + 1;
+    }
+    free(pData); // (the kernels only use the data already in the JPEG's buffer)
+    if (pK->iBlocks == 0 || pK->iIDCTBlocks == 0) {
+        printf("Unable to decode the first blocks of %s\n", szName);
+        return 0;
+    }
+    printf("%s: %dx%d, %d blocks per MCU, %d blocks decoded (%d with AC coefficients)\n", szName, pK->pJPEG->iWidth, pK->pJPEG->iHeight, pK->iMCUBlocks, pK->iBlocks, pK->iIDCTBlocks);
+    return 1;
+} /* PrepareJPEGKernels() */
+//
+// Benchmark the pixel, transform, dither, JPEG and hex output kernels
+// in isolation so that an optimization of one can be measured on its own
+// returns 1 for success, 0 for failure
+//
+int KernelBench(int iWidth, int iHeight, char *szJPEG)
+{
+    static const int iBpps[5] = {1, 4, 8, 24, 32};
+    static const char *szGetPixel[OPTION_COUNT] = {"GetGrayPixel", "GetRedPixel", "GetYellowPixel", "GetBWYRPixel", "GetGrayPixel"};
+    EPD_KERNEL k;
+    char szVariant[32];
+    int i, j, iOption, iSize, rc = 1;
+    uint8_t *pPixels[5];
+
+    memset(&k, 0, sizeof(k));
+    printf("Kernels on a %dx%d image (%d samples after a warmup)\n", iWidth, iHeight, KERNEL_SAMPLES);
+    printf("kernel         variant          median        p95\n");
+    srand(1234);
+    for (i=0; i<256; i++) { // random palette
+        ucRed[i] = (uint8_t)rand();
+        ucGreen[i] = (uint8_t)rand();
+        ucBlue[i] = (uint8_t)rand();
+    }
+    iSize = (iWidth > iHeight) ? iWidth : iHeight;
+    iSize = ((iSize * 4) + 3) * iSize; // room for a rotated 32-bpp image
+    for (i=0; i<5; i++) { // random pixels with some smooth areas to dither
+        pPixels[i] = (uint8_t *)malloc(iSize);
+        for (j=0; j<iSize; j++)
+            pPixels[i][j] = (j & 0x100) ? (uint8_t)rand() : (uint8_t)(j >> 4);
+    }
+    k.pWork = (uint8_t *)malloc(iSize);
+    for (i=0; i<5; i++) {
+        k.pSrc = pPixels[i];
+        k.iBpp = iBpps[i];
+        k.iWidth = iWidth; k.iHeight = iHeight;
+        k.iPitch = (((iWidth * k.iBpp) + 7)/8 + 3) & 0xfffc;
+        k.iKernel = KERNEL_GETPIXEL;
+        for (iOption=OPTION_BW; iOption<OPTION_4GRAY; iOption++) { // (4GRAY uses GetGrayPixel too)
+            if (k.iBpp == 1 && iOption != OPTION_BW) continue; // only gray reads 1-bpp
+            k.iOption = iOption;
+            sprintf(szVariant, "%d-bpp", k.iBpp);
+            TimeKernel(&k, szGetPixel[iOption], szVariant, 0);
+        }
+    }
+    k.pSrc = pPixels[3];
+    k.iBpp = 24;
+    k.iPitch = ((iWidth * 3) + 3) & 0xfffc;
+    k.iKernel = KERNEL_MATCH;
+    for (iOption=OPTION_BWR; iOption<=OPTION_BWYR; iOption++) {
+        k.iOption = iOption;
+        TimeKernel(&k, "MatchBestColor", szOptions[iOption], 0);
+    }
+    for (i=0; i<5; i++) {
+        k.iBpp = iBpps[i];
+        sprintf(szVariant, "%d-bpp", k.iBpp);
+        memcpy(k.pWork, pPixels[i], iSize);
+        k.iKernel = KERNEL_MIRROR;
+        TimeKernel(&k, "MirrorBMP", szVariant, 0);
+        k.iKernel = KERNEL_FLIP;
+        TimeKernel(&k, "FlipBMP", szVariant, 0);
+        k.iKernel = KERNEL_ROTATE;
+        for (j=90; j<=270; j+=90) {
+            k.iOption = j;
+            sprintf(szVariant, "%d-bpp %d", k.iBpp, j);
+            TimeKernel(&k, "RotateImage", szVariant, 0);
+            k.iWidth = iWidth; k.iHeight = iHeight;
+        }
+    }
+    k.iKernel = KERNEL_DITHER;
+    for (i=2; i<4; i++) { // 8 and 24-bpp sources
+        k.pSrc = pPixels[i];
+        k.iBpp = iBpps[i];
+        k.iPitch = (((iWidth * k.iBpp) + 7)/8 + 3) & 0xfffc;
+        for (iOption=0; iOption<OPTION_COUNT; iOption++) {
+            if (k.iBpp < 24 && iOption != OPTION_BW && iOption != OPTION_4GRAY) continue; // color needs 24-bpp
+            k.iOption = iOption;
+            sprintf(szVariant, "%s %d-bpp", szOptions[iOption], k.iBpp);
+            TimeKernel(&k, "DitherBMP", szVariant, 0);
+        }
+    }
+    if (szJPEG) {
+        if (PrepareJPEGKernels(szJPEG, &k)) {
+            k.iKernel = KERNEL_IDCT;
+            TimeKernel(&k, "JPEGIDCT", "AC blocks", 0);
+            k.iKernel = KERNEL_DECODEMCU;
+            TimeKernel(&k, "JPEGDecodeMCU", "huffman", 0);
+        } else {
+            rc = 0;
+        }
+        free(k.pCoefs);
+        free(k.pACFlags);
+        free(k.pQuant);
+        free(k.pJPEG);
+    }
+#ifdef _WIN32
+    k.out.ohandle = fopen("NUL", "wb");
+#else
+    k.out.ohandle = fopen("/dev/null", "wb");
+#endif
+    if (k.out.ohandle) {
+        k.pSrc = pPixels[0]; // one plane of a 1-bpp image
+        k.iBpp = 1;
+        k.iPitch = (iWidth + 7) / 8;
+        k.iKernel = KERNEL_HEX;
+        k.out.iMode = OUTPUT_C;
+        for (i=1; i<=4; i<<=1) {
+            k.out.iWordSize = i;
+            sprintf(szVariant, "%d-bit", i * 8);
+            TimeKernel(&k, "hex emitter", szVariant, 1);
+        }
+        fclose(k.out.ohandle);
+    }
+    // a mostly white 1-bpp plane with bands of detail, like a UI screen
+    k.iPitch = (iWidth + 7) / 8;
+    iSize = k.iPitch * iHeight;
+    for (i=0; i<iSize; i++)
+        pPixels[1][i] = ((i / k.iPitch) & 0x20) ? pPixels[0][i] : 0xff;
+    k.pRLE = (uint8_t *)malloc(iSize + (iSize/EPD_RLE_MAX_LITERAL) + 1);
+    k.iRLESize = CompressPlane(pPixels[1], iSize, k.pRLE);
+    sprintf(szVariant, "%d%% size", (k.iRLESize * 100) / iSize);
+    k.iKernel = KERNEL_RLEDECODE;
+    TimeKernel(&k, "EPD_RLEDecode", szVariant, 1);
+    k.iKernel = KERNEL_RLESTREAM;
+    TimeKernel(&k, "EPD_RLEStream", szVariant, 1);
+    free(k.pRLE);
+    for (i=0; i<5; i++)
+        free(pPixels[i]);
+    free(k.pWork);
+    return rc;
+} /* KernelBench() */
+//
+// Built-in panel profiles (--PANEL), more can be added with --PANELFILE
+// name, width, height, format, rotation, LSB first, swap planes, invert, vertical, row align
+//
+const EPD_PROFILE builtinProfiles[] = {
+    {"epd213_bw", 122, 250, OPTION_BW, 90, 0, 0, 0, 0, 1}, // 2.13" 250x122 in portrait RAM
+    {"epd213_bwr", 122, 250, OPTION_BWR, 90, 0, 0, 0, 0, 1},
+    {"epd290_bw", 128, 296, OPTION_BW, 90, 0, 0, 0, 0, 1}, // 2.9" 296x128 in portrait RAM
+    {"epd290_bwr", 128, 296, OPTION_BWR, 90, 0, 0, 0, 0, 1},
+    {"epd290_4gray", 128, 296, OPTION_4GRAY, 90, 0, 0, 0, 0, 1}, // UC8151 plane order (the default)
+    {"epd290_4gray_lsbplane", 128, 296, OPTION_4GRAY, 90, 0, 1, 0, 0, 1}, // the LSB plane is sent first
+    {"epd420_bw", 400, 300, OPTION_BW, 0, 0, 0, 0, 0, 1},
+    {"epd420_bwr", 400, 300, OPTION_BWR, 0, 0, 0, 2, 0, 1}, // red plane 0 = red
+    {"epd420_bwyr", 400, 300, OPTION_BWYR, 0, 0, 0, 0, 0, 1},
+    {"epd750_bw", 800, 480, OPTION_BW, 0, 0, 0, 0, 0, 1},
+    {"epd750_bwr", 800, 480, OPTION_BWR, 0, 0, 0, 2, 0, 1}, // red plane 0 = red
+    {"memlcd400x240", 400, 240, OPTION_BW, 0, 1, 0, 0, 0, 1}, // memory LCD, LSB first
+    {"oled128x64", 128, 64, OPTION_BW, 0, 1, 0, 0, 1, 1}, // SSD1306 style pages
+    {"oled128x32", 128, 32, OPTION_BW, 0, 1, 0, 0, 1, 1},
+};
+EPD_PROFILE *pProfiles = NULL; // --PANELFILE profiles
+int iProfiles = 0;
+//
+// Parse one line of a panel profile file:
+// <name> size=<width>x<height> format=<format> [rotate=<degrees>]
+//   [bitorder=MSB|LSB] [planes=normal|swap] [invert=none|0|1|both]
+//   [packing=horizontal|vertical] [rowalign=<bytes>]
+// returns 1 for success, 0 for failure
+//
+int ParseProfile(char *szLine, EPD_PROFILE *pProfile)
+{
+    char *szTok, *szValue;
+    int iOrder = -1, bSize = 0, bFormat = 0;
+
+    memset(pProfile, 0, sizeof(EPD_PROFILE));
+    pProfile->iRowAlign = 1;
+    szTok = strtok(szLine, " \t\r\n");
+    if (szTok == NULL || strlen(szTok) >= sizeof(pProfile->szName)) {
+        printf("Invalid panel name\n");
+        return 0;
+    }
+    strcpy(pProfile->szName, szTok);
+    while ((szTok = strtok(NULL, " \t\r\n")) != NULL) {
+        szValue = strchr(szTok, '=');
+        if (szValue == NULL) {
+            printf("Panel %s: expected <key>=<value> instead of %s\n", pProfile->szName, szTok);
+            return 0;
+        }
+        *szValue++ = 0;
+        if (strcmp(szTok, "size") == 0) {
+            bSize = (sscanf(szValue, "%dx%d", &pProfile->iWidth, &pProfile->iHeight) == 2 && pProfile->iWidth > 0 && pProfile->iHeight > 0);
+            if (!bSize) break;
+        } else if (strcmp(szTok, "format") == 0) {
+            for (pProfile->iOption=0; pProfile->iOption<OPTION_COUNT; pProfile->iOption++) {
+                if (strcmp(szValue, szOptions[pProfile->iOption]) == 0) break;
+            }
+            bFormat = (pProfile->iOption < OPTION_COUNT);
+            if (!bFormat) break;
+        } else if (strcmp(szTok, "rotate") == 0) {
+            pProfile->iRotation = atoi(szValue);
+            if (pProfile->iRotation != 0 && pProfile->iRotation != 90 && pProfile->iRotation != 180 && pProfile->iRotation != 270) break;
+        } else if (strcmp(szTok, "bitorder") == 0) {
+            iOrder = (strcmp(szValue, "LSB") == 0) ? 1 : ((strcmp(szValue, "MSB") == 0) ? 0 : -2);
+            if (iOrder == -2) break;
+        } else if (strcmp(szTok, "planes") == 0) {
+            pProfile->bSwapPlanes = (strcmp(szValue, "swap") == 0);
+            if (!pProfile->bSwapPlanes && strcmp(szValue, "normal") != 0) break;
+        } else if (strcmp(szTok, "invert") == 0) {
+            if (strcmp(szValue, "none") == 0) pProfile->iInvert = 0;
+            else if (strcmp(szValue, "0") == 0) pProfile->iInvert = 1;
+            else if (strcmp(szValue, "1") == 0) pProfile->iInvert = 2;
+            else if (strcmp(szValue, "both") == 0) pProfile->iInvert = 3;
+            else break;
+        } else if (strcmp(szTok, "packing") == 0) {
+            pProfile->bVertical = (strcmp(szValue, "vertical") == 0);
+            if (!pProfile->bVertical && strcmp(szValue, "horizontal") != 0) break;
+        } else if (strcmp(szTok, "rowalign") == 0) {
+            pProfile->iRowAlign = atoi(szValue);
+            if (pProfile->iRowAlign < 1 || pProfile->iRowAlign > 16 || (pProfile->iRowAlign & (pProfile->iRowAlign-1)) != 0) break;
+        } else {
+            printf("Panel %s: unknown key %s\n", pProfile->szName, szTok);
+            return 0;
+        }
+    }
+    if (szTok) {
+        printf("Panel %s: invalid %s value %s\n", pProfile->szName, szTok, szValue);
+        return 0;
+    }
+    if (!bSize || !bFormat) {
+        printf("Panel %s needs a size and a format\n", pProfile->szName);
+        return 0;
+    }
+    if (pProfile->bVertical && pProfile->iRowAlign > 1) {
+        printf("Panel %s: rowalign doesn't apply to vertical packing\n", pProfile->szName);
+        return 0;
+    }
+    // the first pixel defaults to the MSB of horizontal bytes and the LSB of vertical ones
+    pProfile->bLSBFirst = (iOrder >= 0) ? iOrder : pProfile->bVertical;
+    return 1;
+} /* ParseProfile() */
+//
+// Read a file of panel profiles, one per line (# starts a comment)
+// The profiles are searched before the built-in ones
+// returns 1 for success, 0 for failure
+//
+int LoadProfiles(char *szFile)
+{
+    FILE *f;
+    char szLine[512], *s;
+    int iLine = 0, rc = 1;
+
+    f = fopen(szFile, "r");
+    if (f == NULL) {
+        printf("Unable to open panel file: %s\n", szFile);
+        return 0;
+    }
+    while (fgets(szLine, sizeof(szLine), f)) {
+        iLine++;
+        if ((s = strchr(szLine, '#')) != NULL) *s = 0;
+        for (s = szLine; *s == ' ' || *s == '\t'; s++) {};
+        if (*s == 0 || *s == '\r' || *s == '\n') continue; // blank line
+        if (iProfiles == MAX_PROFILES) {
+            printf("Panel files support up to %d profiles\n", MAX_PROFILES);
+            rc = 0;
+            break;
+        }
+        if (pProfiles == NULL)
+            pProfiles = (EPD_PROFILE *)calloc(MAX_PROFILES, sizeof(EPD_PROFILE));
+        if (!ParseProfile(s, &pProfiles[iProfiles])) {
+            printf("in %s line %d\n", szFile, iLine);
+            rc = 0;
+            break;
+        }
+        iProfiles++;
+    }
+    fclose(f);
+    return rc;
+} /* LoadProfiles() */
+//
+// Find a panel profile by name
+// returns NULL if there isn't one
+//
+EPD_PROFILE *FindProfile(char *szName)
+{
+    int i;
 
-int JPEGDraw(JPEGDRAW *pDraw)
+    for (i=0; i<iProfiles; i++) {
+        if (strcmp(pProfiles[i].szName, szName) == 0) return &pProfiles[i];
+    }
+    for (i=0; i<(int)(sizeof(builtinProfiles) / sizeof(EPD_PROFILE)); i++) {
+        if (strcmp(builtinProfiles[i].szName, szName) == 0) return (EPD_PROFILE *)&builtinProfiles[i];
+    }
+    return NULL;
+} /* FindProfile() */
+//
+// Describe a panel profile in the terms of a profile file line
+//
+void DescribeProfile(EPD_PROFILE *pProfile, char *szDesc)
 {
-    // defaults to RGB565 little endian
-    int x, y;
-    // convert each pixel to RGB888 and store in our image buffer
-    uint8_t r, g, b, *s8, *d, *pDst = (uint8_t *)pDraw->pUser;
-    uint16_t u16, *s;
-    for (y=0; y<pDraw->iHeight; y++) {
-        if (pDraw->iBpp == 16) {
-            d = &pDst[3 * ((pDraw->y + y) * iWidth) + (pDraw->x * 3)];
-            s = &pDraw->pPixels[y * pDraw->iWidth];
-            for (x=0; x<pDraw->iWidth; x++) {
-                u16 = *s++;
-                r = (u16 >> 11); // top 5 bits = R
-                r = (r << 3) | (r >> 2);
-                g = (u16 >> 5) & 0x3f; // middle 6 bits = G
-                g = (g << 2) | (g >> 4);
-                b = (u16 & 0x1f); // bottom 5 bits = B
-                b = (b << 3) | (b >> 2);
-                d[0] = b; d[1] = g; d[2] = r;
-                d += 3; // 24-bpp output
-            } // for x
-        } else { // 8bpp
-            s8 = (uint8_t *)pDraw->pPixels;
-            s8 += (y * pDraw->iWidth);
-            d = &pDst[((pDraw->y + y) * iWidth) + pDraw->x]; // must be 8bpp
-            memcpy(d, s8, pDraw->iWidth);
-        }
-    } // for y
-    return 1; // returning true (1) tells JPEGDEC to continue decoding. Returning false (0) would quit decoding immediately.
-} /* JPEGDraw() */
+    static const char *szInvert[4] = {"none", "0", "1", "both"};
 
+    sprintf(szDesc, "size=%dx%d format=%s rotate=%d bitorder=%s planes=%s invert=%s packing=%s rowalign=%d",
+            pProfile->iWidth, pProfile->iHeight, szOptions[pProfile->iOption], pProfile->iRotation,
+            (pProfile->bLSBFirst) ? "LSB" : "MSB", (pProfile->bSwapPlanes) ? "swap" : "normal", szInvert[pProfile->iInvert & 3],
+            (pProfile->bVertical) ? "vertical" : "horizontal", pProfile->iRowAlign);
+} /* DescribeProfile() */
 //
-// Decode a JPEG image
+// List the panel profiles
 //
-uint8_t * ReadJPEG(uint8_t *pData, int iSize, int *pWidth, int *pHeight, int *pBpp)
+void ListProfiles(void)
 {
-    int rc;
-    JPEGIMAGE jpg;
-    
-    rc = JPEG_openRAM(&jpg, pData, iSize, JPEGDraw);
-    if (rc) {
-        *pBpp = jpg.ucBpp;
-        *pWidth = jpg.iWidth;
-        *pHeight = 0-jpg.iHeight; // negative because it will be seen as a WinBMP height
-        if (jpg.ucBpp == 8) {
-            // create a fake grayscale palette
-            for (int i=0; i<256; i++) {
-                ucRed[i] = i;
-                ucGreen[i] = i;
-                ucBlue[i] = i;
-            }
-            jpg.ucPixelType = EIGHT_BIT_GRAYSCALE;
-            jpg.pUser = malloc(jpg.iWidth * jpg.iHeight);
-        } else {
-            jpg.pUser = malloc(jpg.iWidth * jpg.iHeight * 3);
+    char szDesc[256];
+    int i;
+
+    for (i=0; i<iProfiles; i++) {
+        DescribeProfile(&pProfiles[i], szDesc);
+        printf("%-22s %s\n", pProfiles[i].szName, szDesc);
+    }
+    for (i=0; i<(int)(sizeof(builtinProfiles) / sizeof(EPD_PROFILE)); i++) {
+        DescribeProfile((EPD_PROFILE *)&builtinProfiles[i], szDesc);
+        printf("%-22s %s\n", builtinProfiles[i].szName, szDesc);
+    }
+} /* ListProfiles() */
+//
+// Convert an image into the native RAM layout of a panel (--PANEL)
+// The image is scaled to fit the panel (before the rotation into its
+// scan order) and the profile's bit order, plane order and polarity
+// are applied by the packers in the same pass
+// returns 1 for success, 0 for failure
+//
+int MakePanel(char *szInName, EPD_PROFILE *pProfile, EPD_OPTIONS *pOpts, EPD_OUTPUT *pSettings, char *szOutName, int bRLE, int iBandRows, int bInterleave)
+{
+    EPD_OPTIONS opts = *pOpts;
+    EPD_IMAGE image, scaled;
+    EPD_PLAN plan;
+    EPD_PLANES planes;
+    EPD_OUTPUT out;
+    char szLeaf[256], szDesc[256];
+    int cx, cy, rc;
+
+    opts.iOption = pProfile->iOption;
+    opts.iRotation = pProfile->iRotation;
+    opts.bVertical = pProfile->bVertical;
+    opts.iRowAlign = pProfile->iRowAlign;
+    opts.pPlan = &plan;
+    MakePlan(pProfile, &plan);
+    cx = pProfile->iWidth; cy = pProfile->iHeight; // size before the rotation
+    if (opts.iRotation == 90 || opts.iRotation == 270) {
+        cx = pProfile->iHeight; cy = pProfile->iWidth;
+    }
+    if (!DecodeImage(szInName, &image, cx, cy))
+        return 0;
+    if (image.iWidth != cx || image.iHeight != cy) {
+        rc = ScaleImage(&image, cx, cy, 0, &scaled);
+        FreeImage(&image);
+        if (!rc) {
+            printf("Error scaling the image to %dx%d\n", cx, cy);
+            return 0;
         }
-        rc = JPEG_decode(&jpg, 0, 0, 0); // full size decode
+        image = scaled;
     }
-    return jpg.pUser;
-} /* ReadJPEG() */
+    rc = ProcessImage(&image, &opts, &planes);
+    FreeImage(&image);
+    if (!rc)
+        return 0;
+    GetLeafName(szInName, szLeaf);
+    if (!StartOutput(&out, pSettings, szOutName, szLeaf, &planes, opts.iOption, bRLE)) {
+        FreePlanes(&planes);
+        return 0;
+    }
+    DescribeProfile(pProfile, szDesc);
+    fprintf(out.ohandle, "// Panel %s: %s\n", pProfile->szName, szDesc);
+    if (!pProfile->bVertical)
+        planes.bLSBFirst = pProfile->bLSBFirst; // packed in the panel's bit order
+    rc = 1;
+    if (bRLE)
+        rc = MakeC_RLE(&planes, &out, szLeaf, opts.iOption, iBandRows);
+    else
+        MakeC_PLAIN(&planes, &out, szLeaf, opts.iOption, bInterleave);
+    FreePlanes(&planes);
+    CloseOutput(&out);
+    return rc;
+} /* MakePanel() */
+//
+// Parse the list of shifts for --SHIFTS ("all" or e.g. "0,2,4,6")
+// returns a bit mask of the shifts, 0 if invalid
+//
+int ParseShifts(char *szList)
+{
+    int iShifts = 0;
+
+    if (strcmp(szList, "all") == 0 || strcmp(szList, "ALL") == 0)
+        return 0xff;
+    while (*szList) {
+        if (*szList < '0' || *szList > '7')
+            return 0;
+        iShifts |= 1 << (*szList++ - '0');
+        if (*szList == ',') szList++;
+        else if (*szList) return 0;
+    }
+    return iShifts;
+} /* ParseShifts() */
 //
 // Main program entry point
 //
 int main(int argc, char *argv[])
 {
-    int iSize;
-    int iOffBits;
-    int iNameParam = 1;
-    int iRotation = 0;
-    int iOption = OPTION_BW; // default
-    int bMirror = 0, bFlipv = 0, bInvert = 0;
-    int bDither = 0;
-    unsigned char *p;
+    int iNameParam = 1, rc, i;
+    int bRLE = 0, iBandRows = 0, bBundle = 0, iAlign = 4, iTileSize = 0, bTrim = 0, bSparse = 0, iShifts = 0;
+    int iWordSize = 1, bBigEndian = 0, iArrayAlign = 0, bInterleave = 0, iWindowCost = 16;
+    char *szDelta = NULL;
+    int bSequence = 0, iKeyInterval = 0, iStable = -1;
+    EPD_STABLE stable;
+    EPD_TARGET targets[MAX_TARGETS];
+    int iTargets = 0;
+    EPD_SIZE sizes[MAX_SIZES];
+    int iSizes = 0, j;
+    char *szSizes = NULL, szSpec[256];
+    EPD_PANEL *pPanels = NULL;
+    char *szWall = NULL, *szPanels[MAX_PANELS];
+    int iPanels = 0, iCols = 0, iRows = 0, iPanelW = 0, iPanelH = 0, iGapX = 0, iGapY = 0;
+    char *szSprites = NULL;
+    int bSpriteArray = 0;
+    char *szPanel = NULL;
+    EPD_PROFILE *pProfile;
+    EPD_OUTPUT outset;
+    int iOutMode = OUTPUT_C;
+    EPD_OPTIONS opts;
+    EPD_PLANES planes, oldplanes;
+    EPD_OUTPUT out;
     char szLeaf[256];
     char szOutName[256];
     
-    if (argc < 3 || argc > 5)
+    memset(&opts, 0, sizeof(opts));
+    opts.iOption = OPTION_BW; // default
+    if (argc >= 2 && strcmp(argv[1], "--PACKBENCH") == 0) { // no files needed
+        int w = 1024, h = 768;
+        if (argc >= 3 && sscanf(argv[2], "%dx%d", &w, &h) != 2) {
+            printf("PACKBENCH size must be <width>x<height>\n");
+            return -1;
+        }
+        return PackBench(w, h) ? 0 : -1;
+    }
+    if (argc >= 2 && strcmp(argv[1], "--KERNELBENCH") == 0) { // optional size and JPEG file
+        int w = 1024, h = 768;
+        char *szJPEG = NULL;
+        for (i=2; i<argc; i++) {
+            if (sscanf(argv[i], "%dx%d", &w, &h) != 2)
+                szJPEG = argv[i];
+        }
+        if (w < 8 || h < 8) {
+            printf("KERNELBENCH size must be <width>x<height>\n");
+            return -1;
+        }
+        return KernelBench(w, h, szJPEG) ? 0 : -1;
+    }
+    if (argc >= 2 && strcmp(argv[1], "--PANELS") == 0) { // no image files needed
+        if (argc >= 3 && !LoadProfiles(argv[2]))
+            return -1;
+        ListProfiles();
+        return 0;
+    }
+    if (argc < 3)
     {
         printf("epd_image Copyright (c) 2023 BitBank Software, Inc.\n");
         printf("Written by Larry Bank\n\n");
         printf("Usage: epd_image <options> <infile> <outfile>\n");
+        printf("       epd_image --BUNDLE <options> <infile> [<infile>...] <outfile>\n");
+        printf("       epd_image --TILES <size> <options> <infile> [<infile>...] <outfile>\n");
+        printf("       epd_image --SEQUENCE <options> <frame> [<frame>...] <outfile>\n");
+        printf("       epd_image <options> --TARGET <spec> <outfile> [--TARGET <spec> <outfile>...] <infile>\n");
+        printf("       epd_image <options> --SIZES <size>[,<size>...] <infile> <outfile>\n");
+        printf("       epd_image <options> --WALL <grid> [--WALLPANEL <panel>...] <infile> <outfile>\n");
+        printf("       epd_image <options> --SPRITES <grid|frames.json> <sheet> <outfile>\n");
+        printf("       epd_image <options> --PANEL <name> <infile> <outfile>\n");
+        printf("       epd_image --PANELS [<panel file>]\n");
         printf("example:\n\n");
         printf("epd_image --BW ./test.bmp test.h\n");
         printf("valid options (defaults to BW, no rotation):\n");
@@ -1125,136 +5705,516 @@ int main(int argc, char *argv[])
         printf("LSBFIRST = mirror each byte (LSB on the left), defaults to MSBFIRST\n");
         printf("FLIPV = flip the image vertically\n");
         printf("INVERT = invert the colors\n");
+        printf("RLE = compress each plane (decompress with epd_decode.h)\n");
+        printf("RLEROWS <rows> = compress each band of N rows separately with an index for partial drawing\n");
+        printf("TRIM = trim each plane to the bounding box of its non-white (non-empty) pixels\n");
+        printf("SPARSE = store the red/yellow plane of BWR/BWY output as spans of non-empty bytes\n");
+        printf("SHIFTS <all|n,n,...> = output BW copies pre-shifted by 0-7 pixels for drawing at any x position\n");
+        printf("ROWALIGN <1|2|4|8|16> = pad each line to a multiple of N bytes (e.g. for DMA)\n");
+        printf("WORDS <8|16|32> = write the plane data as uint8_t/uint16_t/uint32_t arrays\n");
+        printf("BIGENDIAN = put the first byte in the MSB of each word (defaults to little-endian)\n");
+        printf("ARRAYALIGN <bytes> = add an alignment attribute to the arrays\n");
+        printf("INTERLEAVE = write the lines of both planes alternating in one array\n");
+        printf("VERTICAL = pack 8 vertical pixels per byte (LSB on top) in pages for column addressed controllers\n");
+        printf("DELTA <old image> = write the rectangles which changed from the old image for a partial update\n");
+        printf("WINDOWCOST <bytes> = cost of setting up a controller window, in data bytes (default 16)\n");
+        printf("SEQUENCE = store the input images as a keyframe and the rectangles changed by each following frame\n");
+        printf("KEYFRAME <frames> = store a full frame every N frames for seeking (default only the first)\n");
+        printf("STABLE <threshold> = when dithering a SEQUENCE, keep the previous output of pixels which changed by no more than this (0-255)\n");
+        printf("TARGET <spec> <outfile> = also write <outfile> from the same decode; spec is the format plus any of\n");
+        printf("    :<degrees> :DITHER :MIRROR :FLIPV :INVERT (e.g. BWR:90:DITHER), arrays are named after <outfile>\n");
+        printf("SIZES <list> = write several sizes of the image from one decode, e.g. 250x122,296x128:BWR:DITHER\n");
+        printf("    each size is <width>x<height>[!][:<spec>] (! = stretch instead of keeping the aspect ratio),\n");
+        printf("    arrays are named <name>_<width>x<height>\n");
+        printf("WALL <cols>x<rows>:<width>x<height>[:<gap x>[,<gap y>]] = split the image over a video wall of panels,\n");
+        printf("    skipping the pixels hidden by the bezel gaps; dithering is seamless across the panels\n");
+        printf("WALLPANEL <col>,<row>:<format>[:<degrees>] = format and rotation of one wall panel (defaults to the options)\n");
+        printf("SPRITES <width>x<height>[:<count>] | <frames.json> = convert each frame of a sprite sheet, from a grid of\n");
+        printf("    equal frames or a JSON frame list (TexturePacker style), arrays are named <name>_<frame>\n");
+        printf("SPRITEARRAY = write the SPRITES frames to one array with a table of offsets and sizes\n");
+        printf("PANEL <name> = convert to the native RAM layout of a panel profile: size, format, rotation, bit order,\n");
+        printf("    plane order and polarity, horizontal/vertical packing and row alignment (see PANELS)\n");
+        printf("PANELFILE <file> = read more panel profiles, one per line:\n");
+        printf("    <name> size=<w>x<h> format=<format> [rotate=<degrees>] [bitorder=MSB|LSB] [planes=normal|swap]\n");
+        printf("    [invert=none|0|1|both] [packing=horizontal|vertical] [rowalign=<bytes>]\n");
+        printf("PANELS [<panel file>] = list the panel profiles (no image files)\n");
+        printf("STATS = print the time, CPU time, bytes processed and peak heap memory of each stage\n");
+        printf("    (read, decode, scale, orient, invert, dither, pack, emit) when done\n");
+        printf("STATSJSON <file> = write the STATS as JSON to <file> (- for stdout) instead of a table\n");
+        printf("TRACE <file.json> = write a timeline of the pipeline stages, JPEG MCU rows and JPEGDraw calls of\n");
+        printf("    each thread to <file.json> (Chrome trace format for Perfetto or chrome://tracing)\n");
+        printf("THREADS <count> = number of threads for parallel work (defaults to one per CPU)\n");
+        printf("SPLIT = write extern declarations and constants to <outfile> and the data to <outfile>.c\n");
+        printf("ASM = write the data to <outfile>.bin + <outfile>.S (.incbin) and extern declarations to <outfile>\n");
+        printf("BUNDLE = pack all of the input images into one binary file with an index (read it with epd_bundle.h)\n");
+        printf("TILES <8|16> = store all of the input images as maps of shared, de-duplicated tiles\n");
+        printf("ALIGN <bytes> = start each image of a bundle on this boundary (power of 2, e.g. a flash page/sector)\n");
+        printf("PACKBENCH [<width>x<height>] = benchmark the packers for every source bpp/format/bit order (no files)\n");
+        printf("KERNELBENCH [<width>x<height>] [<file.jpg>] = time the pixel, transform, dither, JPEG, hex output and RLE decode kernels (median/p95)\n");
 
         return 0; // no filename passed
     }
-    while (argv[iNameParam][0] == '-') { // check options
-        if (strcmp(argv[iNameParam], "ROTATE") == 0) {
-            iRotation = atoi(&argv[iNameParam][2]);
-            if (iRotation % 90 != 0) {
+    while (iNameParam < argc && argv[iNameParam][0] == '-') { // check options
+        if (strcmp(argv[iNameParam], "--ROTATE") == 0) {
+            if (iNameParam+1 < argc) opts.iRotation = atoi(argv[++iNameParam]);
+            if (opts.iRotation % 90 != 0 || opts.iRotation < 0 || opts.iRotation > 270) {
                 printf("Rotation angle must be 0, 90, 180 or 270\n");
                 return -1;
             }
         } else if (strcmp(argv[iNameParam], "--LSBFIRST") == 0) {
             bMSBFirst = 0;
         } else if (strcmp(argv[iNameParam], "--MIRROR") == 0) {
-            bMirror = 1;
+            opts.bMirror = 1;
         } else if (strcmp(argv[iNameParam], "--FLIPV") == 0) {
-            bFlipv = 1;
+            opts.bFlipv = 1;
         } else if (strcmp(argv[iNameParam], "--INVERT") == 0) {
-            bInvert = 1;
+            opts.bInvert = 1;
         } else if (strcmp(argv[iNameParam], "--DITHER") == 0) {
-            bDither = 1;
+            opts.bDither = 1;
+        } else if (strcmp(argv[iNameParam], "--RLE") == 0) {
+            bRLE = 1;
+        } else if (strcmp(argv[iNameParam], "--SPARSE") == 0) {
+            bSparse = 1;
+        } else if (strcmp(argv[iNameParam], "--SHIFTS") == 0) {
+            if (iNameParam+1 < argc) iShifts = ParseShifts(argv[++iNameParam]);
+            if (iShifts == 0) {
+                printf("SHIFTS needs 'all' or a list of shifts from 0 to 7 (e.g. 0,2,4,6)\n");
+                return -1;
+            }
+        } else if (strcmp(argv[iNameParam], "--ROWALIGN") == 0) {
+            if (iNameParam+1 < argc) opts.iRowAlign = atoi(argv[++iNameParam]);
+            if (opts.iRowAlign < 1 || opts.iRowAlign > 16 || (opts.iRowAlign & (opts.iRowAlign-1)) != 0) {
+                printf("ROWALIGN must be 1, 2, 4, 8 or 16\n");
+                return -1;
+            }
+        } else if (strcmp(argv[iNameParam], "--WORDS") == 0) {
+            if (iNameParam+1 < argc) iWordSize = atoi(argv[++iNameParam]) / 8;
+            if (iWordSize != 1 && iWordSize != 2 && iWordSize != 4) {
+                printf("WORDS must be 8, 16 or 32\n");
+                return -1;
+            }
+        } else if (strcmp(argv[iNameParam], "--BIGENDIAN") == 0) {
+            bBigEndian = 1;
+        } else if (strcmp(argv[iNameParam], "--ARRAYALIGN") == 0) {
+            if (iNameParam+1 < argc) iArrayAlign = atoi(argv[++iNameParam]);
+            if (iArrayAlign < 1 || (iArrayAlign & (iArrayAlign-1)) != 0) {
+                printf("ARRAYALIGN must be a power of 2\n");
+                return -1;
+            }
+        } else if (strcmp(argv[iNameParam], "--DELTA") == 0) {
+            if (iNameParam+1 < argc) szDelta = argv[++iNameParam];
+        } else if (strcmp(argv[iNameParam], "--WINDOWCOST") == 0) {
+            if (iNameParam+1 < argc) iWindowCost = atoi(argv[++iNameParam]);
+            if (iWindowCost < 0) {
+                printf("WINDOWCOST can't be negative\n");
+                return -1;
+            }
+        } else if (strcmp(argv[iNameParam], "--SEQUENCE") == 0) {
+            bSequence = 1;
+        } else if (strcmp(argv[iNameParam], "--KEYFRAME") == 0) {
+            if (iNameParam+1 < argc) iKeyInterval = atoi(argv[++iNameParam]);
+            if (iKeyInterval < 1) {
+                printf("KEYFRAME needs an interval of at least 1 frame\n");
+                return -1;
+            }
+        } else if (strcmp(argv[iNameParam], "--STABLE") == 0) {
+            if (iNameParam+1 < argc) iStable = atoi(argv[++iNameParam]);
+            if (iStable < 0 || iStable > 255) {
+                printf("STABLE needs a threshold from 0 to 255\n");
+                return -1;
+            }
+        } else if (strcmp(argv[iNameParam], "--TARGET") == 0) {
+            if (iNameParam+2 >= argc || iTargets == MAX_TARGETS) {
+                printf("TARGET needs a spec and an output file (up to %d targets)\n", MAX_TARGETS);
+                return -1;
+            }
+            memset(&targets[iTargets], 0, sizeof(EPD_TARGET));
+            targets[iTargets].szSpec = argv[iNameParam+1];
+            targets[iTargets++].szOutName = argv[iNameParam+2];
+            iNameParam += 2;
+        } else if (strcmp(argv[iNameParam], "--SIZES") == 0) {
+            if (iNameParam+1 < argc) szSizes = argv[++iNameParam];
+            if (szSizes == NULL) {
+                printf("SIZES needs a list of sizes (e.g. 250x122,296x128)\n");
+                return -1;
+            }
+        } else if (strcmp(argv[iNameParam], "--WALL") == 0) {
+            if (iNameParam+1 < argc) szWall = argv[++iNameParam];
+            i = (szWall) ? sscanf(szWall, "%dx%d:%dx%d:%d,%d", &iCols, &iRows, &iPanelW, &iPanelH, &iGapX, &iGapY) : 0;
+            if (i < 4) {
+                printf("WALL needs <cols>x<rows>:<width>x<height>[:<gap x>[,<gap y>]] (e.g. 3x2:296x128:12)\n");
+                return -1;
+            }
+            if (i == 5) iGapY = iGapX; // the same gap both ways
+            if (iCols < 1 || iRows < 1 || iCols * iRows > MAX_PANELS || iPanelW < 1 || iPanelH < 1 || iGapX < 0 || iGapY < 0) {
+                printf("Invalid WALL layout (up to %d panels)\n", MAX_PANELS);
+                return -1;
+            }
+        } else if (strcmp(argv[iNameParam], "--WALLPANEL") == 0) {
+            if (iNameParam+1 >= argc || iPanels == MAX_PANELS) {
+                printf("WALLPANEL needs <col>,<row>:<format>[:<degrees>]\n");
+                return -1;
+            }
+            szPanels[iPanels++] = argv[++iNameParam];
+        } else if (strcmp(argv[iNameParam], "--SPRITES") == 0) {
+            if (iNameParam+1 < argc) szSprites = argv[++iNameParam];
+            if (szSprites == NULL) {
+                printf("SPRITES needs a frame grid (e.g. 32x32) or a JSON frame list\n");
+                return -1;
+            }
+        } else if (strcmp(argv[iNameParam], "--SPRITEARRAY") == 0) {
+            bSpriteArray = 1;
+        } else if (strcmp(argv[iNameParam], "--PANEL") == 0) {
+            if (iNameParam+1 < argc) szPanel = argv[++iNameParam];
+            if (szPanel == NULL) {
+                printf("PANEL needs a panel profile name (see PANELS)\n");
+                return -1;
+            }
+        } else if (strcmp(argv[iNameParam], "--PANELFILE") == 0) {
+            if (iNameParam+1 >= argc || !LoadProfiles(argv[++iNameParam]))
+                return -1;
+        } else if (strcmp(argv[iNameParam], "--STATS") == 0) {
+            StartStats();
+        } else if (strcmp(argv[iNameParam], "--STATSJSON") == 0) {
+            if (iNameParam+1 < argc) szStatsJSON = argv[++iNameParam];
+            if (szStatsJSON == NULL) {
+                printf("STATSJSON needs a file name (- for stdout)\n");
+                return -1;
+            }
+            StartStats();
+        } else if (strcmp(argv[iNameParam], "--TRACE") == 0) {
+            if (iNameParam+1 >= argc) {
+                printf("TRACE needs a file name\n");
+                return -1;
+            }
+            StartTrace(argv[++iNameParam]);
+        } else if (strcmp(argv[iNameParam], "--THREADS") == 0) {
+            if (iNameParam+1 < argc) iThreads = atoi(argv[++iNameParam]);
+            if (iThreads < 1) {
+                printf("THREADS needs at least 1 thread\n");
+                return -1;
+            }
+        } else if (strcmp(argv[iNameParam], "--VERTICAL") == 0) {
+            opts.bVertical = 1;
+        } else if (strcmp(argv[iNameParam], "--INTERLEAVE") == 0) {
+            bInterleave = 1;
+        } else if (strcmp(argv[iNameParam], "--TRIM") == 0) {
+            bTrim = 1;
+        } else if (strcmp(argv[iNameParam], "--ASM") == 0) {
+            iOutMode = OUTPUT_ASM;
+        } else if (strcmp(argv[iNameParam], "--SPLIT") == 0) {
+            iOutMode = OUTPUT_SPLIT;
+        } else if (strcmp(argv[iNameParam], "--BUNDLE") == 0) {
+            bBundle = 1;
+        } else if (strcmp(argv[iNameParam], "--TILES") == 0) {
+            if (iNameParam+1 < argc) iTileSize = atoi(argv[++iNameParam]);
+            if (iTileSize != 8 && iTileSize != 16) {
+                printf("TILES size must be 8 or 16\n");
+                return -1;
+            }
+        } else if (strcmp(argv[iNameParam], "--ALIGN") == 0) {
+            if (iNameParam+1 < argc) iAlign = atoi(argv[++iNameParam]);
+            if (iAlign < 1 || (iAlign & (iAlign-1)) != 0) {
+                printf("ALIGN must be a power of 2\n");
+                return -1;
+            }
+        } else if (strcmp(argv[iNameParam], "--RLEROWS") == 0) {
+            bRLE = 1;
+            if (iNameParam+1 < argc) iBandRows = atoi(argv[++iNameParam]);
+            if (iBandRows < 1) {
+                printf("RLEROWS needs a band height of at least 1 row\n");
+                return -1;
+            }
         } else {
-            while (iOption < OPTION_COUNT && strcmp(&argv[iNameParam][2], szOptions[iOption]) != 0) {
-                iOption++;
+            opts.iOption = 0;
+            while (opts.iOption < OPTION_COUNT && strcmp(&argv[iNameParam][2], szOptions[opts.iOption]) != 0) {
+                opts.iOption++;
             }
-            if (iOption == OPTION_COUNT) { // unrecognized option
+            if (opts.iOption == OPTION_COUNT) { // unrecognized option
                 printf("Invalid option: %s\n", argv[iNameParam]);
                 return -1;
             }
         }
        iNameParam++;
     }
-    ihandle = fopen(argv[iNameParam],"rb"); // open input file
-    if (ihandle == NULL)
-    {
-        fprintf(stderr, "Unable to open file: %s\n", argv[iNameParam]);
-        return -1; // bad filename passed
+    memset(&outset, 0, sizeof(outset));
+    outset.iMode = iOutMode;
+    outset.iWordSize = iWordSize;
+    outset.bBigEndian = bBigEndian;
+    outset.iArrayAlign = iArrayAlign;
+    if (szPanel) {
+        pProfile = FindProfile(szPanel);
+        if (pProfile == NULL) {
+            printf("Unknown panel: %s (see PANELS)\n", szPanel);
+            return -1;
+        }
+        if (argc - iNameParam != 2) {
+            printf("Please specify the input and output file names\n");
+            return -1;
+        }
+        if (iTargets || szSizes || szWall || szSprites || bBundle || iTileSize || bSequence || szDelta || bTrim || bSparse || iShifts || iStable >= 0) {
+            printf("PANEL only supports plain or RLE output\n");
+            return -1;
+        }
+        if (!bMSBFirst || opts.bVertical || opts.iRowAlign > 1) {
+            printf("The bit order, packing and row alignment come from the panel profile\n");
+            return -1;
+        }
+        if (bInterleave && (pProfile->iOption == OPTION_BW || pProfile->iOption == OPTION_BWYR || pProfile->bVertical || bRLE)) {
+            printf("INTERLEAVE needs a horizontal, uncompressed 2-plane panel\n");
+            return -1;
+        }
+        if (pProfile->bVertical && iBandRows) {
+            printf("RLEROWS doesn't apply to vertical panels\n");
+            return -1;
+        }
+        if (bRLE && (iWordSize > 1 || pProfile->iRowAlign > 1)) {
+            printf("WORDS and row alignment only apply to uncompressed output\n");
+            return -1;
+        }
+        MakeOutName(argv[iNameParam+1], szOutName);
+        return MakePanel(argv[iNameParam], pProfile, &opts, &outset, szOutName, bRLE, iBandRows, bInterleave) ? 0 : -1;
     }
-    
-    fseek(ihandle, 0L, SEEK_END); // get the file size
-    iSize = (int)ftell(ihandle);
-    fseek(ihandle, 0, SEEK_SET);
-    p = (unsigned char *)malloc(iSize); // read it into RAM
-    fread(p, 1, iSize, ihandle);
-    fclose(ihandle);
-    if (p[0] == 'B' && p[1] == 'M') {
-        if (ReadBMP(p, &iOffBits, &iWidth, &iHeight, &iBpp) == 0) {
-            printf("Invalid BMP file, exiting...\n");
+    if (iTargets) {
+        if (argc - iNameParam != 1) {
+            printf("Please specify one input file after the targets\n");
             return -1;
         }
-    } else if (p[0] == 0xff && p[1] == 0xd8) {
-        uint8_t *pOut = ReadJPEG(p, iSize, &iWidth, &iHeight, &iBpp);
-        if (!pOut) {
-            printf("Invalid JPEG file, exiting...\n");
+        if (bBundle || iTileSize || bSequence || szDelta || bRLE || bTrim || bSparse || iShifts || iStable >= 0 || szSizes || szWall || szSprites) {
+            printf("TARGET only supports uncompressed output\n");
             return -1;
         }
-        free(p);
-        p = pOut;
-        iOffBits = 0;
-    } else {
-        printf("Unrecognized file format. For now, only BMP and JPEG are supported\n");
+        for (i=0; i<iTargets; i++) { // the other options are the defaults
+            targets[i].opts = opts;
+            if (!ParseTarget(targets[i].szSpec, &targets[i].opts))
+                return -1;
+        }
+        return MakeTargets(argv[iNameParam], targets, iTargets, &outset, bInterleave) ? 0 : -1;
+    }
+    if (bSpriteArray && !szSprites) {
+        printf("SPRITEARRAY needs SPRITES\n");
         return -1;
     }
-    if (iHeight > 0) FlipBMP(&p[iOffBits], iWidth, iHeight, iBpp); // positive means bottom-up
-    else iHeight = -iHeight; // negative means top-down
-    if (bMirror) {
-        MirrorBMP(&p[iOffBits], iWidth, iHeight, iBpp);
+    if (szSprites) {
+        if (argc - iNameParam != 2) {
+            printf("Please specify the input and output file names\n");
+            return -1;
+        }
+        if (bBundle || iTileSize || bSequence || szDelta || bRLE || bTrim || bSparse || iShifts || iStable >= 0 || szSizes || szWall) {
+            printf("SPRITES only supports uncompressed output\n");
+            return -1;
+        }
+        if (bSpriteArray && bInterleave) {
+            printf("SPRITEARRAY can't be combined with INTERLEAVE\n");
+            return -1;
+        }
+        MakeOutName(argv[iNameParam+1], szOutName);
+        return MakeSprites(argv[iNameParam], szSprites, &opts, &outset, szOutName, bSpriteArray, bInterleave) ? 0 : -1;
     }
-    if (bFlipv) {
-        FlipBMP(&p[iOffBits], iWidth, iHeight, iBpp);
+    if (iPanels && !szWall) {
+        printf("WALLPANEL needs WALL\n");
+        return -1;
     }
-    if (bInvert) {
-        for (int i=0; i<(iSize - iOffBits); i++) {
-            p[iOffBits + i] = ~p[iOffBits + i];
+    if (szWall) {
+        if (argc - iNameParam != 2) {
+            printf("Please specify the input and output file names\n");
+            return -1;
+        }
+        if (bBundle || iTileSize || bSequence || szDelta || bRLE || bTrim || bSparse || iShifts || iStable >= 0 || szSizes) {
+            printf("WALL only supports uncompressed output\n");
+            return -1;
+        }
+        pPanels = (EPD_PANEL *)calloc(iCols * iRows, sizeof(EPD_PANEL));
+        for (i=0; i<iCols * iRows; i++) { // the other options are the defaults
+            pPanels[i].opts = opts;
+            pPanels[i].iCol = i % iCols;
+            pPanels[i].iRow = i / iCols;
+        }
+        for (i=0; i<iPanels; i++) {
+            EPD_PANEL panel;
+            memset(&panel, 0, sizeof(panel));
+            panel.opts = opts;
+            if (!ParsePanel(szPanels[i], &panel, iCols, iRows)) {
+                free(pPanels);
+                return -1;
+            }
+            pPanels[panel.iRow * iCols + panel.iCol].opts = panel.opts;
         }
+        MakeOutName(argv[iNameParam+1], szOutName);
+        rc = MakeWall(argv[iNameParam], pPanels, iCols, iRows, iPanelW, iPanelH, iGapX, iGapY, &outset, szOutName, bInterleave);
+        free(pPanels);
+        return (rc) ? 0 : -1;
     }
-    if (bDither) {
-        if (iBpp < 24 && (iOption == OPTION_BWR || iOption == OPTION_BWY || iOption == OPTION_BWYR))
-        {
-            printf("Color dithering requires a full color (24/32-bit) source image\n");
+    if (szSizes) {
+        if (argc - iNameParam != 2) {
+            printf("Please specify the input and output file names\n");
             return -1;
         }
-        uint8_t *pNew = DitherBMP(&p[iOffBits], iWidth, iHeight, &iBpp, iOption);
-        if (pNew) { // the bitmap image was replaced
-            free(p);
-            p = pNew; // bitmap has been replaced
-            iOffBits = 0; // image starts at beginning of buffer
+        if (bBundle || iTileSize || bSequence || szDelta || bRLE || bTrim || bSparse || iShifts || iStable >= 0) {
+            printf("SIZES only supports uncompressed output\n");
+            return -1;
+        }
+        while (*szSizes) { // comma separated list
+            for (i=0; szSizes[i] && szSizes[i] != ',' && i < (int)sizeof(szSpec)-1; i++)
+                szSpec[i] = szSizes[i];
+            szSpec[i] = 0;
+            szSizes += i;
+            if (*szSizes == ',') szSizes++;
+            if (iSizes == MAX_SIZES) {
+                printf("SIZES supports up to %d sizes\n", MAX_SIZES);
+                return -1;
+            }
+            memset(&sizes[iSizes], 0, sizeof(EPD_SIZE));
+            sizes[iSizes].opts = opts; // the other options are the defaults
+            if (!ParseSize(szSpec, &sizes[iSizes]))
+                return -1;
+            for (j=0; j<iSizes; j++) {
+                if (sizes[j].iWidth == sizes[iSizes].iWidth && sizes[j].iHeight == sizes[iSizes].iHeight) {
+                    printf("Each size can only be listed once (%s)\n", szSpec);
+                    return -1;
+                }
+            }
+            iSizes++;
+        }
+        if (iSizes == 0) {
+            printf("SIZES needs at least one size\n");
+            return -1;
         }
+        MakeOutName(argv[iNameParam+1], szOutName);
+        return MakeSizes(argv[iNameParam], sizes, iSizes, &outset, szOutName, bInterleave) ? 0 : -1;
     }
-    RotateImage(iRotation, &p[iOffBits], &iWidth, &iHeight, iBpp);
-    GetLeafName(argv[iNameParam], szLeaf);
-    if (argv[iNameParam+1][0] != SLASH_CHAR) { // need to form full name
-       if (getcwd(szOutName, sizeof(szOutName))) {
-	  int i;
-	  i = (int)strlen(szOutName);
-          szOutName[i] = SLASH_CHAR;
-	  szOutName[i+1] = 0;
-          strcat(szOutName, argv[iNameParam+1]);
-       }
-    } else {
-       strcpy(szOutName, argv[iNameParam+1]);
+    if (argc - iNameParam < 2 || (!bBundle && !iTileSize && !bSequence && argc - iNameParam != 2)) {
+        printf("Please specify the input and output file names\n");
+        return -1;
     }
-    ihandle = fopen(szOutName, "wb");
-    if (ihandle == NULL) {
-       printf("Error creating output file: %s\n", szOutName);
+    if (bSequence) {
+        if (bBundle || iTileSize || szDelta || bRLE || bTrim || bSparse || iShifts || bInterleave || opts.bVertical || iWordSize > 1) {
+            printf("SEQUENCE can't be combined with other layouts or compression\n");
+            return -1;
+        }
+        if (iStable >= 0) {
+            if (!opts.bDither) {
+                printf("STABLE needs DITHER\n");
+                return -1;
+            }
+            memset(&stable, 0, sizeof(stable));
+            stable.iThreshold = iStable;
+            opts.pStable = &stable;
+        }
+        rc = MakeSequence(&argv[iNameParam], argc - iNameParam - 1, &opts, iKeyInterval, iWindowCost, argv[argc-1], iOutMode);
+        if (opts.pStable) {
+            free(stable.pSrc);
+            free(stable.pOut);
+        }
+        return (rc) ? 0 : -1;
+    }
+    if (iStable >= 0) {
+        printf("STABLE only applies to SEQUENCE\n");
+        return -1;
+    }
+    if (szDelta && (bBundle || iTileSize || bRLE || bTrim || bSparse || iShifts || bInterleave || opts.bVertical || iWordSize > 1)) {
+        printf("DELTA can't be combined with other layouts or compression\n");
+        return -1;
+    }
+    if (opts.bVertical && (bBundle || iTileSize || iBandRows || bTrim || bSparse || iShifts || bInterleave || opts.iRowAlign > 1)) {
+        printf("VERTICAL only supports plain or RLE output\n");
+        return -1;
+    }
+    if ((bBundle || iTileSize) && (iWordSize > 1 || bInterleave || iArrayAlign)) {
+        printf("WORDS, INTERLEAVE and ARRAYALIGN don't apply to BUNDLE or TILES\n");
+        return -1;
+    }
+    if (bBundle) {
+        if (iBandRows) {
+            printf("RLEROWS is not supported in bundles, use RLE\n");
+            return -1;
+        }
+        return MakeBundle(&argv[iNameParam], argc - iNameParam - 1, &opts, bRLE, iAlign, argv[argc-1]) ? 0 : -1;
+    }
+    if (iTileSize) {
+        if (bRLE) {
+            printf("RLE can't be combined with TILES\n");
+            return -1;
+        }
+        if (opts.iRowAlign > 1) {
+            printf("ROWALIGN can't be combined with TILES\n");
+            return -1;
+        }
+        return MakeTiles(&argv[iNameParam], argc - iNameParam - 1, &opts, iTileSize, argv[argc-1], iOutMode) ? 0 : -1;
+    }
+    if (bTrim + bRLE + bSparse + (iShifts != 0) > 1) {
+        printf("Only one of TRIM, RLE, SPARSE and SHIFTS can be used\n");
+        return -1;
+    }
+    if ((iWordSize > 1 || bInterleave || opts.iRowAlign > 1) && bTrim + bRLE + bSparse + (iShifts != 0) != 0) {
+        printf("ROWALIGN, WORDS and INTERLEAVE only apply to uncompressed output\n");
+        return -1;
+    }
+    if (bInterleave && (opts.iOption == OPTION_BW || opts.iOption == OPTION_BWYR)) {
+        printf("INTERLEAVE needs a 2-plane output format\n");
+        return -1;
+    }
+    if (iShifts && opts.iOption != OPTION_BW) {
+        printf("SHIFTS is only for BW output\n");
+        return -1;
+    }
+    if (bSparse && opts.iOption != OPTION_BWR && opts.iOption != OPTION_BWY) {
+        printf("SPARSE is only for BWR and BWY output\n");
+        return -1;
+    }
+    if (!ConvertImage(argv[iNameParam], &opts, &planes)) {
+        return -1;
+    }
+    if (szDelta) { // the old image goes through the same conversion
+        if (!ConvertImage(szDelta, &opts, &oldplanes)) {
+            FreePlanes(&planes);
+            return -1;
+        }
+        if (oldplanes.iWidth != planes.iWidth || oldplanes.iHeight != planes.iHeight) {
+            printf("DELTA images must be the same size\n");
+            FreePlanes(&oldplanes);
+            FreePlanes(&planes);
+            return -1;
+        }
+    }
+    if (bSparse && planes.iPitch > 255) { // spans store the byte column in 8 bits
+        printf("SPARSE supports images up to 2040 pixels wide\n");
+        FreePlanes(&planes);
+        return -1;
+    }
+    if (iShifts && planes.iPitch > 254) { // the masks store the bytes touched (iPitch+1) in 8 bits
+        printf("SHIFTS supports images up to 2032 pixels wide\n");
+        FreePlanes(&planes);
+        return -1;
+    }
+    GetLeafName(argv[iNameParam], szLeaf);
+    MakeOutName(argv[iNameParam+1], szOutName);
+    if (!StartOutput(&out, &outset, szOutName, szLeaf, &planes, opts.iOption, bRLE)) {
+       FreePlanes(&planes);
        return -1;
     }
-    fprintf(ihandle, "//\n// Created with epd_image\n// https://github.com/bitbank2/epd_image\n");
-    fprintf(ihandle, "//\n// %s\n//\n", szLeaf); // comment header with filename
-    FixName(szLeaf); // remove unusable characters
-    fprintf(ihandle, "// for non-Arduino builds...\n");
-    fprintf(ihandle, "#ifndef PROGMEM\n#define PROGMEM\n#endif\n");
-    switch (iOption) {
-	    case OPTION_BW:
-               MakeC_BW(p, iOffBits, iWidth, iHeight, iBpp, iSize, ihandle, szLeaf); // create the output data
-	    break;
-	    case OPTION_BWR:
-	    case OPTION_BWY:
-            MakeC_3CLR(p, iOffBits, iWidth, iHeight, iBpp, iSize, ihandle, szLeaf, iOption);
-	    break;
-        case OPTION_BWYR:
-            MakeC_4CLR(p, iOffBits, iWidth, iHeight, iBpp, iSize, ihandle, szLeaf);
-            break;
-	    case OPTION_4GRAY:
-	       MakeC_4GRAY(p, iOffBits, iWidth, iHeight, iBpp, iSize, ihandle, szLeaf);
-	    break;
-    } // switch
-    fflush(ihandle);
-    fclose(ihandle);
-    free(p);
-    return 0;
+    rc = 0;
+    if (szDelta) {
+        if (!MakeC_DELTA(&oldplanes, &planes, &out, szLeaf, opts.iOption, iWindowCost))
+            rc = -1;
+        FreePlanes(&oldplanes);
+    } else if (bRLE) {
+        if (!MakeC_RLE(&planes, &out, szLeaf, opts.iOption, iBandRows))
+            rc = -1;
+    } else if (bTrim) {
+        MakeC_TRIM(&planes, &out, szLeaf, opts.iOption);
+    } else if (bSparse) {
+        if (!MakeC_SPARSE(&planes, &out, szLeaf))
+            rc = -1;
+    } else if (iShifts) {
+        if (!MakeC_SHIFTS(&planes, &out, szLeaf, iShifts))
+            rc = -1;
+    } else {
+        MakeC_PLAIN(&planes, &out, szLeaf, opts.iOption, bInterleave);
+    }
+    FreePlanes(&planes);
+    CloseOutput(&out);
+    return rc;
 } /* main() */
 //
 // Make sure the name can be used in C/C++ as a variable
@@ -1274,7 +6234,7 @@ void FixName(char *name)
     {
         c = *s++;
         // these characters can't be in a variable name
-        if (c < ' ' || (c >= '!' && c < '0') || (c > 'Z' && c < 'a'))
+        if (c <= ' ' || (c >= '!' && c < '0') || (c > 'Z' && c < 'a'))
             c = '_'; // convert all to an underscore
         *d++ = c;
     }